@@ -54,8 +54,35 @@ they will be discarded after more than this number start piling up.\n\
 A number less than or equal to zero indicates no limit (very dangerous!).\n\
 ");
 
+static PyObject *
+_get_stats (PyLCMSubscriptionObject *sobj)
+{
+    lcm_subscription_stats_t stats;
+    if (0 != lcm_subscription_get_stats (sobj->subscription, &stats)) {
+        PyErr_SetString (PyExc_ValueError, "invalid subscription");
+        return NULL;
+    }
+
+    return Py_BuildValue ("{s:K,s:K,s:K,s:i,s:i,s:L,s:L}",
+            "num_delivered", (unsigned PY_LONG_LONG) stats.num_delivered,
+            "num_dropped", (unsigned PY_LONG_LONG) stats.num_dropped,
+            "bytes_delivered", (unsigned PY_LONG_LONG) stats.bytes_delivered,
+            "queue_depth", stats.queue_depth,
+            "max_queue_depth", stats.max_queue_depth,
+            "total_handler_ns", (PY_LONG_LONG) stats.total_handler_ns,
+            "max_handler_ns", (PY_LONG_LONG) stats.max_handler_ns);
+}
+PyDoc_STRVAR (pylcm_get_stats_doc,
+"get_stats() -> dict\n\
+Returns counters describing the messages delivered to and dropped by this\n\
+subscription, as a dictionary with the keys num_delivered, num_dropped,\n\
+bytes_delivered, queue_depth, max_queue_depth, total_handler_ns and\n\
+max_handler_ns.  Handler times are in nanoseconds.\n\
+");
+
 static PyMethodDef _methods[] = {
     { "set_queue_capacity", (PyCFunction)_set_queue_capacity, METH_O, pylcm_set_queue_capacity_doc },
+    { "get_stats", (PyCFunction)_get_stats, METH_NOARGS, pylcm_get_stats_doc },
     { NULL, NULL }
 };
 
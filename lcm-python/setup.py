@@ -12,6 +12,7 @@ sources = [ \
     os.path.join("..", "lcm", "eventlog.c"),
     os.path.join("..", "lcm", "lcm.c"),
     os.path.join("..", "lcm", "lcm_file.c"),
+    os.path.join("..", "lcm", "lcm_loop.c"),
     os.path.join("..", "lcm", "lcm_memq.c"),
     os.path.join("..", "lcm", "lcm_mpudpm.c"),
     os.path.join("..", "lcm", "lcm_tcpq.c"),
@@ -18,6 +18,26 @@ Subscription::getQueueSize() const
     return lcm_subscription_get_queue_size(c_subs);
 }
 
+int
+Subscription::setQueuePolicy(lcm_queue_policy_t policy)
+{
+    return lcm_subscription_set_queue_policy(c_subs, policy);
+}
+
+lcm_subscription_stats_t
+Subscription::getStats() const
+{
+    lcm_subscription_stats_t stats;
+    lcm_subscription_get_stats(c_subs, &stats);
+    return stats;
+}
+
+int
+Subscription::setDispatchMode(lcm_dispatch_mode_t mode)
+{
+    return lcm_subscription_set_dispatch_mode(c_subs, mode);
+}
+
 template <class MessageType, class ContextClass>
 class LCMTypedSubscription : public Subscription {
     friend class LCM;
@@ -40,7 +60,10 @@ class LCMTypedSubscription : public Subscription {
             const ReceiveBuffer rb = {
                 rbuf->data,
                 rbuf->data_size,
-                rbuf->recv_utime
+                rbuf->recv_utime,
+                rbuf->send_utime,
+                rbuf->recv_utime_ns,
+                rbuf->send_host_id
             };
             subs->handler(&rb, channel, &msg, subs->context);
         }
@@ -61,7 +84,10 @@ class LCMUntypedSubscription : public Subscription {
             const ReceiveBuffer rb = {
                 rbuf->data,
                 rbuf->data_size,
-                rbuf->recv_utime
+                rbuf->recv_utime,
+                rbuf->send_utime,
+                rbuf->recv_utime_ns,
+                rbuf->send_host_id
             };
             subs->handler(&rb, channel, subs->context);
         }
@@ -88,7 +114,10 @@ class LCMMHSubscription : public Subscription {
             const ReceiveBuffer rb = {
                 rbuf->data,
                 rbuf->data_size,
-                rbuf->recv_utime
+                rbuf->recv_utime,
+                rbuf->send_utime,
+                rbuf->recv_utime_ns,
+                rbuf->send_host_id
             };
             std::string chan_str(channel);
             (subs->handler->*subs->handlerMethod)(&rb, chan_str, &msg);
@@ -108,7 +137,10 @@ class LCMMHUntypedSubscription : public Subscription {
             const ReceiveBuffer rb = {
                 rbuf->data,
                 rbuf->data_size,
-                rbuf->recv_utime
+                rbuf->recv_utime,
+                rbuf->send_utime,
+                rbuf->recv_utime_ns,
+                rbuf->send_host_id
             };
             std::string chan_str(channel);
             (subs->handler->*subs->handlerMethod)(&rb, chan_str);
@@ -216,6 +248,36 @@ LCM::handleTimeout(int timeout_millis) {
     return lcm_handle_timeout(this->lcm, timeout_millis);
 }
 
+inline int
+LCM::handleBatch(int max_msgs, int timeout_millis) {
+    if(!this->lcm) {
+        fprintf(stderr,
+            "LCM instance not initialized.  Ignoring call to handle()\n");
+        return -1;
+    }
+    return lcm_handle_batch(this->lcm, max_msgs, timeout_millis);
+}
+
+inline int
+LCM::getTransportStats(lcm_transport_stats_t* stats) {
+    if(!this->lcm) {
+        fprintf(stderr,
+            "LCM instance not initialized.  Ignoring call to getTransportStats()\n");
+        return -1;
+    }
+    return lcm_get_transport_stats(this->lcm, stats);
+}
+
+inline int
+LCM::setDispatchThreads(int num_threads) {
+    if(!this->lcm) {
+        fprintf(stderr,
+            "LCM instance not initialized.  Ignoring call to setDispatchThreads()\n");
+        return -1;
+    }
+    return lcm_set_dispatch_threads(this->lcm, num_threads);
+}
+
 template <class MessageType, class MessageHandlerClass>
 Subscription*
 LCM::subscribe(const std::string& channel,
@@ -130,6 +130,33 @@ class LCM {
          */
         inline int handleTimeout(int timeout_millis);
 
+        /**
+         * @brief Waits for and dispatches a batch of messages, with a
+         * timeout.
+         *
+         * @return the number of messages handled, 0 if the function timed
+         * out, and <0 if an error occured.
+         * @sa lcm_handle_batch()
+         */
+        inline int handleBatch(int max_msgs, int timeout_millis);
+
+        /**
+         * @brief Invokes message handlers on a pool of worker threads.
+         *
+         * @return 0 on success, -1 if something went wrong.
+         * @sa lcm_set_dispatch_threads()
+         */
+        inline int setDispatchThreads(int num_threads);
+
+        /**
+         * @brief Retrieves receive statistics for the underlying transport.
+         *
+         * @return 0 on success, -1 if the transport does not keep
+         * statistics.
+         * @sa lcm_get_transport_stats()
+         */
+        inline int getTransportStats(lcm_transport_stats_t* stats);
+
         /**
          * @brief Subscribes a callback method of an object to a channel, with
          * automatic message decoding.
@@ -408,6 +435,23 @@ struct ReceiveBuffer {
      * microseconds since the UNIX epoch.
      */
     int64_t recv_utime;
+    /**
+     * Timestamp identifying when the message was published, according to
+     * the publisher's clock, or 0 if the publisher did not send one.
+     * Specified in microseconds since the UNIX epoch.
+     */
+    int64_t send_utime;
+    /**
+     * recv_utime in nanoseconds since the UNIX epoch, with sub-microsecond
+     * resolution where the provider has it.
+     */
+    int64_t recv_utime_ns;
+    /**
+     * Identifies the host that published the message, or 0 if the
+     * publisher did not send a timestamp.  Compare it across the hops of a
+     * pipeline to tell which one adds the latency.
+     */
+    uint32_t send_host_id;
 };
 
 /**
@@ -449,6 +493,30 @@ class Subscription {
          */
         inline int getQueueSize() const;
 
+        /**
+         * @brief Chooses whether this subscription keeps every received
+         * message, or only the most recent message on each channel.
+         *
+         * @sa lcm_subscription_set_queue_policy()
+         */
+        inline int setQueuePolicy(lcm_queue_policy_t policy);
+
+        /**
+         * @brief Retrieves counters describing the messages delivered to and
+         * dropped by this subscription.
+         *
+         * @sa lcm_subscription_get_stats()
+         */
+        inline lcm_subscription_stats_t getStats() const;
+
+        /**
+         * @brief Chooses whether this subscription's handler is invoked on
+         * the %LCM instance's worker threads.
+         *
+         * @sa lcm_subscription_set_dispatch_mode()
+         */
+        inline int setDispatchMode(lcm_dispatch_mode_t mode);
+
     friend class LCM;
     protected:
         Subscription() {};
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -15,25 +16,101 @@
 #include "windows/WinPorting.h"
 #include <winsock2.h>
 #else
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 typedef int SOCKET;
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #define LCM_DEFAULT_URL "udpm://239.255.76.67:7667?ttl=0"
 
+// 64-bit counters for statistics, which don't order other memory accesses.
+#ifdef _MSC_VER
+#define stat_add(p, v) InterlockedExchangeAdd64 ((volatile LONG64 *) (p), (v))
+#define stat_get(p) InterlockedCompareExchange64 ((volatile LONG64 *) (p), 0, 0)
+#define stat_set(p, v) InterlockedExchange64 ((volatile LONG64 *) (p), (v))
+#define stat_cas(p, old, v) \
+    (InterlockedCompareExchange64 ((volatile LONG64 *) (p), (v), (old)) == (old))
+#else
+#define stat_add(p, v) __atomic_fetch_add ((p), (v), __ATOMIC_RELAXED)
+#define stat_get(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+#define stat_set(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+#define stat_cas(p, old, v) __atomic_compare_exchange_n ((p), &(old), (v), 0, \
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+typedef struct _lcm_handler_list lcm_handler_list_t;
+typedef struct _lcm_channel_entry lcm_channel_entry_t;
+typedef struct _lcm_channel_table lcm_channel_table_t;
+typedef struct _lcm_channel_slots lcm_channel_slots_t;
+typedef struct _lcm_dispatch_job lcm_dispatch_job_t;
+typedef struct _lcm_prefix_node lcm_prefix_node_t;
+
 struct _lcm_t {
-    GStaticRecMutex mutex;  // guards data structures
+    GStaticRecMutex mutex;  // serializes writers of the data structures below
     GStaticRecMutex handle_mutex;  // only one thread allowed in lcm_handle at a time
 
-    GPtrArray   *handlers_all;  // list containing *all* handlers
-    GHashTable  *handlers_map;  // map of channel name (string) to GPtrArray 
-                                // of matching handlers (lcm_subscription_t*)
+    GHashTable  *handlers_all;  // set containing *all* handlers
+
+    // the handlers again, indexed by kind to resolve new channel names
+    GHashTable  *literal_handlers;          // channel -> GPtrArray
+    lcm_prefix_node_t *prefix_handlers;     // trie of prefixes
+    GPtrArray   *regex_handlers;
+    unsigned int next_seqno;
+    lcm_channel_table_t *handlers_map;  // map of channel name to the list of
+                                        // matching handlers.  Readable
+                                        // without holding mutex.
+    lcm_prefix_node_t *channel_trie;    // the entries of handlers_map, by name
+    lcm_channel_slots_t *channel_slots; // the entries of handlers_map, by ID.
+                                        // Readable without holding mutex.
+    GPtrArray   *free_slots;            // unused indices into channel_slots
+    unsigned int next_slot;
+    guint32 channel_generation;         // high half of the next channel ID
+
+    // channel cache.  Entries that nothing is subscribed to are kept on the
+    // idle list, least recently used first, and are evicted once handlers_map
+    // holds more than channel_cache_capacity channels.
+    lcm_channel_entry_t *idle_head;
+    lcm_channel_entry_t *idle_tail;
+    int num_idle;
+    int channel_cache_capacity;         // 0 for no limit
+    int cache_hits;                     // not yet added to cache_hits_total
+    uint64_t cache_hits_total;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+
+    int readers[2];             // threads inside a read section, by the
+                                // parity of the epoch they entered in
+    int epoch;
+    int num_retired;            // number of entries on the retired lists
+    GSList *retired_mem;        // replaced tables and handler lists, in this
+                                // epoch
+    GSList *retired_handlers;   // unsubscribed lcm_subscription_t*s, in this
+                                // epoch
+    GSList *old_retired_mem;    // the same, retired in earlier epochs
+    GSList *old_retired_handlers;
 
     lcm_provider_vtable_t * vtable;
     lcm_provider_t * provider;
 
     int default_max_num_queued_messages;
     int in_handle;
+
+    // dispatch executor.  Subscriptions with queued jobs are on exec_ready
+    // or being run by a worker.  Protected by exec_mutex.
+    GMutex      *exec_mutex;
+    GCond       *exec_cond;
+    GQueue      *exec_ready;
+    GPtrArray   *exec_threads;
+    int exec_quit;
+    int dispatch_threaded;      // default for LCM_DISPATCH_DEFAULT subscriptions
+
+    lcm_self_test_handler_t self_test_handler;  // protected by mutex
+    void *self_test_user;
 };
 
 struct _lcm_subscription_t {
@@ -41,14 +118,950 @@ struct _lcm_subscription_t {
     lcm_msg_handler_t  handler;
     void             *userdata;
     lcm_t* lcm;
-    GRegex * regex;
+    lcm_subscription_kind_t kind;
+    int prefix_len;             // LCM_SUBSCRIPTION_PREFIX only
+    GRegex * regex;             // LCM_SUBSCRIPTION_REGEX only
+    unsigned int seqno;         // orders the handlers by subscription time
+    GPtrArray *entries;         // channel entries whose handler lists
+                                // contain this subscription
     int callback_scheduled;
     int marked_for_deletion;
 
     int max_num_queued_messages;
     int num_queued_messages;
+    int queue_policy;           // lcm_queue_policy_t
+
+    // updated with relaxed atomics.  queue_depth is unused.
+    lcm_subscription_stats_t stats;
+
+    int dispatch_mode;          // lcm_dispatch_mode_t
+    int num_executor_queued;    // jobs waiting for or running on a worker
+    GQueue *jobs;               // protected by lcm->exec_mutex
+    int executor_active;        // on lcm->exec_ready or being run
+};
+
+// A received message copied for handling on a dispatch worker.  Shared by all
+// the subscriptions it was queued for.
+struct _lcm_dispatch_job {
+    int refcount;
+    char *channel;
+    lcm_recv_buf_t rbuf;
+};
+
+// An immutable list of the subscriptions matching one channel.  Once
+// published it is never modified; changes publish a replacement list.
+struct _lcm_handler_list {
+    unsigned int len;
+    lcm_subscription_t *handlers[];
+};
+
+struct _lcm_channel_entry {
+    guint hash;
+    lcm_channel_id_t id;
+    lcm_handler_list_t *handlers;   // NULL if nothing is subscribed
+    lcm_channel_entry_t *next;
+    int referenced;                 // looked up since the last eviction sweep
+    int num_queued;                 // messages accepted by
+                                    // lcm_try_enqueue_message() and not yet
+                                    // dispatched or discarded
+
+    // the idle list.  Protected by lcm->mutex.
+    lcm_channel_entry_t *idle_prev;
+    lcm_channel_entry_t *idle_next;
+
+    // latencies of the messages that carry a send timestamp.  Updated with
+    // the stat_*() atomics, and dropped when the entry is evicted.
+    lcm_latency_histogram_t latency;
+
+    char channel[];
 };
 
+struct _lcm_channel_table {
+    unsigned int size;              // number of entries
+    unsigned int nbuckets;          // always a power of two
+    lcm_channel_entry_t *buckets[];
+};
+
+// Maps the low half of a channel ID to its entry.  The high half of the ID is
+// a generation number, so an ID that outlives its entry won't match the entry
+// that later reuses the slot.
+struct _lcm_channel_slots {
+    unsigned int nslots;
+    lcm_channel_entry_t *entries[];
+};
+
+// A node in a trie of strings.  The path from the root spells out the key.
+struct _lcm_prefix_node {
+    char c;
+    lcm_prefix_node_t *child;       // first child
+    lcm_prefix_node_t *sibling;     // next child of the parent
+    GPtrArray *items;               // stored under exactly this key
+};
+
+#define LCM_CHANNEL_TABLE_MIN_BUCKETS 64
+#define LCM_CHANNEL_SLOTS_MIN 64
+#define LCM_DEFAULT_CHANNEL_CACHE_CAPACITY 4096
+#define LCM_CACHE_HITS_FOLD (1 << 24)
+
+/* ==== Channel to handler map ====
+ *
+ * Every received message looks up the handlers for its channel, so the map is
+ * arranged to be read without taking lcm->mutex.  Readers bracket their
+ * accesses with read_section_enter() / read_section_exit().  Writers hold
+ * lcm->mutex, never modify a published handler list or bucket array in place,
+ * and instead publish a replacement with an atomic pointer store.  Whatever
+ * was replaced goes onto a retired list.
+ *
+ * Readers are counted by the parity of the epoch they entered in.  Once no
+ * thread that entered before the current epoch is still reading, nothing
+ * retired before it can be seen, so it is released and a new epoch starts.
+ * This only needs each read section to end, not a moment when no thread is
+ * reading at all.
+ */
+
+static inline void read_section_exit (lcm_t *lcm, int slot);
+
+// Returns the reader slot to pass to read_section_exit().
+static inline int
+read_section_enter (lcm_t *lcm)
+{
+    while (1) {
+        int epoch = g_atomic_int_get (&lcm->epoch);
+        g_atomic_int_inc (&lcm->readers[epoch & 1]);
+        if (g_atomic_int_get (&lcm->epoch) == epoch)
+            return epoch & 1;
+        // a new epoch started meanwhile, which might not have waited for us
+        read_section_exit (lcm, epoch & 1);
+    }
+}
+
+static void lcm_reclaim_retired (lcm_t *lcm);
+static int prefix_trie_remove (lcm_prefix_node_t *node, const char *key,
+        int len, gpointer item);
+
+static inline void
+read_section_exit (lcm_t *lcm, int slot)
+{
+    if (g_atomic_int_dec_and_test (&lcm->readers[slot]) &&
+            g_atomic_int_get (&lcm->num_retired)) {
+        g_static_rec_mutex_lock (&lcm->mutex);
+        lcm_reclaim_retired (lcm);
+        g_static_rec_mutex_unlock (&lcm->mutex);
+    }
+}
+
+// must be called with lcm->mutex held, after mem has been unpublished
+static void
+retire_mem (lcm_t *lcm, void *mem)
+{
+    if (!mem)
+        return;
+    lcm->retired_mem = g_slist_prepend (lcm->retired_mem, mem);
+    g_atomic_int_inc (&lcm->num_retired);
+}
+
+static lcm_channel_table_t *
+channel_table_new (unsigned int nbuckets)
+{
+    lcm_channel_table_t *table = (lcm_channel_table_t *) calloc (1,
+            sizeof (lcm_channel_table_t) +
+            nbuckets * sizeof (lcm_channel_entry_t *));
+    table->nbuckets = nbuckets;
+    return table;
+}
+
+// Find the entry for a channel.  Safe to call without lcm->mutex from inside
+// a read section.  May spuriously return NULL while the table is being
+// resized, so callers that miss must retry with lcm->mutex held.
+static lcm_channel_entry_t *
+channel_table_find (lcm_t *lcm, const char *channel, guint hash)
+{
+    lcm_channel_table_t *table =
+        (lcm_channel_table_t *) g_atomic_pointer_get (&lcm->handlers_map);
+    lcm_channel_entry_t *entry = (lcm_channel_entry_t *) g_atomic_pointer_get (
+            &table->buckets[hash & (table->nbuckets - 1)]);
+    while (entry) {
+        if (entry->hash == hash && !strcmp (entry->channel, channel))
+            return entry;
+        entry = (lcm_channel_entry_t *) g_atomic_pointer_get (&entry->next);
+    }
+    return NULL;
+}
+
+// must be called with lcm->mutex held
+static void
+channel_table_insert (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    lcm_channel_table_t *table = lcm->handlers_map;
+
+    if (table->size >= table->nbuckets) {
+        // Grow the bucket array.  The entries are relinked in place, so a
+        // concurrent reader walking the old array may miss an entry, but will
+        // never follow a dangling pointer.
+        lcm_channel_table_t *grown = channel_table_new (table->nbuckets * 2);
+        grown->size = table->size;
+        for (unsigned int i = 0; i < table->nbuckets; i++) {
+            lcm_channel_entry_t *e = table->buckets[i];
+            while (e) {
+                lcm_channel_entry_t *next = e->next;
+                unsigned int b = e->hash & (grown->nbuckets - 1);
+                g_atomic_pointer_set (&e->next, grown->buckets[b]);
+                grown->buckets[b] = e;
+                e = next;
+            }
+        }
+        g_atomic_pointer_set (&lcm->handlers_map, grown);
+        retire_mem (lcm, table);
+        table = grown;
+    }
+
+    unsigned int b = entry->hash & (table->nbuckets - 1);
+    entry->next = table->buckets[b];
+    g_atomic_pointer_set (&table->buckets[b], entry);
+    table->size++;
+}
+
+// Unlink an entry and retire it.  A concurrent reader that is looking at the
+// entry can still follow its next pointer.  Must be called with lcm->mutex
+// held.
+static void
+channel_table_remove (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    lcm_channel_table_t *table = lcm->handlers_map;
+    lcm_channel_entry_t **link =
+        &table->buckets[entry->hash & (table->nbuckets - 1)];
+    while (*link && *link != entry)
+        link = &(*link)->next;
+    if (!*link)
+        return;
+    g_atomic_pointer_set (link, entry->next);
+    table->size--;
+    retire_mem (lcm, entry);
+}
+
+// Give an entry a channel ID that providers can use to look it up again.
+// Must be called with lcm->mutex held.
+static void
+channel_slots_assign (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    unsigned int slot;
+    if (lcm->free_slots->len) {
+        slot = GPOINTER_TO_UINT (g_ptr_array_index (lcm->free_slots,
+                    lcm->free_slots->len - 1));
+        g_ptr_array_remove_index_fast (lcm->free_slots, lcm->free_slots->len - 1);
+    } else {
+        slot = lcm->next_slot++;
+    }
+
+    lcm_channel_slots_t *slots = lcm->channel_slots;
+    if (slot >= slots->nslots) {
+        lcm_channel_slots_t *grown = (lcm_channel_slots_t *) calloc (1,
+                sizeof (lcm_channel_slots_t) +
+                2 * slots->nslots * sizeof (lcm_channel_entry_t *));
+        grown->nslots = 2 * slots->nslots;
+        memcpy (grown->entries, slots->entries,
+                slots->nslots * sizeof (lcm_channel_entry_t *));
+        g_atomic_pointer_set (&lcm->channel_slots, grown);
+        retire_mem (lcm, slots);
+        slots = grown;
+    }
+
+    // 0 is never a valid ID
+    if (!++lcm->channel_generation)
+        lcm->channel_generation = 1;
+    entry->id = ((lcm_channel_id_t) lcm->channel_generation << 32) | slot;
+    g_atomic_pointer_set (&slots->entries[slot], entry);
+}
+
+// must be called with lcm->mutex held
+static void
+channel_slots_release (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    unsigned int slot = (unsigned int) (entry->id & 0xffffffff);
+    g_atomic_pointer_set (&lcm->channel_slots->entries[slot], NULL);
+    g_ptr_array_add (lcm->free_slots, GUINT_TO_POINTER (slot));
+}
+
+// Find the entry for a channel ID.  Safe to call without lcm->mutex from
+// inside a read section.  Returns NULL if the entry has been evicted.
+static lcm_channel_entry_t *
+channel_slots_find (lcm_t *lcm, lcm_channel_id_t id)
+{
+    lcm_channel_slots_t *slots =
+        (lcm_channel_slots_t *) g_atomic_pointer_get (&lcm->channel_slots);
+    unsigned int slot = (unsigned int) (id & 0xffffffff);
+    if (!id || slot >= slots->nslots)
+        return NULL;
+    lcm_channel_entry_t *entry = (lcm_channel_entry_t *) g_atomic_pointer_get (
+            &slots->entries[slot]);
+    return entry && entry->id == id ? entry : NULL;
+}
+
+// must be called with lcm->mutex held
+static void
+idle_list_append (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    entry->idle_prev = lcm->idle_tail;
+    entry->idle_next = NULL;
+    if (lcm->idle_tail)
+        lcm->idle_tail->idle_next = entry;
+    else
+        lcm->idle_head = entry;
+    lcm->idle_tail = entry;
+    lcm->num_idle++;
+}
+
+// must be called with lcm->mutex held
+static void
+idle_list_remove (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    if (entry->idle_prev)
+        entry->idle_prev->idle_next = entry->idle_next;
+    else
+        lcm->idle_head = entry->idle_next;
+    if (entry->idle_next)
+        entry->idle_next->idle_prev = entry->idle_prev;
+    else
+        lcm->idle_tail = entry->idle_prev;
+    entry->idle_prev = entry->idle_next = NULL;
+    lcm->num_idle--;
+}
+
+// Evict idle entries until the channel cache has room for num_new more
+// within its capacity.  Readers only mark the entries they look up, so this
+// approximates LRU by giving recently used entries a second chance (the CLOCK
+// algorithm).  Must be called with lcm->mutex held.
+static void
+channel_cache_trim (lcm_t *lcm, unsigned int num_new)
+{
+    if (lcm->channel_cache_capacity <= 0)
+        return;
+    int budget = 2 * lcm->num_idle;
+    while (lcm->handlers_map->size + num_new >
+            (unsigned int) lcm->channel_cache_capacity &&
+            lcm->idle_head && budget-- > 0) {
+        lcm_channel_entry_t *entry = lcm->idle_head;
+        idle_list_remove (lcm, entry);
+        if (g_atomic_int_get (&entry->referenced)) {
+            g_atomic_int_set (&entry->referenced, 0);
+            idle_list_append (lcm, entry);
+            continue;
+        }
+        prefix_trie_remove (lcm->channel_trie, entry->channel,
+                strlen (entry->channel), entry);
+        channel_slots_release (lcm, entry);
+        channel_table_remove (lcm, entry);
+        lcm->cache_evictions++;
+    }
+}
+
+// must be called with lcm->mutex held
+static void
+channel_cache_fold_hits (lcm_t *lcm)
+{
+    int hits;
+    do {
+        hits = g_atomic_int_get (&lcm->cache_hits);
+    } while (!g_atomic_int_compare_and_exchange (&lcm->cache_hits, hits, 0));
+    lcm->cache_hits_total += hits;
+}
+
+// Count a lookup that found its entry without taking lcm->mutex.
+static inline void
+channel_cache_hit (lcm_t *lcm, lcm_channel_entry_t *entry)
+{
+    if (!g_atomic_int_get (&entry->referenced))
+        g_atomic_int_set (&entry->referenced, 1);
+    if (g_atomic_int_exchange_and_add (&lcm->cache_hits, 1) ==
+            LCM_CACHE_HITS_FOLD) {
+        g_static_rec_mutex_lock (&lcm->mutex);
+        channel_cache_fold_hits (lcm);
+        g_static_rec_mutex_unlock (&lcm->mutex);
+    }
+}
+
+static lcm_handler_list_t *
+handler_list_new (unsigned int len)
+{
+    lcm_handler_list_t *list = (lcm_handler_list_t *) malloc (
+            sizeof (lcm_handler_list_t) + len * sizeof (lcm_subscription_t *));
+    list->len = len;
+    return list;
+}
+
+// Publish a copy of an entry's handler list with h appended.  Must be called
+// with lcm->mutex held.
+static void
+channel_entry_add_handler (lcm_t *lcm, lcm_channel_entry_t *entry,
+        lcm_subscription_t *h)
+{
+    lcm_handler_list_t *old = entry->handlers;
+    unsigned int len = old ? old->len : 0;
+    lcm_handler_list_t *list = handler_list_new (len + 1);
+    if (len)
+        memcpy (list->handlers, old->handlers, len * sizeof (lcm_subscription_t *));
+    list->handlers[len] = h;
+    g_atomic_pointer_set (&entry->handlers, list);
+    retire_mem (lcm, old);
+    g_ptr_array_add (h->entries, entry);
+    if (!old)
+        idle_list_remove (lcm, entry);
+}
+
+// Publish a copy of an entry's handler list with h removed.  Must be called
+// with lcm->mutex held.  Doesn't update h->entries.
+static void
+channel_entry_remove_handler (lcm_t *lcm, lcm_channel_entry_t *entry,
+        lcm_subscription_t *h)
+{
+    lcm_handler_list_t *old = entry->handlers;
+    if (!old)
+        return;
+    unsigned int pos;
+    for (pos = 0; pos < old->len && old->handlers[pos] != h; pos++);
+    if (pos == old->len)
+        return;
+
+    lcm_handler_list_t *list = NULL;
+    if (old->len > 1) {
+        list = handler_list_new (old->len - 1);
+        memcpy (list->handlers, old->handlers, pos * sizeof (lcm_subscription_t *));
+        memcpy (list->handlers + pos, old->handlers + pos + 1,
+                (old->len - pos - 1) * sizeof (lcm_subscription_t *));
+    }
+    g_atomic_pointer_set (&entry->handlers, list);
+    retire_mem (lcm, old);
+    if (!list)
+        idle_list_append (lcm, entry);
+}
+
+/* ==== Subscription index ====
+ *
+ * Most subscriptions are either a literal channel name or a literal prefix
+ * followed by ".*".  Those are matched without GRegex, and indexed so that
+ * resolving a new channel name doesn't have to test every subscription.
+ */
+
+static int
+is_literal_pattern (const char *pattern, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (strchr ("\\^$.|?*+()[]{}", pattern[i]))
+            return 0;
+    }
+    return 1;
+}
+
+lcm_subscription_kind_t
+lcm_classify_subscription (const char *channel, int *prefix_len)
+{
+    size_t len = strlen (channel);
+    if (is_literal_pattern (channel, len))
+        return LCM_SUBSCRIPTION_LITERAL;
+    if (len >= 2 && !strcmp (channel + len - 2, ".*") &&
+            is_literal_pattern (channel, len - 2)) {
+        *prefix_len = len - 2;
+        return LCM_SUBSCRIPTION_PREFIX;
+    }
+    return LCM_SUBSCRIPTION_REGEX;
+}
+
+static int
+is_handler_subscriber(lcm_subscription_t *h, const char *channel_name)
+{
+    switch (h->kind) {
+        case LCM_SUBSCRIPTION_LITERAL:
+            return !strcmp (h->channel, channel_name);
+        case LCM_SUBSCRIPTION_PREFIX:
+            return !strncmp (h->channel, channel_name, h->prefix_len);
+        default:
+            return g_regex_match(h->regex, channel_name, (GRegexMatchFlags) 0,
+                    NULL);
+    }
+}
+
+static int
+is_keep_latest (lcm_subscription_t *h)
+{
+    return g_atomic_int_get (&h->queue_policy) == LCM_QUEUE_KEEP_LATEST;
+}
+
+static lcm_prefix_node_t *
+prefix_node_new (char c)
+{
+    lcm_prefix_node_t *node =
+        (lcm_prefix_node_t *) calloc (1, sizeof (lcm_prefix_node_t));
+    node->c = c;
+    return node;
+}
+
+static void
+prefix_node_free (lcm_prefix_node_t *node)
+{
+    while (node->child) {
+        lcm_prefix_node_t *child = node->child;
+        node->child = child->sibling;
+        prefix_node_free (child);
+    }
+    if (node->items)
+        g_ptr_array_free (node->items, TRUE);
+    free (node);
+}
+
+static lcm_prefix_node_t *
+prefix_node_child (lcm_prefix_node_t *node, char c)
+{
+    lcm_prefix_node_t *child = node->child;
+    while (child && child->c != c)
+        child = child->sibling;
+    return child;
+}
+
+static void
+prefix_trie_add (lcm_prefix_node_t *node, const char *key, int len,
+        gpointer item)
+{
+    for (int i = 0; i < len; i++) {
+        lcm_prefix_node_t *child = prefix_node_child (node, key[i]);
+        if (!child) {
+            child = prefix_node_new (key[i]);
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    if (!node->items)
+        node->items = g_ptr_array_new ();
+    g_ptr_array_add (node->items, item);
+}
+
+// Removes item from the trie.  Returns 1 if node is left empty and can be
+// pruned.
+static int
+prefix_trie_remove (lcm_prefix_node_t *node, const char *key, int len,
+        gpointer item)
+{
+    if (!len) {
+        if (node->items) {
+            g_ptr_array_remove (node->items, item);
+            if (!node->items->len) {
+                g_ptr_array_free (node->items, TRUE);
+                node->items = NULL;
+            }
+        }
+    } else {
+        lcm_prefix_node_t **link = &node->child;
+        while (*link && (*link)->c != key[0])
+            link = &(*link)->sibling;
+        lcm_prefix_node_t *child = *link;
+        if (child && prefix_trie_remove (child, key + 1, len - 1, item)) {
+            *link = child->sibling;
+            free (child);
+        }
+    }
+    return !node->items && !node->child;
+}
+
+// Returns the node for a key, or NULL if no stored key starts with it.
+static lcm_prefix_node_t *
+prefix_trie_find (lcm_prefix_node_t *node, const char *key, int len)
+{
+    for (int i = 0; node && i < len; i++)
+        node = prefix_node_child (node, key[i]);
+    return node;
+}
+
+// Appends the items stored under every prefix of key onto result.
+static void
+prefix_trie_collect_prefixes (lcm_prefix_node_t *node, const char *key,
+        GPtrArray *result)
+{
+    while (node) {
+        if (node->items) {
+            for (unsigned int i = 0; i < node->items->len; i++)
+                g_ptr_array_add (result, g_ptr_array_index (node->items, i));
+        }
+        if (!*key)
+            break;
+        node = prefix_node_child (node, *key);
+        key++;
+    }
+}
+
+// Appends the items stored under node and all of its descendants onto result.
+static void
+prefix_trie_collect_all (lcm_prefix_node_t *node, GPtrArray *result)
+{
+    if (node->items) {
+        for (unsigned int i = 0; i < node->items->len; i++)
+            g_ptr_array_add (result, g_ptr_array_index (node->items, i));
+    }
+    for (lcm_prefix_node_t *child = node->child; child; child = child->sibling)
+        prefix_trie_collect_all (child, result);
+}
+
+static void
+free_ptr_array (gpointer data)
+{
+    g_ptr_array_free ((GPtrArray *) data, TRUE);
+}
+
+// must be called with lcm->mutex held
+static void
+subscription_index_add (lcm_t *lcm, lcm_subscription_t *h)
+{
+    switch (h->kind) {
+        case LCM_SUBSCRIPTION_LITERAL:
+            {
+                GPtrArray *handlers = (GPtrArray *) g_hash_table_lookup (
+                        lcm->literal_handlers, h->channel);
+                if (!handlers) {
+                    handlers = g_ptr_array_new ();
+                    g_hash_table_insert (lcm->literal_handlers,
+                            strdup (h->channel), handlers);
+                }
+                g_ptr_array_add (handlers, h);
+            }
+            break;
+        case LCM_SUBSCRIPTION_PREFIX:
+            prefix_trie_add (lcm->prefix_handlers, h->channel, h->prefix_len, h);
+            break;
+        default:
+            g_ptr_array_add (lcm->regex_handlers, h);
+            break;
+    }
+}
+
+// must be called with lcm->mutex held
+static void
+subscription_index_remove (lcm_t *lcm, lcm_subscription_t *h)
+{
+    switch (h->kind) {
+        case LCM_SUBSCRIPTION_LITERAL:
+            {
+                GPtrArray *handlers = (GPtrArray *) g_hash_table_lookup (
+                        lcm->literal_handlers, h->channel);
+                if (handlers) {
+                    g_ptr_array_remove (handlers, h);
+                    if (!handlers->len)
+                        g_hash_table_remove (lcm->literal_handlers, h->channel);
+                }
+            }
+            break;
+        case LCM_SUBSCRIPTION_PREFIX:
+            prefix_trie_remove (lcm->prefix_handlers, h->channel, h->prefix_len,
+                    h);
+            break;
+        default:
+            g_ptr_array_remove (lcm->regex_handlers, h);
+            break;
+    }
+}
+
+static gint
+compare_subscription_seqno (gconstpointer a, gconstpointer b)
+{
+    const lcm_subscription_t *ha = *(const lcm_subscription_t * const *) a;
+    const lcm_subscription_t *hb = *(const lcm_subscription_t * const *) b;
+    return ha->seqno < hb->seqno ? -1 : (ha->seqno > hb->seqno ? 1 : 0);
+}
+
+// Returns the subscriptions that match a channel, in the order they were
+// made.  Must be called with lcm->mutex held.
+static GPtrArray *
+subscription_index_find (lcm_t *lcm, const char *channel)
+{
+    GPtrArray *matches = g_ptr_array_new ();
+
+    GPtrArray *literals = (GPtrArray *) g_hash_table_lookup (
+            lcm->literal_handlers, channel);
+    for (unsigned int i = 0; literals && i < literals->len; i++)
+        g_ptr_array_add (matches, g_ptr_array_index (literals, i));
+
+    prefix_trie_collect_prefixes (lcm->prefix_handlers, channel, matches);
+
+    for (unsigned int i = 0; i < lcm->regex_handlers->len; i++) {
+        lcm_subscription_t *h =
+            (lcm_subscription_t *) g_ptr_array_index (lcm->regex_handlers, i);
+        if (is_handler_subscriber (h, channel))
+            g_ptr_array_add (matches, h);
+    }
+
+    g_ptr_array_sort (matches, compare_subscription_seqno);
+    return matches;
+}
+
+// Returns the channel entries that a subscription matches.  Must be called
+// with lcm->mutex held.
+static GPtrArray *
+subscription_find_entries (lcm_t *lcm, lcm_subscription_t *h)
+{
+    GPtrArray *entries = g_ptr_array_new ();
+    switch (h->kind) {
+        case LCM_SUBSCRIPTION_LITERAL:
+            {
+                lcm_channel_entry_t *entry = channel_table_find (lcm,
+                        h->channel, g_str_hash (h->channel));
+                if (entry)
+                    g_ptr_array_add (entries, entry);
+            }
+            break;
+        case LCM_SUBSCRIPTION_PREFIX:
+            {
+                lcm_prefix_node_t *node = prefix_trie_find (lcm->channel_trie,
+                        h->channel, h->prefix_len);
+                if (node)
+                    prefix_trie_collect_all (node, entries);
+            }
+            break;
+        default:
+            {
+                // a regex has to be tested against every known channel
+                lcm_channel_table_t *table = lcm->handlers_map;
+                for (unsigned int i = 0; i < table->nbuckets; i++) {
+                    for (lcm_channel_entry_t *entry = table->buckets[i]; entry;
+                            entry = entry->next) {
+                        if (is_handler_subscriber (h, entry->channel))
+                            g_ptr_array_add (entries, entry);
+                    }
+                }
+            }
+            break;
+    }
+    return entries;
+}
+
+/* ==== Subscription statistics ==== */
+
+static inline void
+stat_max (int64_t *stat, int64_t value)
+{
+    int64_t old = stat_get (stat);
+    while (value > old && !stat_cas (stat, old, value))
+        old = stat_get (stat);
+}
+
+static inline void
+stat_min (int64_t *stat, int64_t value)
+{
+    int64_t old = stat_get (stat);
+    while (value < old && !stat_cas (stat, old, value))
+        old = stat_get (stat);
+}
+
+static void
+latency_clear (lcm_latency_histogram_t *hist)
+{
+    stat_set (&hist->count, 0);
+    stat_set (&hist->min_usec, INT64_MAX);
+    stat_set (&hist->max_usec, INT64_MIN);
+    stat_set (&hist->total_usec, 0);
+    for (int i = 0; i < LCM_LATENCY_HISTOGRAM_BUCKETS; i++)
+        stat_set (&hist->buckets[i], 0);
+}
+
+static inline int64_t
+handler_clock_ns (void)
+{
+#ifdef WIN32
+    GTimeVal tv;
+    g_get_current_time (&tv);
+    return ((int64_t) tv.tv_sec * 1000000 + tv.tv_usec) * 1000;
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Invoke a subscription's handler, and account for it in its statistics.
+static void
+subscription_invoke (lcm_subscription_t *h, const lcm_recv_buf_t *rbuf,
+        const char *channel)
+{
+    int64_t start = handler_clock_ns ();
+    h->handler (rbuf, channel, h->userdata);
+    int64_t elapsed = handler_clock_ns () - start;
+
+    stat_add (&h->stats.num_delivered, 1);
+    stat_add (&h->stats.bytes_delivered, rbuf->data_size);
+    stat_add (&h->stats.total_handler_ns, elapsed);
+    stat_max (&h->stats.max_handler_ns, elapsed);
+}
+
+/* ==== Dispatch executor ====
+ *
+ * Subscriptions that are dispatched on worker threads get a private FIFO of
+ * jobs.  A subscription with pending jobs is put on lcm->exec_ready, and is
+ * run by at most one worker at a time, so its handler sees messages in the
+ * order they were received while other subscriptions run in parallel.  Each
+ * queued job holds a callback_scheduled reference on its subscription.
+ */
+
+static lcm_dispatch_job_t *
+dispatch_job_new (const lcm_recv_buf_t *rbuf, const char *channel)
+{
+    size_t channel_len = strlen (channel) + 1;
+    lcm_dispatch_job_t *job = (lcm_dispatch_job_t *) malloc (
+            sizeof (lcm_dispatch_job_t) + channel_len + rbuf->data_size);
+    job->refcount = 1;
+    job->channel = (char *) (job + 1);
+    memcpy (job->channel, channel, channel_len);
+    job->rbuf = *rbuf;
+    job->rbuf.data = job->channel + channel_len;
+    memcpy (job->rbuf.data, rbuf->data, rbuf->data_size);
+    return job;
+}
+
+static void
+dispatch_job_unref (lcm_dispatch_job_t *job)
+{
+    if (g_atomic_int_dec_and_test (&job->refcount))
+        free (job);
+}
+
+static gpointer
+dispatch_worker (gpointer user)
+{
+    lcm_t *lcm = (lcm_t *) user;
+
+    g_mutex_lock (lcm->exec_mutex);
+    while (1) {
+        while (!lcm->exec_quit && g_queue_is_empty (lcm->exec_ready))
+            g_cond_wait (lcm->exec_cond, lcm->exec_mutex);
+        if (lcm->exec_quit)
+            break;
+
+        lcm_subscription_t *h =
+            (lcm_subscription_t *) g_queue_pop_head (lcm->exec_ready);
+        lcm_dispatch_job_t *job = (lcm_dispatch_job_t *) g_queue_pop_head (h->jobs);
+        g_mutex_unlock (lcm->exec_mutex);
+
+        if (!g_atomic_int_get (&h->marked_for_deletion))
+            subscription_invoke (h, &job->rbuf, job->channel);
+        g_atomic_int_add (&h->num_executor_queued, -1);
+        dispatch_job_unref (job);
+
+        g_mutex_lock (lcm->exec_mutex);
+        // go to the back of the line, so that a busy subscription doesn't
+        // starve the others
+        if (g_queue_is_empty (h->jobs))
+            h->executor_active = 0;
+        else
+            g_queue_push_tail (lcm->exec_ready, h);
+
+        // h may be freed as soon as its last reference is dropped
+        if (g_atomic_int_dec_and_test (&h->callback_scheduled) &&
+                g_atomic_int_get (&lcm->num_retired)) {
+            g_mutex_unlock (lcm->exec_mutex);
+            g_static_rec_mutex_lock (&lcm->mutex);
+            lcm_reclaim_retired (lcm);
+            g_static_rec_mutex_unlock (&lcm->mutex);
+            g_mutex_lock (lcm->exec_mutex);
+        }
+    }
+    g_mutex_unlock (lcm->exec_mutex);
+    return NULL;
+}
+
+// Queue a job for a subscription.  Must be called from inside a read section.
+static void
+dispatch_job_queue (lcm_t *lcm, lcm_subscription_t *h, lcm_dispatch_job_t *job)
+{
+    g_atomic_int_inc (&h->callback_scheduled);
+    g_atomic_int_inc (&h->num_executor_queued);
+    g_atomic_int_inc (&job->refcount);
+
+    g_mutex_lock (lcm->exec_mutex);
+    if (is_keep_latest (h)) {
+        // drop the jobs that this one supersedes.  The job being run, if
+        // any, has already been taken off the queue.
+        GList *link = h->jobs->head;
+        while (link) {
+            GList *next = link->next;
+            lcm_dispatch_job_t *old = (lcm_dispatch_job_t *) link->data;
+            if (!strcmp (old->channel, job->channel)) {
+                g_queue_delete_link (h->jobs, link);
+                dispatch_job_unref (old);
+                g_atomic_int_add (&h->num_executor_queued, -1);
+                g_atomic_int_add (&h->callback_scheduled, -1);
+            }
+            link = next;
+        }
+    }
+    g_queue_push_tail (h->jobs, job);
+    if (!h->executor_active) {
+        h->executor_active = 1;
+        g_queue_push_tail (lcm->exec_ready, h);
+        g_cond_signal (lcm->exec_cond);
+    }
+    g_mutex_unlock (lcm->exec_mutex);
+}
+
+// Start worker threads until there are num_threads.  Must be called with
+// lcm->mutex held.
+static int
+executor_start (lcm_t *lcm, int num_threads)
+{
+    if (!lcm->exec_threads) {
+        lcm->exec_mutex = g_mutex_new ();
+        lcm->exec_cond = g_cond_new ();
+        lcm->exec_ready = g_queue_new ();
+        lcm->exec_threads = g_ptr_array_new ();
+    }
+    while ((int) lcm->exec_threads->len < num_threads) {
+        GThread *thread = g_thread_create (dispatch_worker, lcm, TRUE, NULL);
+        if (!thread) {
+            fprintf (stderr, "Error: LCM failed to start dispatch thread\n");
+            return -1;
+        }
+        g_ptr_array_add (lcm->exec_threads, thread);
+    }
+    return 0;
+}
+
+static void
+executor_discard_jobs (lcm_subscription_t *h)
+{
+    while (!g_queue_is_empty (h->jobs)) {
+        dispatch_job_unref ((lcm_dispatch_job_t *) g_queue_pop_head (h->jobs));
+        h->callback_scheduled--;
+        h->num_executor_queued--;
+    }
+    h->executor_active = 0;
+}
+
+// Stop the worker threads and discard the jobs they didn't get to.
+static void
+executor_stop (lcm_t *lcm)
+{
+    if (!lcm->exec_threads)
+        return;
+
+    g_mutex_lock (lcm->exec_mutex);
+    lcm->exec_quit = 1;
+    g_cond_broadcast (lcm->exec_cond);
+    g_mutex_unlock (lcm->exec_mutex);
+    for (unsigned int i = 0; i < lcm->exec_threads->len; i++)
+        g_thread_join ((GThread *) g_ptr_array_index (lcm->exec_threads, i));
+    g_ptr_array_free (lcm->exec_threads, TRUE);
+    lcm->exec_threads = NULL;
+
+    GHashTableIter iter;
+    gpointer h;
+    g_hash_table_iter_init (&iter, lcm->handlers_all);
+    while (g_hash_table_iter_next (&iter, &h, NULL))
+        executor_discard_jobs ((lcm_subscription_t *) h);
+    for (GSList *it = lcm->retired_handlers; it; it = it->next)
+        executor_discard_jobs ((lcm_subscription_t *) it->data);
+    for (GSList *it = lcm->old_retired_handlers; it; it = it->next)
+        executor_discard_jobs ((lcm_subscription_t *) it->data);
+
+    g_queue_free (lcm->exec_ready);
+    g_cond_free (lcm->exec_cond);
+    g_mutex_free (lcm->exec_mutex);
+}
+
 extern void lcm_udpm_provider_init (GPtrArray * providers);
 extern void lcm_logprov_provider_init (GPtrArray * providers);
 extern void lcm_tcpq_provider_init (GPtrArray * providers);
@@ -118,8 +1131,19 @@ lcm_create (const char *url)
     lcm = (lcm_t *) calloc (1, sizeof (lcm_t));
 
     lcm->vtable = info->vtable;
-    lcm->handlers_all = g_ptr_array_new();
-    lcm->handlers_map = g_hash_table_new (g_str_hash, g_str_equal);
+    lcm->handlers_all = g_hash_table_new (g_direct_hash, g_direct_equal);
+    lcm->literal_handlers = g_hash_table_new_full (g_str_hash, g_str_equal,
+            free, free_ptr_array);
+    lcm->prefix_handlers = prefix_node_new (0);
+    lcm->regex_handlers = g_ptr_array_new();
+    lcm->handlers_map = channel_table_new (LCM_CHANNEL_TABLE_MIN_BUCKETS);
+    lcm->channel_trie = prefix_node_new (0);
+    lcm->channel_slots = (lcm_channel_slots_t *) calloc (1,
+            sizeof (lcm_channel_slots_t) +
+            LCM_CHANNEL_SLOTS_MIN * sizeof (lcm_channel_entry_t *));
+    lcm->channel_slots->nslots = LCM_CHANNEL_SLOTS_MIN;
+    lcm->free_slots = g_ptr_array_new ();
+    lcm->channel_cache_capacity = LCM_DEFAULT_CHANNEL_CACHE_CAPACITY;
 
     g_static_rec_mutex_init (&lcm->mutex);
     g_static_rec_mutex_init (&lcm->handle_mutex);
@@ -153,48 +1177,125 @@ fail:
     return NULL;
 }
 
-// free the array that we associate for each channel, and the key. Don't free
-// the lcm_subscription_t*s.
-static void 
-map_free_handlers_callback(gpointer _key, gpointer _value, gpointer _data)
-{
-    GPtrArray *handlers = (GPtrArray*) _value;
-    g_ptr_array_free(handlers, TRUE);
-    free(_key);
-}
-
 static void
 lcm_handler_free (lcm_subscription_t *h) 
 {
     assert (!h->callback_scheduled);
-    g_regex_unref(h->regex);
+    g_queue_free(h->jobs);
+    g_ptr_array_free(h->entries, TRUE);
+    if (h->regex)
+        g_regex_unref(h->regex);
     free (h->channel);
     memset (h, 0, sizeof (lcm_subscription_t));
     free (h);
 }
 
+// Release retired memory and subscriptions if no reader can still see them.
+// Must be called with lcm->mutex held.
+static void
+lcm_reclaim_retired (lcm_t *lcm)
+{
+    // with no readers, two epochs release everything
+    for (int pass = 0; pass < 2 && g_atomic_int_get (&lcm->num_retired);
+            pass++) {
+        int epoch = g_atomic_int_get (&lcm->epoch);
+        if (g_atomic_int_get (&lcm->readers[(epoch - 1) & 1]))
+            return;
+
+        // every thread reading now entered in this epoch, after the old
+        // retired entries were unpublished
+        int nfreed = 0;
+        for (; lcm->old_retired_mem;
+                lcm->old_retired_mem = g_slist_delete_link (
+                    lcm->old_retired_mem, lcm->old_retired_mem)) {
+            free (lcm->old_retired_mem->data);
+            nfreed++;
+        }
+
+        GSList *still_scheduled = NULL;
+        for (; lcm->old_retired_handlers;
+                lcm->old_retired_handlers = g_slist_delete_link (
+                    lcm->old_retired_handlers, lcm->old_retired_handlers)) {
+            lcm_subscription_t *h =
+                (lcm_subscription_t *) lcm->old_retired_handlers->data;
+            if (g_atomic_int_get (&h->callback_scheduled)) {
+                still_scheduled = g_slist_prepend (still_scheduled, h);
+            } else {
+                lcm_handler_free (h);
+                nfreed++;
+            }
+        }
+        g_atomic_int_add (&lcm->num_retired, -nfreed);
+
+        // start a new epoch.  What was retired in this one is released once
+        // the threads reading now are done.
+        lcm->old_retired_mem = lcm->retired_mem;
+        lcm->old_retired_handlers = g_slist_concat (still_scheduled,
+                lcm->retired_handlers);
+        lcm->retired_mem = NULL;
+        lcm->retired_handlers = NULL;
+        g_atomic_int_set (&lcm->epoch, epoch + 1);
+    }
+}
+
 void
 lcm_destroy (lcm_t * lcm)
 {
+    GHashTableIter iter;
+    gpointer h;
+    // handlers still running on the dispatch threads may publish or
+    // unsubscribe, so they must be done before the provider goes away
+    executor_stop (lcm);
     if (lcm->provider){
-        for (unsigned int i = 0; i < lcm->handlers_all->len; i++) {
-            // unsubscribe from all handlers
-            lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index(
-                    lcm->handlers_all, i);
-            lcm_unsubscribe(lcm, h);
+        g_hash_table_iter_init (&iter, lcm->handlers_all);
+        while (g_hash_table_iter_next (&iter, &h, NULL)) {
+            if (lcm->vtable->unsubscribe)
+                lcm->vtable->unsubscribe(lcm->provider,
+                        ((lcm_subscription_t *) h)->channel);
         }
         lcm->vtable->destroy (lcm->provider);
+        lcm->provider = NULL;
     }
-    g_hash_table_foreach (lcm->handlers_map, map_free_handlers_callback, NULL);
-    g_hash_table_destroy (lcm->handlers_map);
 
-    for (unsigned int i = 0; i < lcm->handlers_all->len; i++) {
-        lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index(
-                lcm->handlers_all, i);
-        h->callback_scheduled = 0; // XXX hack...
+    // no readers can remain once the provider is gone
+    lcm_channel_table_t *table = lcm->handlers_map;
+    for (unsigned int i = 0; i < table->nbuckets; i++) {
+        lcm_channel_entry_t *entry = table->buckets[i];
+        while (entry) {
+            lcm_channel_entry_t *next = entry->next;
+            free (entry->handlers);
+            free (entry);
+            entry = next;
+        }
+    }
+    free (table);
+    prefix_node_free (lcm->channel_trie);
+    free (lcm->channel_slots);
+    g_ptr_array_free (lcm->free_slots, TRUE);
+
+    g_hash_table_iter_init (&iter, lcm->handlers_all);
+    while (g_hash_table_iter_next (&iter, &h, NULL)) {
+        ((lcm_subscription_t *) h)->callback_scheduled = 0; // XXX hack...
+        lcm_handler_free((lcm_subscription_t *) h);
+    }
+    g_hash_table_destroy(lcm->handlers_all);
+    g_hash_table_destroy(lcm->literal_handlers);
+    prefix_node_free(lcm->prefix_handlers);
+    g_ptr_array_free(lcm->regex_handlers, TRUE);
+
+    lcm->retired_handlers = g_slist_concat (lcm->retired_handlers,
+            lcm->old_retired_handlers);
+    for (GSList *it = lcm->retired_handlers; it; it = it->next) {
+        lcm_subscription_t *h = (lcm_subscription_t *) it->data;
+        h->callback_scheduled = 0;
         lcm_handler_free(h);
     }
-    g_ptr_array_free(lcm->handlers_all, TRUE);
+    g_slist_free (lcm->retired_handlers);
+    lcm->retired_mem = g_slist_concat (lcm->retired_mem,
+            lcm->old_retired_mem);
+    for (GSList *it = lcm->retired_mem; it; it = it->next)
+        free (it->data);
+    g_slist_free (lcm->retired_mem);
 
     g_static_rec_mutex_free (&lcm->handle_mutex);
     g_static_rec_mutex_free (&lcm->mutex);
@@ -220,23 +1321,55 @@ lcm_handle (lcm_t * lcm)
         return -1;
 }
 
-int
-lcm_handle_timeout (lcm_t *lcm, int timeout_milis)
+// Waits up to timeout_millis for a file descriptor to become readable.
+// Returns >0 if it is readable, 0 on timeout, and <0 on error.
+static int
+lcm_wait_fd (SOCKET fd, int timeout_millis)
 {
+#ifdef WIN32
   fd_set fds;
   FD_ZERO(&fds);
-  SOCKET lcm_fd = lcm_get_fileno(lcm);
-  FD_SET(lcm_fd, &fds);
+  FD_SET(fd, &fds);
 
   struct timeval timeout;
-  timeout.tv_sec = timeout_milis / 1000;
-  timeout.tv_usec = (timeout_milis % 1000) * 1000;
+  timeout.tv_sec = timeout_millis / 1000;
+  timeout.tv_usec = (timeout_millis % 1000) * 1000;
 
+  return select(fd + 1, &fds, NULL, NULL, &timeout);
+#else
+  // poll() rather than select(), which can't watch file descriptors numbered
+  // FD_SETSIZE or higher
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  int status;
+  do {
+      status = poll(&pfd, 1, timeout_millis);
+  } while (status < 0 && errno == EINTR);
+  return status;
+#endif
+}
+
+// Waits up to timeout_millis for messages to be ready to handle.
+// Returns >0 if they are, 0 on timeout, and <0 on error.
+static int
+lcm_wait_fileno (lcm_t *lcm, int timeout_millis)
+{
+  if (lcm->provider && lcm->vtable->wait_ready)
+      return lcm->vtable->wait_ready (lcm->provider, timeout_millis);
+  return lcm_wait_fd (lcm_get_fileno(lcm), timeout_millis);
+}
+
+int
+lcm_handle_timeout (lcm_t *lcm, int timeout_milis)
+{
   if (timeout_milis < 0) {
       return -1;
   }
 
-  int select_result = select(lcm_fd + 1, &fds, NULL, NULL, &timeout);
+  int select_result = lcm_wait_fileno(lcm, timeout_milis);
   if (select_result > 0) {
       int lcm_handle_result = lcm_handle(lcm);
       return lcm_handle_result == 0 ? 1 : lcm_handle_result;
@@ -247,6 +1380,39 @@ lcm_handle_timeout (lcm_t *lcm, int timeout_milis)
   }
 }
 
+int
+lcm_handle_batch (lcm_t *lcm, int max_msgs, int timeout_millis)
+{
+    if (!lcm->provider || !lcm->vtable->handle || max_msgs <= 0)
+        return -1;
+
+    if (timeout_millis >= 0) {
+        int select_result = lcm_wait_fileno(lcm, timeout_millis);
+        if (select_result <= 0)
+            return select_result;
+    }
+
+    int ret;
+    g_static_rec_mutex_lock (&lcm->handle_mutex);
+    assert(!lcm->in_handle); // recursive calls to lcm_handle are not allowed
+    lcm->in_handle = 1;
+    if (lcm->vtable->handle_batch) {
+        ret = lcm->vtable->handle_batch (lcm->provider, max_msgs);
+    } else {
+        // the provider can only handle one message at a time.  Keep going
+        // for as long as it has more messages ready.
+        ret = lcm->vtable->handle (lcm->provider) == 0 ? 1 : -1;
+        while (ret > 0 && ret < max_msgs && lcm_wait_fileno(lcm, 0) > 0) {
+            if (lcm->vtable->handle (lcm->provider) != 0)
+                break;
+            ret++;
+        }
+    }
+    lcm->in_handle = 0;
+    g_static_rec_mutex_unlock (&lcm->handle_mutex);
+    return ret;
+}
+
 int
 lcm_get_fileno (lcm_t * lcm)
 {
@@ -266,36 +1432,6 @@ lcm_publish (lcm_t *lcm, const char *channel, const void *data,
         return -1;
 }
 
-static int 
-is_handler_subscriber(lcm_subscription_t *h, const char *channel_name)
-{
-    return g_regex_match(h->regex, channel_name, (GRegexMatchFlags) 0, NULL);
-}
-
-// add the handler to any channel's handler list if its subscription matches
-static void 
-map_add_handler_callback(gpointer _key, gpointer _value, gpointer _data)
-{
-    lcm_subscription_t *h = (lcm_subscription_t*) _data;
-    char *channel_name = (char*) _key;
-    GPtrArray *handlers = (GPtrArray*) _value;
-
-    if (!is_handler_subscriber(h, channel_name))
-        return;
-    
-    g_ptr_array_add(handlers, h);
-}
-
-// remove from a channel's handler list
-static void 
-map_remove_handler_callback(gpointer _key, gpointer _value, 
-        gpointer _data)
-{
-    lcm_subscription_t *h = (lcm_subscription_t*) _data;
-    GPtrArray *handlers = (GPtrArray*) _value;
-    g_ptr_array_remove_fast(handlers, h);
-}
-
 lcm_subscription_t
 *lcm_subscribe (lcm_t *lcm, const char *channel, 
                      lcm_msg_handler_t handler, void *userdata)
@@ -317,22 +1453,44 @@ lcm_subscription_t
     h->marked_for_deletion = 0;
     h->max_num_queued_messages = lcm->default_max_num_queued_messages;
     h->num_queued_messages = 0;
+    h->dispatch_mode = LCM_DISPATCH_DEFAULT;
+    h->jobs = g_queue_new();
+    h->entries = g_ptr_array_new();
     h->lcm = lcm;
 
-    char *regexbuf = g_strdup_printf("^%s$", channel);
+    h->kind = lcm_classify_subscription(channel, &h->prefix_len);
     GError *rerr = NULL;
-    h->regex = g_regex_new(regexbuf, (GRegexCompileFlags) 0, (GRegexMatchFlags) 0, &rerr);
-    g_free(regexbuf);
+    if (h->kind == LCM_SUBSCRIPTION_REGEX) {
+        char *regexbuf = g_strdup_printf("^%s$", channel);
+        h->regex = g_regex_new(regexbuf, (GRegexCompileFlags) 0, (GRegexMatchFlags) 0, &rerr);
+        g_free(regexbuf);
+    }
     if(rerr) {
         fprintf(stderr, "%s: %s\n", __FUNCTION__, rerr->message);
         dbg(DBG_LCM, "%s: %s\n", __FUNCTION__, rerr->message);
         g_error_free(rerr);
+        if (lcm->provider && lcm->vtable->unsubscribe)
+            lcm->vtable->unsubscribe(lcm->provider, channel);
+        g_queue_free(h->jobs);
+        g_ptr_array_free(h->entries, TRUE);
+        free(h->channel);
         free(h);
         return NULL;
     }
     g_static_rec_mutex_lock (&lcm->mutex);
-    g_ptr_array_add(lcm->handlers_all, h);
-    g_hash_table_foreach(lcm->handlers_map, map_add_handler_callback, h);
+    h->seqno = lcm->next_seqno++;
+    g_hash_table_insert(lcm->handlers_all, h, h);
+    subscription_index_add(lcm, h);
+
+    // add the handler to any channel's handler list if its subscription
+    // matches
+    GPtrArray *entries = subscription_find_entries(lcm, h);
+    for (unsigned int i = 0; i < entries->len; i++) {
+        channel_entry_add_handler(lcm,
+                (lcm_channel_entry_t *) g_ptr_array_index(entries, i), h);
+    }
+    g_ptr_array_free(entries, TRUE);
+    lcm_reclaim_retired(lcm);
     g_static_rec_mutex_unlock (&lcm->mutex);
 
     return h;
@@ -344,19 +1502,26 @@ lcm_unsubscribe (lcm_t *lcm, lcm_subscription_t *h)
     g_static_rec_mutex_lock (&lcm->mutex);
 
     // remove the handler from the master list
-    int foundit = g_ptr_array_remove(lcm->handlers_all, h);
+    int foundit = g_hash_table_remove(lcm->handlers_all, h);
 
     if (lcm->provider && lcm->vtable->unsubscribe) {
         lcm->vtable->unsubscribe(lcm->provider, h->channel);
     }
 
     if (foundit) {
-        // remove the handler from all the lists in the hash table
-        g_hash_table_foreach(lcm->handlers_map, map_remove_handler_callback, h);
-        if (!h->callback_scheduled)
-            lcm_handler_free (h);
-        else
-            h->marked_for_deletion = 1;
+        subscription_index_remove(lcm, h);
+
+        // remove the handler from all the lists in the channel map.  It can't
+        // be freed until any thread that might be dispatching to it is done.
+        g_atomic_int_set(&h->marked_for_deletion, 1);
+        for (unsigned int i = 0; i < h->entries->len; i++) {
+            channel_entry_remove_handler(lcm,
+                    (lcm_channel_entry_t *) g_ptr_array_index(h->entries, i), h);
+        }
+        g_ptr_array_set_size(h->entries, 0);
+        lcm->retired_handlers = g_slist_prepend(lcm->retired_handlers, h);
+        g_atomic_int_inc(&lcm->num_retired);
+        lcm_reclaim_retired(lcm);
     }
 
     g_static_rec_mutex_unlock (&lcm->mutex);
@@ -366,112 +1531,340 @@ lcm_unsubscribe (lcm_t *lcm, lcm_subscription_t *h)
 
 /* ==== Internal API for Providers ==== */
 
-GPtrArray *
-lcm_get_handlers (lcm_t * lcm, const char * channel)
+// Returns the entry for a channel, creating it if the channel hasn't been seen
+// before.  If id is nonzero, it is tried before the channel name.  Must be
+// called from inside a read section, and the result is only valid until the
+// read section is exited.
+static lcm_channel_entry_t *
+lcm_get_channel_entry (lcm_t * lcm, const char * channel, lcm_channel_id_t id)
 {
-    g_static_rec_mutex_lock (&lcm->mutex);
-    GPtrArray * handlers = (GPtrArray *) g_hash_table_lookup (lcm->handlers_map, channel);
-    if (handlers)
-        goto finished;
-
-    // if we haven't seen this channel name before, create a new list
-    // of subscribed handlers.
-    handlers = g_ptr_array_new ();
-    // alloc channel name
-    g_hash_table_insert (lcm->handlers_map, strdup(channel), handlers);
-
-    // find all the matching handlers
-    for (unsigned int i = 0; i < lcm->handlers_all->len; i++) {
-        lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index (lcm->handlers_all, i);
-        if (is_handler_subscriber (h, channel))
-            g_ptr_array_add(handlers, h);
+    lcm_channel_entry_t *entry = channel_slots_find (lcm, id);
+    if (entry) {
+        channel_cache_hit (lcm, entry);
+        return entry;
+    }
+
+    guint hash = g_str_hash (channel);
+    entry = channel_table_find (lcm, channel, hash);
+    if (entry) {
+        channel_cache_hit (lcm, entry);
+        return entry;
     }
 
-finished:
+    g_static_rec_mutex_lock (&lcm->mutex);
+    entry = channel_table_find (lcm, channel, hash);
+    if (!entry) {
+        // make room first, so that the new entry isn't evicted before it is
+        // returned
+        channel_cache_trim (lcm, 1);
+
+        // if we haven't seen this channel name before, create a new list
+        // of subscribed handlers.  It has just been used, so it gets the
+        // same second chance as the entries that were looked up.
+        size_t channel_len = strlen (channel);
+        entry = (lcm_channel_entry_t *) calloc (1,
+                sizeof (lcm_channel_entry_t) + channel_len + 1);
+        memcpy (entry->channel, channel, channel_len + 1);
+        entry->hash = hash;
+        entry->referenced = 1;
+        latency_clear (&entry->latency);
+
+        // find all the matching handlers
+        GPtrArray *matches = subscription_index_find (lcm, channel);
+        if (matches->len) {
+            entry->handlers = handler_list_new (matches->len);
+            memcpy (entry->handlers->handlers, matches->pdata,
+                    matches->len * sizeof (lcm_subscription_t *));
+        } else {
+            idle_list_append (lcm, entry);
+        }
+        for (unsigned int i = 0; i < matches->len; i++) {
+            lcm_subscription_t *h =
+                (lcm_subscription_t *) g_ptr_array_index (matches, i);
+            g_ptr_array_add (h->entries, entry);
+        }
+        g_ptr_array_free (matches, TRUE);
+
+        channel_slots_assign (lcm, entry);
+        channel_table_insert (lcm, entry);
+        prefix_trie_add (lcm->channel_trie, channel, channel_len, entry);
+        lcm->cache_misses++;
+    } else {
+        channel_cache_hit (lcm, entry);
+    }
     g_static_rec_mutex_unlock (&lcm->mutex);
-    return handlers;
+    return entry;
+}
+
+// Returns the handlers subscribed to a channel, or NULL if there are none.
+// Must be called from inside a read section, and the result is only valid
+// until the read section is exited.
+static lcm_handler_list_t *
+lcm_get_handlers (lcm_t * lcm, const char * channel)
+{
+    lcm_channel_entry_t *entry = lcm_get_channel_entry (lcm, channel, 0);
+    return (lcm_handler_list_t *) g_atomic_pointer_get (&entry->handlers);
+}
+
+// Reserve a slot in a subscription's queue, if there's room.  Messages waiting
+// on the dispatch executor count against the queue capacity.  A subscription
+// that only keeps the latest message always has room, since the new message
+// supersedes an older one.
+static int
+subscription_reserve_queued (lcm_subscription_t *h)
+{
+    int keep_latest =
+        g_atomic_int_get (&h->queue_policy) == LCM_QUEUE_KEEP_LATEST;
+    while (1) {
+        int max_queued = g_atomic_int_get (&h->max_num_queued_messages);
+        int queued = g_atomic_int_get (&h->num_queued_messages);
+        if (max_queued > 0 && !keep_latest &&
+                queued + g_atomic_int_get (&h->num_executor_queued) >= max_queued)
+            return 0;
+        if (g_atomic_int_compare_and_exchange (&h->num_queued_messages,
+                    queued, queued + 1))
+            break;
+    }
+
+    int depth = lcm_subscription_get_queue_size (h);
+    int max_depth = g_atomic_int_get (&h->stats.max_queue_depth);
+    while (depth > max_depth && !g_atomic_int_compare_and_exchange (
+                &h->stats.max_queue_depth, max_depth, depth))
+        max_depth = g_atomic_int_get (&h->stats.max_queue_depth);
+    return 1;
+}
+
+// Decrement a counter unless it is already 0.  Returns 0 if it was.
+static int
+atomic_dec_if_positive (int *counter)
+{
+    while (1) {
+        int value = g_atomic_int_get (counter);
+        if (value <= 0)
+            return 0;
+        if (g_atomic_int_compare_and_exchange (counter, value, value - 1))
+            return 1;
+    }
+}
+
+// Release a previously reserved slot in a subscription's queue.  Returns 0 if
+// nothing was queued.
+static int
+subscription_release_queued (lcm_subscription_t *h)
+{
+    return atomic_dec_if_positive (&h->num_queued_messages);
+}
+
+// Returns LCM_HANDLERS_KEEP_LATEST if every handler in the list only keeps
+// the latest message, and 1 otherwise.
+static int
+handler_list_policy (lcm_handler_list_t *handlers)
+{
+    for (unsigned int i = 0; i < handlers->len; i++) {
+        if (!is_keep_latest (handlers->handlers[i]))
+            return 1;
+    }
+    return LCM_HANDLERS_KEEP_LATEST;
 }
 
 int
 lcm_try_enqueue_message(lcm_t* lcm, const char* channel)
 {
-    g_static_rec_mutex_lock (&lcm->mutex);
-    GPtrArray * handlers = lcm_get_handlers (lcm, channel);
+    return lcm_try_enqueue_message_id (lcm, channel, NULL);
+}
+
+int
+lcm_try_enqueue_message_id(lcm_t* lcm, const char* channel,
+        lcm_channel_id_t* id)
+{
+    int slot = read_section_enter (lcm);
+    lcm_channel_entry_t * entry = lcm_get_channel_entry (lcm, channel,
+            id ? *id : 0);
+    lcm_handler_list_t * handlers =
+        (lcm_handler_list_t *) g_atomic_pointer_get (&entry->handlers);
+    if (id)
+        *id = entry->id;
     int num_keepers = 0;
-    for(unsigned int i=0; i<handlers->len; i++) {
-        lcm_subscription_t* h = (lcm_subscription_t*) g_ptr_array_index(handlers, i);
-        if(h->num_queued_messages < h->max_num_queued_messages ||
-                h->max_num_queued_messages <= 0) {
-            h->num_queued_messages++;
+    for(unsigned int i=0; handlers && i<handlers->len; i++) {
+        if (subscription_reserve_queued (handlers->handlers[i]))
             num_keepers++;
-        }
+        else
+            stat_add (&handlers->handlers[i]->stats.num_dropped, 1);
     }
-    g_static_rec_mutex_unlock (&lcm->mutex);
-    return num_keepers > 0;
+    int status = 0;
+    if (num_keepers) {
+        g_atomic_int_inc (&entry->num_queued);
+        status = handler_list_policy (handlers);
+    }
+    read_section_exit (lcm, slot);
+    return status;
+}
+
+void
+lcm_discard_message (lcm_t * lcm, const char * channel, lcm_channel_id_t id)
+{
+    int slot = read_section_enter (lcm);
+    lcm_channel_entry_t * entry = lcm_get_channel_entry (lcm, channel, id);
+    lcm_handler_list_t * handlers =
+        (lcm_handler_list_t *) g_atomic_pointer_get (&entry->handlers);
+    for (unsigned int i = 0; handlers && i < handlers->len; i++)
+        subscription_release_queued (handlers->handlers[i]);
+    atomic_dec_if_positive (&entry->num_queued);
+    read_section_exit (lcm, slot);
 }
 
 int
 lcm_has_handlers (lcm_t * lcm, const char * channel)
 {
-    int has_handlers = 1;
-    g_static_rec_mutex_lock (&lcm->mutex);
-    GPtrArray * handlers = lcm_get_handlers (lcm, channel);
-    if (!handlers || !handlers->len)
-        has_handlers = 0;
-    g_static_rec_mutex_unlock (&lcm->mutex);
+    int slot = read_section_enter (lcm);
+    lcm_handler_list_t * handlers = lcm_get_handlers (lcm, channel);
+    int has_handlers = handlers && handlers->len ?
+        handler_list_policy (handlers) : 0;
+    read_section_exit (lcm, slot);
     return has_handlers;
 }
 
 int
 lcm_dispatch_handlers (lcm_t * lcm, lcm_recv_buf_t * buf, const char *channel)
 {
-    g_static_rec_mutex_lock (&lcm->mutex);
+    return lcm_dispatch_handlers_id (lcm, buf, channel, 0);
+}
 
-    GPtrArray * handlers = lcm_get_handlers (lcm, channel);
-
-    // ref the handlers to prevent them from being destroyed by an
-    // lcm_unsubscribe.  This guarantees that handlers 0-(nhandlers-1) will not
-    // be destroyed during the callbacks.  Store nhandlers in a local variable
-    // so that we don't iterate over handlers that are added during the
-    // callbacks.
-    int nhandlers = handlers->len;
-    for (int i = 0; i < nhandlers; i++) {
-        lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index(handlers, i);
-        h->callback_scheduled = 1;
-    }
-
-    // now, call the handlers.
-    for (int i = 0; i < nhandlers; i++) {
-        lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index(handlers, i);
-        if (!h->marked_for_deletion && h->num_queued_messages > 0) {
-            h->num_queued_messages--;
-            int depth = g_static_rec_mutex_unlock_full (&lcm->mutex);
-            h->handler (buf, channel, h->userdata);
-            g_static_rec_mutex_lock_full (&lcm->mutex, depth);
+// Account for the latency of a message that carries a send timestamp.  May
+// race with other dispatching threads, so every field is updated atomically.
+static void
+latency_record (lcm_latency_histogram_t *hist, int64_t send_utime)
+{
+    GTimeVal tv;
+    g_get_current_time (&tv);
+    int64_t latency = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec - send_utime;
+
+    int bucket = 0;
+    while (bucket < LCM_LATENCY_HISTOGRAM_BUCKETS - 1 &&
+            latency >= ((int64_t) 1 << bucket))
+        bucket++;
+
+    stat_min (&hist->min_usec, latency);
+    stat_max (&hist->max_usec, latency);
+    stat_add (&hist->total_usec, latency);
+    stat_add (&hist->buckets[bucket], 1);
+    // counted last, so that a reader that sees the message also sees its
+    // minimum and maximum
+    stat_add (&hist->count, 1);
+}
+
+int
+lcm_dispatch_handlers_id (lcm_t * lcm, lcm_recv_buf_t * buf,
+        const char *channel, lcm_channel_id_t id)
+{
+    // The read section guarantees that the handler list, and the handlers in
+    // it, will not be destroyed by an lcm_unsubscribe during the callbacks.
+    // Handlers subscribed during the callbacks are not in this list.
+    int slot = read_section_enter (lcm);
+
+    lcm_channel_entry_t * entry = lcm_get_channel_entry (lcm, channel, id);
+    if (buf->send_utime)
+        latency_record (&entry->latency, buf->send_utime);
+    lcm_handler_list_t * handlers =
+        (lcm_handler_list_t *) g_atomic_pointer_get (&entry->handlers);
+    // if a newer message on this channel is already queued, then this one
+    // has been superseded for the subscriptions that only keep the latest
+    int superseded = g_atomic_int_get (&entry->num_queued) > 1;
+    lcm_dispatch_job_t *job = NULL;
+    for (unsigned int i = 0; handlers && i < handlers->len; i++) {
+        lcm_subscription_t *h = handlers->handlers[i];
+        if (g_atomic_int_get (&h->marked_for_deletion) ||
+                !subscription_release_queued (h) ||
+                (superseded && is_keep_latest (h)))
+            continue;
+
+        int mode = g_atomic_int_get (&h->dispatch_mode);
+        if (mode == LCM_DISPATCH_THREADED || (mode == LCM_DISPATCH_DEFAULT &&
+                    g_atomic_int_get (&lcm->dispatch_threaded))) {
+            // the provider reuses buf once we return, so copy it once for
+            // all the subscriptions that run on the executor
+            if (!job)
+                job = dispatch_job_new (buf, channel);
+            dispatch_job_queue (lcm, h, job);
+        } else {
+            g_atomic_int_inc (&h->callback_scheduled);
+            subscription_invoke (h, buf, channel);
+            g_atomic_int_add (&h->callback_scheduled, -1);
         }
     }
+    if (job)
+        dispatch_job_unref (job);
+    atomic_dec_if_positive (&entry->num_queued);
 
-    // unref the handlers and check if any should be deleted
-    GList *to_remove = NULL;
-    for (int i = 0; i < nhandlers; i++) {
-        lcm_subscription_t *h = (lcm_subscription_t *) g_ptr_array_index(handlers, i);
-        h->callback_scheduled = 0;
-        if (h->marked_for_deletion)
-            to_remove = g_list_prepend (to_remove, h);
-    }
-    // actually delete handlers marked for deletion
-    for (;to_remove; to_remove = g_list_delete_link (to_remove, to_remove)) {
-        lcm_subscription_t *h = (lcm_subscription_t *) to_remove->data;
-        g_ptr_array_remove (lcm->handlers_all, h);
-        g_hash_table_foreach (lcm->handlers_map, 
-                map_remove_handler_callback, h);
-        lcm_handler_free (h);
-    }
-    g_static_rec_mutex_unlock (&lcm->mutex);
+    read_section_exit (lcm, slot);
 
     return 0;
 }
 
+int
+lcm_notify_init (lcm_notify_t * notify)
+{
+#ifdef __linux__
+    int fd = eventfd (0, EFD_CLOEXEC);
+    notify->fds[0] = notify->fds[1] = fd;
+    return fd < 0 ? -1 : 0;
+#else
+    if (0 != lcm_internal_pipe_create (notify->fds)) {
+        notify->fds[0] = notify->fds[1] = -1;
+        return -1;
+    }
+#ifndef WIN32
+    fcntl (notify->fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    return 0;
+#endif
+}
+
+void
+lcm_notify_close (lcm_notify_t * notify)
+{
+    if (notify->fds[0] >= 0)
+        lcm_internal_pipe_close (notify->fds[0]);
+    if (notify->fds[1] >= 0 && notify->fds[1] != notify->fds[0])
+        lcm_internal_pipe_close (notify->fds[1]);
+    notify->fds[0] = notify->fds[1] = -1;
+}
+
+int
+lcm_notify_post (lcm_notify_t * notify)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    return write (notify->fds[1], &one, sizeof (one)) == sizeof (one) ? 0 : -1;
+#else
+    return lcm_internal_pipe_write (notify->fds[1], "+", 1) == 1 ? 0 : -1;
+#endif
+}
+
+int
+lcm_notify_poll (lcm_notify_t * notify, int timeout_millis)
+{
+    return lcm_wait_fd (notify->fds[0], timeout_millis);
+}
+
+int
+lcm_notify_wait (lcm_notify_t * notify)
+{
+#ifdef __linux__
+    uint64_t count;
+    int status;
+    do {
+        status = read (notify->fds[0], &count, sizeof (count));
+    } while (status < 0 && errno == EINTR);
+    if (status != sizeof (count))
+        return -1;
+    return count > G_MAXINT ? G_MAXINT : (int) count;
+#else
+    char ch;
+    return lcm_internal_pipe_read (notify->fds[0], &ch, 1) == 1 ? 1 : -1;
+#endif
+}
+
 int
 lcm_parse_url (const char * url, char ** provider, char ** network,
         GHashTable * args)
@@ -522,16 +1915,159 @@ lcm_parse_url (const char * url, char ** provider, char ** network,
 int 
 lcm_subscription_set_queue_capacity(lcm_subscription_t* subs, int num_messages)
 {
-    g_static_rec_mutex_lock(&subs->lcm->mutex);
-    subs->max_num_queued_messages = num_messages;
-    g_static_rec_mutex_unlock(&subs->lcm->mutex);
+    g_atomic_int_set(&subs->max_num_queued_messages, num_messages);
     return 0;
 }
 
 int lcm_subscription_get_queue_size(lcm_subscription_t* subs)
 {
-    g_static_rec_mutex_lock(&subs->lcm->mutex);
-    int result = subs->num_queued_messages;
-    g_static_rec_mutex_unlock(&subs->lcm->mutex);
-    return result;
+    return g_atomic_int_get(&subs->num_queued_messages) +
+        g_atomic_int_get(&subs->num_executor_queued);
+}
+
+int
+lcm_subscription_set_queue_policy(lcm_subscription_t* subs,
+        lcm_queue_policy_t policy)
+{
+    if (policy != LCM_QUEUE_KEEP_ALL && policy != LCM_QUEUE_KEEP_LATEST)
+        return -1;
+    g_atomic_int_set(&subs->queue_policy, policy);
+    return 0;
+}
+
+int
+lcm_subscription_get_stats(lcm_subscription_t* subs,
+        lcm_subscription_stats_t* stats)
+{
+    if (!subs || !stats)
+        return -1;
+    stats->num_delivered = stat_get(&subs->stats.num_delivered);
+    stats->num_dropped = stat_get(&subs->stats.num_dropped);
+    stats->bytes_delivered = stat_get(&subs->stats.bytes_delivered);
+    stats->queue_depth = lcm_subscription_get_queue_size(subs);
+    stats->max_queue_depth = g_atomic_int_get(&subs->stats.max_queue_depth);
+    stats->total_handler_ns = stat_get(&subs->stats.total_handler_ns);
+    stats->max_handler_ns = stat_get(&subs->stats.max_handler_ns);
+    return 0;
+}
+
+int
+lcm_set_dispatch_threads(lcm_t* lcm, int num_threads)
+{
+    if (num_threads <= 0)
+        return -1;
+    g_static_rec_mutex_lock(&lcm->mutex);
+    int status = executor_start(lcm, num_threads);
+    if (status == 0)
+        g_atomic_int_set(&lcm->dispatch_threaded, 1);
+    g_static_rec_mutex_unlock(&lcm->mutex);
+    return status;
+}
+
+int
+lcm_subscription_set_dispatch_mode(lcm_subscription_t* subs,
+        lcm_dispatch_mode_t mode)
+{
+    lcm_t* lcm = subs->lcm;
+    int status = 0;
+    g_static_rec_mutex_lock(&lcm->mutex);
+    if (mode == LCM_DISPATCH_THREADED)
+        status = executor_start(lcm, 1);
+    if (status == 0)
+        g_atomic_int_set(&subs->dispatch_mode, mode);
+    g_static_rec_mutex_unlock(&lcm->mutex);
+    return status;
+}
+
+int
+lcm_set_channel_cache_capacity(lcm_t* lcm, int num_channels)
+{
+    if (num_channels < 0)
+        return -1;
+    g_static_rec_mutex_lock(&lcm->mutex);
+    lcm->channel_cache_capacity = num_channels;
+    channel_cache_trim(lcm, 0);
+    lcm_reclaim_retired(lcm);
+    g_static_rec_mutex_unlock(&lcm->mutex);
+    return 0;
+}
+
+void
+lcm_get_channel_cache_stats(lcm_t* lcm, lcm_channel_cache_stats_t* stats)
+{
+    g_static_rec_mutex_lock(&lcm->mutex);
+    channel_cache_fold_hits(lcm);
+    stats->num_channels = lcm->handlers_map->size;
+    stats->num_idle = lcm->num_idle;
+    stats->capacity = lcm->channel_cache_capacity;
+    stats->hits = lcm->cache_hits_total;
+    stats->misses = lcm->cache_misses;
+    stats->evictions = lcm->cache_evictions;
+    g_static_rec_mutex_unlock(&lcm->mutex);
+}
+
+int
+lcm_get_transport_stats(lcm_t* lcm, lcm_transport_stats_t* stats)
+{
+    memset(stats, 0, sizeof(lcm_transport_stats_t));
+    if (!lcm->provider || !lcm->vtable->get_transport_stats)
+        return -1;
+    return lcm->vtable->get_transport_stats(lcm->provider, stats);
+}
+
+void
+lcm_set_self_test_handler(lcm_t* lcm, lcm_self_test_handler_t handler,
+        void* user)
+{
+    g_static_rec_mutex_lock(&lcm->mutex);
+    lcm->self_test_handler = handler;
+    lcm->self_test_user = user;
+    g_static_rec_mutex_unlock(&lcm->mutex);
+}
+
+void
+lcm_report_self_test(lcm_t* lcm, int status)
+{
+    g_static_rec_mutex_lock(&lcm->mutex);
+    lcm_self_test_handler_t handler = lcm->self_test_handler;
+    void* user = lcm->self_test_user;
+    g_static_rec_mutex_unlock(&lcm->mutex);
+    if (handler)
+        handler(lcm, status, user);
+}
+
+int
+lcm_get_latency_histogram(lcm_t* lcm, const char* channel,
+        lcm_latency_histogram_t* hist)
+{
+    memset(hist, 0, sizeof(lcm_latency_histogram_t));
+
+    // lcm->mutex keeps the entry from being freed
+    g_static_rec_mutex_lock(&lcm->mutex);
+    lcm_channel_entry_t* entry =
+        channel_table_find(lcm, channel, g_str_hash(channel));
+    if (entry)
+        hist->count = stat_get(&entry->latency.count);
+    if (hist->count) {
+        hist->min_usec = stat_get(&entry->latency.min_usec);
+        hist->max_usec = stat_get(&entry->latency.max_usec);
+        hist->total_usec = stat_get(&entry->latency.total_usec);
+        for (int i = 0; i < LCM_LATENCY_HISTOGRAM_BUCKETS; i++)
+            hist->buckets[i] = stat_get(&entry->latency.buckets[i]);
+    }
+    g_static_rec_mutex_unlock(&lcm->mutex);
+    return hist->count ? 0 : -1;
+}
+
+void
+lcm_reset_latency_histograms(lcm_t* lcm)
+{
+    g_static_rec_mutex_lock(&lcm->mutex);
+    lcm_channel_table_t* table = lcm->handlers_map;
+    for (unsigned int i = 0; i < table->nbuckets; i++) {
+        for (lcm_channel_entry_t* entry = table->buckets[i]; entry;
+                entry = entry->next)
+            latency_clear(&entry->latency);
+    }
+    g_static_rec_mutex_unlock(&lcm->mutex);
 }
@@ -78,6 +78,23 @@ struct _lcm_recv_buf_t
      * pointer to the lcm_t struct that owns this buffer
      */
     lcm_t *lcm;
+    /**
+     * timestamp (microseconds since the epoch) at which the message was
+     * published, according to the publisher's clock, or 0 if the publisher
+     * did not send one.  See lcm_get_latency_histogram().
+     */
+    int64_t send_utime;
+    /**
+     * identifies the host that published the message, or 0 if the publisher
+     * did not send a timestamp.
+     */
+    uint32_t send_host_id;
+    /**
+     * recv_utime in nanoseconds since the epoch.  The udpm and mpudpm
+     * providers take it from the kernel's timestamp of the packet's arrival
+     * where available.  Other providers only have microsecond resolution.
+     */
+    int64_t recv_utime_ns;
 };
 
 /**
@@ -121,6 +138,88 @@ typedef void (*lcm_msg_handler_t) (const lcm_recv_buf_t *rbuf,
          ttl = N
              time to live of transmitted packets.  Default 0
 
+         recv_threads = N
+             number of threads receiving packets, each with its own socket.
+             Packets are divided among the threads by sender, so that one
+             thread reassembles all of a sender's fragmented messages.  Only
+             supported on Linux.  Default 1
+
+         channel_filter = [0|1]
+             if 1, packets on channels with no subscribers are dropped by a
+             socket filter before they leave the kernel.  Lost and reordered
+             messages aren't counted while the filter drops any channels.
+             Only supported on Linux.  Default 0
+
+         ringbuf_mb = N
+             megabytes set aside by each receive thread for received messages
+             waiting to be handled, which may be fractional.  The buffer grows
+             when a burst of messages fills it.  Also accepted by mpudpm.
+             Default 0.2
+
+         recv_bufs = N
+             number of received message buffers each receive thread allocates
+             at a time.  Also accepted by mpudpm.  Default 2000
+
+         frag_mb = N
+             megabytes each receive thread may use for reassembling
+             fragmented messages.  The least recently updated messages are
+             dropped when it runs out.  Also accepted by mpudpm.  Default 16
+
+         ringbuf_adaptive = [0|1]
+             if 1, a receive buffer that grew shrinks back to ringbuf_mb once
+             it is idle.  Also accepted by mpudpm.  Default 0
+
+         hugepages = [0|1]
+             if 1, the receive buffers are backed by huge pages where the
+             system provides them.  Reserved huge pages are used whole, so
+             each buffer then takes a multiple of 2 megabytes.  Only
+             supported on Linux.  Also accepted by mpudpm.  Default 0
+
+         coalesce_us = N
+             if greater than 0, short messages are held for up to N
+             microseconds and sent together in one packet.  Default 0
+
+         coalesce_bytes = N
+             largest packet of coalesced messages, in bytes, from 64 up to
+             the largest short message packet.  Default 1400
+
+         advertise = [0|1]
+             if 1, the channels subscribed to are advertised every second,
+             and messages are only sent on channels that some process
+             subscribes to.  Every process on the multicast group must use
+             this option.  Default 0
+
+         busy_poll = [0|1]
+             if 1, the receive threads and lcm_handle() spin instead of
+             sleeping until packets and messages arrive, which lowers the
+             latency but takes a whole CPU for each of them.  lcm_handle()
+             sleeps as usual once no message has arrived for 100
+             milliseconds.  Also accepted by mpudpm.  Default 0
+
+         self_test = [0|1|async]
+             whether to check that published messages are received before
+             receiving starts.  1 blocks the first subscribe or lcm_handle()
+             call until the test is done, async runs it in the background,
+             and 0 skips it.  A test that passed isn't repeated for the same
+             multicast group in the same process.  See
+             lcm_set_self_test_handler().  Default 1
+
+         trace = [0|1]
+             if 1, each published message carries its send time, in
+             microseconds, which receivers report in rbuf->send_utime and
+             lcm_get_latency_histogram().  Also accepted by mpudpm.
+             Default 0
+
+         reliable = REGEX
+             fragmented messages published on the channels that match REGEX
+             are kept, and their fragments are sent again when a receiver
+             reports them missing.  Only the publisher needs this option.
+             Default none
+
+         reliable_mb = N
+             megabytes of the most recent reliable messages kept to send
+             again.  Default 16
+
      examples:
          "udpm://239.255.76.67:7667"
              Default initialization string
@@ -325,6 +424,32 @@ int lcm_handle (lcm_t *lcm);
 LCM_EXPORT
 int lcm_handle_timeout (lcm_t *lcm, int timeout_millis);
 
+/**
+ * @brief Wait for and dispatch a batch of incoming messages.
+ *
+ * This function is equivalent to lcm_handle_timeout(), except that once a
+ * message is available, it keeps dispatching messages that have already been
+ * received, up to @p max_msgs, before returning.  This is considerably cheaper
+ * than calling lcm_handle() once per message when messages arrive at a high
+ * rate.
+ *
+ * Message handlers are invoked from the calling thread, and the same
+ * restrictions on recursive calls apply as for lcm_handle().
+ *
+ * @param lcm the %LCM object
+ * @param max_msgs the maximum number of messages to dispatch.  Must be greater
+ *        than 0.
+ * @param timeout_millis the maximum amount of time to wait for the first
+ *        message, in milliseconds.  If 0, then dispatches any available
+ *        messages and then returns immediately.  If less than 0, then waits
+ *        indefinitely.
+ *
+ * @return the number of messages handled, 0 if the function timed out, and <0
+ * if an error occured.
+ */
+LCM_EXPORT
+int lcm_handle_batch (lcm_t *lcm, int max_msgs, int timeout_millis);
+
 /**
  * @brief Adjusts the maximum number of received messages that can be queued up
  * for a subscription.
@@ -352,6 +477,388 @@ int lcm_subscription_set_queue_capacity(lcm_subscription_t* handler, int num_mes
 LCM_EXPORT
 int lcm_subscription_get_queue_size(lcm_subscription_t* handler);
 
+/**
+ * Runtime statistics for a subscription.  See lcm_subscription_get_stats().
+ */
+typedef struct _lcm_subscription_stats_t {
+    /**
+     * The number of messages passed to the subscription's handler.
+     */
+    uint64_t num_delivered;
+    /**
+     * The number of messages dropped because the subscription's queue was
+     * full.
+     */
+    uint64_t num_dropped;
+    /**
+     * The total size of the messages passed to the handler, in bytes.
+     */
+    uint64_t bytes_delivered;
+    /**
+     * The number of messages currently waiting to be handled.
+     */
+    int queue_depth;
+    /**
+     * The largest number of messages that have waited to be handled at once.
+     */
+    int max_queue_depth;
+    /**
+     * The total time spent in the handler, in nanoseconds.
+     */
+    int64_t total_handler_ns;
+    /**
+     * The longest time spent in a single call to the handler, in
+     * nanoseconds.
+     */
+    int64_t max_handler_ns;
+} lcm_subscription_stats_t;
+
+/**
+ * @brief Retrieve runtime statistics for a subscription.
+ *
+ * The counters are updated without locking, so a snapshot taken while
+ * messages are being handled may not be consistent between fields.
+ *
+ * @param handler the subscription object
+ * @param stats filled in with the subscription's statistics.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_subscription_get_stats(lcm_subscription_t* handler,
+        lcm_subscription_stats_t* stats);
+
+/**
+ * Which received messages a subscription keeps while they wait to be handled.
+ */
+typedef enum {
+    /**
+     * Keep every message, up to the subscription's queue capacity.  Messages
+     * that arrive while the queue is full are dropped.
+     */
+    LCM_QUEUE_KEEP_ALL = 0,
+    /**
+     * Keep only the most recent message on each channel.  A new message
+     * supersedes any message on the same channel that has not been handled
+     * yet, and the queue capacity is ignored.
+     */
+    LCM_QUEUE_KEEP_LATEST
+} lcm_queue_policy_t;
+
+/**
+ * @brief Choose which received messages a subscription keeps.
+ *
+ * Use @c LCM_QUEUE_KEEP_LATEST for channels such as state estimates, where a
+ * slow handler should skip to the newest message instead of working through
+ * stale ones.
+ *
+ * @param handler the subscription object
+ * @param policy the queue policy.  The default is @c LCM_QUEUE_KEEP_ALL.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_subscription_set_queue_policy(lcm_subscription_t* handler,
+        lcm_queue_policy_t policy);
+
+/**
+ * Where a subscription's message handler is invoked.
+ */
+typedef enum {
+    /**
+     * Dispatch on the worker threads if lcm_set_dispatch_threads() has been
+     * called for the %LCM instance, and inline otherwise.
+     */
+    LCM_DISPATCH_DEFAULT = 0,
+    /**
+     * Invoke the handler from the thread that calls lcm_handle().
+     */
+    LCM_DISPATCH_INLINE,
+    /**
+     * Invoke the handler on the %LCM instance's worker threads.
+     */
+    LCM_DISPATCH_THREADED
+} lcm_dispatch_mode_t;
+
+/**
+ * @brief Invoke message handlers on a pool of worker threads.
+ *
+ * By default, message handlers are invoked from the thread that calls
+ * lcm_handle(), one after another.  After calling this function, lcm_handle()
+ * instead queues each message for its subscriptions, and the handlers are
+ * invoked on @p num_threads worker threads.  A subscription's handler is never
+ * invoked concurrently with itself, and receives its messages in the order
+ * they were received, but handlers for different subscriptions may run in
+ * parallel.
+ *
+ * Messages waiting for a worker count against the subscription's queue
+ * capacity (see lcm_subscription_set_queue_capacity()).
+ *
+ * Individual subscriptions can opt out with lcm_subscription_set_dispatch_mode().
+ *
+ * @param lcm the %LCM object
+ * @param num_threads the number of worker threads.  Calling this function
+ *        again can add threads, but not remove them.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_set_dispatch_threads(lcm_t* lcm, int num_threads);
+
+/**
+ * @brief Choose where a subscription's handler is invoked.
+ *
+ * Setting @c LCM_DISPATCH_THREADED on a subscription starts a single worker
+ * thread for the %LCM instance if lcm_set_dispatch_threads() has not been
+ * called.
+ *
+ * Note that when a handler runs on a worker thread, a callback that a worker
+ * has already started may still be running after lcm_unsubscribe() returns.
+ *
+ * @param handler the subscription object
+ * @param mode where to invoke the handler.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_subscription_set_dispatch_mode(lcm_subscription_t* handler,
+        lcm_dispatch_mode_t mode);
+
+/**
+ * Statistics for the cache of channel names that an %LCM instance has seen.
+ */
+typedef struct _lcm_channel_cache_stats_t {
+    /**
+     * The number of channel names currently cached.
+     */
+    int num_channels;
+    /**
+     * How many of those channels have no subscribers, and may be evicted.
+     */
+    int num_idle;
+    /**
+     * The capacity of the cache, or 0 if unlimited.
+     */
+    int capacity;
+    /**
+     * Lookups of a received message's channel that found it in the cache.
+     */
+    uint64_t hits;
+    /**
+     * Lookups that had to add the channel to the cache.
+     */
+    uint64_t misses;
+    /**
+     * Channels removed from the cache to stay within its capacity.
+     */
+    uint64_t evictions;
+} lcm_channel_cache_stats_t;
+
+/**
+ * @brief Limit how many channel names an %LCM instance remembers.
+ *
+ * Every channel name that a message arrives on is remembered, along with the
+ * subscriptions that match it.  When more than @p num_channels names are
+ * remembered, the least recently used names that have no subscribers are
+ * forgotten.  Channels with subscribers are never forgotten, so the cache can
+ * exceed its capacity if they alone fill it.
+ *
+ * @param lcm the %LCM object
+ * @param num_channels the maximum number of channel names.  The default is
+ *        4096.  A value of 0 indicates no limit.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_set_channel_cache_capacity(lcm_t* lcm, int num_channels);
+
+/**
+ * @brief Retrieve statistics for an %LCM instance's channel name cache.
+ *
+ * @param lcm the %LCM object
+ * @param stats filled in with the current statistics.
+ */
+LCM_EXPORT
+void lcm_get_channel_cache_stats(lcm_t* lcm, lcm_channel_cache_stats_t* stats);
+
+/**
+ * Receive statistics for the transport underlying an %LCM instance.  They
+ * tell apart messages lost on the network, in the kernel, and in %LCM itself.
+ */
+typedef struct _lcm_transport_stats_t {
+    /**
+     * The number of packets read from the network, including bad ones.
+     */
+    uint64_t packets_received;
+    /**
+     * The number of packets discarded because they were malformed.
+     */
+    uint64_t packets_bad;
+    /**
+     * The number of packets dropped by the kernel because the socket's
+     * receive buffer was full.  Only available on Linux.
+     */
+    uint64_t kernel_drops;
+    /**
+     * The number of messages missing from the sequence numbers of their
+     * senders.  These were lost on the network or by the kernel before being
+     * read.  Not counted while the udpm provider's socket filter, enabled
+     * with channel_filter=1 in the URL, drops channels with no subscribers.
+     */
+    uint64_t messages_lost;
+    /**
+     * The number of messages that arrived after a later message from the same
+     * sender.  These were first counted as lost.
+     */
+    uint64_t messages_reordered;
+    /**
+     * The number of times the receive ring buffer was full and had to be
+     * replaced with a bigger one.
+     */
+    uint64_t ringbuf_exhausted;
+    /**
+     * The number of fragmented messages dropped because not all of their
+     * fragments arrived.
+     */
+    uint64_t reassembly_incomplete;
+    /**
+     * How many of the incomplete messages were dropped because no fragment
+     * arrived for too long.
+     */
+    uint64_t reassembly_timeouts;
+    /**
+     * How many of the incomplete messages were dropped to make room for newer
+     * ones.
+     */
+    uint64_t reassembly_evictions;
+    /**
+     * The number of fragments that were received more than once.
+     */
+    uint64_t duplicate_fragments;
+} lcm_transport_stats_t;
+
+/**
+ * @brief Retrieve receive statistics for an %LCM instance's transport.
+ *
+ * Only the udpm and mpudpm providers keep these statistics.  mpudpm does not
+ * track sequence numbers, so it always reports 0 lost and reordered messages.
+ * The counters are updated without locking, so a snapshot taken while
+ * messages are being received may not be consistent between fields.
+ *
+ * @param lcm the %LCM object
+ * @param stats filled in with the current statistics.
+ *
+ * @return 0 on success, -1 if the provider does not keep statistics.
+ */
+LCM_EXPORT
+int lcm_get_transport_stats(lcm_t* lcm, lcm_transport_stats_t* stats);
+
+/**
+ * Callback function prototype for the result of a provider's self-test.
+ *
+ * @param lcm the %LCM object
+ * @param status 0 if the self-test passed, -1 if it failed.
+ * @param user the user data passed to lcm_set_self_test_handler()
+ */
+typedef void (*lcm_self_test_handler_t)(lcm_t* lcm, int status, void* user);
+
+/**
+ * @brief Be told the result of the provider's self-test.
+ *
+ * When the udpm and mpudpm providers first start receiving, they check that
+ * a message they publish comes back.  By default the lcm_subscribe(),
+ * lcm_get_fileno() or lcm_handle() call that starts receiving waits for the
+ * result, and fails if the test fails.  A test that passed is remembered per
+ * multicast group for the life of the process, and not repeated.
+ *
+ * Passing self_test=async in the udpm URL runs the test in the background
+ * instead, so those calls don't wait.  Messages are received in the meantime,
+ * and the receive threads keep running if the test fails.  self_test=0 skips
+ * the test.
+ *
+ * The handler is called once per test, either from the thread that started
+ * receiving or from the background thread running the test, and should return
+ * quickly.
+ *
+ * @param lcm the %LCM object
+ * @param handler the function to call, or NULL to stop calling one.
+ * @param user passed to the handler.
+ */
+LCM_EXPORT
+void lcm_set_self_test_handler(lcm_t* lcm, lcm_self_test_handler_t handler,
+        void* user);
+
+#define LCM_LATENCY_HISTOGRAM_BUCKETS 32
+
+/**
+ * The latencies of the messages received on one channel, from when they were
+ * published to when they were dispatched to their handlers.  See
+ * lcm_get_latency_histogram().
+ */
+typedef struct _lcm_latency_histogram_t {
+    /**
+     * The number of messages measured.
+     */
+    uint64_t count;
+    /**
+     * The smallest latency, in microseconds.  Negative if the publisher's
+     * clock is ahead of the receiver's.
+     */
+    int64_t min_usec;
+    /**
+     * The largest latency, in microseconds.
+     */
+    int64_t max_usec;
+    /**
+     * The sum of the latencies, in microseconds.
+     */
+    int64_t total_usec;
+    /**
+     * buckets[0] counts latencies below 1 microsecond, including negative
+     * ones.  buckets[i] counts latencies of at least 2^(i-1) and less than
+     * 2^i microseconds, except that the last bucket has no upper bound.
+     */
+    uint64_t buckets[LCM_LATENCY_HISTOGRAM_BUCKETS];
+} lcm_latency_histogram_t;
+
+/**
+ * @brief Retrieve the publish-to-dispatch latencies of a channel.
+ *
+ * Only messages that carry the publisher's send timestamp are measured.  The
+ * udpm and mpudpm providers send one when trace=1 is passed in the
+ * publisher's URL, and every receiver understands it, but receivers from
+ * before timestamps were added drop the timestamped messages.  The latency
+ * is only meaningful if the clocks of the publishing and receiving hosts are
+ * synchronized, for example with PTP.
+ *
+ * Latencies are recorded for each channel that a timestamped message is
+ * dispatched on, whether or not a subscription handles it.  To measure one
+ * hop of a pipeline, compare rbuf->send_utime and rbuf->recv_utime in the
+ * handler instead.
+ *
+ * The latencies are kept with the channel's entry in the channel cache, so
+ * they are forgotten when a channel that nothing subscribes to is evicted
+ * from it.  See lcm_set_channel_cache_capacity().
+ *
+ * @param lcm the %LCM object
+ * @param channel the channel name
+ * @param hist filled in with the channel's latencies.
+ *
+ * @return 0 on success, -1 if no timestamped message has been dispatched on
+ * the channel.
+ */
+LCM_EXPORT
+int lcm_get_latency_histogram(lcm_t* lcm, const char* channel,
+        lcm_latency_histogram_t* hist);
+
+/**
+ * @brief Forget the latencies measured so far on every channel.
+ *
+ * @param lcm the %LCM object
+ */
+LCM_EXPORT
+void lcm_reset_latency_histograms(lcm_t* lcm);
+
 /**
  * @}
  */
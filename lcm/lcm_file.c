@@ -38,7 +38,7 @@ struct _lcm_provider_t {
 
     int thread_created;
     GThread *timer_thread;
-    int notify_pipe[2];
+    lcm_notify_t notify;
     int timer_pipe[2];
 };
 
@@ -56,8 +56,7 @@ lcm_logprov_destroy (lcm_logprov_t *lr)
         g_thread_join (lr->timer_thread);
     }
 
-    if(lr->notify_pipe[0] >= 0) lcm_internal_pipe_close(lr->notify_pipe[0]);
-    if(lr->notify_pipe[1] >= 0) lcm_internal_pipe_close(lr->notify_pipe[1]);
+    lcm_notify_close(&lr->notify);
     if(lr->timer_pipe[0] >= 0)  lcm_internal_pipe_close(lr->timer_pipe[0]);
     if(lr->timer_pipe[1] >= 0)  lcm_internal_pipe_close(lr->timer_pipe[1]);
 
@@ -105,12 +104,12 @@ timer_thread (void * user)
 
             if (0 == status) {
                 // select timed out
-                if(lcm_internal_pipe_write(lr->notify_pipe[1], "+", 1) < 0) {
+                if(lcm_notify_post(&lr->notify) < 0) {
                     perror(__FILE__ " - write (timer select)");
                 }
             }
         } else {
-            if(lcm_internal_pipe_write(lr->notify_pipe[1], "+", 1) < 0) {
+            if(lcm_notify_post(&lr->notify) < 0) {
                 perror(__FILE__ " - write (timer)");
             }
        }
@@ -183,8 +182,8 @@ lcm_logprov_create (lcm_t * parent, const char *target, const GHashTable *args)
     dbg (DBG_LCM, "Initializing LCM log provider context...\n");
     dbg (DBG_LCM, "Filename %s\n", lr->filename);
 
-    if(lcm_internal_pipe_create(lr->notify_pipe) != 0) {
-        perror(__FILE__ " - pipe (notify)");
+    if(lcm_notify_init(&lr->notify) != 0) {
+        perror(__FILE__ " - notify");
         lcm_logprov_destroy (lr);
         return NULL;
     }
@@ -193,7 +192,6 @@ lcm_logprov_create (lcm_t * parent, const char *target, const GHashTable *args)
         lcm_logprov_destroy (lr);
         return NULL;
     }
-    //fcntl (lcm->notify_pipe[1], F_SETFL, O_NONBLOCK);
 
     switch (lr->log_mode) {
         case LCM_LOGPROV_READ_MODE:
@@ -235,7 +233,7 @@ lcm_logprov_create (lcm_t * parent, const char *target, const GHashTable *args)
         }
         lr->thread_created = 1;
 
-        if(lcm_internal_pipe_write(lr->notify_pipe[1], "+", 1) < 0) {
+        if(lcm_notify_post(&lr->notify) < 0) {
             perror(__FILE__ " - write (reader create)");
         }
 
@@ -251,24 +249,18 @@ lcm_logprov_create (lcm_t * parent, const char *target, const GHashTable *args)
 static int
 lcm_logprov_get_fileno (lcm_logprov_t *lr)
 {
-    return lr->notify_pipe[0];
+    return lcm_notify_get_fileno(&lr->notify);
 }
 
 static int
-lcm_logprov_handle (lcm_logprov_t * lr)
+lcm_logprov_handle_batch (lcm_logprov_t * lr, int max_msgs)
 {
     lcm_recv_buf_t rbuf;
 
     if (!lr->event)
         return -1;
 
-    char ch;
-    int status = lcm_internal_pipe_read(lr->notify_pipe[0], &ch, 1);
-    if (status == 0) {
-        fprintf (stderr, "Error: lcm_handle read 0 bytes from notify_pipe\n");
-        return -1;
-    }
-    else if (status < 0) {
+    if (lcm_notify_wait(&lr->notify) < 0) {
         fprintf (stderr, "Error: lcm_handle read: %s\n", strerror (errno));
         return -1;
     }
@@ -278,32 +270,44 @@ lcm_logprov_handle (lcm_logprov_t * lr)
     if (lr->next_clock_time < 0)
         lr->next_clock_time = now;
 
-//    rbuf.channel = lr->event->channel,
-    rbuf.data = (uint8_t*) lr->event->data;
-    rbuf.data_size = lr->event->datalen;
-    rbuf.recv_utime = lr->next_clock_time;
-    rbuf.lcm = lr->lcm;
-
-    if(lcm_try_enqueue_message(lr->lcm, lr->event->channel))
-        lcm_dispatch_handlers (lr->lcm, &rbuf, lr->event->channel);
-
-    int64_t prev_log_time = lr->event->timestamp;
-    if (load_next_event (lr) < 0) {
-        /* end-of-file reached.  This call succeeds, but next call to
-         * _handle will fail */
-        lr->event = NULL;
-        if(lcm_internal_pipe_write(lr->notify_pipe[1], "+", 1) < 0) {
-            perror(__FILE__ " - write(notify)");
+    /* Dispatch events for as long as they are due, then arm either the notify
+     * pipe or the timer once for the whole batch. */
+    int num_handled = 0;
+    while (1) {
+//        rbuf.channel = lr->event->channel,
+        rbuf.data = (uint8_t*) lr->event->data;
+        rbuf.data_size = lr->event->datalen;
+        rbuf.recv_utime = lr->next_clock_time;
+        rbuf.lcm = lr->lcm;
+        rbuf.send_utime = 0;
+        rbuf.send_host_id = 0;
+        rbuf.recv_utime_ns = rbuf.recv_utime * 1000;
+
+        if(lcm_try_enqueue_message(lr->lcm, lr->event->channel))
+            lcm_dispatch_handlers (lr->lcm, &rbuf, lr->event->channel);
+        num_handled++;
+
+        int64_t prev_log_time = lr->event->timestamp;
+        if (load_next_event (lr) < 0) {
+            /* end-of-file reached.  This call succeeds, but next call to
+             * _handle will fail */
+            lr->event = NULL;
+            if(lcm_notify_post(&lr->notify) < 0) {
+                perror(__FILE__ " - write(notify)");
+            }
+            return num_handled;
         }
-        return 0;
-    }
 
-    /* Compute the wall time for the next event */
-    if (lr->speed > 0)
-        lr->next_clock_time +=
-            (lr->event->timestamp - prev_log_time) / lr->speed;
-    else
-        lr->next_clock_time = now;
+        /* Compute the wall time for the next event */
+        if (lr->speed > 0)
+            lr->next_clock_time +=
+                (lr->event->timestamp - prev_log_time) / lr->speed;
+        else
+            lr->next_clock_time = now;
+
+        if (lr->next_clock_time > now || num_handled >= max_msgs)
+            break;
+    }
 
     if (lr->next_clock_time > now) {
         int wstatus = lcm_internal_pipe_write(lr->timer_pipe[1], &lr->next_clock_time, 8);
@@ -311,13 +315,18 @@ lcm_logprov_handle (lcm_logprov_t * lr)
             perror(__FILE__ " - write(timer_pipe)");
         }
     } else {
-        int wstatus = lcm_internal_pipe_write(lr->notify_pipe[1], "+", 1);
-        if(wstatus < 0) {
-            perror(__FILE__ " - write(notify_pipe)");
+        if(lcm_notify_post(&lr->notify) < 0) {
+            perror(__FILE__ " - write(notify)");
         }
     }
 
-    return 0;
+    return num_handled;
+}
+
+static int
+lcm_logprov_handle (lcm_logprov_t * lr)
+{
+    return lcm_logprov_handle_batch (lr, 1) < 0 ? -1 : 0;
 }
 
 
@@ -365,7 +374,8 @@ static lcm_provider_vtable_t logprov_vtable = {
     .unsubscribe = NULL,
     .publish     = lcm_logprov_publish,
     .handle      = lcm_logprov_handle,
-    .get_fileno  = lcm_logprov_get_fileno
+    .get_fileno  = lcm_logprov_get_fileno,
+    .handle_batch = lcm_logprov_handle_batch
 };
 #endif
 
@@ -383,6 +393,7 @@ lcm_logprov_provider_init (GPtrArray * providers)
     logprov_vtable.publish     = lcm_logprov_publish;
     logprov_vtable.handle      = lcm_logprov_handle;
     logprov_vtable.get_fileno  = lcm_logprov_get_fileno;
+    logprov_vtable.handle_batch = lcm_logprov_handle_batch;
 #endif
 
     logprov_info.name = "file";
@@ -42,24 +42,146 @@ struct _lcm_provider_vtable_t {
             unsigned int);
     int (*handle)(lcm_provider_t *);
     int (*get_fileno)(lcm_provider_t *);
+    // Optional.  Waits for at least one message, then dispatches up to
+    // max_msgs messages that are ready.  Returns the number of messages
+    // dispatched, or -1 on error.
+    int (*handle_batch)(lcm_provider_t *, int max_msgs);
+    // Optional.  Fills in receive statistics, returning 0 on success or -1
+    // on error.
+    int (*get_transport_stats)(lcm_provider_t *, lcm_transport_stats_t *);
+    // Optional.  Waits up to timeout_millis for messages to be ready, as
+    // polling the file descriptor from get_fileno would.  For providers that
+    // can wait without sleeping on it.  Returns >0 if messages are ready, 0
+    // on timeout, or -1 on error.
+    int (*wait_ready)(lcm_provider_t *, int timeout_millis);
 };
 
+/**
+ * A notification that providers post when received messages are ready to be
+ * handled.  The file descriptor returned by lcm_notify_get_fileno() is
+ * readable while the notification is posted.  On Linux this is a single
+ * eventfd holding a counter, elsewhere it is a pipe.
+ */
+typedef struct _lcm_notify_t lcm_notify_t;
+struct _lcm_notify_t {
+    int fds[2];     // read and write ends.  Both the same eventfd on Linux.
+};
+
+int
+lcm_notify_init (lcm_notify_t * notify);
+
+void
+lcm_notify_close (lcm_notify_t * notify);
+
+static inline int
+lcm_notify_get_fileno (lcm_notify_t * notify)
+{
+    return notify->fds[0];
+}
+
+/**
+ * Post the notification.  Returns 0 on success, -1 on failure.
+ */
+int
+lcm_notify_post (lcm_notify_t * notify);
+
+/**
+ * Wait up to timeout_millis for the notification to be posted, without
+ * clearing it.  Returns >0 if it is posted, 0 on timeout, or -1 on failure.
+ */
+int
+lcm_notify_poll (lcm_notify_t * notify, int timeout_millis);
+
+/**
+ * Block until the notification is posted, then clear it.  Returns the number
+ * of posts that were cleared (always 1 for a pipe), or -1 on failure.
+ */
+int
+lcm_notify_wait (lcm_notify_t * notify);
+
 int
 lcm_parse_url (const char * url, char ** provider, char ** target,
         GHashTable * args);
 
+typedef enum {
+    LCM_SUBSCRIPTION_LITERAL,   // matches one channel name exactly
+    LCM_SUBSCRIPTION_PREFIX,    // "prefix.*", where prefix is a literal
+    LCM_SUBSCRIPTION_REGEX      // anything else
+} lcm_subscription_kind_t;
+
+/**
+ * Classify the channel pattern of a subscription.  For prefix subscriptions,
+ * the length of the prefix is returned in @p prefix_len.
+ */
+lcm_subscription_kind_t
+lcm_classify_subscription (const char * channel, int * prefix_len);
+
+/**
+ * Returned by lcm_try_enqueue_message() and lcm_has_handlers() when every
+ * subscription to the channel only keeps the latest message.  Providers that
+ * queue messages should then discard the older messages queued on the same
+ * channel, with lcm_discard_message() if they were enqueued.
+ */
+#define LCM_HANDLERS_KEEP_LATEST 2
+
 /**
  * Try to enqueue a message.  This may fail if there are no subscribers, or if
  * all the subscribers' queues are full.  The actual message contents are not
  * enqueued here, only a placeholder for the message.
+ *
+ * Returns 0 if the message should be dropped, LCM_HANDLERS_KEEP_LATEST if it
+ * supersedes any queued messages on the same channel, and 1 otherwise.
  */
 int
 lcm_try_enqueue_message (lcm_t * lcm, const char * channel);
 
+/**
+ * Identifies a channel name that LCM has interned.  Looking a channel up by
+ * its ID avoids hashing and comparing the name.  IDs become stale when the
+ * channel is evicted from LCM's channel cache, and a stale ID never matches
+ * another channel.  0 is never a valid ID.
+ */
+typedef uint64_t lcm_channel_id_t;
+
+/**
+ * Same as lcm_try_enqueue_message(), but also returns the channel's ID in
+ * @p id, to be passed to lcm_dispatch_handlers_id() later.  If @p id already
+ * holds an ID, it is tried before @p channel.
+ */
+int
+lcm_try_enqueue_message_id (lcm_t * lcm, const char * channel,
+        lcm_channel_id_t * id);
+
+/**
+ * Release the placeholder of a message that was enqueued with
+ * lcm_try_enqueue_message(), without dispatching it.
+ */
+void
+lcm_discard_message (lcm_t * lcm, const char * channel, lcm_channel_id_t id);
+
+/**
+ * Returns 0 if nothing is subscribed to a channel, LCM_HANDLERS_KEEP_LATEST
+ * if every subscription to it only keeps the latest message, and 1 otherwise.
+ */
 int
 lcm_has_handlers (lcm_t * lcm, const char * channel);
 
 int
 lcm_dispatch_handlers (lcm_t * lcm, lcm_recv_buf_t * buf, const char *channel);
 
+/**
+ * Same as lcm_dispatch_handlers(), but looks the channel up by @p id first.
+ * Falls back to @p channel if the ID is 0 or has become stale.
+ */
+int
+lcm_dispatch_handlers_id (lcm_t * lcm, lcm_recv_buf_t * buf,
+        const char *channel, lcm_channel_id_t id);
+
+/**
+ * Pass the result of a provider's self-test to the handler set with
+ * lcm_set_self_test_handler(), if any.
+ */
+void
+lcm_report_self_test (lcm_t * lcm, int status);
+
 #endif
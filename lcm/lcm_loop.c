@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "lcm_loop.h"
+#include "lcm_internal.h"
+
+#ifndef WIN32
+#include <time.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// the most messages handled from one LCM instance before looking at the
+// other sources again
+#define LCM_LOOP_MAX_BATCH 64
+
+typedef enum {
+    LOOP_SOURCE_LCM,
+    LOOP_SOURCE_FD,
+    LOOP_SOURCE_WAKEUP
+} loop_source_kind_t;
+
+typedef struct _loop_source loop_source_t;
+struct _loop_source {
+    loop_source_kind_t kind;
+    int fd;
+    lcm_t *lcm;                     // LOOP_SOURCE_LCM only
+    lcm_loop_fd_handler_t handler;  // LOOP_SOURCE_FD only
+    void *user_data;
+    int removed;
+};
+
+typedef struct _loop_timer loop_timer_t;
+struct _loop_timer {
+    int id;
+    int64_t deadline;               // microseconds, monotonic clock
+    int interval_millis;
+    int repeat;
+    lcm_loop_timer_handler_t handler;
+    void *user_data;
+    int removed;
+};
+
+struct _lcm_loop_t {
+    GHashTable *sources;        // fd -> loop_source_t*
+    GPtrArray *timers;
+    int next_timer_id;
+
+    // Sources and timers removed while dispatching are only unlinked, and
+    // freed once dispatching is done.
+    int dispatching;
+    GSList *removed_sources;
+    int num_removed_timers;
+
+    lcm_notify_t wakeup;
+    int quit;
+
+#ifdef __linux__
+    int epfd;
+    struct epoll_event events[LCM_LOOP_MAX_BATCH];
+#else
+    // rebuilt from sources whenever it changes
+    int pollfds_dirty;
+    struct pollfd *pollfds;
+    loop_source_t **poll_sources;
+    unsigned int npollfds;
+#endif
+};
+
+static int64_t
+loop_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+loop_source_add (lcm_loop_t *loop, loop_source_t *src)
+{
+    if (src->fd < 0 || g_hash_table_lookup (loop->sources,
+                GINT_TO_POINTER (src->fd))) {
+        free (src);
+        return -1;
+    }
+#ifdef __linux__
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+        perror ("lcm_loop: epoll_ctl");
+        free (src);
+        return -1;
+    }
+#else
+    loop->pollfds_dirty = 1;
+#endif
+    g_hash_table_insert (loop->sources, GINT_TO_POINTER (src->fd), src);
+    return 0;
+}
+
+static void
+loop_source_remove (lcm_loop_t *loop, loop_source_t *src)
+{
+    g_hash_table_remove (loop->sources, GINT_TO_POINTER (src->fd));
+#ifdef __linux__
+    epoll_ctl (loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+#else
+    loop->pollfds_dirty = 1;
+#endif
+    if (loop->dispatching) {
+        src->removed = 1;
+        loop->removed_sources = g_slist_prepend (loop->removed_sources, src);
+    } else {
+        free (src);
+    }
+}
+
+lcm_loop_t *
+lcm_loop_create (void)
+{
+    lcm_loop_t *loop = (lcm_loop_t *) calloc (1, sizeof (lcm_loop_t));
+    loop->sources = g_hash_table_new (g_direct_hash, g_direct_equal);
+    loop->timers = g_ptr_array_new ();
+    loop->next_timer_id = 1;
+#ifdef __linux__
+    loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror ("lcm_loop: epoll_create1");
+        loop->wakeup.fds[0] = loop->wakeup.fds[1] = -1;
+        lcm_loop_destroy (loop);
+        return NULL;
+    }
+#endif
+    if (0 != lcm_notify_init (&loop->wakeup)) {
+        perror ("lcm_loop: wakeup");
+        lcm_loop_destroy (loop);
+        return NULL;
+    }
+
+    loop_source_t *src = (loop_source_t *) calloc (1, sizeof (loop_source_t));
+    src->kind = LOOP_SOURCE_WAKEUP;
+    src->fd = lcm_notify_get_fileno (&loop->wakeup);
+    if (0 != loop_source_add (loop, src)) {
+        lcm_loop_destroy (loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void
+lcm_loop_destroy (lcm_loop_t *loop)
+{
+    GHashTableIter iter;
+    gpointer src;
+    g_hash_table_iter_init (&iter, loop->sources);
+    while (g_hash_table_iter_next (&iter, NULL, &src))
+        free (src);
+    g_hash_table_destroy (loop->sources);
+    for (unsigned int i = 0; i < loop->timers->len; i++)
+        free (g_ptr_array_index (loop->timers, i));
+    g_ptr_array_free (loop->timers, TRUE);
+#ifdef __linux__
+    if (loop->epfd >= 0)
+        close (loop->epfd);
+#else
+    free (loop->pollfds);
+    free (loop->poll_sources);
+#endif
+    lcm_notify_close (&loop->wakeup);
+    free (loop);
+}
+
+int
+lcm_loop_add_lcm (lcm_loop_t *loop, lcm_t *lcm)
+{
+    loop_source_t *src = (loop_source_t *) calloc (1, sizeof (loop_source_t));
+    src->kind = LOOP_SOURCE_LCM;
+    src->fd = lcm_get_fileno (lcm);
+    src->lcm = lcm;
+    return loop_source_add (loop, src);
+}
+
+int
+lcm_loop_remove_lcm (lcm_loop_t *loop, lcm_t *lcm)
+{
+    loop_source_t *src = (loop_source_t *) g_hash_table_lookup (loop->sources,
+            GINT_TO_POINTER (lcm_get_fileno (lcm)));
+    if (!src || src->kind != LOOP_SOURCE_LCM || src->lcm != lcm)
+        return -1;
+    loop_source_remove (loop, src);
+    return 0;
+}
+
+int
+lcm_loop_add_fd (lcm_loop_t *loop, int fd, lcm_loop_fd_handler_t handler,
+        void *user_data)
+{
+    if (!handler)
+        return -1;
+    loop_source_t *src = (loop_source_t *) calloc (1, sizeof (loop_source_t));
+    src->kind = LOOP_SOURCE_FD;
+    src->fd = fd;
+    src->handler = handler;
+    src->user_data = user_data;
+    return loop_source_add (loop, src);
+}
+
+int
+lcm_loop_remove_fd (lcm_loop_t *loop, int fd)
+{
+    loop_source_t *src = (loop_source_t *) g_hash_table_lookup (loop->sources,
+            GINT_TO_POINTER (fd));
+    if (!src || src->kind != LOOP_SOURCE_FD)
+        return -1;
+    loop_source_remove (loop, src);
+    return 0;
+}
+
+int
+lcm_loop_add_timer (lcm_loop_t *loop, int interval_millis, int repeat,
+        lcm_loop_timer_handler_t handler, void *user_data)
+{
+    if (interval_millis < 0 || !handler || (repeat && !interval_millis))
+        return -1;
+    loop_timer_t *timer = (loop_timer_t *) calloc (1, sizeof (loop_timer_t));
+    timer->id = loop->next_timer_id++;
+    if (loop->next_timer_id <= 0)
+        loop->next_timer_id = 1;
+    timer->deadline = loop_now () + (int64_t) interval_millis * 1000;
+    timer->interval_millis = interval_millis;
+    timer->repeat = repeat;
+    timer->handler = handler;
+    timer->user_data = user_data;
+    g_ptr_array_add (loop->timers, timer);
+    return timer->id;
+}
+
+int
+lcm_loop_remove_timer (lcm_loop_t *loop, int timer_id)
+{
+    for (unsigned int i = 0; i < loop->timers->len; i++) {
+        loop_timer_t *timer = (loop_timer_t *) g_ptr_array_index (loop->timers, i);
+        if (timer->id != timer_id || timer->removed)
+            continue;
+        if (loop->dispatching) {
+            timer->removed = 1;
+            loop->num_removed_timers++;
+        } else {
+            g_ptr_array_remove_index (loop->timers, i);
+            free (timer);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Returns 1 if the source was dispatched.
+static int
+loop_source_dispatch (lcm_loop_t *loop, loop_source_t *src)
+{
+    if (src->removed)
+        return 0;
+    switch (src->kind) {
+        case LOOP_SOURCE_LCM:
+            // the wakeup may be spurious, or the messages already handled,
+            // so don't wait for any and hold up the other sources
+            return lcm_handle_batch (src->lcm, LCM_LOOP_MAX_BATCH, 0) > 0;
+        case LOOP_SOURCE_FD:
+            src->handler (loop, src->fd, src->user_data);
+            return 1;
+        default:
+            lcm_notify_wait (&loop->wakeup);
+            return 0;
+    }
+}
+
+// Fire the timers that have expired.  Returns how many fired.
+static int
+loop_dispatch_timers (lcm_loop_t *loop)
+{
+    int64_t now = loop_now ();
+    int nfired = 0;
+    // timers added by the handlers are appended, and don't fire until the
+    // next iteration
+    unsigned int ntimers = loop->timers->len;
+    for (unsigned int i = 0; i < ntimers; i++) {
+        loop_timer_t *timer = (loop_timer_t *) g_ptr_array_index (loop->timers, i);
+        if (timer->removed || timer->deadline > now)
+            continue;
+        if (timer->repeat) {
+            timer->deadline += (int64_t) timer->interval_millis * 1000;
+            // don't try to catch up on expirations that were missed
+            if (timer->deadline <= now)
+                timer->deadline = now + (int64_t) timer->interval_millis * 1000;
+        } else {
+            timer->removed = 1;
+            loop->num_removed_timers++;
+        }
+        timer->handler (loop, timer->id, timer->user_data);
+        nfired++;
+    }
+    return nfired;
+}
+
+// Free the sources and timers that were removed while dispatching.
+static void
+loop_collect_removed (lcm_loop_t *loop)
+{
+    for (GSList *it = loop->removed_sources; it; it = it->next)
+        free (it->data);
+    g_slist_free (loop->removed_sources);
+    loop->removed_sources = NULL;
+
+    for (unsigned int i = 0; loop->num_removed_timers && i < loop->timers->len;) {
+        loop_timer_t *timer = (loop_timer_t *) g_ptr_array_index (loop->timers, i);
+        if (timer->removed) {
+            g_ptr_array_remove_index (loop->timers, i);
+            free (timer);
+            loop->num_removed_timers--;
+        } else {
+            i++;
+        }
+    }
+}
+
+// Returns how long to wait for the sources, in milliseconds, given the
+// caller's timeout and the pending timers.
+static int
+loop_wait_millis (lcm_loop_t *loop, int timeout_millis)
+{
+    if (!loop->timers->len)
+        return timeout_millis;
+    int64_t now = loop_now ();
+    int64_t next = -1;
+    for (unsigned int i = 0; i < loop->timers->len; i++) {
+        loop_timer_t *timer = (loop_timer_t *) g_ptr_array_index (loop->timers, i);
+        if (next < 0 || timer->deadline < next)
+            next = timer->deadline;
+    }
+    // round up, so that the timer has expired when the wait is over
+    int64_t wait = next <= now ? 0 : (next - now + 999) / 1000;
+    if (timeout_millis >= 0 && timeout_millis < wait)
+        return timeout_millis;
+    return wait > G_MAXINT ? G_MAXINT : (int) wait;
+}
+
+#ifndef __linux__
+static void
+loop_rebuild_pollfds (lcm_loop_t *loop)
+{
+    unsigned int n = g_hash_table_size (loop->sources);
+    loop->pollfds = (struct pollfd *) realloc (loop->pollfds,
+            n * sizeof (struct pollfd));
+    loop->poll_sources = (loop_source_t **) realloc (loop->poll_sources,
+            n * sizeof (loop_source_t *));
+    loop->npollfds = 0;
+
+    GHashTableIter iter;
+    gpointer src;
+    g_hash_table_iter_init (&iter, loop->sources);
+    while (g_hash_table_iter_next (&iter, NULL, &src)) {
+        loop->pollfds[loop->npollfds].fd = ((loop_source_t *) src)->fd;
+        loop->pollfds[loop->npollfds].events = POLLIN;
+        loop->poll_sources[loop->npollfds] = (loop_source_t *) src;
+        loop->npollfds++;
+    }
+    loop->pollfds_dirty = 0;
+}
+#endif
+
+int
+lcm_loop_run_once (lcm_loop_t *loop, int timeout_millis)
+{
+    int wait_millis = loop_wait_millis (loop, timeout_millis);
+    int ndispatched = 0;
+
+#ifdef __linux__
+    int nready = epoll_wait (loop->epfd, loop->events, LCM_LOOP_MAX_BATCH,
+            wait_millis);
+#else
+    if (loop->pollfds_dirty)
+        loop_rebuild_pollfds (loop);
+    int nready = poll (loop->pollfds, loop->npollfds, wait_millis);
+#endif
+    if (nready < 0) {
+        if (errno != EINTR) {
+            perror ("lcm_loop");
+            return -1;
+        }
+        nready = 0;
+    }
+
+    loop->dispatching = 1;
+#ifdef __linux__
+    for (int i = 0; i < nready; i++) {
+        ndispatched += loop_source_dispatch (loop,
+                (loop_source_t *) loop->events[i].data.ptr);
+    }
+#else
+    for (unsigned int i = 0; nready && i < loop->npollfds; i++) {
+        if (!loop->pollfds[i].revents)
+            continue;
+        ndispatched += loop_source_dispatch (loop, loop->poll_sources[i]);
+        nready--;
+    }
+#endif
+    ndispatched += loop_dispatch_timers (loop);
+    loop->dispatching = 0;
+    loop_collect_removed (loop);
+    return ndispatched;
+}
+
+int
+lcm_loop_run (lcm_loop_t *loop)
+{
+    while (!g_atomic_int_get (&loop->quit)) {
+        if (lcm_loop_run_once (loop, -1) < 0)
+            return -1;
+    }
+    g_atomic_int_set (&loop->quit, 0);
+    return 0;
+}
+
+void
+lcm_loop_quit (lcm_loop_t *loop)
+{
+    g_atomic_int_set (&loop->quit, 1);
+    lcm_notify_post (&loop->wakeup);
+}
+
+#else
+
+lcm_loop_t *
+lcm_loop_create (void)
+{
+    fprintf (stderr, "Error: lcm_loop_t is not supported on this platform\n");
+    return NULL;
+}
+
+void
+lcm_loop_destroy (lcm_loop_t *loop)
+{
+}
+
+int
+lcm_loop_add_lcm (lcm_loop_t *loop, lcm_t *lcm)
+{
+    return -1;
+}
+
+int
+lcm_loop_remove_lcm (lcm_loop_t *loop, lcm_t *lcm)
+{
+    return -1;
+}
+
+int
+lcm_loop_add_fd (lcm_loop_t *loop, int fd, lcm_loop_fd_handler_t handler,
+        void *user_data)
+{
+    return -1;
+}
+
+int
+lcm_loop_remove_fd (lcm_loop_t *loop, int fd)
+{
+    return -1;
+}
+
+int
+lcm_loop_add_timer (lcm_loop_t *loop, int interval_millis, int repeat,
+        lcm_loop_timer_handler_t handler, void *user_data)
+{
+    return -1;
+}
+
+int
+lcm_loop_remove_timer (lcm_loop_t *loop, int timer_id)
+{
+    return -1;
+}
+
+int
+lcm_loop_run_once (lcm_loop_t *loop, int timeout_millis)
+{
+    return -1;
+}
+
+int
+lcm_loop_run (lcm_loop_t *loop)
+{
+    return -1;
+}
+
+void
+lcm_loop_quit (lcm_loop_t *loop)
+{
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef _LCM_LOOP_H_
+#define _LCM_LOOP_H_
+
+#include "lcm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup LcmC_lcm_loop_t lcm_loop_t
+ * @ingroup LcmC
+ * @brief Handle many %LCM instances, file descriptors and timers from one
+ * thread
+ *
+ * An event loop waits for any of its sources to become ready and dispatches
+ * the ones that are.  Sources are %LCM instances, whose messages are handled
+ * with lcm_handle_batch(), arbitrary readable file descriptors, and timers.
+ * On Linux the loop is built on epoll, so it scales to thousands of sources
+ * and is not limited by @c FD_SETSIZE.
+ *
+ * Except for lcm_loop_quit(), the functions on an event loop must be called
+ * from the thread that runs it, or from its callbacks.
+ *
+ * The event loop is not available on Windows.
+ *
+ * @code
+ * #include <lcm/lcm_loop.h>
+ * @endcode
+ *
+ * Linking: <tt> `pkg-config --libs lcm` </tt>
+ *
+ * @{
+ */
+
+/**
+ * Opaque data structure containing an event loop.
+ */
+typedef struct _lcm_loop_t lcm_loop_t;
+
+/**
+ * @brief Callback invoked when a file descriptor registered with
+ * lcm_loop_add_fd() is readable, or has an error pending.
+ */
+typedef void (*lcm_loop_fd_handler_t) (lcm_loop_t *loop, int fd,
+        void *user_data);
+
+/**
+ * @brief Callback invoked when a timer registered with lcm_loop_add_timer()
+ * expires.
+ */
+typedef void (*lcm_loop_timer_handler_t) (lcm_loop_t *loop, int timer_id,
+        void *user_data);
+
+/**
+ * @brief Constructor
+ *
+ * @return a newly allocated event loop, or NULL on failure.
+ */
+LCM_EXPORT
+lcm_loop_t * lcm_loop_create(void);
+
+/**
+ * @brief Destructor
+ *
+ * The %LCM instances and file descriptors registered with the loop are not
+ * closed.
+ */
+LCM_EXPORT
+void lcm_loop_destroy(lcm_loop_t *loop);
+
+/**
+ * @brief Dispatch messages for an %LCM instance from the loop.
+ *
+ * Whenever @p lcm has messages waiting, the loop calls lcm_handle_batch() on
+ * it.  The instance must not also be handled by another thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_loop_add_lcm(lcm_loop_t *loop, lcm_t *lcm);
+
+/**
+ * @brief Stop dispatching messages for an %LCM instance.
+ *
+ * @return 0 on success, -1 if @p lcm was not registered.
+ */
+LCM_EXPORT
+int lcm_loop_remove_lcm(lcm_loop_t *loop, lcm_t *lcm);
+
+/**
+ * @brief Invoke a callback whenever a file descriptor is readable.
+ *
+ * @param fd the file descriptor.  A file descriptor can only be registered
+ *        once.
+ * @param handler invoked from the loop when @p fd is readable, or has an
+ *        error pending.  It should read from @p fd, or remove it, or the
+ *        handler will be invoked again right away.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_loop_add_fd(lcm_loop_t *loop, int fd, lcm_loop_fd_handler_t handler,
+        void *user_data);
+
+/**
+ * @brief Stop watching a file descriptor.
+ *
+ * @return 0 on success, -1 if @p fd was not registered.
+ */
+LCM_EXPORT
+int lcm_loop_remove_fd(lcm_loop_t *loop, int fd);
+
+/**
+ * @brief Invoke a callback after a delay.
+ *
+ * @param interval_millis the delay, in milliseconds.
+ * @param repeat if nonzero, the timer is rearmed every @p interval_millis
+ *        until it is removed.  Otherwise it fires once and is removed.
+ *
+ * @return a positive timer ID on success, -1 on failure.
+ */
+LCM_EXPORT
+int lcm_loop_add_timer(lcm_loop_t *loop, int interval_millis, int repeat,
+        lcm_loop_timer_handler_t handler, void *user_data);
+
+/**
+ * @brief Cancel a timer.
+ *
+ * @return 0 on success, -1 if no such timer is pending.
+ */
+LCM_EXPORT
+int lcm_loop_remove_timer(lcm_loop_t *loop, int timer_id);
+
+/**
+ * @brief Wait for any sources to become ready, and dispatch them.
+ *
+ * @param timeout_millis the maximum amount of time to wait, in milliseconds.
+ *        If 0, dispatches whatever is ready without waiting.  If negative,
+ *        waits indefinitely.
+ *
+ * @return the number of sources dispatched, 0 if the timeout expired, or -1
+ *         on error.
+ */
+LCM_EXPORT
+int lcm_loop_run_once(lcm_loop_t *loop, int timeout_millis);
+
+/**
+ * @brief Dispatch sources until lcm_loop_quit() is called.
+ *
+ * @return 0 after lcm_loop_quit() was called, or -1 on error.
+ */
+LCM_EXPORT
+int lcm_loop_run(lcm_loop_t *loop);
+
+/**
+ * @brief Make lcm_loop_run() return.
+ *
+ * May be called from any thread.
+ */
+LCM_EXPORT
+void lcm_loop_quit(lcm_loop_t *loop);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #ifndef WIN32
@@ -17,7 +18,7 @@ struct _lcm_provider_t {
     lcm_t* lcm;
     GQueue* queue;
     GMutex* mutex;
-    int notify_pipe[2];
+    lcm_notify_t notify;
 };
 
 typedef struct _memq_msg memq_msg_t;
@@ -34,6 +35,9 @@ memq_msg_new(lcm_t* lcm, const char* channel, const void* data, int data_size, i
     memcpy(msg->rbuf.data, data, data_size);
     msg->rbuf.recv_utime = utime;
     msg->rbuf.lcm = lcm;
+    msg->rbuf.send_utime = 0;
+    msg->rbuf.send_host_id = 0;
+    msg->rbuf.recv_utime_ns = utime * 1000;
     msg->channel = g_strdup(channel);
     return msg;
 }
@@ -50,8 +54,7 @@ static void
 lcm_memq_destroy (lcm_memq_t *self)
 {
     dbg(DBG_LCM, "destroying LCM memq provider context\n");
-    if(self->notify_pipe[0] >= 0) lcm_internal_pipe_close(self->notify_pipe[0]);
-    if(self->notify_pipe[1] >= 0) lcm_internal_pipe_close(self->notify_pipe[1]);
+    lcm_notify_close(&self->notify);
 
     while (!g_queue_is_empty(self->queue)) {
         memq_msg_t* msg = (memq_msg_t*) g_queue_pop_head(self->queue);
@@ -81,8 +84,8 @@ lcm_memq_create (lcm_t* parent, const char* target, const GHashTable* args)
 
     dbg(DBG_LCM, "Initializing LCM memq provider context...\n");
 
-    if(lcm_internal_pipe_create(self->notify_pipe) != 0) {
-        perror(__FILE__ " - pipe (notify)");
+    if(lcm_notify_init(&self->notify) != 0) {
+        perror(__FILE__ " - notify");
         lcm_memq_destroy (self);
         return NULL;
     }
@@ -92,38 +95,51 @@ lcm_memq_create (lcm_t* parent, const char* target, const GHashTable* args)
 static int
 lcm_memq_get_fileno(lcm_memq_t* self)
 {
-    return self->notify_pipe[0];
+    return lcm_notify_get_fileno(&self->notify);
 }
 
 static int
-lcm_memq_handle(lcm_memq_t* self)
+lcm_memq_handle_batch(lcm_memq_t* self, int max_msgs)
 {
-    char ch;
-    int status = lcm_internal_pipe_read(self->notify_pipe[0], &ch, 1);
-    if (status == 0) {
+    if (lcm_notify_wait(&self->notify) < 0) {
         fprintf(stderr,
-            "Error: lcm_memq_handle read 0 bytes from notify_pipe\n");
+            "Error: lcm_memq_handle failed to read notification\n");
         return -1;
     }
 
+    GQueue batch;
+    g_queue_init(&batch);
     g_mutex_lock(self->mutex);
-    memq_msg_t* msg = (memq_msg_t*)g_queue_pop_head(self->queue);
+    for (int i = 0; i < max_msgs && !g_queue_is_empty(self->queue); i++) {
+        g_queue_push_tail(&batch, g_queue_pop_head(self->queue));
+    }
     if (!g_queue_is_empty(self->queue)) {
-        if(lcm_internal_pipe_write(self->notify_pipe[1], "+", 1) < 0) {
-            perror(__FILE__ " - write to notify pipe (lcm_memq_handle)");
+        if(lcm_notify_post(&self->notify) < 0) {
+            perror(__FILE__ " - notify (lcm_memq_handle)");
         }
     }
     g_mutex_unlock(self->mutex);
 
-    dbg(DBG_LCM, "Dispatching message on channel [%s], size [%d]\n",
-        msg->channel, msg->rbuf.data_size);
+    int num_handled = 0;
+    while (!g_queue_is_empty(&batch)) {
+        memq_msg_t* msg = (memq_msg_t*)g_queue_pop_head(&batch);
+        dbg(DBG_LCM, "Dispatching message on channel [%s], size [%d]\n",
+            msg->channel, msg->rbuf.data_size);
+
+        if (lcm_try_enqueue_message(self->lcm, msg->channel)) {
+          lcm_dispatch_handlers(self->lcm, &msg->rbuf, msg->channel);
+        }
 
-    if (lcm_try_enqueue_message(self->lcm, msg->channel)) {
-      lcm_dispatch_handlers(self->lcm, &msg->rbuf, msg->channel);
+        memq_msg_destroy(msg);
+        num_handled++;
     }
+    return num_handled;
+}
 
-    memq_msg_destroy(msg);
-    return 0;
+static int
+lcm_memq_handle(lcm_memq_t* self)
+{
+    return lcm_memq_handle_batch(self, 1) < 0 ? -1 : 0;
 }
 
 
@@ -131,7 +147,8 @@ static int
 lcm_memq_publish (lcm_memq_t *self, const char *channel, const void *data,
         unsigned int datalen)
 {
-    if(!lcm_has_handlers(self->lcm, channel)) {
+    int status = lcm_has_handlers(self->lcm, channel);
+    if(!status) {
       dbg(DBG_LCM,
           "Publishing [%s] size [%d] - dropping (no subscribers)\n",
           channel, datalen);
@@ -143,10 +160,23 @@ lcm_memq_publish (lcm_memq_t *self, const char *channel, const void *data,
 
     g_mutex_lock(self->mutex);
     int was_empty = g_queue_is_empty(self->queue);
+    if (status == LCM_HANDLERS_KEEP_LATEST) {
+        // the new message supersedes the ones queued on the same channel
+        GList* link = self->queue->head;
+        while (link) {
+            GList* next = link->next;
+            memq_msg_t* old = (memq_msg_t*)link->data;
+            if (!strcmp(old->channel, channel)) {
+                g_queue_delete_link(self->queue, link);
+                memq_msg_destroy(old);
+            }
+            link = next;
+        }
+    }
     g_queue_push_tail(self->queue, msg);
     if (was_empty) {
-        if(lcm_internal_pipe_write(self->notify_pipe[1], "+", 1) < 0) {
-            perror(__FILE__ " - write to notify pipe (lcm_memq_publish)");
+        if(lcm_notify_post(&self->notify) < 0) {
+            perror(__FILE__ " - notify (lcm_memq_publish)");
         }
     }
     g_mutex_unlock(self->mutex);
@@ -163,7 +193,8 @@ static lcm_provider_vtable_t memq_vtable = {
     .unsubscribe = NULL,
     .publish     = lcm_memq_publish,
     .handle      = lcm_memq_handle,
-    .get_fileno  = lcm_memq_get_fileno
+    .get_fileno  = lcm_memq_get_fileno,
+    .handle_batch = lcm_memq_handle_batch
 };
 #endif
 static lcm_provider_info_t memq_info;
@@ -179,6 +210,7 @@ lcm_memq_provider_init (GPtrArray * providers)
     memq_vtable.publish     = lcm_memq_publish;
     memq_vtable.handle      = lcm_memq_handle;
     memq_vtable.get_fileno  = lcm_memq_get_fileno;
+    memq_vtable.handle_batch = lcm_memq_handle_batch;
 #endif
     memq_info.name = "memq";
     memq_info.vtable = &memq_vtable;
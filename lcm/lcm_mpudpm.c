@@ -57,6 +57,7 @@ typedef struct _mpudpm_socket_t {
     SOCKET fd;
     uint16_t port;
     int num_subscribers;
+    uint32_t kernel_drops;  // packets dropped by the kernel so far
 } mpudpm_socket_t;
 
 
@@ -85,6 +86,13 @@ typedef struct _mpudpm_subscriber_t {
  *                        don't use > 1.  that's just rude.
  * @recv_buf_size:        requested size of the kernel receive buffer, set with
  *                        SO_RCVBUF.  0 indicates to use the default settings.
+ * @mem:                  memory set aside by the read thread for incoming
+ *                        messages.
+ * @busy_poll:            if nonzero, the read thread and lcm_handle () spin
+ *                        instead of sleeping until packets and messages
+ *                        arrive.  Each uses a whole CPU.
+ * @trace:                if nonzero, published messages carry the time they
+ *                        were published and the host they were published on.
  *
  */
 typedef struct _mpudpm_params_t mpudpm_params_t;
@@ -94,6 +102,9 @@ struct _mpudpm_params_t {
     uint16_t num_mc_ports;
     uint8_t mc_ttl; 
     int recv_buf_size;
+    lcm_recv_mem_params_t mem;
+    int busy_poll;
+    int trace;
 };
 
 typedef struct _lcm_provider_t lcm_mpudpm_t;
@@ -121,16 +132,6 @@ struct _lcm_provider_t {
     /* list of mpudpm_subscriber_t structs */
     GSList* subscribers;
 
-    /* Packet structures available for sending or receiving use are
-     * stored in the *_empty queues. */
-    lcm_buf_queue_t * inbufs_empty;
-    /* Received packets that are filled with data are queued here. */
-    lcm_buf_queue_t * inbufs_filled;
-
-    /* Memory for received small packets is taken from a fixed-size ring buffer
-     * so we don't have to do any mallocs */
-    lcm_ringbuf_t * ringbuf;
-
     /* Indicates whether the receive thread was successfully created */
     int8_t recv_thread_created;
 
@@ -165,7 +166,13 @@ struct _lcm_provider_t {
      **************************************************************/
 
     GThread *read_thread;
-    int notify_pipe[2];         // pipe to notify application when messages arrive
+    /* Messages received by the read thread are passed to lcm_handle () here,
+     * and passed back once they are handled.  Memory for them is taken from a
+     * ringbuffer that only the read thread uses, so we don't have to do any
+     * mallocs or take any locks. */
+    lcm_buf_handoff_t * handoff;
+    lcm_notify_t notify;        // to notify application when messages arrive
+    int notify_pending;         // set while the notification is posted
     int thread_msg_pipe[2];     // pipe to notify read thread when to cancel a
     // select or terminate
 
@@ -179,11 +186,11 @@ struct _lcm_provider_t {
     /* other variables */
     lcm_frag_buf_store  *frag_bufs;
 
-    uint32_t     udp_rx;            // packets received and processed
-    uint32_t     udp_discarded_bad; // packets discarded because they were bad 
+    uint64_t     udp_rx;            // packets received
+    uint64_t     udp_discarded_bad; // packets discarded because they were bad 
     // somehow
-    double       udp_low_watermark; // least buffer available
-    int32_t      udp_last_report_secs;
+    uint64_t     kernel_drops;      // packets dropped by the kernel, summed
+                                    // over all receive sockets
 
     // regex to check whether a passed in channel is a regex :-)
     GRegex* regex_finder_re;
@@ -260,21 +267,15 @@ destroy_recv_parts (lcm_mpudpm_t *lcm)
         g_slist_free(lcm->subscribers);
     }
 
-    if (lcm->frag_bufs) {
-        lcm_frag_buf_store_destroy(lcm->frag_bufs);
+    // the handoff may hold reassembled messages from the fragment buffer
+    // store's pool, so free it first
+    if (lcm->handoff) {
+        lcm_buf_handoff_free (lcm->handoff);
+        lcm->handoff = NULL;
     }
 
-    if (lcm->inbufs_empty) {
-        lcm_buf_queue_free (lcm->inbufs_empty, lcm->ringbuf);
-        lcm->inbufs_empty = NULL;
-    }
-    if (lcm->inbufs_filled) {
-        lcm_buf_queue_free (lcm->inbufs_filled, lcm->ringbuf);
-        lcm->inbufs_filled = NULL;
-    }
-    if (lcm->ringbuf) {
-        lcm_ringbuf_free (lcm->ringbuf);
-        lcm->ringbuf = NULL;
+    if (lcm->frag_bufs) {
+        lcm_frag_buf_store_destroy(lcm->frag_bufs);
     }
 }
 
@@ -291,8 +292,7 @@ lcm_mpudpm_destroy (lcm_mpudpm_t *lcm)
         g_hash_table_destroy(lcm->channel_to_port_map);
     }
 
-    lcm_internal_pipe_close(lcm->notify_pipe[0]);
-    lcm_internal_pipe_close(lcm->notify_pipe[1]);
+    lcm_notify_close(&lcm->notify);
 
     g_static_mutex_free (&lcm->receive_lock);
     g_static_mutex_free (&lcm->transmit_lock);
@@ -362,6 +362,8 @@ static void
 new_argument (gpointer key, gpointer value, gpointer user)
 {
     mpudpm_params_t * params = (mpudpm_params_t *) user;
+    if (lcm_recv_mem_parse_arg (&params->mem, (char *) key, (char *) value))
+        return;
     if (!strcmp ((char *) key, "recv_buf_size")) {
         char *endptr = NULL;
         params->recv_buf_size = strtol ((char *) value, &endptr, 0);
@@ -374,6 +376,18 @@ new_argument (gpointer key, gpointer value, gpointer user)
         if (endptr == value)
             fprintf (stderr, "Warning: Invalid value for ttl\n");
     }
+    else if (!strcmp ((char *) key, "busy_poll")) {
+        char *endptr = NULL;
+        params->busy_poll = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for busy_poll\n");
+    }
+    else if (!strcmp ((char *) key, "trace")) {
+        char *endptr = NULL;
+        params->trace = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for trace\n");
+    }
     else if (!strcmp ((char *) key, "nports")) {
         char *endptr = NULL;
         params->num_mc_ports = strtol ((char *) value, &endptr, 0);
@@ -402,25 +416,29 @@ static int
 recv_message_fragment (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
 {
     lcm2_header_long_t *hdr = (lcm2_header_long_t*) lcmb->buf;
+    uint32_t hdr_size = lcm2_long_header_size (ntohl (hdr->magic));
 
-    // any existing fragment buffer for this message source?
-    lcm_frag_buf_t *fbuf = lcm_frag_buf_store_lookup(lcm->frag_bufs,
-            &lcmb->from);
+    if (sz < hdr_size) {
+        lcm->udp_discarded_bad++;
+        return 0;
+    }
 
     uint32_t msg_seqno = ntohl (hdr->msg_seqno);
     uint32_t data_size = ntohl (hdr->msg_size);
     uint32_t fragment_offset = ntohl (hdr->fragment_offset);
     //    uint16_t fragment_no = ntohs (hdr->fragment_no);
     uint16_t fragments_in_msg = ntohs (hdr->fragments_in_msg);
-    uint32_t frag_size = sz - sizeof (lcm2_header_long_t);
-    char *data_start = (char*) (hdr + 1);
+    uint32_t frag_size = sz - hdr_size;
+    char *data_start = lcmb->buf + hdr_size;
+
+    // any existing fragment buffer for this message?
+    lcm_frag_buf_t *fbuf = lcm_frag_buf_store_lookup(lcm->frag_bufs,
+            &lcmb->from, msg_seqno);
 
-    // discard any stale fragments from previous messages
-    if (fbuf && ((fbuf->msg_seqno != msg_seqno) ||
-            (fbuf->data_size != data_size))) {
+    // discard it if the sender has started over with a different message
+    if (fbuf && ((fbuf->data_size != data_size) ||
+                 (fbuf->nfragments != fragments_in_msg))) {
         lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
-        dbg(DBG_LCM, "Dropping message (missing %d fragments)\n",
-            fbuf->fragments_remaining);
         fbuf = NULL;
     }
 
@@ -432,7 +450,7 @@ recv_message_fragment (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
     // create a new fragment buffer if necessary
     //TODO(abachrac): this discards a msg if the first fragment is out of order
     if (!fbuf && hdr->fragment_no == 0) {
-        char *channel = (char*) (hdr + 1);
+        char *channel = data_start;
         int channel_sz = strlen (channel);
         if (channel_sz > LCM_MAX_CHANNEL_NAME_LENGTH) {
             dbg (DBG_LCM, "bad channel name length\n");
@@ -445,10 +463,11 @@ recv_message_fragment (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
                 && !is_reserved_channel(channel))
             return 0;
 
-        fbuf = lcm_frag_buf_new (*((struct sockaddr_in*) &lcmb->from),
-                channel, msg_seqno, data_size, fragments_in_msg,
-                lcmb->recv_utime);
-        lcm_frag_buf_store_add (lcm->frag_bufs, fbuf);
+        fbuf = lcm_frag_buf_store_add (lcm->frag_bufs, &lcmb->from, channel,
+                msg_seqno, data_size, fragments_in_msg, lcmb->recv_utime_ns);
+        if (hdr_size > sizeof (*hdr))
+            lcm2_trace_ext_parse (hdr + 1, &fbuf->send_utime,
+                    &fbuf->send_host_id);
         data_start += channel_sz + 1;
         frag_size -= (channel_sz + 1);
     }
@@ -476,47 +495,38 @@ recv_message_fragment (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
     }
 #endif
 
-    if (fragment_offset + frag_size > fbuf->data_size) {
-        dbg (DBG_LCM, "dropping invalid fragment (off: %d, %d / %d)\n",
-                fragment_offset, frag_size, fbuf->data_size);
-        lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
-        return 0;
-    }
-
     // copy data
-    memcpy (fbuf->data + fragment_offset, data_start, frag_size);
-    fbuf->last_packet_utime = lcmb->recv_utime;
-
-    fbuf->fragments_remaining --;
-
-    if (0 == fbuf->fragments_remaining) {
+    if (1 == lcm_frag_buf_store_add_fragment (lcm->frag_bufs, fbuf,
+                ntohs (hdr->fragment_no), fragment_offset, data_start,
+                frag_size, lcmb->recv_utime_ns)) {
         // complete message received.  Is there a subscriber that still
         // wants it?  (i.e., does any subscriber have space in its queue?)
         // WARNING: lcm_try_enqueue_message increments the number of queued
         // messages, so we must check whether it is a reserved channel FIRST
+        lcmb->channel_id = 0;
+        int status = 1;
         if (!is_reserved_channel(fbuf->channel)
-                && !lcm_try_enqueue_message(lcm->lcm, fbuf->channel)) {
+                && !(status = lcm_try_enqueue_message_id(lcm->lcm,
+                        fbuf->channel, &lcmb->channel_id))) {
             // no... sad... free the fragment buffer and return
             lcm_frag_buf_store_remove(lcm->frag_bufs, fbuf);
             return 0;
         }
 
-        // yes, transfer the message into the lcm_buf_t
-
-        // deallocate the ringbuffer-allocated buffer
-        g_static_mutex_lock(&lcm->receive_lock);
-        lcm_buf_free_data(lcmb, lcm->ringbuf);
-        g_static_mutex_unlock(&lcm->receive_lock);
+        // yes, transfer the message into the lcm_buf_t.  Its packet buffer
+        // is reused for the next packet.
 
         // transfer ownership of the message's payload buffer
-        lcmb->buf = fbuf->data;
-        fbuf->data = NULL;
+        lcm_frag_buf_store_take_data (lcm->frag_bufs, fbuf, lcmb);
 
         strcpy (lcmb->channel_name, fbuf->channel);
         lcmb->channel_size = strlen (lcmb->channel_name);
         lcmb->data_offset = 0;
         lcmb->data_size = fbuf->data_size;
-        lcmb->recv_utime = fbuf->last_packet_utime;
+        lcm_buf_set_recv_time (lcmb, fbuf->last_packet_ns);
+        lcmb->send_utime = fbuf->send_utime;
+        lcmb->send_host_id = fbuf->send_host_id;
+        lcmb->keep_latest = status == LCM_HANDLERS_KEEP_LATEST;
 
         // don't need the fragment buffer anymore
         lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
@@ -531,10 +541,21 @@ static int
 recv_short_message (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, int sz)
 {
     lcm2_header_short_t *hdr2 = (lcm2_header_short_t*) lcmb->buf;
+    int hdr_size = lcm2_short_header_size (ntohl (hdr2->magic));
+
+    if (sz < hdr_size) {
+        lcm->udp_discarded_bad++;
+        return 0;
+    }
+    lcmb->send_utime = 0;
+    lcmb->send_host_id = 0;
+    if (hdr_size > sizeof (*hdr2))
+        lcm2_trace_ext_parse (hdr2 + 1, &lcmb->send_utime,
+                &lcmb->send_host_id);
 
     // shouldn't have to worry about buffer overflow here because we
     // zeroed out byte #65536, which is never written to by recv
-    const char *pkt_channel_str = (char*) (hdr2 + 1);
+    const char *pkt_channel_str = lcmb->buf + hdr_size;
 
     lcmb->channel_size = strlen (pkt_channel_str);
 
@@ -544,30 +565,31 @@ recv_short_message (lcm_mpudpm_t *lcm, lcm_buf_t *lcmb, int sz)
         return 0;
     }
 
-    lcm->udp_rx++;
-
     // if the packet has no subscribers, drop the message now.
     // WARNING: lcm_try_enqueue_message increments the number of queued
     // messages, so we must check whether it is a reserved channel FIRST
+    lcmb->channel_id = 0;
+    lcmb->keep_latest = 0;
     if (!is_reserved_channel(pkt_channel_str)
             || strcmp(pkt_channel_str, SELF_TEST_CHANNEL) == 0) {
-        if (!lcm_try_enqueue_message(lcm->lcm, pkt_channel_str)) {
+        int status = lcm_try_enqueue_message_id(lcm->lcm, pkt_channel_str,
+                &lcmb->channel_id);
+        if (!status) {
             return 0;
         }
+        lcmb->keep_latest = status == LCM_HANDLERS_KEEP_LATEST;
     }
 
     strcpy (lcmb->channel_name, pkt_channel_str);
 
-    lcmb->data_offset = 
-            sizeof (lcm2_header_short_t) + lcmb->channel_size + 1;
+    lcmb->data_offset = hdr_size + lcmb->channel_size + 1;
 
     lcmb->data_size = sz - lcmb->data_offset;
     return 1;
 }
 
 // this function will aquire locks if needed
-static void dispatch_complete_message(lcm_mpudpm_t * lcm, lcm_buf_t * lcmb,
-        int actual_size) {
+static void dispatch_complete_message(lcm_mpudpm_t * lcm, lcm_buf_t * lcmb) {
     int handled_internal_message = 0;
     if (strcmp(lcmb->channel_name, CHANNEL_TO_PORT_MAP_REQUEST_CHANNEL) == 0) {
         g_static_mutex_lock(&lcm->transmit_lock);
@@ -592,35 +614,30 @@ static void dispatch_complete_message(lcm_mpudpm_t * lcm, lcm_buf_t * lcmb,
         handled_internal_message = 1;
     }
 
+    lcm_buf_handoff_t *handoff = lcm->handoff;
     if (handled_internal_message) {
         // one of the handlers above took it, so discard lcmb
-        g_static_mutex_lock(&lcm->receive_lock);
-        lcm_buf_free_data(lcmb, lcm->ringbuf);
-        lcm_buf_enqueue(lcm->inbufs_empty, lcmb);
-        g_static_mutex_unlock(&lcm->receive_lock);
-    } else {
-        // enqueue the lcmb for handling by the user
-        g_static_mutex_lock(&lcm->receive_lock);
+        lcm_buf_free_data(lcmb, handoff->ringbuf);
+        lcm_buf_enqueue(handoff->inbufs_empty, lcmb);
+        return;
+    }
 
-        // if the newly received packet is a short packet, then resize the space
-        // allocated in the ringbuffer to exactly match the amount of space
-        // required.  That way, we do not use 64k of the ringbuffer for every
-        // incoming message.
-        if (lcmb->ringbuf) {
-            lcm_ringbuf_shrink_last(lcmb->ringbuf, lcmb->buf, actual_size);
-        }
-        // If necessary, notify the reading thread by writing to a pipe.  We
-        // only want one character in the pipe at a time to avoid blocking
-        // writes, so we only do this when the queue transitions from empty to
-        // non-empty.
-        if (lcm_buf_queue_is_empty(lcm->inbufs_filled)) {
-            if (lcm_internal_pipe_write(lcm->notify_pipe[1], "+", 1) < 0) {
-                perror("write to notify");
-            }
+    // Queue the packet for future retrieval by lcm_handle ().
+    if (0 != lcm_buf_handoff_push(handoff, lcm->lcm, lcmb)) {
+        // too many messages are waiting to be handled, so drop this one
+        dbg(DBG_LCM, "dropping message, too many queued\n");
+        lcm_discard_message(lcm->lcm, lcmb->channel_name, lcmb->channel_id);
+        lcm_buf_free_data(lcmb, handoff->ringbuf);
+        lcm_buf_enqueue(handoff->inbufs_empty, lcmb);
+        return;
+    }
+
+    // If necessary, notify the reading thread.  Only one notification is
+    // posted at a time.
+    if (g_atomic_int_compare_and_exchange(&lcm->notify_pending, 0, 1)) {
+        if (lcm_notify_post(&lcm->notify) < 0) {
+            perror("write to notify");
         }
-        /* Queue the packet for future retrieval by lcm_handle (). */
-        lcm_buf_enqueue(lcm->inbufs_filled, lcmb);
-        g_static_mutex_unlock(&lcm->receive_lock);
     }
 }
 
@@ -637,6 +654,12 @@ recv_thread(void * user) {
 
     lcm_mpudpm_t * lcm = (lcm_mpudpm_t *) user;
 
+    // Each packet is received here first.  Short messages are then copied
+    // into exactly as much of the ringbuffer as they need.
+    char *packet = (char *) malloc(65536);
+    // zero the last byte so that strlen never segfaults
+    packet[65535] = 0;
+
     lcm_buf_t *lcmb = NULL;
     // loop until we get an exit message on the thread_msg_pipe
     while (1) {
@@ -664,10 +687,19 @@ recv_thread(void * user) {
         // unlock receive_lock while we wait for a message
         g_static_mutex_unlock(&lcm->receive_lock);
 
-        if (select(maxfd + 1, &fds, NULL, NULL, NULL) < 0) {
+        // when busy polling, check the sockets without sleeping until
+        // one of them is readable
+        struct timeval no_wait = { 0, 0 };
+        int status = select(maxfd + 1, &fds, NULL, NULL,
+                lcm->params.busy_poll ? &no_wait : NULL);
+        if (status < 0) {
             perror("udp_read_packet -- select() failed:");
             continue;
         }
+        if (status == 0) {
+            lcm_cpu_relax();
+            continue;
+        }
 
         // check for a signaling message
         if (FD_ISSET(lcm->thread_msg_pipe[0], &fds)) {
@@ -691,8 +723,7 @@ recv_thread(void * user) {
                     // just free it here.  Do the latter.
                     //
                     // Can also just free its lcm_buf_t here.  Its data buffer
-                    // is managed either by the ring buffer or the fragment
-                    // buffer, so we can ignore it.
+                    // is the packet buffer, freed below.
                     free(lcmb);
                 }
                 break;
@@ -727,8 +758,12 @@ recv_thread(void * user) {
             while (1) {
                 // We should be holding receive_lock at the start of this loop
                 if (lcmb == NULL ) {
-                    lcmb = lcm_buf_allocate_data(lcm->inbufs_empty,
-                            &lcm->ringbuf);
+                    // take back the buffers of the messages that were
+                    // handled, so that their space can be reused
+                    lcm_buf_handoff_recycle(lcm->handoff);
+                    lcmb = lcm_buf_reserve(lcm->handoff);
+                    lcmb->buf = packet;
+                    lcmb->ringbuf = NULL;
                 }
 
                 // unlock while we actually receive the incoming message
@@ -746,12 +781,14 @@ recv_thread(void * user) {
                 // operating systems that provide SO_TIMESTAMP allow us to
                 // obtain more accurate timestamps by having the kernel produce
                 // timestamps as soon as packets are received.
-                char controlbuf[64];
+                char controlbuf[LCM_RECV_CONTROL_SIZE];
                 msg.msg_control = controlbuf;
                 msg.msg_controllen = sizeof(controlbuf);
                 msg.msg_flags = 0;
 #endif
                 int sz = recvmsg(recv_fd, &msg, 0);
+                // for the packets the kernel didn't timestamp
+                int64_t read_ns = lcm_timestamp_now_ns();
 
                 if (sz < 0) {
 #ifndef WIN32
@@ -765,6 +802,8 @@ recv_thread(void * user) {
                     break;
                 }
 
+                lcm->udp_rx++;
+
                 if (sz < sizeof(lcm2_header_short_t)) {
                     // packet too short to be LCM
                     lcm->udp_discarded_bad++;
@@ -785,32 +824,38 @@ recv_thread(void * user) {
                 from_addr->sin_addr.s_addr &= 0xFFFF0000;
                 from_addr->sin_addr.s_addr |= htons(recv_port);
 
-                int got_utime = 0;
+                int64_t recv_ns = 0;
 #ifdef SO_TIMESTAMP
                 struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
                 // Get the receive timestamp out of the packet headers
                 // (if possible)
-                while (!lcmb->recv_utime && cmsg) {
+                while (cmsg) {
+                    lcm_parse_recv_timestamp(cmsg, &recv_ns);
+#ifdef SO_RXQ_OVFL
+                    // the kernel reports how many packets it has dropped on
+                    // this socket so far
                     if (cmsg->cmsg_level == SOL_SOCKET
-                            && cmsg->cmsg_type == SCM_TIMESTAMP) {
-                        struct timeval * t = (struct timeval*) CMSG_DATA (cmsg);
-                        lcmb->recv_utime = (int64_t) t->tv_sec * 1000000
-                                + t->tv_usec;
-                        got_utime = 1;
-                        break;
+                            && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                        uint32_t drops;
+                        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                        // the socket's count wraps at 32 bits, the sum
+                        // doesn't
+                        lcm->kernel_drops +=
+                            (uint32_t) (drops - sub_socket->kernel_drops);
+                        sub_socket->kernel_drops = drops;
                     }
+#endif
                     cmsg = CMSG_NXTHDR (&msg, cmsg);
                 }
 #endif
-                if (!got_utime)
-                    lcmb->recv_utime = lcm_timestamp_now();
+                lcm_buf_set_recv_time(lcmb, recv_ns ? recv_ns : read_ns);
 
                 lcm2_header_short_t *hdr2 = (lcm2_header_short_t*) lcmb->buf;
                 uint32_t rcvd_magic = ntohl(hdr2->magic);
                 int got_complete_message = 0;
-                if (rcvd_magic == LCM2_MAGIC_SHORT)
+                if (lcm2_short_header_size(rcvd_magic))
                     got_complete_message = recv_short_message(lcm, lcmb, sz);
-                else if (rcvd_magic == LCM2_MAGIC_LONG)
+                else if (lcm2_long_header_size(rcvd_magic))
                     got_complete_message = recv_message_fragment(lcm, lcmb, sz);
                 else {
                     dbg(DBG_LCM, "LCM: bad magic\n");
@@ -820,7 +865,9 @@ recv_thread(void * user) {
 
                 // dispatch internal messages
                 if (got_complete_message) {
-                    dispatch_complete_message(lcm, lcmb, sz);
+                    if (lcmb->buf == packet)
+                        lcm_buf_copy_data(lcm->handoff, lcmb, sz);
+                    dispatch_complete_message(lcm, lcmb);
                     lcmb = NULL;
                 }
                 // lock to go back around the while loop
@@ -840,6 +887,7 @@ recv_thread(void * user) {
         g_static_mutex_unlock(&lcm->receive_lock);
     }
 
+    free(packet);
     dbg(DBG_LCM, "read thread exiting\n");
     return NULL ;
 }
@@ -850,7 +898,7 @@ lcm_mpudpm_get_fileno (lcm_mpudpm_t *lcm)
     if (setup_recv_parts(lcm) < 0) {
         return -1;
     }
-    return lcm->notify_pipe[0];
+    return lcm_notify_get_fileno(&lcm->notify);
 }
 
 int
@@ -1189,28 +1237,43 @@ publish_message_internal (lcm_mpudpm_t *lcm, const char *channel, const void *da
     // set the destination port
     lcm->dest_addr.sin_port = htons(chan_port);
 
+    lcm2_trace_ext_t trace_ext;
+    lcm2_trace_ext_t *trace = NULL;
+    int trace_size = 0;
+    if (lcm->params.trace) {
+        lcm2_trace_ext_init(&trace_ext, lcm_timestamp_now(), lcm_host_id());
+        trace = &trace_ext;
+        trace_size = sizeof(trace_ext);
+    }
+
     int payload_size = channel_size + 1 + datalen;
-    if (payload_size <= LCM_SHORT_MESSAGE_MAX_SIZE) {
+    if (payload_size + trace_size <= LCM_SHORT_MESSAGE_MAX_SIZE) {
         // message is short.  send in a single packet
         lcm2_header_short_t hdr;
-        hdr.magic = htonl(LCM2_MAGIC_SHORT);
+        hdr.magic = htonl(trace ? LCM2_MAGIC_SHORT_TRACED : LCM2_MAGIC_SHORT);
         hdr.msg_seqno = htonl(lcm->msg_seqno);
 
-        struct iovec sendbufs[3];
-        sendbufs[0].iov_base = (char *) &hdr;
-        sendbufs[0].iov_len = sizeof (hdr);
-        sendbufs[1].iov_base = (char *) channel;
-        sendbufs[1].iov_len = channel_size + 1;
-        sendbufs[2].iov_base = (char *) data;
-        sendbufs[2].iov_len = datalen;
+        struct iovec sendbufs[4];
+        int nbufs = 0;
+        sendbufs[nbufs].iov_base = (char *) &hdr;
+        sendbufs[nbufs++].iov_len = sizeof (hdr);
+        if (trace) {
+            sendbufs[nbufs].iov_base = (char *) trace;
+            sendbufs[nbufs++].iov_len = trace_size;
+        }
+        sendbufs[nbufs].iov_base = (char *) channel;
+        sendbufs[nbufs++].iov_len = channel_size + 1;
+        sendbufs[nbufs].iov_base = (char *) data;
+        sendbufs[nbufs++].iov_len = datalen;
 
         // transmit
-        int packet_size = datalen + sizeof (hdr) + channel_size + 1;
+        int packet_size = datalen + sizeof (hdr) + trace_size +
+                channel_size + 1;
         struct msghdr msg;
         msg.msg_name = (struct sockaddr*) &lcm->dest_addr;
         msg.msg_namelen = sizeof(lcm->dest_addr);
         msg.msg_iov = sendbufs;
-        msg.msg_iovlen = 3;
+        msg.msg_iovlen = nbufs;
         msg.msg_control = NULL;
         msg.msg_controllen = 0;
         msg.msg_flags = 0;
@@ -1222,7 +1285,7 @@ publish_message_internal (lcm_mpudpm_t *lcm, const char *channel, const void *da
         else return status;
     } else {
         // message is large.  fragment into multiple packets
-        int fragment_size = LCM_FRAGMENT_MAX_PAYLOAD;
+        int fragment_size = lcm_fragment_max_payload(trace != NULL);
         int nfragments = payload_size / fragment_size +
                 !!(payload_size % fragment_size);
 
@@ -1231,71 +1294,11 @@ publish_message_internal (lcm_mpudpm_t *lcm, const char *channel, const void *da
             return -1;
         }
 
-        uint32_t fragment_offset = 0;
-
-        lcm2_header_long_t hdr;
-        hdr.magic = htonl (LCM2_MAGIC_LONG);
-        hdr.msg_seqno = htonl (lcm->msg_seqno);
-        hdr.msg_size = htonl (datalen);
-        hdr.fragment_offset = 0;
-        hdr.fragment_no = 0;
-        hdr.fragments_in_msg = htons (nfragments);
-
-        // first fragment is special.  insert channel before data
-        int firstfrag_datasize = fragment_size - (channel_size + 1);
-        assert (firstfrag_datasize <= datalen);
-
-        struct iovec    first_sendbufs[3];
-        first_sendbufs[0].iov_base = (char *) &hdr;
-        first_sendbufs[0].iov_len = sizeof (hdr);
-        first_sendbufs[1].iov_base = (char *) channel;
-        first_sendbufs[1].iov_len = channel_size + 1;
-        first_sendbufs[2].iov_base = (char *) data;
-        first_sendbufs[2].iov_len = firstfrag_datasize;
-
-        int packet_size = sizeof (hdr) + channel_size + 1 + firstfrag_datasize;
-        fragment_offset += firstfrag_datasize;
-        struct msghdr msg;
-        msg.msg_name = (struct sockaddr*) &lcm->dest_addr;
-        msg.msg_namelen = sizeof(lcm->dest_addr);
-        msg.msg_iov = first_sendbufs;
-        msg.msg_iovlen = 3;
-        msg.msg_control = NULL;
-        msg.msg_controllen = 0;
-        msg.msg_flags = 0;
-        int status = sendmsg(lcm->send_fd, &msg, 0);
-
-        // transmit the rest of the fragments
-        for (uint16_t frag_no=1; 
-                packet_size == status && frag_no<nfragments; 
-                frag_no++) {
-            hdr.fragment_offset = htonl (fragment_offset);
-            hdr.fragment_no = htons (frag_no);
-
-            int fraglen = MIN (fragment_size,
-                    datalen - fragment_offset);
-
-            struct iovec sendbufs[2];
-            sendbufs[0].iov_base = (char *) &hdr;
-            sendbufs[0].iov_len = sizeof (hdr);
-            sendbufs[1].iov_base = (char *) ((char *)data + fragment_offset);
-            sendbufs[1].iov_len = fraglen;
-
-            msg.msg_iov = sendbufs;
-            msg.msg_iovlen = 2;
-            status = sendmsg(lcm->send_fd, &msg, 0);
-
-            fragment_offset += fraglen;
-            packet_size = sizeof (hdr) + fraglen;
-        }
-
-        // sanity check
-        if (0 == status) {
-            assert (fragment_offset == datalen);
-        }
+        int status = lcm_udpm_send_fragments (lcm->send_fd, &lcm->dest_addr,
+                lcm->msg_seqno, channel, data, datalen, nfragments, trace);
 
         ++lcm->msg_seqno;
-        return 0;
+        return status;
     }
 }
 
@@ -1316,66 +1319,104 @@ lcm_mpudpm_publish(lcm_mpudpm_t *lcm, const char *channel,
     return status;
 }
 
-int
-lcm_mpudpm_handle (lcm_mpudpm_t *lcm)
+// Spin on the read thread's queue for up to usec microseconds, rather than
+// sleep.  Returns 1 if a message is ready.
+static int
+spin_until_ready (lcm_mpudpm_t *lcm, int64_t usec)
 {
-    int status;
-    char ch;
-    if(0 != setup_recv_parts (lcm)){
-        return -1;
+    int64_t deadline = lcm_timestamp_now () + usec;
+    while (lcm_buf_handoff_is_empty (lcm->handoff)) {
+        if (lcm_timestamp_now () >= deadline)
+            return 0;
+        lcm_cpu_relax ();
     }
+    return 1;
+}
 
-    /* Read one byte from the notify pipe.  This will block if no packets are
-     * available yet and wake up when they are. */
-    status = lcm_internal_pipe_read(lcm->notify_pipe[0], &ch, 1);
-    if (status == 0) {
-        fprintf (stderr, "Error: lcm_handle read 0 bytes from notify_pipe\n");
+static int
+lcm_mpudpm_wait_ready (lcm_mpudpm_t *lcm, int timeout_millis)
+{
+    if (setup_recv_parts (lcm) < 0)
+        return -1;
+    if (!lcm->params.busy_poll)
+        return lcm_notify_poll (&lcm->notify, timeout_millis);
+
+    return spin_until_ready (lcm, (int64_t) timeout_millis * 1000);
+}
+
+static int
+lcm_mpudpm_handle_batch (lcm_mpudpm_t *lcm, int max_msgs)
+{
+    if(0 != setup_recv_parts (lcm)){
         return -1;
     }
-    else if (status < 0) {
+
+    if (lcm->params.busy_poll &&
+            spin_until_ready (lcm, LCM_BUSY_POLL_SPIN_USEC)) {
+        /* Spin until a message is queued, or sleep as usual below if none
+         * comes for a while.  The read thread still posts the notification
+         * for anyone polling the file descriptor, so take it down if it is
+         * posted. */
+        if (g_atomic_int_get (&lcm->notify_pending) &&
+                lcm_notify_wait(&lcm->notify) < 0) {
+            fprintf (stderr, "Error: lcm_handle read: %s\n",
+                    strerror (errno));
+            return -1;
+        }
+    } else if (lcm_notify_wait(&lcm->notify) < 0) {
+        /* Wait for the notification.  This will block if no packets are
+         * available yet and wake up when they are. */
         fprintf (stderr, "Error: lcm_handle read: %s\n", strerror (errno));
         return -1;
     }
 
-    /* Dequeue the next received packet */
-    g_static_mutex_lock (&lcm->receive_lock);
-    lcm_buf_t * lcmb = lcm_buf_dequeue (lcm->inbufs_filled);
+    /* Clear the flag before looking for messages, so that any message
+     * queued from now on posts the notification again. */
+    g_atomic_int_set (&lcm->notify_pending, 0);
+
+    /* Handle up to max_msgs received messages */
+    int num_handled = 0;
+    lcm_buf_t * lcmb;
+    while (num_handled < max_msgs &&
+            (lcmb = lcm_buf_handoff_pop (lcm->handoff))) {
+        lcm_recv_buf_t rbuf;
+        rbuf.data = (uint8_t*) lcmb->buf + lcmb->data_offset;
+        rbuf.data_size = lcmb->data_size;
+        rbuf.recv_utime = lcmb->recv_utime;
+        rbuf.recv_utime_ns = lcmb->recv_utime_ns;
+        rbuf.lcm = lcm->lcm;
+        rbuf.send_utime = lcmb->send_utime;
+        rbuf.send_host_id = lcmb->send_host_id;
+
+        if(lcm->creating_read_thread) {
+            // special case:  If we're creating the read thread and are in
+            // self-test mode, then only dispatch the self-test message.
+            if(!strcmp(lcmb->channel_name, SELF_TEST_CHANNEL))
+                lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
+        } else {
+            lcm_dispatch_handlers_id (lcm->lcm, &rbuf, lcmb->channel_name,
+                    lcmb->channel_id);
+        }
 
-    if (!lcmb) {
-        fprintf (stderr, 
-                "Error: no packet available despite getting notification.\n");
-        g_static_mutex_unlock (&lcm->receive_lock);
-        return -1;
+        /* Hand the buffer back to the read thread for reuse */
+        lcm_buf_handoff_release (lcm->handoff, lcmb);
+        num_handled++;
     }
 
-    /* If there are still packets in the queue, put something back in the pipe
-     * so that future invocations will get called. */
-    if (!lcm_buf_queue_is_empty (lcm->inbufs_filled))
-        if (lcm_internal_pipe_write(lcm->notify_pipe[1], "+", 1) < 0)
+    /* If there are still messages queued, post the notification again so
+     * that future invocations will get called. */
+    if (!lcm_buf_handoff_is_empty (lcm->handoff) &&
+            g_atomic_int_compare_and_exchange (&lcm->notify_pending, 0, 1))
+        if (lcm_notify_post(&lcm->notify) < 0)
             perror ("write to notify");
-    g_static_mutex_unlock (&lcm->receive_lock);
-
-    lcm_recv_buf_t rbuf;
-    rbuf.data = (uint8_t*) lcmb->buf + lcmb->data_offset;
-    rbuf.data_size = lcmb->data_size;
-    rbuf.recv_utime = lcmb->recv_utime;
-    rbuf.lcm = lcm->lcm;
-
-    if(lcm->creating_read_thread) {
-        // special case:  If we're creating the read thread and are in
-        // self-test mode, then only dispatch the self-test message.
-        if(!strcmp(lcmb->channel_name, SELF_TEST_CHANNEL))
-            lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
-    } else {
-        lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
-    }
 
-    g_static_mutex_lock (&lcm->receive_lock);
-    lcm_buf_free_data(lcmb, lcm->ringbuf);
-    lcm_buf_enqueue (lcm->inbufs_empty, lcmb);
-    g_static_mutex_unlock (&lcm->receive_lock);
+    return num_handled;
+}
 
-    return 0;
+int
+lcm_mpudpm_handle (lcm_mpudpm_t *lcm)
+{
+    return lcm_mpudpm_handle_batch (lcm, 1) < 0 ? -1 : 0;
 }
 
 static void
@@ -1393,6 +1434,8 @@ mpudpm_self_test (lcm_mpudpm_t *lcm)
     // register a handler for the self test message
     lcm_subscription_t *h = lcm_subscribe (lcm->lcm, SELF_TEST_CHANNEL, 
             self_test_handler, &success);
+    // success lives on this stack frame, so never hand it to a worker thread
+    lcm_subscription_set_dispatch_mode (h, LCM_DISPATCH_INLINE);
 
     // transmit a message
     char *msg = "lcm self test";
@@ -1412,7 +1455,7 @@ mpudpm_self_test (lcm_mpudpm_t *lcm)
     GTimeVal next_retransmit;
     lcm_timeval_add (&now, &retransmit_interval, &next_retransmit);
 
-    int recvfd = lcm->notify_pipe[0];
+    int recvfd = lcm_notify_get_fileno(&lcm->notify);
 
     do {
         GTimeVal selectto;
@@ -1481,6 +1524,9 @@ add_recv_socket(lcm_mpudpm_t *lcm, uint16_t port){
         goto add_recv_socket_fail;
     }
 
+    if (lcm->params.busy_poll)
+        lcm_set_busy_poll (recv_fd);
+
 #ifdef USE_REUSEPORT
     /* Mac OS and FreeBSD require the REUSEPORT option in addition
      * to REUSEADDR or it won't let multiple processes bind to the
@@ -1528,8 +1574,13 @@ add_recv_socket(lcm_mpudpm_t *lcm, uint16_t port){
 
     /* Enable per-packet timestamping by the kernel, if available */
 #ifdef SO_TIMESTAMP
+    lcm_enable_recv_timestamps (recv_fd);
+#endif
+
+    /* Have the kernel report how many packets it has dropped, if available */
+#ifdef SO_RXQ_OVFL
     opt = 1;
-    setsockopt (recv_fd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof (opt));
+    setsockopt (recv_fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof (opt));
 #endif
 
     if (bind (recv_fd, (struct sockaddr*)&addr, sizeof (addr)) < 0) {
@@ -1631,19 +1682,10 @@ setup_recv_parts (lcm_mpudpm_t *lcm)
     dbg (DBG_LCM, "allocating resources for receiving messages\n");
 
     // allocate the fragment buffer hashtable
-    lcm->frag_bufs = lcm_frag_buf_store_new(MAX_FRAG_BUF_TOTAL_SIZE,
-            MAX_NUM_FRAG_BUFS);
-
-    lcm->inbufs_empty = lcm_buf_queue_new ();
-    lcm->inbufs_filled = lcm_buf_queue_new ();
-    lcm->ringbuf = lcm_ringbuf_new (LCM_RINGBUF_SIZE);
+    lcm->frag_bufs = lcm_frag_buf_store_new(
+            lcm->params.mem.max_frag_buf_total_size, MAX_NUM_FRAG_BUFS);
 
-    for (int i = 0; i < LCM_DEFAULT_RECV_BUFS; i++) {
-        /* We don't set the receive buffer's data pointer yet because it
-         * will be taken from the ringbuffer at receive time. */
-        lcm_buf_t * lcmb = (lcm_buf_t *) calloc (1, sizeof (lcm_buf_t));
-        lcm_buf_enqueue (lcm->inbufs_empty, lcmb);
-    }
+    lcm->handoff = lcm_buf_handoff_new (&lcm->params.mem);
 
     // setup a pipe for notifying the reader thread when to quit
     if(0 != lcm_internal_pipe_create(lcm->thread_msg_pipe)) {
@@ -1677,13 +1719,21 @@ setup_recv_parts (lcm_mpudpm_t *lcm)
 
     g_static_mutex_unlock(&lcm->receive_lock);
 
-    // conduct a self-test just to make sure everything is working.
-    dbg (DBG_LCM, "LCM: conducting self test\n");
-    int self_test_results = mpudpm_self_test(lcm);
+    // conduct a self-test just to make sure everything is working, unless
+    // one already passed on this multicast group earlier in the process
+    int self_test_results = 0;
+    int passed_before = lcm_self_test_passed("mpudpm", lcm->params.mc_addr,
+            htons(lcm->params.mc_port_range_start), lcm->params.mc_ttl);
+    if (!passed_before) {
+        dbg (DBG_LCM, "LCM: conducting self test\n");
+        self_test_results = mpudpm_self_test(lcm);
+    }
     g_static_mutex_lock(&lcm->receive_lock);
 
     if (0 == self_test_results) {
         dbg (DBG_LCM, "LCM: self test successful\n");
+        lcm_self_test_set_passed("mpudpm", lcm->params.mc_addr,
+                htons(lcm->params.mc_port_range_start), lcm->params.mc_ttl);
     } else {
         // self test failed.  destroy the read thread
         fprintf (stderr, "LCM self test failed!!\n"
@@ -1703,6 +1753,7 @@ setup_recv_parts (lcm_mpudpm_t *lcm)
     lcm->recv_thread_created_tx = 1;
     g_static_mutex_unlock(&lcm->transmit_lock);
 
+    lcm_report_self_test(lcm->lcm, self_test_results);
     return self_test_results;
 
     setup_recv_thread_fail:
@@ -1718,6 +1769,7 @@ lcm_mpudpm_create (lcm_t * parent, const char *network, const GHashTable *args)
     mpudpm_params_t params;
     memset (&params, 0, sizeof (mpudpm_params_t));
     params.num_mc_ports = 500;
+    lcm_recv_mem_params_init (&params.mem);
 
     g_hash_table_foreach ((GHashTable*) args, new_argument, &params);
 
@@ -1732,7 +1784,6 @@ lcm_mpudpm_create (lcm_t * parent, const char *network, const GHashTable *args)
     lcm->recv_sockets = NULL;
     lcm->send_fd = -1;
     lcm->thread_msg_pipe[0] = lcm->thread_msg_pipe[1] = -1;
-    lcm->udp_low_watermark = 1.0;
 
     lcm->kernel_rbuf_sz = 0;
     lcm->warned_about_small_kernel_buf = 0;
@@ -1744,13 +1795,12 @@ lcm_mpudpm_create (lcm_t * parent, const char *network, const GHashTable *args)
     lcm->create_read_thread_mutex = NULL;
     lcm->create_read_thread_cond = NULL;
 
-    // internal notification pipe
-    if(0 != lcm_internal_pipe_create(lcm->notify_pipe)) {
-        perror(__FILE__ " pipe(create)");
+    // internal notification
+    if(0 != lcm_notify_init(&lcm->notify)) {
+        perror(__FILE__ " notify(create)");
         lcm_mpudpm_destroy (lcm);
         return NULL;
     }
-    fcntl (lcm->notify_pipe[1], F_SETFL, O_NONBLOCK);
 
     g_static_mutex_init (&lcm->receive_lock);
     g_static_mutex_init (&lcm->transmit_lock);
@@ -1879,6 +1929,26 @@ lcm_mpudpm_create (lcm_t * parent, const char *network, const GHashTable *args)
     return lcm;
 }
 
+static int
+lcm_mpudpm_get_transport_stats (lcm_mpudpm_t *lcm,
+        lcm_transport_stats_t *stats)
+{
+    g_static_mutex_lock (&lcm->receive_lock);
+    stats->packets_received = lcm->udp_rx;
+    stats->packets_bad = lcm->udp_discarded_bad;
+    stats->kernel_drops = lcm->kernel_drops;
+    if (lcm->handoff)
+        stats->ringbuf_exhausted = lcm->handoff->num_ringbuf_exhausted;
+    if (lcm->frag_bufs) {
+        stats->reassembly_incomplete = lcm->frag_bufs->num_incomplete;
+        stats->reassembly_timeouts = lcm->frag_bufs->num_timed_out;
+        stats->reassembly_evictions = lcm->frag_bufs->num_evicted;
+        stats->duplicate_fragments = lcm->frag_bufs->num_duplicates;
+    }
+    g_static_mutex_unlock (&lcm->receive_lock);
+    return 0;
+}
+
 #ifdef WIN32
 static lcm_provider_vtable_t mpudpm_vtable;
 #else
@@ -1889,7 +1959,10 @@ static lcm_provider_vtable_t mpudpm_vtable = {
     .unsubscribe = lcm_mpudpm_unsubscribe,
     .publish     = lcm_mpudpm_publish,
     .handle      = lcm_mpudpm_handle,
-    .get_fileno  = lcm_mpudpm_get_fileno
+    .get_fileno  = lcm_mpudpm_get_fileno,
+    .handle_batch = lcm_mpudpm_handle_batch,
+    .get_transport_stats = lcm_mpudpm_get_transport_stats,
+    .wait_ready  = lcm_mpudpm_wait_ready,
 };
 #endif
 static lcm_provider_info_t mpudpm_info;
@@ -1907,6 +1980,9 @@ lcm_mpudpm_provider_init (GPtrArray * providers)
     mpudpm_vtable.publish     = lcm_mpudpm_publish;
     mpudpm_vtable.handle      = lcm_mpudpm_handle;
     mpudpm_vtable.get_fileno  = lcm_mpudpm_get_fileno;
+    mpudpm_vtable.handle_batch = lcm_mpudpm_handle_batch;
+    mpudpm_vtable.get_transport_stats = lcm_mpudpm_get_transport_stats;
+    mpudpm_vtable.wait_ready  = lcm_mpudpm_wait_ready;
 #endif
     mpudpm_info.name = "mpudpm";
     mpudpm_info.vtable = &mpudpm_vtable;
@@ -380,6 +380,9 @@ lcm_tcpq_handle(lcm_tcpq_t * self)
     rbuf.data_size = data_len;
     rbuf.recv_utime = timestamp_now();
     rbuf.lcm = self->lcm;
+    rbuf.send_utime = 0;
+    rbuf.send_host_id = 0;
+    rbuf.recv_utime_ns = rbuf.recv_utime * 1000;
 
     if(lcm_try_enqueue_message(self->lcm, self->recv_channel_buf))
         lcm_dispatch_handlers(self->lcm, &rbuf, self->recv_channel_buf);
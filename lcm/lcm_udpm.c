@@ -1,6 +1,11 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // for recvmmsg
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -18,6 +23,12 @@
 #include <sys/select.h>
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+#endif
+
 #ifdef SO_TIMESTAMP
 #define MSG_EXT_HDR
 #endif
@@ -40,6 +51,69 @@
 
 
 #define SELF_TEST_CHANNEL "LCM_SELF_TEST"
+#define SELF_TEST_TIMEOUT_USEC 10000000
+#define SELF_TEST_RETRANSMIT_USEC 100000
+
+// values of the self_test option
+#define UDPM_SELF_TEST_OFF 0
+#define UDPM_SELF_TEST_SYNC 1       // before the first receive call returns
+#define UDPM_SELF_TEST_ASYNC 2      // in the background
+
+/* With the advertise option, each process announces the channel patterns it
+ * subscribes to on this channel, and only publishes the channels that some
+ * process subscribes to.  The payload is the patterns, each terminated by a
+ * NUL. */
+#define ADVERTISE_CHANNEL "#!udpm_SUBSCRIPTIONS"
+#define ADVERTISE_INTERVAL_USEC 1000000
+// forget the subscriptions of a process that stopped advertising them
+#define ADVERTISE_TIMEOUT_USEC 3500000
+
+/* With the reliable option, the publisher keeps the fragmented messages it
+ * sends on matching channels for a while, and announces each one on
+ * RELIABLE_CHANNEL after its last fragment, and a few times more in case the
+ * announcement is lost.  The payload is a udpm_reliable_announce_t followed
+ * by the channel name and its NUL.  A receiver that is missing some of the
+ * message's fragments asks for them on NACK_CHANNEL, with a udpm_nack_t
+ * followed by the missing fragment numbers, and the publisher sends them
+ * again.  Both carry the publisher's random ID, since the address that
+ * receivers see the messages come from isn't known to the publisher.
+ * Neither channel's messages are passed to subscribers. */
+#define RELIABLE_CHANNEL "#!udpm_RELIABLE"
+#define NACK_CHANNEL "#!udpm_NACK"
+#define UDPM_DEFAULT_RELIABLE_MB 16
+// times a message is sent again, after which its NACKs are ignored
+#define UDPM_MAX_RETRANSMITS 16
+// ignore NACKs for a fragment this soon after sending it again, since
+// other receivers are likely to be asking for the same one
+#define UDPM_RETRANSMIT_HOLDOFF_USEC 10000
+// a NACK for more fragments asks for all of them, with num_fragments 0
+#define UDPM_MAX_NACK_FRAGMENTS 512
+// how long each receive thread remembers the messages it reassembled, so
+// that their later announcements and retransmitted fragments are ignored
+#define UDPM_RELIABLE_DONE_USEC 2000000
+// announcements of older messages don't start reassembling them, so that a
+// message is still remembered whenever it is announced again.  Longer than
+// the UDPM_REANNOUNCE_TIMES announcements take, and shorter than
+// UDPM_RELIABLE_DONE_USEC by more than the network delay.
+#define UDPM_ANNOUNCE_MAX_AGE_USEC 1000000
+// times a message is announced again after it is sent, first after
+// UDPM_REANNOUNCE_USEC and then twice as long after each time
+#define UDPM_REANNOUNCE_TIMES 4
+#define UDPM_REANNOUNCE_USEC 50000
+
+/* The receive thread reads up to UDPM_RECV_BATCH packets at a time, with a
+ * single recvmmsg () call on Linux, or with non-blocking recvmsg () calls
+ * elsewhere.  The packets of a batch are queued for lcm_handle () together. */
+#ifdef __linux__
+#define USE_RECVMMSG
+#endif
+#ifdef MSG_DONTWAIT
+#define UDPM_RECV_BATCH 32
+#else
+#define UDPM_RECV_BATCH 1
+#endif
+
+#define UDPM_RECV_PACKET_SIZE 65536
 
 /**
  * udpm_params_t:
@@ -51,6 +125,31 @@
  *                  don't use > 1.  that's just rude. 
  * @recv_buf_size:  requested size of the kernel receive buffer, set with
  *                  SO_RCVBUF.  0 indicates to use the default settings.
+ * @recv_threads:   number of receive threads.  Each thread has its own socket,
+ *                  which only accepts packets from a share of the senders.
+ * @channel_filter: if nonzero, the receive sockets drop packets on channels
+ *                  with no subscribers before they leave the kernel.  Lost
+ *                  messages can't be counted then.
+ * @mem:            memory set aside by each receive thread for incoming
+ *                  messages.
+ * @coalesce_us:    if nonzero, short messages are held for up to this many
+ *                  microseconds, and sent together in one packet.
+ * @coalesce_bytes: largest packet of coalesced messages.
+ * @advertise:      if nonzero, advertise the channels subscribed to, and
+ *                  don't send messages on channels that no process using
+ *                  this option subscribes to.  Every process on the
+ *                  multicast group must use it.
+ * @busy_poll:      if nonzero, the receive threads and lcm_handle () spin
+ *                  instead of sleeping until packets and messages arrive.
+ *                  Each uses a whole CPU.
+ * @self_test:      when to test that published messages are received, one
+ *                  of UDPM_SELF_TEST_*.
+ * @trace:          if nonzero, published messages carry the time they were
+ *                  published and the host they were published on.
+ *                  Receivers older than the trace extension drop them.
+ * @reliable:       channel pattern whose fragmented messages are sent again
+ *                  when receivers miss some of their fragments, or NULL.
+ * @reliable_mb:    megabytes of recent messages kept to send again.
  *
  */
 typedef struct _udpm_params_t udpm_params_t;
@@ -59,11 +158,121 @@ struct _udpm_params_t {
     uint16_t mc_port;
     uint8_t mc_ttl; 
     int recv_buf_size;
+    int recv_threads;
+    int channel_filter;
+    lcm_recv_mem_params_t mem;
+    int coalesce_us;
+    int coalesce_bytes;
+    int advertise;
+    int busy_poll;
+    int self_test;
+    int trace;
+    char *reliable;
+    int reliable_mb;
 };
 
+/* small enough to send without IP fragmentation on Ethernet */
+#define UDPM_DEFAULT_COALESCE_BYTES 1400
+#define UDPM_MAX_COALESCE_BYTES \
+    (LCM_SHORT_MESSAGE_MAX_SIZE + sizeof (lcm2_header_short_t))
+
 typedef struct _lcm_provider_t lcm_udpm_t;
-struct _lcm_provider_t {
+
+/* A receive thread, and the state that only it uses. */
+typedef struct _udpm_recv_thread_t udpm_recv_thread_t;
+struct _udpm_recv_thread_t {
+    lcm_udpm_t *lcm;
+    int index;
+
     SOCKET recvfd;
+    GThread *thread;
+
+    /* Messages received by this thread are passed to lcm_handle () here, and
+     * passed back once they are handled.  Memory for them is taken from a
+     * ringbuffer that only this thread uses, so we don't have to do any
+     * mallocs or take any locks. */
+    lcm_buf_handoff_t * handoff;
+
+    /* fragments of partially received messages.  Each sender's packets are
+     * read by only one thread, so it reassembles all of its messages. */
+    lcm_frag_buf_store * frag_bufs;
+
+    /* message sequence numbers of the senders this thread reads from */
+    lcm_seqno_tracker_t * seqnos;
+
+    uint64_t     udp_rx;            // packets received
+    uint64_t     udp_discarded_bad; // packets discarded because they were bad 
+                                    // somehow
+    uint32_t     kernel_drops;      // packets dropped by the kernel so far
+
+    /* messages reassembled in the last UDPM_RELIABLE_DONE_USEC.  Every
+     * fragmented message is noted, since its announcement, if any, comes
+     * after its last fragment. */
+    lcm_frag_done_set_t * reliable_done;
+};
+
+/* A channel pattern subscribed to by some process */
+typedef struct _udpm_pattern_t udpm_pattern_t;
+struct _udpm_pattern_t {
+    char *channel;
+    lcm_subscription_kind_t kind;
+    int prefix_len;
+    GRegex *regex;
+};
+
+/* The subscriptions last advertised by another process */
+typedef struct _udpm_advert_t udpm_advert_t;
+struct _udpm_advert_t {
+    char *payload;              // as received, to tell when it changes
+    int payload_size;
+    GPtrArray *patterns;        // udpm_pattern_t
+    int64_t expire_utime;
+};
+
+/* The announcement of a message on RELIABLE_CHANNEL, in network byte
+ * order */
+typedef struct _udpm_reliable_announce_t udpm_reliable_announce_t;
+struct _udpm_reliable_announce_t {
+    uint32_t publisher_id;
+    uint32_t msg_seqno;
+    uint32_t msg_size;
+    uint32_t age_usec;          // since the message was sent
+    uint16_t nfragments;
+    uint16_t reserved;
+};
+
+/* A request on NACK_CHANNEL for the fragments of a message, in network byte
+ * order */
+typedef struct _udpm_nack_t udpm_nack_t;
+struct _udpm_nack_t {
+    uint32_t publisher_id;      // as announced with the message
+    uint32_t msg_seqno;
+    uint16_t num_fragments;     // 0 for all of them
+    uint16_t reserved;
+};
+
+/* A message kept by the publisher to send again */
+typedef struct _udpm_sent_msg_t udpm_sent_msg_t;
+struct _udpm_sent_msg_t {
+    uint32_t msg_seqno;
+    char *channel;
+    char *data;
+    unsigned int datalen;
+    int nfragments;
+    lcm2_trace_ext_t trace;
+    int traced;
+    int num_retransmits;
+    int64_t retransmit_utime;   // when it was last sent again
+    uint8_t *resent;            // one bit per fragment sent again since then
+    int64_t sent_utime;
+    int num_reannounced;
+    int64_t reannounce_utime;   // when to announce it again
+};
+
+#define CHANNEL_WANTED GINT_TO_POINTER (1)
+#define CHANNEL_UNWANTED GINT_TO_POINTER (2)
+
+struct _lcm_provider_t {
     SOCKET sendfd;
     struct sockaddr_in dest_addr;
 
@@ -75,26 +284,64 @@ struct _lcm_provider_t {
     int kernel_rbuf_sz;
     int warned_about_small_kernel_buf;
 
-    /* Packet structures available for sending or receiving use are
-     * stored in the *_empty queues. */
-    lcm_buf_queue_t * inbufs_empty;
-    /* Received packets that are filled with data are queued here. */
-    lcm_buf_queue_t * inbufs_filled;
-
-    /* Memory for received small packets is taken from a fixed-size ring buffer
-     * so we don't have to do any mallocs */
-    lcm_ringbuf_t * ringbuf;
-
-    GStaticRecMutex mutex; /* Must be locked when reading/writing to the
-                              above three queues */
+    GStaticRecMutex mutex; /* Must be locked when setting up or tearing
+                              down the receive threads */
 
     int thread_created;
-    GThread *read_thread;
-    int notify_pipe[2];         // pipe to notify application when messages arrive
+    int num_recv_threads;
+    udpm_recv_thread_t *recv_threads;
+    int next_recv_thread;       // the next one lcm_handle () takes from
+    lcm_notify_t notify;        // to notify application when messages arrive
+    int notify_pending;         // set while the notification is posted
     int thread_msg_pipe[2];     // pipe to notify read thread when to quit
+    int recv_quit;              // tells busy polling read threads to quit
 
     GStaticMutex transmit_lock; // so that only thread at a time can transmit
 
+    /* Short messages waiting to be sent together, if coalesce_us is set.
+     * Guarded by transmit_lock. */
+    char *coalesce_buf;
+    int coalesce_len;           // 0 if no messages are waiting
+    int64_t coalesce_deadline;  // when the waiting messages must be sent
+
+    /* Subscriptions advertised by this and other processes, if advertise is
+     * set.  Guarded by transmit_lock. */
+    GPtrArray *local_patterns;  // udpm_pattern_t, subscribed to here
+    GHashTable *remote_subs;    // sender address -> udpm_advert_t
+    GHashTable *wanted_channels;    // channel -> CHANNEL_(UN)WANTED, cached
+    int64_t next_advert_utime;  // when to advertise the subscriptions again
+    int64_t advert_ready_utime; // when other processes have advertised
+    int advert_ready;
+    int local_patterns_gen;     // subscriptions_gen of local_patterns
+
+    GThread *send_thread;       // sends packets that are due later
+    GCond *send_cond;           // wakes send_thread
+    int send_quit;
+
+    /* The self-test run in the background with self_test=async.  Guarded by
+     * transmit_lock, except that the receive threads read
+     * self_test_pending atomically first. */
+    GThread *self_test_thread;
+    GCond *self_test_cond;      // wakes self_test_thread
+    int self_test_pending;      // until the self-test packet comes back
+    int self_test_received;
+    int self_test_quit;
+    uint32_t self_test_nonce[2];    // the payload of the self-test packets
+
+    /* Recent messages on the reliable channels, oldest first, if reliable is
+     * set.  Guarded by transmit_lock. */
+    GPtrArray *reliable_patterns;   // udpm_pattern_t
+    GQueue *sent_msgs;          // udpm_sent_msg_t
+    GHashTable *sent_by_seqno;  // msg_seqno -> udpm_sent_msg_t
+    int64_t sent_bytes;         // kept in sent_msgs
+    uint32_t publisher_id;      // identifies our messages in the NACKs
+
+    /* Channel patterns subscribed to, and how many times each.  Guarded by
+     * mutex.  The receive sockets' filter is built from these. */
+    GHashTable *subscriptions;
+    int subscriptions_gen;      // incremented when they are advertised
+    int channel_filtered;       // set while the filter drops some channels
+
     /* synchronization variables used only while allocating receive resources
      */
     int creating_read_thread;
@@ -102,36 +349,171 @@ struct _lcm_provider_t {
     GMutex* create_read_thread_mutex;
 
 
-    /* other variables */
-    lcm_frag_buf_store * frag_bufs;
+    uint32_t     msg_seqno; // rolling counter of how many messages transmitted
+};
 
-    uint32_t     udp_rx;            // packets received and processed
-    uint32_t     udp_discarded_bad; // packets discarded because they were bad 
-                                    // somehow
-    double       udp_low_watermark; // least buffer available
-    int32_t      udp_last_report_secs;
+#ifdef USE_RECVMMSG
+typedef struct mmsghdr udpm_mmsghdr_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} udpm_mmsghdr_t;
+#endif
 
-    uint32_t     msg_seqno; // rolling counter of how many messages transmitted
+/* Packets read by the receive thread that have yet to be queued. */
+typedef struct _udpm_recv_batch_t udpm_recv_batch_t;
+struct _udpm_recv_batch_t {
+    /* UDPM_RECV_BATCH packets of UDPM_RECV_PACKET_SIZE bytes.  Complete short
+     * messages are copied from here into the ringbuffer once they are
+     * queued, so the ringbuffer only holds as much space as they need. */
+    char *data;
+
+    /* The lcm_buf_t for each packet, taken from the receive thread's empty
+     * buffers ahead of time. */
+    lcm_buf_t *bufs[UDPM_RECV_BATCH];
+    int complete[UDPM_RECV_BATCH];
+
+    /* When the batch was read, for the packets the kernel didn't
+     * timestamp. */
+    int64_t read_ns;
+
+    struct iovec vecs[UDPM_RECV_BATCH];
+    udpm_mmsghdr_t msgs[UDPM_RECV_BATCH];
+#ifdef MSG_EXT_HDR
+    char controlbufs[UDPM_RECV_BATCH][LCM_RECV_CONTROL_SIZE];
+#endif
 };
 
 static int _setup_recv_parts (lcm_udpm_t *lcm);
+static void _remove_subscription (lcm_udpm_t *lcm, const char *channel);
+static void _update_recv_filters (lcm_udpm_t *lcm);
+static void _stop_self_test (lcm_udpm_t *lcm);
+static int _send_short_packet (lcm_udpm_t *lcm, const char *channel,
+        const void *data, int datalen);
 
 static GStaticPrivate CREATE_READ_THREAD_PKEY = G_STATIC_PRIVATE_INIT;
 
+static udpm_pattern_t *
+_pattern_new (const char *channel)
+{
+    udpm_pattern_t *pat = (udpm_pattern_t *) calloc (1,
+            sizeof (udpm_pattern_t));
+    pat->channel = strdup (channel);
+    pat->kind = lcm_classify_subscription (channel, &pat->prefix_len);
+    if (pat->kind == LCM_SUBSCRIPTION_REGEX) {
+        char *regexbuf = g_strdup_printf ("^%s$", channel);
+        pat->regex = g_regex_new (regexbuf, (GRegexCompileFlags) 0,
+                (GRegexMatchFlags) 0, NULL);
+        g_free (regexbuf);
+    }
+    return pat;
+}
+
+static void
+_patterns_free (GPtrArray *patterns)
+{
+    if (!patterns)
+        return;
+    for (guint i = 0; i < patterns->len; i++) {
+        udpm_pattern_t *pat = (udpm_pattern_t *) g_ptr_array_index (patterns,
+                i);
+        if (pat->regex)
+            g_regex_unref (pat->regex);
+        free (pat->channel);
+        free (pat);
+    }
+    g_ptr_array_free (patterns, TRUE);
+}
+
+static int
+_patterns_match (GPtrArray *patterns, const char *channel)
+{
+    for (guint i = 0; i < patterns->len; i++) {
+        udpm_pattern_t *pat = (udpm_pattern_t *) g_ptr_array_index (patterns,
+                i);
+        switch (pat->kind) {
+            case LCM_SUBSCRIPTION_LITERAL:
+                if (!strcmp (pat->channel, channel))
+                    return 1;
+                break;
+            case LCM_SUBSCRIPTION_PREFIX:
+                if (!strncmp (pat->channel, channel, pat->prefix_len))
+                    return 1;
+                break;
+            default:
+                // assume that a pattern we can't compile matches
+                if (!pat->regex || g_regex_match (pat->regex, channel,
+                            (GRegexMatchFlags) 0, NULL))
+                    return 1;
+                break;
+        }
+    }
+    return 0;
+}
+
+static void
+_advert_free (gpointer data)
+{
+    udpm_advert_t *advert = (udpm_advert_t *) data;
+    _patterns_free (advert->patterns);
+    free (advert->payload);
+    free (advert);
+}
+
+static void
+_sent_msg_free (gpointer data)
+{
+    udpm_sent_msg_t *msg = (udpm_sent_msg_t *) data;
+    free (msg->channel);
+    free (msg->data);
+    free (msg->resent);
+    free (msg);
+}
+
+/* Announce a message kept to send again on RELIABLE_CHANNEL.  transmit_lock
+ * must be held. */
+static void
+_send_announcement (lcm_udpm_t *lcm, const udpm_sent_msg_t *msg)
+{
+    udpm_reliable_announce_t ann;
+    ann.publisher_id = htonl (lcm->publisher_id);
+    ann.msg_seqno = htonl (msg->msg_seqno);
+    ann.msg_size = htonl (msg->datalen);
+    int64_t age_usec = lcm_timestamp_now () - msg->sent_utime;
+    ann.age_usec = htonl (age_usec < 0 ? 0 :
+            (uint32_t) MIN (age_usec, (int64_t) UINT32_MAX));
+    ann.nfragments = htons (msg->nfragments);
+    ann.reserved = 0;
+
+    char payload[sizeof (ann) + LCM_MAX_CHANNEL_NAME_LENGTH + 1];
+    int channel_size = strlen (msg->channel) + 1;
+    memcpy (payload, &ann, sizeof (ann));
+    memcpy (payload + sizeof (ann), msg->channel, channel_size);
+    if (_send_short_packet (lcm, RELIABLE_CHANNEL, payload,
+                sizeof (ann) + channel_size) < 0)
+        perror ("LCM: announcing a reliable message");
+}
+
 static void
 _destroy_recv_parts (lcm_udpm_t *lcm)
 {
     if (lcm->thread_created) {
-        // send the read thread an exit command
+        // send the read threads an exit command.  None of them read from the
+        // pipe, so one byte wakes them all up.
+        g_atomic_int_set (&lcm->recv_quit, 1);
         int wstatus = lcm_internal_pipe_write(lcm->thread_msg_pipe[1], "\0", 1);
         if(wstatus < 0) {
             perror(__FILE__ " write(destroy)");
         } else {
-            g_thread_join (lcm->read_thread);
+            for (int i = 0; i < lcm->num_recv_threads; i++)
+                if (lcm->recv_threads[i].thread)
+                    g_thread_join (lcm->recv_threads[i].thread);
         }
-        lcm->read_thread = NULL;
         lcm->thread_created = 0;
+        g_atomic_int_set (&lcm->recv_quit, 0);
     }
+    g_atomic_int_set (&lcm->self_test_pending, 0);
 
     if (lcm->thread_msg_pipe[0] >= 0) {
         lcm_internal_pipe_close(lcm->thread_msg_pipe[0]);
@@ -139,27 +521,26 @@ _destroy_recv_parts (lcm_udpm_t *lcm)
         lcm->thread_msg_pipe[0] = lcm->thread_msg_pipe[1] = -1;
     }
 
-    if (lcm->recvfd >= 0) {
-        lcm_close_socket(lcm->recvfd);
-        lcm->recvfd = -1;
-    }
-
-    if (lcm->frag_bufs) {
-        lcm_frag_buf_store_destroy(lcm->frag_bufs);
-        lcm->frag_bufs = NULL;
-    }
-
-    if (lcm->inbufs_empty) {
-        lcm_buf_queue_free (lcm->inbufs_empty, lcm->ringbuf);
-        lcm->inbufs_empty = NULL;
-    }
-    if (lcm->inbufs_filled) {
-        lcm_buf_queue_free (lcm->inbufs_filled, lcm->ringbuf);
-        lcm->inbufs_filled = NULL;
-    }
-    if (lcm->ringbuf) {
-        lcm_ringbuf_free (lcm->ringbuf);
-        lcm->ringbuf = NULL;
+    if (lcm->recv_threads) {
+        for (int i = 0; i < lcm->num_recv_threads; i++) {
+            udpm_recv_thread_t *rt = &lcm->recv_threads[i];
+            if (rt->recvfd >= 0)
+                lcm_close_socket(rt->recvfd);
+            // the handoff may hold reassembled messages from the
+            // fragment buffer store's pool, so free it first
+            if (rt->handoff)
+                lcm_buf_handoff_free(rt->handoff);
+            if (rt->frag_bufs)
+                lcm_frag_buf_store_destroy(rt->frag_bufs);
+            if (rt->seqnos)
+                lcm_seqno_tracker_destroy(rt->seqnos);
+            if (rt->reliable_done)
+                lcm_frag_done_set_destroy(rt->reliable_done);
+        }
+        free (lcm->recv_threads);
+        lcm->recv_threads = NULL;
+        lcm->num_recv_threads = 0;
+        lcm->next_recv_thread = 0;
     }
 }
 
@@ -167,20 +548,48 @@ void
 lcm_udpm_destroy (lcm_udpm_t *lcm) 
 {
     dbg (DBG_LCM, "closing lcm context\n");
+    _stop_self_test (lcm);
     _destroy_recv_parts (lcm);
 
+    if (lcm->send_thread) {
+        // send the packets that are still due, and stop the thread
+        g_static_mutex_lock (&lcm->transmit_lock);
+        lcm->coalesce_deadline = 0;
+        lcm->send_quit = 1;
+        g_cond_signal (lcm->send_cond);
+        g_static_mutex_unlock (&lcm->transmit_lock);
+        g_thread_join (lcm->send_thread);
+        g_cond_free (lcm->send_cond);
+    }
+    free (lcm->coalesce_buf);
+    _patterns_free (lcm->local_patterns);
+    if (lcm->remote_subs) {
+        g_hash_table_destroy (lcm->remote_subs);
+        g_hash_table_destroy (lcm->wanted_channels);
+    }
+    _patterns_free (lcm->reliable_patterns);
+    if (lcm->sent_msgs) {
+        while (!g_queue_is_empty (lcm->sent_msgs))
+            _sent_msg_free (g_queue_pop_head (lcm->sent_msgs));
+        g_queue_free (lcm->sent_msgs);
+        g_hash_table_destroy (lcm->sent_by_seqno);
+    }
+    free (lcm->params.reliable);
+
     if (lcm->sendfd >= 0)
         lcm_close_socket(lcm->sendfd);
 
-    lcm_internal_pipe_close(lcm->notify_pipe[0]);
-    lcm_internal_pipe_close(lcm->notify_pipe[1]);
+    lcm_notify_close(&lcm->notify);
 
     g_static_rec_mutex_free (&lcm->mutex);
     g_static_mutex_free (&lcm->transmit_lock);
+    g_hash_table_destroy (lcm->subscriptions);
     if(lcm->create_read_thread_mutex) {
         g_mutex_free(lcm->create_read_thread_mutex);
         g_cond_free(lcm->create_read_thread_cond);
     }
+    if (lcm->self_test_cond)
+        g_cond_free (lcm->self_test_cond);
     free (lcm);
 }
 
@@ -216,6 +625,8 @@ static void
 new_argument (gpointer key, gpointer value, gpointer user)
 {
     udpm_params_t * params = (udpm_params_t *) user;
+    if (lcm_recv_mem_parse_arg (&params->mem, (char *) key, (char *) value))
+        return;
     if (!strcmp ((char *) key, "recv_buf_size")) {
         char *endptr = NULL;
         params->recv_buf_size = strtol ((char *) value, &endptr, 0);
@@ -228,6 +639,83 @@ new_argument (gpointer key, gpointer value, gpointer user)
         if (endptr == value)
             fprintf (stderr, "Warning: Invalid value for ttl\n");
     }
+    else if (!strcmp ((char *) key, "recv_threads")) {
+        char *endptr = NULL;
+        params->recv_threads = strtol ((char *) value, &endptr, 0);
+        if (endptr == value || params->recv_threads < 1) {
+            fprintf (stderr, "Warning: Invalid value for recv_threads\n");
+            params->recv_threads = 1;
+        }
+    }
+    else if (!strcmp ((char *) key, "channel_filter")) {
+        char *endptr = NULL;
+        params->channel_filter = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for channel_filter\n");
+    }
+    else if (!strcmp ((char *) key, "coalesce_us")) {
+        char *endptr = NULL;
+        params->coalesce_us = strtol ((char *) value, &endptr, 0);
+        if (endptr == value || params->coalesce_us < 0) {
+            fprintf (stderr, "Warning: Invalid value for coalesce_us\n");
+            params->coalesce_us = 0;
+        }
+    }
+    else if (!strcmp ((char *) key, "coalesce_bytes")) {
+        char *endptr = NULL;
+        int size = strtol ((char *) value, &endptr, 0);
+        if (endptr == value || size < 64 || size > UDPM_MAX_COALESCE_BYTES)
+            fprintf (stderr, "Warning: Invalid value for coalesce_bytes\n");
+        else
+            params->coalesce_bytes = size;
+    }
+    else if (!strcmp ((char *) key, "advertise")) {
+        char *endptr = NULL;
+        params->advertise = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for advertise\n");
+    }
+    else if (!strcmp ((char *) key, "busy_poll")) {
+        char *endptr = NULL;
+        params->busy_poll = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for busy_poll\n");
+    }
+    else if (!strcmp ((char *) key, "trace")) {
+        char *endptr = NULL;
+        params->trace = strtol ((char *) value, &endptr, 0);
+        if (endptr == value)
+            fprintf (stderr, "Warning: Invalid value for trace\n");
+    }
+    else if (!strcmp ((char *) key, "reliable")) {
+        if (!*(char *) value ||
+                strlen ((char *) value) > LCM_MAX_CHANNEL_NAME_LENGTH) {
+            fprintf (stderr, "Warning: Invalid value for reliable\n");
+        } else {
+            free (params->reliable);
+            params->reliable = strdup ((char *) value);
+        }
+    }
+    else if (!strcmp ((char *) key, "reliable_mb")) {
+        char *endptr = NULL;
+        int mb = strtol ((char *) value, &endptr, 0);
+        if (endptr == value || mb < 1)
+            fprintf (stderr, "Warning: Invalid value for reliable_mb\n");
+        else
+            params->reliable_mb = mb;
+    }
+    else if (!strcmp ((char *) key, "self_test")) {
+        char *endptr = NULL;
+        if (!strcmp ((char *) value, "async")) {
+            params->self_test = UDPM_SELF_TEST_ASYNC;
+        } else if (strtol ((char *) value, &endptr, 0)) {
+            params->self_test = UDPM_SELF_TEST_SYNC;
+        } else if (endptr == value) {
+            fprintf (stderr, "Warning: Invalid value for self_test\n");
+        } else {
+            params->self_test = UDPM_SELF_TEST_OFF;
+        }
+    }
     else if (!strcmp ((char *) key, "transmit_only")) {
         fprintf (stderr, "%s:%d -- transmit_only option is now obsolete\n",
                 __FILE__, __LINE__);
@@ -239,28 +727,39 @@ new_argument (gpointer key, gpointer value, gpointer user)
 }
 
 static int 
-_recv_message_fragment (lcm_udpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
+_recv_message_fragment (udpm_recv_thread_t *rt, lcm_buf_t *lcmb, uint32_t sz)
 {
+    lcm_udpm_t *lcm = rt->lcm;
     lcm2_header_long_t *hdr = (lcm2_header_long_t*) lcmb->buf;
+    uint32_t hdr_size = lcm2_long_header_size (ntohl (hdr->magic));
 
-    // any existing fragment buffer for this message source?
-    lcm_frag_buf_t *fbuf = lcm_frag_buf_store_lookup(lcm->frag_bufs,
-            &lcmb->from);
+    if (sz < hdr_size) {
+        rt->udp_discarded_bad++;
+        return 0;
+    }
 
     uint32_t msg_seqno = ntohl (hdr->msg_seqno);
     uint32_t data_size = ntohl (hdr->msg_size);
     uint32_t fragment_offset = ntohl (hdr->fragment_offset);
 //    uint16_t fragment_no = ntohs (hdr->fragment_no);
     uint16_t fragments_in_msg = ntohs (hdr->fragments_in_msg);
-    uint32_t frag_size = sz - sizeof (lcm2_header_long_t);
-    char *data_start = (char*) (hdr + 1);
-
-    // discard any stale fragments from previous messages
-    if (fbuf && ((fbuf->msg_seqno != msg_seqno) ||
-                 (fbuf->data_size != data_size))) {
-        lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
-        dbg(DBG_LCM, "Dropping message (missing %d fragments)\n",
-            fbuf->fragments_remaining);
+    uint32_t frag_size = sz - hdr_size;
+    char *data_start = lcmb->buf + hdr_size;
+
+    // gaps in the sequence numbers are meaningless while the socket filter
+    // drops the sender's other channels
+    if (!g_atomic_int_get (&lcm->channel_filtered))
+        lcm_seqno_tracker_update (rt->seqnos, &lcmb->from, msg_seqno,
+                hdr->fragment_no == 0);
+
+    // any existing fragment buffer for this message?
+    lcm_frag_buf_t *fbuf = lcm_frag_buf_store_lookup(rt->frag_bufs,
+            &lcmb->from, msg_seqno);
+
+    // discard it if the sender has started over with a different message
+    if (fbuf && ((fbuf->data_size != data_size) ||
+                 (fbuf->nfragments != fragments_in_msg))) {
+        lcm_frag_buf_store_remove (rt->frag_bufs, fbuf);
         fbuf = NULL;
     }
 
@@ -273,34 +772,46 @@ _recv_message_fragment (lcm_udpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
         return 0;
     }
 
-    // create a new fragment buffer if necessary
-    if (!fbuf && hdr->fragment_no == 0) {
-        char *channel = (char*) (hdr + 1);
+    // the first fragment has the channel name before its data.  Its fragment
+    // buffer may already have been started by an announcement of the message
+    char *channel = NULL;
+    if (hdr->fragment_no == 0) {
+        channel = data_start;
         int channel_sz = strlen (channel);
-        if (channel_sz > LCM_MAX_CHANNEL_NAME_LENGTH) {
+        if (channel_sz > LCM_MAX_CHANNEL_NAME_LENGTH ||
+                channel_sz + 1 > frag_size) {
             dbg (DBG_LCM, "bad channel name length\n");
-            lcm->udp_discarded_bad++;
+            rt->udp_discarded_bad++;
             return 0;
         }
+        data_start += channel_sz + 1;
+        frag_size -= (channel_sz + 1);
+    }
 
-        // if the packet has no subscribers, drop the message now.
-        if(!lcm_has_handlers(lcm->lcm, channel))
+    // create a new fragment buffer if necessary
+    if (!fbuf && channel) {
+        // if the packet has no subscribers, drop the message now.  Also
+        // drop the first fragment when it is sent again for another
+        // receiver, after this one reassembled the message.
+        if(!lcm_has_handlers(lcm->lcm, channel) ||
+                lcm_frag_done_set_contains (rt->reliable_done, &lcmb->from,
+                    msg_seqno, lcmb->recv_utime_ns / 1000))
             return 0;
 
-        fbuf = lcm_frag_buf_new (*((struct sockaddr_in*) &lcmb->from),
-                channel, msg_seqno, data_size, fragments_in_msg,
-                lcmb->recv_utime);
-        lcm_frag_buf_store_add (lcm->frag_bufs, fbuf);
-        data_start += channel_sz + 1;
-        frag_size -= (channel_sz + 1);
+        fbuf = lcm_frag_buf_store_add (rt->frag_bufs, &lcmb->from, channel,
+                msg_seqno, data_size, fragments_in_msg, lcmb->recv_utime_ns);
     }
+    if (fbuf && hdr_size > sizeof (*hdr) && !fbuf->send_utime)
+        lcm2_trace_ext_parse (hdr + 1, &fbuf->send_utime,
+                &fbuf->send_host_id);
 
     if (!fbuf) return 0;
 
 #ifdef __linux__
     if(lcm->kernel_rbuf_sz < 262145 && 
        data_size > lcm->kernel_rbuf_sz &&
-       ! lcm->warned_about_small_kernel_buf) {
+       g_atomic_int_compare_and_exchange (
+           &lcm->warned_about_small_kernel_buf, 0, 1)) {
         fprintf(stderr, 
 "==== LCM Warning ===\n"
 "LCM detected that large packets are being received, but the kernel UDP\n"
@@ -309,51 +820,41 @@ _recv_message_fragment (lcm_udpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
 "\n"
 "For more information, visit:\n"
 "   http://lcm-proj.github.io/multicast_setup.html\n\n");
-        lcm->warned_about_small_kernel_buf = 1;
     }
 #endif
 
-    if (fragment_offset + frag_size > fbuf->data_size) {
-        dbg (DBG_LCM, "dropping invalid fragment (off: %d, %d / %d)\n",
-                fragment_offset, frag_size, fbuf->data_size);
-        lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
-        return 0;
-    }
-
     // copy data
-    memcpy (fbuf->data + fragment_offset, data_start, frag_size);
-    fbuf->last_packet_utime = lcmb->recv_utime;
-
-    fbuf->fragments_remaining --;
-
-    if (0 == fbuf->fragments_remaining) {
+    if (1 == lcm_frag_buf_store_add_fragment (rt->frag_bufs, fbuf,
+                ntohs (hdr->fragment_no), fragment_offset, data_start,
+                frag_size, lcmb->recv_utime_ns)) {
         // complete message received.  Is there a subscriber that still
         // wants it?  (i.e., does any subscriber have space in its queue?)
-        if(!lcm_try_enqueue_message(lcm->lcm, fbuf->channel)) {
+        lcm_frag_done_set_add (rt->reliable_done, &lcmb->from, msg_seqno,
+                lcmb->recv_utime_ns / 1000);
+        lcmb->channel_id = 0;
+        int status = lcm_try_enqueue_message_id(lcm->lcm, fbuf->channel,
+                &lcmb->channel_id);
+        if(!status) {
             // no... sad... free the fragment buffer and return
-            lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
+            lcm_frag_buf_store_remove (rt->frag_bufs, fbuf);
             return 0;
         }
 
-        // yes, transfer the message into the lcm_buf_t
-
-        // deallocate the ringbuffer-allocated buffer
-        g_static_rec_mutex_lock (&lcm->mutex);
-        lcm_buf_free_data(lcmb, lcm->ringbuf);
-        g_static_rec_mutex_unlock (&lcm->mutex);
-
-        // transfer ownership of the message's payload buffer
-        lcmb->buf = fbuf->data;
-        fbuf->data = NULL;
+        // yes, transfer ownership of the message's payload buffer into the
+        // lcm_buf_t.  The packet itself is still in the receive batch.
+        lcm_frag_buf_store_take_data (rt->frag_bufs, fbuf, lcmb);
 
         strcpy (lcmb->channel_name, fbuf->channel);
         lcmb->channel_size = strlen (lcmb->channel_name);
         lcmb->data_offset = 0;
         lcmb->data_size = fbuf->data_size;
-        lcmb->recv_utime = fbuf->last_packet_utime;
+        lcm_buf_set_recv_time (lcmb, fbuf->last_packet_ns);
+        lcmb->send_utime = fbuf->send_utime;
+        lcmb->send_host_id = fbuf->send_host_id;
+        lcmb->keep_latest = status == LCM_HANDLERS_KEEP_LATEST;
 
         // don't need the fragment buffer anymore
-        lcm_frag_buf_store_remove (lcm->frag_bufs, fbuf);
+        lcm_frag_buf_store_remove (rt->frag_bufs, fbuf);
 
         return 1;
     }
@@ -361,193 +862,572 @@ _recv_message_fragment (lcm_udpm_t *lcm, lcm_buf_t *lcmb, uint32_t sz)
     return 0;
 }
 
+/* Note that a packet sent by the background self-test came back. */
+static void
+_recv_self_test (lcm_udpm_t *lcm, const char *payload, int payload_size)
+{
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (payload_size == sizeof (lcm->self_test_nonce) &&
+            !memcmp (payload, lcm->self_test_nonce, payload_size)) {
+        lcm->self_test_received = 1;
+        g_cond_signal (lcm->self_test_cond);
+    }
+    g_static_mutex_unlock (&lcm->transmit_lock);
+}
+
+/* Record the subscriptions advertised by another process. */
+static void
+_recv_advertisement (lcm_udpm_t *lcm, const lcm_buf_t *lcmb,
+        const char *payload, int payload_size)
+{
+    if (payload_size > 0 && payload[payload_size - 1]) {
+        dbg (DBG_LCM, "LCM: bad subscription advertisement\n");
+        return;
+    }
+    const struct sockaddr_in *from = (const struct sockaddr_in *) &lcmb->from;
+    char *sender = g_strdup_printf ("%08x:%04x",
+            (unsigned int) ntohl (from->sin_addr.s_addr),
+            (unsigned int) ntohs (from->sin_port));
+    int64_t expire_utime = lcm_timestamp_now () + ADVERTISE_TIMEOUT_USEC;
+
+    // usually the subscriptions are the same as before
+    g_static_mutex_lock (&lcm->transmit_lock);
+    udpm_advert_t *advert = (udpm_advert_t *) g_hash_table_lookup (
+            lcm->remote_subs, sender);
+    if (advert && advert->payload_size == payload_size &&
+            !memcmp (advert->payload, payload, payload_size)) {
+        advert->expire_utime = expire_utime;
+        g_static_mutex_unlock (&lcm->transmit_lock);
+        g_free (sender);
+        return;
+    }
+    g_static_mutex_unlock (&lcm->transmit_lock);
+
+    advert = NULL;
+    if (payload_size) {
+        advert = (udpm_advert_t *) calloc (1, sizeof (udpm_advert_t));
+        advert->payload = (char *) malloc (payload_size);
+        memcpy (advert->payload, payload, payload_size);
+        advert->payload_size = payload_size;
+        advert->patterns = g_ptr_array_new ();
+        advert->expire_utime = expire_utime;
+        for (const char *pos = payload; pos < payload + payload_size;
+                pos += strlen (pos) + 1) {
+            if (*pos && strlen (pos) <= LCM_MAX_CHANNEL_NAME_LENGTH)
+                g_ptr_array_add (advert->patterns, _pattern_new (pos));
+        }
+    }
+
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (advert)
+        g_hash_table_replace (lcm->remote_subs, sender, advert);
+    else
+        g_hash_table_remove (lcm->remote_subs, sender);
+    g_hash_table_remove_all (lcm->wanted_channels);
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    if (!advert)
+        g_free (sender);
+}
+
+/* Ask on NACK_CHANNEL for the fragments of a message that are missing. */
+static void
+_send_nack (lcm_udpm_t *lcm, uint32_t publisher_id, uint32_t msg_seqno,
+        const uint16_t *fragment_nos, int num_fragment_nos)
+{
+    udpm_nack_t nack;
+    nack.publisher_id = htonl (publisher_id);
+    nack.msg_seqno = htonl (msg_seqno);
+    nack.num_fragments = htons (num_fragment_nos);
+    nack.reserved = 0;
+
+    char payload[sizeof (nack) + UDPM_MAX_NACK_FRAGMENTS * sizeof (uint16_t)];
+    memcpy (payload, &nack, sizeof (nack));
+    for (int i = 0; i < num_fragment_nos; i++) {
+        uint16_t frag_no = htons (fragment_nos[i]);
+        memcpy (payload + sizeof (nack) + i * sizeof (frag_no), &frag_no,
+                sizeof (frag_no));
+    }
+
+    dbg (DBG_LCM, "LCM: asking for %d fragments of message %u\n",
+            num_fragment_nos, msg_seqno);
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (_send_short_packet (lcm, NACK_CHANNEL, payload,
+                sizeof (nack) + num_fragment_nos * sizeof (uint16_t)) < 0)
+        perror ("LCM: sending NACK");
+    g_static_mutex_unlock (&lcm->transmit_lock);
+}
+
+/* Ask the publisher of an announced message for the fragments that haven't
+ * been received.  A message whose first fragment was lost gets its fragment
+ * buffer here. */
+static void
+_recv_announcement (udpm_recv_thread_t *rt, lcm_buf_t *lcmb,
+        const char *payload, int payload_size)
+{
+    lcm_udpm_t *lcm = rt->lcm;
+    udpm_reliable_announce_t ann;
+    if (payload_size < (int) sizeof (ann) + 2 || payload[payload_size - 1]) {
+        rt->udp_discarded_bad++;
+        return;
+    }
+    memcpy (&ann, payload, sizeof (ann));
+    const char *channel = payload + sizeof (ann);
+    uint32_t msg_seqno = ntohl (ann.msg_seqno);
+    uint32_t data_size = ntohl (ann.msg_size);
+    uint16_t nfragments = ntohs (ann.nfragments);
+    if (strlen (channel) > LCM_MAX_CHANNEL_NAME_LENGTH || !nfragments ||
+            data_size > LCM_MAX_MESSAGE_SIZE) {
+        rt->udp_discarded_bad++;
+        return;
+    }
+
+    if (!lcm_has_handlers (lcm->lcm, channel) ||
+            lcm_frag_done_set_contains (rt->reliable_done, &lcmb->from,
+                msg_seqno, lcmb->recv_utime_ns / 1000))
+        return;
+
+    lcm_frag_buf_t *fbuf = lcm_frag_buf_store_lookup (rt->frag_bufs,
+            &lcmb->from, msg_seqno);
+    if (fbuf && ((fbuf->data_size != data_size) ||
+                 (fbuf->nfragments != nfragments))) {
+        lcm_frag_buf_store_remove (rt->frag_bufs, fbuf);
+        fbuf = NULL;
+    }
+    if (!fbuf) {
+        // a message this old may have been reassembled and forgotten since
+        if (ntohl (ann.age_usec) >= UDPM_ANNOUNCE_MAX_AGE_USEC)
+            return;
+        fbuf = lcm_frag_buf_store_add (rt->frag_bufs, &lcmb->from, channel,
+                msg_seqno, data_size, nfragments, lcmb->recv_utime_ns);
+    }
+
+    // too many fragments to list asks for all of them
+    uint16_t missing[UDPM_MAX_NACK_FRAGMENTS];
+    int num_missing = 0;
+    for (int i = 0; i < nfragments; i++) {
+        if (fbuf->received[i / 8] & (1 << (i % 8)))
+            continue;
+        if (num_missing == UDPM_MAX_NACK_FRAGMENTS) {
+            num_missing = 0;
+            break;
+        }
+        missing[num_missing++] = i;
+    }
+    if (num_missing || fbuf->fragments_remaining)
+        _send_nack (lcm, ntohl (ann.publisher_id), msg_seqno, missing,
+                num_missing);
+}
+
+/* Send again the fragments of one of our messages that a receiver asked
+ * for, and announce the message again so that receivers still missing some
+ * can ask again. */
+static void
+_recv_nack (lcm_udpm_t *lcm, const char *payload, int payload_size)
+{
+    udpm_nack_t nack;
+    if (payload_size < (int) sizeof (nack))
+        return;
+    memcpy (&nack, payload, sizeof (nack));
+    int num_fragment_nos = ntohs (nack.num_fragments);
+    if (num_fragment_nos > UDPM_MAX_NACK_FRAGMENTS || payload_size !=
+            (int) (sizeof (nack) + num_fragment_nos * sizeof (uint16_t)))
+        return;
+    const char *fragment_nos = payload + sizeof (nack);
+
+    if (ntohl (nack.publisher_id) != lcm->publisher_id)
+        return;
+
+    g_static_mutex_lock (&lcm->transmit_lock);
+    udpm_sent_msg_t *msg = (udpm_sent_msg_t *) g_hash_table_lookup (
+            lcm->sent_by_seqno, GUINT_TO_POINTER (ntohl (nack.msg_seqno)));
+    if (!msg || msg->num_retransmits >= UDPM_MAX_RETRANSMITS) {
+        g_static_mutex_unlock (&lcm->transmit_lock);
+        return;
+    }
+
+    // within the holdoff, only send the fragments that weren't already sent
+    // again
+    int64_t now = lcm_timestamp_now ();
+    if (now - msg->retransmit_utime >= UDPM_RETRANSMIT_HOLDOFF_USEC) {
+        memset (msg->resent, 0, (msg->nfragments + 7) / 8);
+        msg->retransmit_utime = now;
+        msg->num_retransmits++;
+    }
+    int num_asked = num_fragment_nos ? num_fragment_nos : msg->nfragments;
+    uint16_t *resend = (uint16_t *) malloc (num_asked * sizeof (uint16_t));
+    int num_resend = 0;
+    for (int i = 0; i < num_asked; i++) {
+        uint16_t frag_no = i;
+        if (num_fragment_nos) {
+            memcpy (&frag_no, fragment_nos + i * sizeof (frag_no),
+                    sizeof (frag_no));
+            frag_no = ntohs (frag_no);
+        }
+        uint8_t bit = 1 << (frag_no % 8);
+        if (frag_no >= msg->nfragments || (msg->resent[frag_no / 8] & bit))
+            continue;
+        msg->resent[frag_no / 8] |= bit;
+        resend[num_resend++] = frag_no;
+    }
+
+    if (num_resend) {
+        dbg (DBG_LCM_MSG, "sending %d fragments of [%s] message %u again\n",
+                num_resend, msg->channel, msg->msg_seqno);
+        if (lcm_udpm_resend_fragments (lcm->sendfd, &lcm->dest_addr,
+                    msg->msg_seqno, msg->channel, msg->data, msg->datalen,
+                    msg->nfragments, msg->traced ? &msg->trace : NULL,
+                    resend, num_resend) < 0)
+            perror ("LCM: sending fragments again");
+        _send_announcement (lcm, msg);
+    }
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    free (resend);
+}
+
 static int
-_recv_short_message (lcm_udpm_t *lcm, lcm_buf_t *lcmb, int sz)
+_recv_short_message (udpm_recv_thread_t *rt, lcm_buf_t *lcmb, int sz)
 {
+    lcm_udpm_t *lcm = rt->lcm;
     lcm2_header_short_t *hdr2 = (lcm2_header_short_t*) lcmb->buf;
+    int hdr_size = lcm2_short_header_size (ntohl (hdr2->magic));
+
+    if (sz < hdr_size) {
+        rt->udp_discarded_bad++;
+        return 0;
+    }
+    lcmb->send_utime = 0;
+    lcmb->send_host_id = 0;
+    if (hdr_size > sizeof (*hdr2))
+        lcm2_trace_ext_parse (hdr2 + 1, &lcmb->send_utime,
+                &lcmb->send_host_id);
+
+    if (!g_atomic_int_get (&lcm->channel_filtered))
+        lcm_seqno_tracker_update (rt->seqnos, &lcmb->from,
+                ntohl (hdr2->msg_seqno), 1);
 
     // shouldn't have to worry about buffer overflow here because we
     // zeroed out byte #65536, which is never written to by recv
-    const char *pkt_channel_str = (char*) (hdr2 + 1);
+    const char *pkt_channel_str = lcmb->buf + hdr_size;
 
     lcmb->channel_size = strlen (pkt_channel_str);
 
     if (lcmb->channel_size > LCM_MAX_CHANNEL_NAME_LENGTH) {
         dbg (DBG_LCM, "bad channel name length\n");
-        lcm->udp_discarded_bad++;
+        rt->udp_discarded_bad++;
         return 0;
     }
 
-    lcm->udp_rx++;
+    if (lcm->params.advertise && !strcmp (pkt_channel_str, ADVERTISE_CHANNEL)) {
+        int data_offset = hdr_size + lcmb->channel_size + 1;
+        _recv_advertisement (lcm, lcmb, lcmb->buf + data_offset,
+                sz - data_offset);
+        return 0;
+    }
+    // the reliable delivery messages are never handled by subscribers
+    if (!strcmp (pkt_channel_str, RELIABLE_CHANNEL)) {
+        int data_offset = hdr_size + lcmb->channel_size + 1;
+        _recv_announcement (rt, lcmb, lcmb->buf + data_offset,
+                sz - data_offset);
+        return 0;
+    }
+    if (!strcmp (pkt_channel_str, NACK_CHANNEL)) {
+        int data_offset = hdr_size + lcmb->channel_size + 1;
+        if (lcm->params.reliable)
+            _recv_nack (lcm, lcmb->buf + data_offset, sz - data_offset);
+        return 0;
+    }
+    if (g_atomic_int_get (&lcm->self_test_pending) &&
+            !strcmp (pkt_channel_str, SELF_TEST_CHANNEL)) {
+        int data_offset = hdr_size + lcmb->channel_size + 1;
+        _recv_self_test (lcm, lcmb->buf + data_offset, sz - data_offset);
+        return 0;
+    }
 
     // if the packet has no subscribers, drop the message now.
-    if(!lcm_try_enqueue_message(lcm->lcm, pkt_channel_str))
+    lcmb->channel_id = 0;
+    int status = lcm_try_enqueue_message_id(lcm->lcm, pkt_channel_str,
+            &lcmb->channel_id);
+    if(!status)
         return 0;
+    lcmb->keep_latest = status == LCM_HANDLERS_KEEP_LATEST;
 
     strcpy (lcmb->channel_name, pkt_channel_str);
 
-    lcmb->data_offset = 
-        sizeof (lcm2_header_short_t) + lcmb->channel_size + 1;
+    lcmb->data_offset = hdr_size + lcmb->channel_size + 1;
 
     lcmb->data_size = sz - lcmb->data_offset;
     return 1;
 }
 
-// read continuously until a complete message arrives
-static lcm_buf_t *
-udp_read_packet (lcm_udpm_t *lcm)
+// wait for incoming packets and read as many as are available, up to
+// UDPM_RECV_BATCH.  Returns the number of packets read, or -1 when the read
+// thread is asked to exit.
+static int
+udp_read_packets (udpm_recv_thread_t *rt, udpm_recv_batch_t *batch)
 {
-    lcm_buf_t *lcmb = NULL;
-
-    int sz = 0;
-
-    // TODO warn about message loss somewhere else.
-
-//    g_static_rec_mutex_lock (&lcm->mutex);
-//    unsigned int ring_capacity = lcm_ringbuf_capacity(lcm->ringbuf);
-//    unsigned int ring_used = lcm_ringbuf_used(lcm->ringbuf);
-//    double buf_avail = ((double)(ring_capacity - ring_used)) / ring_capacity;
-//    g_static_rec_mutex_unlock (&lcm->mutex);
-//    if (buf_avail < lcm->udp_low_watermark)
-//        lcm->udp_low_watermark = buf_avail;
-//
-//    GTimeVal tv;
-//    g_get_current_time(&tv);
-//    int elapsedsecs = tv.tv_sec - lcm->udp_last_report_secs;
-//    if (elapsedsecs > 2) {
-//        uint32_t total_bad = lcm->udp_discarded_bad;
-//        if (total_bad > 0 || lcm->udp_low_watermark < 0.5) {
-//            fprintf(stderr, 
-//                    "%d.%03d LCM loss %4.1f%% : %5d err, "
-//                    "buf avail %4.1f%%\n", 
-//                   (int) tv.tv_sec, (int) tv.tv_usec/1000,
-//                   total_bad * 100.0 / (lcm->udp_rx + total_bad),
-//                   lcm->udp_discarded_bad,
-//                   100.0 * lcm->udp_low_watermark);
-//            
-//            lcm->udp_rx = 0;
-//            lcm->udp_discarded_bad = 0;
-//            lcm->udp_last_report_secs = tv.tv_sec;
-//            lcm->udp_low_watermark = HUGE;
-//        }
-//    }
-    
-    int got_complete_message = 0;
-
-    while (!got_complete_message) {
-        // wait for either incoming UDP data, or for an abort message
-        fd_set fds;
-        FD_ZERO (&fds);
-        FD_SET (lcm->recvfd, &fds);
-        FD_SET (lcm->thread_msg_pipe[0], &fds);
-        SOCKET maxfd = MAX(lcm->recvfd, lcm->thread_msg_pipe[0]);
-
-        if (select (maxfd + 1, &fds, NULL, NULL, NULL) <= 0) { 
-            perror ("udp_read_packet -- select:");
-            continue;
-        }
+    lcm_udpm_t *lcm = rt->lcm;
 
-        if (FD_ISSET (lcm->thread_msg_pipe[0], &fds)) {
-            // received an exit command.
-            dbg (DBG_LCM, "read thread received exit command\n");
-            if (lcmb) {
-                // lcmb is not on one of the memory managed buffer queues.  We could
-                // either put it back on one of the queues, or just free it here.  Do the
-                // latter.
-                //
-                // Can also just free its lcm_buf_t here.  Its data buffer is
-                // managed either by the ring buffer or the fragment buffer, so
-                // we can ignore it.
-                free (lcmb);
+    while (1) {
+        if (lcm->params.busy_poll) {
+            // keep trying to read without blocking, rather than sleep
+            if (g_atomic_int_get (&lcm->recv_quit)) {
+                dbg (DBG_LCM, "read thread received exit command\n");
+                return -1;
+            }
+        } else {
+            // wait for either incoming UDP data, or for an abort message
+            fd_set fds;
+            FD_ZERO (&fds);
+            FD_SET (rt->recvfd, &fds);
+            FD_SET (lcm->thread_msg_pipe[0], &fds);
+            SOCKET maxfd = MAX(rt->recvfd, lcm->thread_msg_pipe[0]);
+
+            if (select (maxfd + 1, &fds, NULL, NULL, NULL) <= 0) { 
+                perror ("udp_read_packet -- select:");
+                continue;
             }
-            return NULL;
-        }
 
-        // there is incoming UDP data ready.
-        assert (FD_ISSET (lcm->recvfd, &fds));
+            if (FD_ISSET (lcm->thread_msg_pipe[0], &fds)) {
+                // received an exit command.
+                dbg (DBG_LCM, "read thread received exit command\n");
+                return -1;
+            }
 
-        if (!lcmb) {
-            g_static_rec_mutex_lock (&lcm->mutex);
-            lcmb = lcm_buf_allocate_data(lcm->inbufs_empty, &lcm->ringbuf);
-            g_static_rec_mutex_unlock (&lcm->mutex);
+            // there is incoming UDP data ready.
+            assert (FD_ISSET (rt->recvfd, &fds));
         }
-        struct iovec        vec;
-        vec.iov_base = lcmb->buf;
-        vec.iov_len = 65535;
 
-        struct msghdr msg;
-        memset(&msg, 0, sizeof(struct msghdr));
-        msg.msg_name = &lcmb->from;
-        msg.msg_namelen = sizeof (struct sockaddr);
-        msg.msg_iov = &vec;
-        msg.msg_iovlen = 1;
+        for (int i = 0; i < UDPM_RECV_BATCH; i++) {
+            struct msghdr *msg = &batch->msgs[i].msg_hdr;
+            batch->vecs[i].iov_base = batch->data + i * UDPM_RECV_PACKET_SIZE;
+            batch->vecs[i].iov_len = UDPM_RECV_PACKET_SIZE - 1;
+            memset (msg, 0, sizeof (struct msghdr));
+            msg->msg_name = &batch->bufs[i]->from;
+            msg->msg_namelen = sizeof (struct sockaddr);
+            msg->msg_iov = &batch->vecs[i];
+            msg->msg_iovlen = 1;
 #ifdef MSG_EXT_HDR
-        // operating systems that provide SO_TIMESTAMP allow us to obtain more
-        // accurate timestamps by having the kernel produce timestamps as soon
-        // as packets are received.
-        char controlbuf[64];
-        msg.msg_control = controlbuf;
-        msg.msg_controllen = sizeof (controlbuf);
-        msg.msg_flags = 0;
+            // operating systems that provide SO_TIMESTAMP allow us to obtain
+            // more accurate timestamps by having the kernel produce
+            // timestamps as soon as packets are received.
+            msg->msg_control = batch->controlbufs[i];
+            msg->msg_controllen = sizeof (batch->controlbufs[i]);
 #endif
-        sz = recvmsg (lcm->recvfd, &msg, 0);
+        }
 
-        if (sz < 0) {
-            perror ("udp_read_packet -- recvmsg");
-            lcm->udp_discarded_bad++;
-            continue;
+#ifdef USE_RECVMMSG
+        int num_packets = recvmmsg (rt->recvfd, batch->msgs, UDPM_RECV_BATCH,
+                MSG_DONTWAIT, NULL);
+#else
+        // read the first packet, which is known to be available unless busy
+        // polling, and then whatever else is available without blocking.
+        int num_packets = 0;
+        while (num_packets < UDPM_RECV_BATCH) {
+            int flags = 0;
+#ifdef MSG_DONTWAIT
+            if (num_packets || lcm->params.busy_poll)
+                flags = MSG_DONTWAIT;
+#endif
+            int sz = recvmsg (rt->recvfd, &batch->msgs[num_packets].msg_hdr,
+                    flags);
+            if (sz < 0) {
+                if (num_packets)
+                    break;
+                num_packets = -1;
+                break;
+            }
+            batch->msgs[num_packets].msg_len = sz;
+            num_packets++;
         }
+#endif
 
-        if (sz < sizeof(lcm2_header_short_t)) { 
-            // packet too short to be LCM
-            lcm->udp_discarded_bad++;
+        if (num_packets < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror ("udp_read_packet -- recvmsg");
+                rt->udp_discarded_bad++;
+            } else if (lcm->params.busy_poll) {
+                lcm_cpu_relax ();
+            }
             continue;
         }
+        batch->read_ns = lcm_timestamp_now_ns ();
+        return num_packets;
+    }
+}
+
+// parse a received packet, and reassemble it if it is a fragment.  Returns 1
+// if the packet completes a message that has subscribers.
+static int
+udp_parse_packet (udpm_recv_thread_t *rt, udpm_recv_batch_t *batch, int i)
+{
+    lcm_buf_t *lcmb = batch->bufs[i];
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    int sz = batch->msgs[i].msg_len;
 
-        lcmb->fromlen = msg.msg_namelen;
+    rt->udp_rx++;
 
-        int got_utime = 0;
+    if (sz < sizeof(lcm2_header_short_t)) { 
+        // packet too short to be LCM
+        rt->udp_discarded_bad++;
+        return 0;
+    }
+
+    lcmb->buf = batch->data + i * UDPM_RECV_PACKET_SIZE;
+    lcmb->ringbuf = NULL;
+    lcmb->packet_size = sz;
+    lcmb->fromlen = msg->msg_namelen;
+
+    int64_t recv_ns = 0;
 #ifdef SO_TIMESTAMP
-        struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
-        /* Get the receive timestamp out of the packet headers if possible */
-        while (!lcmb->recv_utime && cmsg) {
-            if (cmsg->cmsg_level == SOL_SOCKET &&
-                    cmsg->cmsg_type == SCM_TIMESTAMP) {
-                struct timeval * t = (struct timeval*) CMSG_DATA (cmsg);
-                lcmb->recv_utime = (int64_t) t->tv_sec * 1000000 + t->tv_usec;
-                got_utime = 1;
-                break;
-            }
-            cmsg = CMSG_NXTHDR (&msg, cmsg);
-        }
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR (msg);
+    /* Get the receive timestamp out of the packet headers if possible, and
+     * the number of packets the kernel has dropped */
+    while (cmsg) {
+        lcm_parse_recv_timestamp (cmsg, &recv_ns);
+#ifdef SO_RXQ_OVFL
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SO_RXQ_OVFL)
+            memcpy (&rt->kernel_drops, CMSG_DATA (cmsg), sizeof (uint32_t));
+#endif
+        cmsg = CMSG_NXTHDR (msg, cmsg);
+    }
 #endif
-        if (!got_utime)
-            lcmb->recv_utime = lcm_timestamp_now ();
-
-        lcm2_header_short_t *hdr2 = (lcm2_header_short_t*) lcmb->buf;
-        uint32_t rcvd_magic = ntohl(hdr2->magic);
-        if (rcvd_magic == LCM2_MAGIC_SHORT)
-            got_complete_message = _recv_short_message (lcm, lcmb, sz);
-        else if (rcvd_magic == LCM2_MAGIC_LONG)
-            got_complete_message = _recv_message_fragment (lcm, lcmb, sz);
-        else {
-            dbg (DBG_LCM, "LCM: bad magic\n");
-            lcm->udp_discarded_bad++;
+    lcm_buf_set_recv_time (lcmb, recv_ns ? recv_ns : batch->read_ns);
+
+    lcm2_header_short_t *hdr2 = (lcm2_header_short_t*) lcmb->buf;
+    uint32_t rcvd_magic = ntohl(hdr2->magic);
+    if (lcm2_short_header_size (rcvd_magic))
+        return _recv_short_message (rt, lcmb, sz);
+    else if (lcm2_long_header_size (rcvd_magic))
+        return _recv_message_fragment (rt, lcmb, sz);
+    else if (rcvd_magic == LCM2_MAGIC_COALESCED)
+        return 1;   // unpacked by _enqueue_batch ()
+
+    dbg (DBG_LCM, "LCM: bad magic\n");
+    rt->udp_discarded_bad++;
+    return 0;
+}
+
+/* Queue a complete message for future retrieval by lcm_handle ().  Short
+ * messages are still in the receive batch, and are copied out of it first.
+ * Returns -1 if too many messages are waiting for lcm_handle (), in which
+ * case the message is dropped. */
+static int
+_enqueue_message (udpm_recv_thread_t *rt, lcm_buf_t *lcmb, int in_batch)
+{
+    lcm_udpm_t *lcm = rt->lcm;
+    lcm_buf_handoff_t *handoff = rt->handoff;
+
+    if (in_batch)
+        lcm_buf_copy_data (handoff, lcmb, lcmb->packet_size);
+
+    if (0 != lcm_buf_handoff_push (handoff, lcm->lcm, lcmb)) {
+        dbg (DBG_LCM, "dropping message, too many queued\n");
+        lcm_discard_message (lcm->lcm, lcmb->channel_name,
+                lcmb->channel_id);
+        lcm_buf_free_data (lcmb, handoff->ringbuf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue the short messages of a coalesced packet.  Returns the number
+ * queued. */
+static int
+_enqueue_coalesced (udpm_recv_thread_t *rt, lcm_buf_t *lcmb)
+{
+    lcm_buf_handoff_t *handoff = rt->handoff;
+    const char *pos = lcmb->buf + sizeof (uint32_t);
+    const char *end = lcmb->buf + lcmb->packet_size;
+    int num_queued = 0;
+
+    while (pos < end) {
+        uint16_t size;
+        if (end - pos < (int) sizeof (size))
+            goto bad;
+        memcpy (&size, pos, sizeof (size));
+        size = ntohs (size);
+        pos += sizeof (size);
+
+        // each message is a short message packet, and its channel name must
+        // end inside it
+        const lcm2_header_short_t *hdr = (const lcm2_header_short_t *) pos;
+        int hdr_size = size > sizeof (*hdr) && size <= end - pos ?
+            lcm2_short_header_size (ntohl (hdr->magic)) : 0;
+        if (!hdr_size || size <= hdr_size ||
+                !memchr (pos + hdr_size, 0, size - hdr_size))
+            goto bad;
+
+        lcm_buf_t *msg = lcm_buf_reserve (handoff);
+        msg->buf = (char *) pos;
+        msg->ringbuf = NULL;
+        msg->packet_size = size;
+        msg->from = lcmb->from;
+        msg->fromlen = lcmb->fromlen;
+        lcm_buf_set_recv_time (msg, lcmb->recv_utime_ns);
+        pos += size;
+
+        if (_recv_short_message (rt, msg, size) &&
+                0 == _enqueue_message (rt, msg, 1)) {
+            num_queued++;
             continue;
         }
+        msg->buf = NULL;
+        lcm_buf_enqueue (handoff->inbufs_empty, msg);
     }
+    return num_queued;
+
+bad:
+    dbg (DBG_LCM, "LCM: bad coalesced packet\n");
+    rt->udp_discarded_bad++;
+    return num_queued;
+}
+
+/* Queue the complete messages of a batch for future retrieval by
+ * lcm_handle (). */
+static void
+_enqueue_batch (udpm_recv_thread_t *rt, udpm_recv_batch_t *batch,
+        int num_packets)
+{
+    lcm_udpm_t *lcm = rt->lcm;
+    lcm_buf_handoff_t *handoff = rt->handoff;
 
-    // if the newly received packet is a short packet, then resize the space
-    // allocated to it on the ringbuffer to exactly match the amount of space
-    // required.  That way, we do not use 64k of the ringbuffer for every
-    // incoming message.
-    if (lcmb->ringbuf) {
-        g_static_rec_mutex_lock (&lcm->mutex);
-        lcm_ringbuf_shrink_last(lcmb->ringbuf, lcmb->buf, sz);
-        g_static_rec_mutex_unlock (&lcm->mutex);
+    /* Take back the buffers of the messages that were handled, so that their
+     * space in the ringbuffer can be reused. */
+    lcm_buf_handoff_recycle (handoff);
+
+    int num_queued = 0;
+    for (int i = 0; i < num_packets; i++) {
+        if (!batch->complete[i])
+            continue;
+        lcm_buf_t *lcmb = batch->bufs[i];
+        char *packet = batch->data + i * UDPM_RECV_PACKET_SIZE;
+
+        /* Coalesced messages are unpacked here rather than when their packet
+         * is parsed, so that all messages are queued in the order they were
+         * received. */
+        if (lcmb->buf == packet && ntohl (((lcm2_header_short_t *)
+                        packet)->magic) == LCM2_MAGIC_COALESCED) {
+            num_queued += _enqueue_coalesced (rt, lcmb);
+            continue;
+        }
+
+        /* Short messages are still in the receive batch.  Fragmented
+         * messages were reassembled into their own buffer.  If the message
+         * is dropped, keep its lcm_buf_t for the next packet. */
+        if (0 != _enqueue_message (rt, lcmb, lcmb->buf == packet))
+            continue;
+        batch->bufs[i] = lcm_buf_reserve (handoff);
+        num_queued++;
     }
 
-    return lcmb;
+    /* Notify the reading thread by writing to a pipe.  We only want one
+     * character in the pipe at a time to avoid blocking writes, so only the
+     * receive thread that sets notify_pending does this. */
+    if (num_queued &&
+            g_atomic_int_compare_and_exchange (&lcm->notify_pending, 0, 1))
+        if (lcm_notify_post(&lcm->notify) < 0)
+            perror ("write to notify");
 }
 
 /* This is the receiver thread that runs continuously to retrieve any incoming
@@ -562,28 +1442,65 @@ recv_thread (void * user)
     pthread_sigmask(SIG_SETMASK, &mask, NULL);
 #endif
 
-    lcm_udpm_t * lcm = (lcm_udpm_t *) user;
-
-    while (1) {
+    udpm_recv_thread_t * rt = (udpm_recv_thread_t *) user;
+    lcm_udpm_t * lcm = rt->lcm;
 
-        lcm_buf_t *lcmb = udp_read_packet(lcm);
-        if (!lcmb) break;
+#ifdef __linux__
+    /* With several receive threads, run each one on a different CPU, chosen
+     * among the CPUs this process may run on. */
+    if (lcm->num_recv_threads > 1) {
+        cpu_set_t allowed;
+        if (0 == sched_getaffinity (0, sizeof (allowed), &allowed)) {
+            int num_allowed = CPU_COUNT (&allowed);
+            int n = rt->index % num_allowed;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET (cpu, &allowed) || n--)
+                    continue;
+                cpu_set_t pinned;
+                CPU_ZERO (&pinned);
+                CPU_SET (cpu, &pinned);
+                if (pthread_setaffinity_np (pthread_self (), sizeof (pinned),
+                            &pinned))
+                    dbg (DBG_LCM, "unable to pin receive thread to CPU %d\n",
+                            cpu);
+                break;
+            }
+        }
+    }
+#endif
 
-        /* If necessary, notify the reading thread by writing to a pipe.  We
-         * only want one character in the pipe at a time to avoid blocking
-         * writes, so we only do this when the queue transitions from empty to
-         * non-empty. */
-        g_static_rec_mutex_lock (&lcm->mutex);
+    udpm_recv_batch_t * batch =
+        (udpm_recv_batch_t *) calloc (1, sizeof (udpm_recv_batch_t));
+    batch->data = (char *) malloc (UDPM_RECV_BATCH * UDPM_RECV_PACKET_SIZE);
+    for (int i = 0; i < UDPM_RECV_BATCH; i++) {
+        // zero the last byte of each packet so that strlen never segfaults
+        batch->data[(i + 1) * UDPM_RECV_PACKET_SIZE - 1] = 0;
+    }
+    for (int i = 0; i < UDPM_RECV_BATCH; i++)
+        batch->bufs[i] = lcm_buf_reserve (rt->handoff);
 
-        if (lcm_buf_queue_is_empty (lcm->inbufs_filled))
-            if (lcm_internal_pipe_write(lcm->notify_pipe[1], "+", 1) < 0)
-                perror ("write to notify");
+    while (1) {
+        int num_packets = udp_read_packets (rt, batch);
+        if (num_packets < 0)
+            break;
+
+        int num_complete = 0;
+        for (int i = 0; i < num_packets; i++) {
+            batch->complete[i] = udp_parse_packet (rt, batch, i);
+            num_complete += batch->complete[i];
+        }
 
-        /* Queue the packet for future retrieval by lcm_handle (). */
-        lcm_buf_enqueue (lcm->inbufs_filled, lcmb);
-        
-        g_static_rec_mutex_unlock (&lcm->mutex);
+        if (num_complete)
+            _enqueue_batch (rt, batch, num_packets);
     }
+
+    /* The reserved lcm_buf_t are not in the handoff, and their data is either
+     * in the receive batch or was handed off, so just free them here. */
+    for (int i = 0; i < UDPM_RECV_BATCH; i++)
+        free (batch->bufs[i]);
+    free (batch->data);
+    free (batch);
+
     dbg (DBG_LCM, "read thread exiting\n");
     return NULL;
 }
@@ -594,13 +1511,367 @@ lcm_udpm_get_fileno (lcm_udpm_t *lcm)
     if (_setup_recv_parts (lcm) < 0) {
         return -1;
     }
-    return lcm->notify_pipe[0];
+    return lcm_notify_get_fileno(&lcm->notify);
+}
+
+/* Advertise the subscriptions after they change.  The mutex isn't held
+ * while the transmit lock is taken, so the snapshots are numbered to keep
+ * an older one from replacing a newer one. */
+static void
+_update_advertisement (lcm_udpm_t *lcm)
+{
+    if (!lcm->params.advertise)
+        return;
+
+    GPtrArray *patterns = g_ptr_array_new ();
+    g_static_rec_mutex_lock (&lcm->mutex);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init (&iter, lcm->subscriptions);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (patterns, _pattern_new ((const char *) key));
+    int gen = ++lcm->subscriptions_gen;
+    g_static_rec_mutex_unlock (&lcm->mutex);
+
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (gen > lcm->local_patterns_gen) {
+        _patterns_free (lcm->local_patterns);
+        lcm->local_patterns = patterns;
+        lcm->local_patterns_gen = gen;
+        patterns = NULL;
+        g_hash_table_remove_all (lcm->wanted_channels);
+        lcm->next_advert_utime = 0;
+        g_cond_signal (lcm->send_cond);
+    }
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    _patterns_free (patterns);
 }
 
 static int
 lcm_udpm_subscribe (lcm_udpm_t *lcm, const char *channel)
 {
-    return _setup_recv_parts (lcm);
+    // add the channel before the receive sockets are opened, so that their
+    // filters accept it.  Don't hold the mutex while they are set up, since
+    // another thread may be setting them up.
+    g_static_rec_mutex_lock (&lcm->mutex);
+    int count = GPOINTER_TO_INT (g_hash_table_lookup (lcm->subscriptions,
+                channel));
+    g_hash_table_insert (lcm->subscriptions, strdup (channel),
+            GINT_TO_POINTER (count + 1));
+    g_static_rec_mutex_unlock (&lcm->mutex);
+
+    int status = _setup_recv_parts (lcm);
+
+    g_static_rec_mutex_lock (&lcm->mutex);
+    if (status < 0)
+        _remove_subscription (lcm, channel);
+    _update_recv_filters (lcm);
+    g_static_rec_mutex_unlock (&lcm->mutex);
+    _update_advertisement (lcm);
+    return status;
+}
+
+static int
+lcm_udpm_unsubscribe (lcm_udpm_t *lcm, const char *channel)
+{
+    g_static_rec_mutex_lock (&lcm->mutex);
+    _remove_subscription (lcm, channel);
+    _update_recv_filters (lcm);
+    g_static_rec_mutex_unlock (&lcm->mutex);
+    _update_advertisement (lcm);
+    return 0;
+}
+
+/* Send the coalesced messages that are waiting.  transmit_lock must be
+ * held. */
+static int
+_flush_coalesced (lcm_udpm_t *lcm)
+{
+    if (!lcm->coalesce_len)
+        return 0;
+    dbg (DBG_LCM_MSG, "transmitting %d bytes of coalesced messages\n",
+            lcm->coalesce_len);
+    int len = lcm->coalesce_len;
+    lcm->coalesce_len = 0;
+    int status = sendto (lcm->sendfd, lcm->coalesce_buf, len, 0,
+            (struct sockaddr *) &lcm->dest_addr, sizeof (lcm->dest_addr));
+    return (status == len) ? 0 : -1;
+}
+
+/* Send a short message that bypasses coalescing and advertising, for the
+ * provider's own use.  transmit_lock must be held. */
+static int
+_send_short_packet (lcm_udpm_t *lcm, const char *channel, const void *data,
+        int datalen)
+{
+    lcm2_header_short_t hdr;
+    hdr.magic = htonl (LCM2_MAGIC_SHORT);
+    hdr.msg_seqno = htonl (lcm->msg_seqno);
+
+    struct iovec sendbufs[3];
+    sendbufs[0].iov_base = (char *) &hdr;
+    sendbufs[0].iov_len = sizeof (hdr);
+    sendbufs[1].iov_base = (char *) channel;
+    sendbufs[1].iov_len = strlen (channel) + 1;
+    sendbufs[2].iov_base = (char *) data;
+    sendbufs[2].iov_len = datalen;
+
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_name = (struct sockaddr*) &lcm->dest_addr;
+    msg.msg_namelen = sizeof (lcm->dest_addr);
+    msg.msg_iov = sendbufs;
+    msg.msg_iovlen = 3;
+    int status = sendmsg (lcm->sendfd, &msg, 0);
+
+    lcm->msg_seqno ++;
+    return status < 0 ? -1 : 0;
+}
+
+/* Send the local subscriptions on ADVERTISE_CHANNEL.  transmit_lock must
+ * be held. */
+static void
+_send_advertisement (lcm_udpm_t *lcm)
+{
+    GString *payload = g_string_new (NULL);
+    for (guint i = 0; i < lcm->local_patterns->len; i++) {
+        udpm_pattern_t *pat = (udpm_pattern_t *) g_ptr_array_index (
+                lcm->local_patterns, i);
+        g_string_append_len (payload, pat->channel, strlen (pat->channel) + 1);
+    }
+    if (sizeof (ADVERTISE_CHANNEL) + payload->len > LCM_SHORT_MESSAGE_MAX_SIZE) {
+        // too many to list, so ask for every channel
+        g_string_truncate (payload, 0);
+        g_string_append_len (payload, ".*", sizeof (".*"));
+    }
+
+    dbg (DBG_LCM_MSG, "advertising %d bytes of subscriptions\n",
+            (int) payload->len);
+    if (_send_short_packet (lcm, ADVERTISE_CHANNEL, payload->str,
+                payload->len) < 0)
+        perror ("LCM: sending subscription advertisement");
+    g_string_free (payload, TRUE);
+}
+
+/* Forget the subscriptions of processes that stopped advertising them.
+ * transmit_lock must be held. */
+static void
+_expire_advertisements (lcm_udpm_t *lcm, int64_t now)
+{
+    int expired = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init (&iter, lcm->remote_subs);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        if (((udpm_advert_t *) value)->expire_utime < now) {
+            g_hash_table_iter_remove (&iter);
+            expired = 1;
+        }
+    }
+    if (expired)
+        g_hash_table_remove_all (lcm->wanted_channels);
+}
+
+/* Whether this process or another one subscribes to a channel.  Until the
+ * other processes have had time to advertise their subscriptions, every
+ * channel is assumed to be wanted. */
+static int
+_channel_wanted (lcm_udpm_t *lcm, const char *channel)
+{
+    int wanted = 1;
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (!lcm->advert_ready) {
+        int64_t now = lcm_timestamp_now ();
+        if (!lcm->advert_ready_utime)
+            lcm->advert_ready_utime = now + ADVERTISE_TIMEOUT_USEC;
+        lcm->advert_ready = now >= lcm->advert_ready_utime;
+    }
+    if (lcm->advert_ready) {
+        gpointer cached = g_hash_table_lookup (lcm->wanted_channels, channel);
+        if (cached) {
+            wanted = cached == CHANNEL_WANTED;
+        } else {
+            wanted = _patterns_match (lcm->local_patterns, channel);
+            GHashTableIter iter;
+            gpointer value;
+            g_hash_table_iter_init (&iter, lcm->remote_subs);
+            while (!wanted && g_hash_table_iter_next (&iter, NULL, &value))
+                wanted = _patterns_match (((udpm_advert_t *) value)->patterns,
+                        channel);
+            g_hash_table_insert (lcm->wanted_channels, strdup (channel),
+                    wanted ? CHANNEL_WANTED : CHANNEL_UNWANTED);
+        }
+    }
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    return wanted;
+}
+
+/* Announce again the kept messages that are due, and return when the next
+ * one is, or 0 if none is.  The messages are kept in the order they were
+ * sent, so the ones still to be announced again are at the tail of
+ * sent_msgs.  transmit_lock must be held. */
+static int64_t
+_reannounce_messages (lcm_udpm_t *lcm, int64_t now)
+{
+    int64_t next_utime = 0;
+    for (GList *link = lcm->sent_msgs->tail; link; link = link->prev) {
+        udpm_sent_msg_t *msg = (udpm_sent_msg_t *) link->data;
+        if (msg->num_reannounced >= UDPM_REANNOUNCE_TIMES)
+            break;
+        if (now >= msg->reannounce_utime) {
+            _send_announcement (lcm, msg);
+            msg->num_reannounced++;
+            msg->reannounce_utime = now +
+                ((int64_t) UDPM_REANNOUNCE_USEC << msg->num_reannounced);
+            if (msg->num_reannounced >= UDPM_REANNOUNCE_TIMES)
+                continue;
+        }
+        if (!next_utime || msg->reannounce_utime < next_utime)
+            next_utime = msg->reannounce_utime;
+    }
+    return next_utime;
+}
+
+/* Sends the packets that are due later: the coalesced messages once they
+ * have waited for coalesce_us, the subscription advertisements, and the
+ * announcements of reliable messages. */
+static void *
+send_thread (void *user)
+{
+#ifdef G_OS_UNIX
+    // Mask out all signals on this thread.
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+#endif
+
+    lcm_udpm_t *lcm = (lcm_udpm_t *) user;
+    GMutex *mutex = g_static_mutex_get_mutex (&lcm->transmit_lock);
+
+    g_mutex_lock (mutex);
+    while (1) {
+        int64_t now = lcm_timestamp_now ();
+        if (lcm->coalesce_len && now >= lcm->coalesce_deadline) {
+            if (_flush_coalesced (lcm) < 0)
+                perror ("LCM: sending coalesced messages");
+        }
+        if (lcm->params.advertise && now >= lcm->next_advert_utime) {
+            _expire_advertisements (lcm, now);
+            // a process without subscriptions only says so when it changes
+            if (lcm->local_patterns->len || !lcm->next_advert_utime)
+                _send_advertisement (lcm);
+            lcm->next_advert_utime = now + ADVERTISE_INTERVAL_USEC;
+        }
+        int64_t reannounce_utime = lcm->sent_msgs ?
+            _reannounce_messages (lcm, now) : 0;
+        if (lcm->send_quit)
+            break;
+
+        int64_t deadline = lcm->params.advertise ? lcm->next_advert_utime : 0;
+        if (reannounce_utime && (!deadline || reannounce_utime < deadline))
+            deadline = reannounce_utime;
+        if (lcm->coalesce_len && (!deadline ||
+                    lcm->coalesce_deadline < deadline))
+            deadline = lcm->coalesce_deadline;
+        if (!deadline) {
+            g_cond_wait (lcm->send_cond, mutex);
+            continue;
+        }
+        GTimeVal until;
+        until.tv_sec = deadline / 1000000;
+        until.tv_usec = deadline % 1000000;
+        g_cond_timed_wait (lcm->send_cond, mutex, &until);
+    }
+    g_mutex_unlock (mutex);
+    return NULL;
+}
+
+/* Add a short message to the packet of coalesced messages, sending the
+ * packet first if the message doesn't fit. */
+static int
+_coalesce_message (lcm_udpm_t *lcm, const char *channel, int channel_size,
+        const void *data, unsigned int datalen, const lcm2_trace_ext_t *trace)
+{
+    uint16_t size = sizeof (lcm2_header_short_t) + channel_size + 1 + datalen +
+        (trace ? sizeof (*trace) : 0);
+    int status = 0;
+
+    g_static_mutex_lock (&lcm->transmit_lock);
+    if (lcm->coalesce_len + sizeof (size) + size > lcm->params.coalesce_bytes)
+        status = _flush_coalesced (lcm);
+    if (!lcm->coalesce_len) {
+        uint32_t magic = htonl (LCM2_MAGIC_COALESCED);
+        memcpy (lcm->coalesce_buf, &magic, sizeof (magic));
+        lcm->coalesce_len = sizeof (magic);
+        lcm->coalesce_deadline = lcm_timestamp_now () +
+            lcm->params.coalesce_us;
+        g_cond_signal (lcm->send_cond);
+    }
+
+    char *pos = lcm->coalesce_buf + lcm->coalesce_len;
+    uint16_t nsize = htons (size);
+    memcpy (pos, &nsize, sizeof (nsize));
+    pos += sizeof (nsize);
+    lcm2_header_short_t hdr;
+    hdr.magic = htonl (trace ? LCM2_MAGIC_SHORT_TRACED : LCM2_MAGIC_SHORT);
+    hdr.msg_seqno = htonl (lcm->msg_seqno);
+    memcpy (pos, &hdr, sizeof (hdr));
+    pos += sizeof (hdr);
+    if (trace) {
+        memcpy (pos, trace, sizeof (*trace));
+        pos += sizeof (*trace);
+    }
+    memcpy (pos, channel, channel_size + 1);
+    pos += channel_size + 1;
+    memcpy (pos, data, datalen);
+    lcm->coalesce_len += sizeof (nsize) + size;
+
+    lcm->msg_seqno ++;
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    return status;
+}
+
+/* Keep a fragmented message to send again, dropping the oldest ones kept
+ * to make room, and announce it.  transmit_lock must be held. */
+static void
+_keep_for_retransmit (lcm_udpm_t *lcm, uint32_t msg_seqno, const char *channel,
+        const void *data, unsigned int datalen, int nfragments,
+        const lcm2_trace_ext_t *trace)
+{
+    int64_t max_bytes = (int64_t) lcm->params.reliable_mb << 20;
+    if (datalen > max_bytes)
+        return;
+    while (lcm->sent_bytes + datalen > max_bytes) {
+        udpm_sent_msg_t *old = (udpm_sent_msg_t *) g_queue_pop_head (
+                lcm->sent_msgs);
+        g_hash_table_remove (lcm->sent_by_seqno,
+                GUINT_TO_POINTER (old->msg_seqno));
+        lcm->sent_bytes -= old->datalen;
+        _sent_msg_free (old);
+    }
+
+    udpm_sent_msg_t *msg = (udpm_sent_msg_t *) calloc (1,
+            sizeof (udpm_sent_msg_t));
+    msg->msg_seqno = msg_seqno;
+    msg->channel = strdup (channel);
+    msg->data = (char *) malloc (datalen);
+    memcpy (msg->data, data, datalen);
+    msg->datalen = datalen;
+    msg->nfragments = nfragments;
+    if (trace) {
+        msg->trace = *trace;
+        msg->traced = 1;
+    }
+    msg->resent = (uint8_t *) calloc ((nfragments + 7) / 8, 1);
+    msg->sent_utime = lcm_timestamp_now ();
+    msg->reannounce_utime = msg->sent_utime + UDPM_REANNOUNCE_USEC;
+    g_queue_push_tail (lcm->sent_msgs, msg);
+    g_hash_table_replace (lcm->sent_by_seqno, GUINT_TO_POINTER (msg_seqno),
+            msg);
+    lcm->sent_bytes += datalen;
+
+    _send_announcement (lcm, msg);
+    g_cond_signal (lcm->send_cond);
 }
 
 static int 
@@ -614,26 +1885,64 @@ lcm_udpm_publish (lcm_udpm_t *lcm, const char *channel, const void *data,
         return -1;
     }
 
+    if (lcm->params.advertise) {
+        // the receive threads hear the other processes' advertisements
+        if (!g_atomic_int_get (&lcm->thread_created))
+            _setup_recv_parts (lcm);
+        if (!_channel_wanted (lcm, channel))
+            return 0;
+    }
+    if (lcm->params.reliable && !g_atomic_int_get (&lcm->thread_created)) {
+        // and the receivers' NACKs
+        _setup_recv_parts (lcm);
+    }
+
+    // the time is taken before any coalescing delay, which is part of the
+    // latency
+    lcm2_trace_ext_t trace_ext;
+    lcm2_trace_ext_t *trace = NULL;
+    int trace_size = 0;
+    if (lcm->params.trace) {
+        lcm2_trace_ext_init (&trace_ext, lcm_timestamp_now (), lcm_host_id ());
+        trace = &trace_ext;
+        trace_size = sizeof (trace_ext);
+    }
+
     int payload_size = channel_size + 1 + datalen;
-    if (payload_size <= LCM_SHORT_MESSAGE_MAX_SIZE) {
+    if (lcm->params.coalesce_us > 0 && sizeof (uint32_t) + sizeof (uint16_t) +
+            sizeof (lcm2_header_short_t) + trace_size + payload_size <=
+            lcm->params.coalesce_bytes)
+        return _coalesce_message (lcm, channel, channel_size, data, datalen,
+                trace);
+
+    if (payload_size + trace_size <= LCM_SHORT_MESSAGE_MAX_SIZE) {
         // message is short.  send in a single packet
 
         g_static_mutex_lock (&lcm->transmit_lock);
+        // keep the messages in order
+        if (_flush_coalesced (lcm) < 0)
+            perror ("LCM: sending coalesced messages");
 
         lcm2_header_short_t hdr;
-        hdr.magic = htonl (LCM2_MAGIC_SHORT);
+        hdr.magic = htonl (trace ? LCM2_MAGIC_SHORT_TRACED : LCM2_MAGIC_SHORT);
         hdr.msg_seqno = htonl(lcm->msg_seqno);
 
-        struct iovec sendbufs[3];
-        sendbufs[0].iov_base = (char *) &hdr;
-        sendbufs[0].iov_len = sizeof (hdr);
-        sendbufs[1].iov_base = (char *) channel;
-        sendbufs[1].iov_len = channel_size + 1;
-        sendbufs[2].iov_base = (char *) data;
-        sendbufs[2].iov_len = datalen;
+        struct iovec sendbufs[4];
+        int nbufs = 0;
+        sendbufs[nbufs].iov_base = (char *) &hdr;
+        sendbufs[nbufs++].iov_len = sizeof (hdr);
+        if (trace) {
+            sendbufs[nbufs].iov_base = (char *) trace;
+            sendbufs[nbufs++].iov_len = trace_size;
+        }
+        sendbufs[nbufs].iov_base = (char *) channel;
+        sendbufs[nbufs++].iov_len = channel_size + 1;
+        sendbufs[nbufs].iov_base = (char *) data;
+        sendbufs[nbufs++].iov_len = datalen;
 
         // transmit
-        int packet_size = datalen + sizeof (hdr) + channel_size + 1;
+        int packet_size = datalen + sizeof (hdr) + trace_size +
+            channel_size + 1;
         dbg (DBG_LCM_MSG, "transmitting %d byte [%s] payload (%d byte pkt)\n", 
                 datalen, channel, packet_size);
 
@@ -642,7 +1951,7 @@ lcm_udpm_publish (lcm_udpm_t *lcm, const char *channel, const void *data,
         msg.msg_name = (struct sockaddr*) &lcm->dest_addr;
         msg.msg_namelen = sizeof(lcm->dest_addr);
         msg.msg_iov = sendbufs;
-        msg.msg_iovlen = 3;
+        msg.msg_iovlen = nbufs;
         msg.msg_control = NULL;
         msg.msg_controllen = 0;
         msg.msg_flags = 0;
@@ -656,7 +1965,7 @@ lcm_udpm_publish (lcm_udpm_t *lcm, const char *channel, const void *data,
     } else {
         // message is large.  fragment into multiple packets
 
-        int fragment_size = LCM_FRAGMENT_MAX_PAYLOAD;
+        int fragment_size = lcm_fragment_max_payload (trace != NULL);
         int nfragments = payload_size / fragment_size +
             !!(payload_size % fragment_size);
 
@@ -669,140 +1978,144 @@ lcm_udpm_publish (lcm_udpm_t *lcm, const char *channel, const void *data,
         // together, and so that no other message uses the same sequence number
         // (at least until the sequence # rolls over)
         g_static_mutex_lock (&lcm->transmit_lock);
+        if (_flush_coalesced (lcm) < 0)
+            perror ("LCM: sending coalesced messages");
         dbg (DBG_LCM_MSG, "transmitting %d byte [%s] payload in %d fragments\n",
                 payload_size, channel, nfragments);
 
-        uint32_t fragment_offset = 0;
-
-        lcm2_header_long_t hdr;
-        hdr.magic = htonl (LCM2_MAGIC_LONG);
-        hdr.msg_seqno = htonl (lcm->msg_seqno);
-        hdr.msg_size = htonl (datalen);
-        hdr.fragment_offset = 0;
-        hdr.fragment_no = 0;
-        hdr.fragments_in_msg = htons (nfragments);
-
-        // first fragment is special.  insert channel before data
-        int firstfrag_datasize = fragment_size - (channel_size + 1);
-        assert (firstfrag_datasize <= datalen);
-
-        struct iovec    first_sendbufs[3];
-        first_sendbufs[0].iov_base = (char *) &hdr;
-        first_sendbufs[0].iov_len = sizeof (hdr);
-        first_sendbufs[1].iov_base = (char *) channel;
-        first_sendbufs[1].iov_len = channel_size + 1;
-        first_sendbufs[2].iov_base = (char *) data;
-        first_sendbufs[2].iov_len = firstfrag_datasize;
-
-        int packet_size = sizeof (hdr) + channel_size + 1 + firstfrag_datasize;
-        fragment_offset += firstfrag_datasize;
-//        int status = writev (lcm->sendfd, first_sendbufs, 3);
-        struct msghdr msg;
-        msg.msg_name = (struct sockaddr*) &lcm->dest_addr;
-        msg.msg_namelen = sizeof(lcm->dest_addr);
-        msg.msg_iov = first_sendbufs;
-        msg.msg_iovlen = 3;
-        msg.msg_control = NULL;
-        msg.msg_controllen = 0;
-        msg.msg_flags = 0;
-        int status = sendmsg(lcm->sendfd, &msg, 0);
-
-        // transmit the rest of the fragments
-        for (uint16_t frag_no=1; 
-                packet_size == status && frag_no<nfragments; 
-                frag_no++) {
-            hdr.fragment_offset = htonl (fragment_offset);
-            hdr.fragment_no = htons (frag_no);
-
-            int fraglen = MIN (fragment_size,
-                    datalen - fragment_offset);
-
-            struct iovec sendbufs[2];
-            sendbufs[0].iov_base = (char *) &hdr;
-            sendbufs[0].iov_len = sizeof (hdr);
-            sendbufs[1].iov_base = (char *) ((char *)data + fragment_offset);
-            sendbufs[1].iov_len = fraglen;
-
-//            status = writev (lcm->sendfd, sendbufs, 2);
-            msg.msg_iov = sendbufs;
-            msg.msg_iovlen = 2;
-            status = sendmsg(lcm->sendfd, &msg, 0);
-
-            fragment_offset += fraglen;
-            packet_size = sizeof (hdr) + fraglen;
-        }
-
-        // sanity check
-        if (0 == status) {
-            assert (fragment_offset == datalen);
-        }
-
-        lcm->msg_seqno ++;
+        uint32_t msg_seqno = lcm->msg_seqno ++;
+        int status = lcm_udpm_send_fragments (lcm->sendfd, &lcm->dest_addr,
+                msg_seqno, channel, data, datalen, nfragments, trace);
+        if (status == 0 && lcm->reliable_patterns &&
+                _patterns_match (lcm->reliable_patterns, channel))
+            _keep_for_retransmit (lcm, msg_seqno, channel, data, datalen,
+                    nfragments, trace);
         g_static_mutex_unlock (&lcm->transmit_lock);
+
+        return status;
     }
+}
 
+static int
+_messages_ready (lcm_udpm_t *lcm)
+{
+    for (int i = 0; i < lcm->num_recv_threads; i++)
+        if (!lcm_buf_handoff_is_empty (lcm->recv_threads[i].handoff))
+            return 1;
     return 0;
 }
 
-static int 
-lcm_udpm_handle (lcm_udpm_t *lcm)
+// Spin on the receive threads' queues for up to usec microseconds, rather
+// than sleep.  Returns 1 if a message is ready.
+static int
+_spin_until_ready (lcm_udpm_t *lcm, int64_t usec)
 {
-    int status;
-    char ch;
-    if(0 != _setup_recv_parts (lcm))
+    int64_t deadline = lcm_timestamp_now () + usec;
+    while (!_messages_ready (lcm)) {
+        if (lcm_timestamp_now () >= deadline)
+            return 0;
+        lcm_cpu_relax ();
+    }
+    return 1;
+}
+
+static int
+lcm_udpm_wait_ready (lcm_udpm_t *lcm, int timeout_millis)
+{
+    if (_setup_recv_parts (lcm) < 0)
         return -1;
+    if (!lcm->params.busy_poll)
+        return lcm_notify_poll (&lcm->notify, timeout_millis);
+    return _spin_until_ready (lcm, (int64_t) timeout_millis * 1000);
+}
 
-    /* Read one byte from the notify pipe.  This will block if no packets are
-     * available yet and wake up when they are. */
-    status = lcm_internal_pipe_read(lcm->notify_pipe[0], &ch, 1);
-    if (status == 0) {
-        fprintf (stderr, "Error: lcm_handle read 0 bytes from notify_pipe\n");
+static int
+lcm_udpm_handle_batch (lcm_udpm_t *lcm, int max_msgs)
+{
+    if(0 != _setup_recv_parts (lcm))
         return -1;
-    }
-    else if (status < 0) {
+
+    if (lcm->params.busy_poll &&
+            _spin_until_ready (lcm, LCM_BUSY_POLL_SPIN_USEC)) {
+        /* Spin until a message is queued, or sleep as usual below if none
+         * comes for a while.  The receive threads still post the
+         * notification for anyone polling the file descriptor, so take it
+         * down if it is posted. */
+        if (g_atomic_int_get (&lcm->notify_pending) &&
+                lcm_notify_wait(&lcm->notify) < 0) {
+            fprintf (stderr, "Error: lcm_handle read: %s\n",
+                    strerror (errno));
+            return -1;
+        }
+    } else if (lcm_notify_wait(&lcm->notify) < 0) {
+        /* Wait for the notification.  This will block if no packets are
+         * available yet and wake up when they are. */
         fprintf (stderr, "Error: lcm_handle read: %s\n", strerror (errno));
         return -1;
     }
 
-    /* Dequeue the next received packet */
-    g_static_rec_mutex_lock (&lcm->mutex);
-    lcm_buf_t * lcmb = lcm_buf_dequeue (lcm->inbufs_filled);
+    /* Clear the flag before looking for messages, so that any message
+     * queued from now on posts the notification again. */
+    g_atomic_int_set (&lcm->notify_pending, 0);
 
-    if (!lcmb) {
-        fprintf (stderr, 
-                "Error: no packet available despite getting notification.\n");
-        g_static_rec_mutex_unlock (&lcm->mutex);
-        return -1;
-    }
+    /* Handle up to max_msgs received messages, taking them from each receive
+     * thread in turn so that none of them is starved. */
+    int num_handled = 0;
+    int num_empty = 0;
+    while (num_handled < max_msgs && num_empty < lcm->num_recv_threads) {
+        udpm_recv_thread_t *rt = &lcm->recv_threads[lcm->next_recv_thread];
+        lcm->next_recv_thread =
+            (lcm->next_recv_thread + 1) % lcm->num_recv_threads;
 
-    /* If there are still packets in the queue, put something back in the pipe
-     * so that future invocations will get called. */
-    if (!lcm_buf_queue_is_empty (lcm->inbufs_filled))
-        if (lcm_internal_pipe_write(lcm->notify_pipe[1], "+", 1) < 0)
-            perror ("write to notify");
-    g_static_rec_mutex_unlock (&lcm->mutex);
+        lcm_buf_t *lcmb = lcm_buf_handoff_pop (rt->handoff);
+        if (!lcmb) {
+            num_empty++;
+            continue;
+        }
+        num_empty = 0;
+
+        lcm_recv_buf_t rbuf;
+        rbuf.data = (uint8_t*) lcmb->buf + lcmb->data_offset;
+        rbuf.data_size = lcmb->data_size;
+        rbuf.recv_utime = lcmb->recv_utime;
+        rbuf.recv_utime_ns = lcmb->recv_utime_ns;
+        rbuf.lcm = lcm->lcm;
+        rbuf.send_utime = lcmb->send_utime;
+        rbuf.send_host_id = lcmb->send_host_id;
+
+        if(lcm->creating_read_thread) {
+            // special case:  If we're creating the read thread and are in
+            // self-test mode, then only dispatch the self-test message.
+            if(!strcmp(lcmb->channel_name, SELF_TEST_CHANNEL))
+                lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
+        } else {
+            lcm_dispatch_handlers_id (lcm->lcm, &rbuf, lcmb->channel_name,
+                    lcmb->channel_id);
+        }
 
-    lcm_recv_buf_t rbuf;
-    rbuf.data = (uint8_t*) lcmb->buf + lcmb->data_offset;
-    rbuf.data_size = lcmb->data_size;
-    rbuf.recv_utime = lcmb->recv_utime;
-    rbuf.lcm = lcm->lcm;
+        /* Hand the buffer back to its receive thread for reuse */
+        lcm_buf_handoff_release (rt->handoff, lcmb);
+        num_handled++;
+    }
 
-    if(lcm->creating_read_thread) {
-        // special case:  If we're creating the read thread and are in
-        // self-test mode, then only dispatch the self-test message.
-        if(!strcmp(lcmb->channel_name, SELF_TEST_CHANNEL))
-            lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
-    } else {
-        lcm_dispatch_handlers (lcm->lcm, &rbuf, lcmb->channel_name);
+    /* If there are still messages queued, post the notification again so
+     * that future invocations will get called. */
+    for (int i = 0; i < lcm->num_recv_threads; i++) {
+        if (lcm_buf_handoff_is_empty (lcm->recv_threads[i].handoff))
+            continue;
+        if (g_atomic_int_compare_and_exchange (&lcm->notify_pending, 0, 1))
+            if (lcm_notify_post(&lcm->notify) < 0)
+                perror ("write to notify");
+        break;
     }
 
-    g_static_rec_mutex_lock (&lcm->mutex);
-    lcm_buf_free_data(lcmb, lcm->ringbuf);
-    lcm_buf_enqueue (lcm->inbufs_empty, lcmb);
-    g_static_rec_mutex_unlock (&lcm->mutex);
+    return num_handled;
+}
 
-    return 0;
+static int
+lcm_udpm_handle (lcm_udpm_t *lcm)
+{
+    return lcm_udpm_handle_batch (lcm, 1) < 0 ? -1 : 0;
 }
 
 static void
@@ -820,6 +2133,8 @@ udpm_self_test (lcm_udpm_t *lcm)
     // register a handler for the self test message
     lcm_subscription_t *h = lcm_subscribe (lcm->lcm, SELF_TEST_CHANNEL, 
                                            self_test_handler, &success);
+    // success lives on this stack frame, so never hand it to a worker thread
+    lcm_subscription_set_dispatch_mode (h, LCM_DISPATCH_INLINE);
 
     // transmit a message
     char *msg = "lcm self test";
@@ -836,7 +2151,7 @@ udpm_self_test (lcm_udpm_t *lcm)
     GTimeVal next_retransmit;
     lcm_timeval_add (&now, &retransmit_interval, &next_retransmit);
 
-    int recvfd = lcm->notify_pipe[0];
+    int recvfd = lcm_notify_get_fileno(&lcm->notify);
 
     do {
         GTimeVal selectto;
@@ -870,61 +2185,340 @@ udpm_self_test (lcm_udpm_t *lcm)
     return (success == 1)?0:-1;
 }
 
+/* Remember a self-test that passed, and report the result. */
+static void
+_self_test_done (lcm_udpm_t *lcm, int status)
+{
+    if (0 == status)
+        lcm_self_test_set_passed ("udpm", lcm->params.mc_addr,
+                lcm->params.mc_port, lcm->params.mc_ttl);
+    lcm_report_self_test (lcm->lcm, status);
+}
+
+/* Runs the self-test in the background.  It sends SELF_TEST_CHANNEL
+ * packets, which the receive threads look for instead of queueing them. */
+static void *
+self_test_thread (void *user)
+{
+#ifdef G_OS_UNIX
+    // Mask out all signals on this thread.
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+#endif
+
+    lcm_udpm_t *lcm = (lcm_udpm_t *) user;
+    GMutex *mutex = g_static_mutex_get_mutex (&lcm->transmit_lock);
+    int64_t now = lcm_timestamp_now ();
+    int64_t deadline = now + SELF_TEST_TIMEOUT_USEC;
+
+    dbg (DBG_LCM, "LCM: conducting self test in the background\n");
+    g_mutex_lock (mutex);
+    while (!lcm->self_test_received && !lcm->self_test_quit &&
+            now < deadline) {
+        // periodically retransmit, just in case
+        if (_send_short_packet (lcm, SELF_TEST_CHANNEL, lcm->self_test_nonce,
+                    sizeof (lcm->self_test_nonce)) < 0)
+            perror ("LCM: sending self test");
+        int64_t retransmit = MIN (now + SELF_TEST_RETRANSMIT_USEC, deadline);
+        GTimeVal until;
+        until.tv_sec = retransmit / 1000000;
+        until.tv_usec = retransmit % 1000000;
+        g_cond_timed_wait (lcm->self_test_cond, mutex, &until);
+        now = lcm_timestamp_now ();
+    }
+    int status = lcm->self_test_received ? 0 : -1;
+    int quit = lcm->self_test_quit;
+    g_atomic_int_set (&lcm->self_test_pending, 0);
+    g_mutex_unlock (mutex);
+    if (quit)
+        return NULL;
+
+    // stop accepting the self-test packets
+    g_static_rec_mutex_lock (&lcm->mutex);
+    _update_recv_filters (lcm);
+    g_static_rec_mutex_unlock (&lcm->mutex);
+
+    if (0 == status) {
+        dbg (DBG_LCM, "LCM: self test successful\n");
+    } else {
+        // the receive threads keep running, in case the network comes up
+        fprintf (stderr, "LCM self test failed!!\n"
+                "Check your routing tables and firewall settings\n");
+    }
+    _self_test_done (lcm, status);
+    return NULL;
+}
+
+/* Start the background self-test.  The receive threads are already
+ * looking for its packets. */
 static int
-_setup_recv_parts (lcm_udpm_t *lcm)
+_start_self_test (lcm_udpm_t *lcm)
 {
-    g_static_rec_mutex_lock(&lcm->mutex);
+    if (!lcm->self_test_cond)
+        lcm->self_test_cond = g_cond_new ();
+    lcm->self_test_thread = g_thread_create (self_test_thread, lcm, TRUE,
+            NULL);
+    if (!lcm->self_test_thread) {
+        fprintf (stderr, "Error: LCM failed to start self test thread\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // some thread synchronization code to ensure that only one thread sets up the
-    // receive thread, and that all threads entering this function after the thread
-    // setup begins wait for it to finish.
-    if(lcm->creating_read_thread) {
-        // check if this thread is the one creating the receive thread.
-        // If so, just return.
-        if(g_static_private_get(&CREATE_READ_THREAD_PKEY)) {
-            g_static_rec_mutex_unlock(&lcm->mutex);
-            return 0;
-        }
+static void
+_stop_self_test (lcm_udpm_t *lcm)
+{
+    if (!lcm->self_test_thread)
+        return;
+    g_static_mutex_lock (&lcm->transmit_lock);
+    lcm->self_test_quit = 1;
+    g_cond_signal (lcm->self_test_cond);
+    g_static_mutex_unlock (&lcm->transmit_lock);
+    g_thread_join (lcm->self_test_thread);
+    lcm->self_test_thread = NULL;
+}
 
-        // ugly bit with two mutexes because we can't use a GStaticRecMutex with a GCond
-        g_mutex_lock(lcm->create_read_thread_mutex);
-        g_static_rec_mutex_unlock(&lcm->mutex);
+static void
+_remove_subscription (lcm_udpm_t *lcm, const char *channel)
+{
+    int count = GPOINTER_TO_INT (g_hash_table_lookup (lcm->subscriptions,
+                channel));
+    if (count > 1)
+        g_hash_table_insert (lcm->subscriptions, strdup (channel),
+                GINT_TO_POINTER (count - 1));
+    else if (count == 1)
+        g_hash_table_remove (lcm->subscriptions, channel);
+}
 
-        // wait for the thread creating the read thread to finish
-        while(lcm->creating_read_thread) {
-            g_cond_wait(lcm->create_read_thread_cond, lcm->create_read_thread_mutex);
-        }
-        g_mutex_unlock(lcm->create_read_thread_mutex);
-        g_static_rec_mutex_lock(&lcm->mutex);
+#ifdef __linux__
+#define UDPM_FILTER_ACCEPT 0xffffffff
 
-        // if we've gotten here, then either the read thread is created, or it
-        // was not possible to do so.  Figure out which happened, and return.
-        int result = lcm->thread_created ? 0 : -1;
-        g_static_rec_mutex_unlock(&lcm->mutex);
-        return result;
-    } else if(lcm->thread_created) {
-        g_static_rec_mutex_unlock(&lcm->mutex);
+/* Append the instructions that accept the packet if the channel name at
+ * offset X of the packet starts with the @len bytes at @name, and otherwise
+ * fall through to the instruction after them. */
+static int
+_append_channel_match (struct sock_filter *code, int n, const char *name,
+        int len)
+{
+    int nchunks = len / 4 + (len % 4) / 2 + (len % 2);
+    int end = n + 3 + 2 * nchunks + 1;
+
+    // skip the comparisons if the packet is too short to hold the name
+    code[n] = (struct sock_filter) BPF_STMT (BPF_LD | BPF_W | BPF_LEN, 0);
+    n++;
+    code[n] = (struct sock_filter) BPF_STMT (BPF_ALU | BPF_SUB | BPF_X, 0);
+    n++;
+    code[n] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, len,
+            0, end - n - 1);
+    n++;
+
+    // compare the name a word at a time, in network byte order
+    for (int off = 0; off < len; ) {
+        int size = (len - off >= 4) ? 4 : (len - off >= 2) ? 2 : 1;
+        uint32_t k = 0;
+        for (int i = 0; i < size; i++)
+            k = (k << 8) | (uint8_t) name[off + i];
+        int width = (size == 4) ? BPF_W : (size == 2) ? BPF_H : BPF_B;
+        code[n] = (struct sock_filter) BPF_STMT (BPF_LD | width | BPF_IND,
+                off);
+        n++;
+        code[n] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, k,
+                0, end - n - 1);
+        n++;
+        off += size;
+    }
+    code[n] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K,
+            UDPM_FILTER_ACCEPT);
+    n++;
+    assert (n == end);
+    return n;
+}
+
+/* Build the socket filter for one receive thread's socket.  With several
+ * receive threads, it only accepts packets from the senders assigned to the
+ * thread's shard.  Senders are assigned by their address and port, which the
+ * filter reads from the IP and UDP headers.
+ *
+ * If every subscription is to a literal channel name or a prefix, it also
+ * drops the first packet of messages on other channels.  The remaining
+ * fragments of a long message carry no channel name, and are dropped by
+ * _recv_message_fragment () when the first one is missing.  With advertise,
+ * it also accepts the subscription advertisements, and while the background
+ * self-test runs, its packets.  It accepts the announcements of reliable
+ * messages if there are any subscriptions, and with reliable, the NACKs.
+ *
+ * Returns the number of instructions, or 0 if no filter is needed.  Sets
+ * @filtered if the filter drops some channels. */
+static int
+_build_recv_filter (lcm_udpm_t *lcm, int shard, struct sock_filter **result,
+        int *filtered)
+{
+    int num_shards = lcm->num_recv_threads;
+    int num_subs = g_hash_table_size (lcm->subscriptions);
+    *filtered = 0;
+    *result = NULL;
+
+    int self_test = g_atomic_int_get (&lcm->self_test_pending);
+    int num_channels = num_subs + (lcm->params.advertise ? 1 : 0) +
+        (self_test ? 1 : 0) + (num_subs ? 1 : 0) +
+        (lcm->params.reliable ? 1 : 0);
+    int by_channel = lcm->params.channel_filter && num_channels > 0;
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init (&iter, lcm->subscriptions);
+    while (by_channel && g_hash_table_iter_next (&iter, &key, NULL)) {
+        int prefix_len;
+        if (lcm_classify_subscription ((char *) key, &prefix_len) ==
+                LCM_SUBSCRIPTION_REGEX)
+            by_channel = 0;
+    }
+
+    // each channel takes at most 4 + 2 * ceil (len / 4) instructions
+    int max_per_channel = 4 + 2 * ((LCM_MAX_CHANNEL_NAME_LENGTH + 4) / 4);
+    int max_len = 32 + (by_channel ? num_channels * max_per_channel : 0);
+    if (max_len > BPF_MAXINSNS) {
+        dbg (DBG_LCM, "LCM: too many channels to filter in the kernel\n");
+        by_channel = 0;
+        max_len = 32;
+    }
+    if (num_shards <= 1 && !by_channel)
         return 0;
+
+    struct sock_filter *code = (struct sock_filter *) calloc (max_len,
+            sizeof (struct sock_filter));
+    int n = 0;
+#define EMIT(insn) (code[n++] = (struct sock_filter) insn)
+
+    if (num_shards > 1) {
+        // A = source address ^ source port
+        EMIT (BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12));
+        EMIT (BPF_STMT (BPF_MISC | BPF_TAX, 0));
+        EMIT (BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 0));
+        EMIT (BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0));
+        // drop the packet unless A % num_shards == shard
+        EMIT (BPF_STMT (BPF_ALU | BPF_MOD | BPF_K, num_shards));
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, shard, 1, 0));
+        EMIT (BPF_STMT (BPF_RET | BPF_K, 0));
     }
 
-    // no other thread is trying to create the read thread right now.  claim that task.
-    lcm->creating_read_thread = 1;
-    lcm->create_read_thread_mutex = g_mutex_new();
-    lcm->create_read_thread_cond = g_cond_new();
-    // mark this thread as the one creating the read thread
-    g_static_private_set(&CREATE_READ_THREAD_PKEY, GINT_TO_POINTER(1), NULL);
+    if (by_channel) {
+        // the LCM header follows the 8 byte UDP header.  Point X at the
+        // channel name, which follows the LCM header.
+        int hdr = 8;
+        int ext = sizeof (lcm2_trace_ext_t);
+        EMIT (BPF_STMT (BPF_LD | BPF_W | BPF_ABS, hdr));
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, LCM2_MAGIC_SHORT, 0, 2));
+        EMIT (BPF_STMT (BPF_LDX | BPF_W | BPF_IMM,
+                    hdr + sizeof (lcm2_header_short_t)));
+        EMIT (BPF_STMT (BPF_JMP | BPF_JA, 12));
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, LCM2_MAGIC_SHORT_TRACED,
+                    0, 2));
+        EMIT (BPF_STMT (BPF_LDX | BPF_W | BPF_IMM,
+                    hdr + sizeof (lcm2_header_short_t) + ext));
+        EMIT (BPF_STMT (BPF_JMP | BPF_JA, 9));
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, LCM2_MAGIC_LONG, 0, 2));
+        EMIT (BPF_STMT (BPF_LDX | BPF_W | BPF_IMM,
+                    hdr + sizeof (lcm2_header_long_t)));
+        EMIT (BPF_STMT (BPF_JMP | BPF_JA, 3));
+        // accept other packets, so they are counted as bad
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, LCM2_MAGIC_LONG_TRACED,
+                    1, 0));
+        EMIT (BPF_STMT (BPF_RET | BPF_K, UDPM_FILTER_ACCEPT));
+        EMIT (BPF_STMT (BPF_LDX | BPF_W | BPF_IMM,
+                    hdr + sizeof (lcm2_header_long_t) + ext));
+        // only the first fragment has the channel name
+        EMIT (BPF_STMT (BPF_LD | BPF_H | BPF_ABS,
+                    hdr + offsetof (lcm2_header_long_t, fragment_no)));
+        EMIT (BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0));
+        EMIT (BPF_STMT (BPF_RET | BPF_K, UDPM_FILTER_ACCEPT));
+
+        // literal names are compared along with their terminating NUL
+        g_hash_table_iter_init (&iter, lcm->subscriptions);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            const char *channel = (const char *) key;
+            int len = strlen (channel) + 1;
+            lcm_classify_subscription (channel, &len);
+            n = _append_channel_match (code, n, channel, len);
+        }
+        if (lcm->params.advertise)
+            n = _append_channel_match (code, n, ADVERTISE_CHANNEL,
+                    sizeof (ADVERTISE_CHANNEL));
+        if (self_test)
+            n = _append_channel_match (code, n, SELF_TEST_CHANNEL,
+                    sizeof (SELF_TEST_CHANNEL));
+        if (num_subs)
+            n = _append_channel_match (code, n, RELIABLE_CHANNEL,
+                    sizeof (RELIABLE_CHANNEL));
+        if (lcm->params.reliable)
+            n = _append_channel_match (code, n, NACK_CHANNEL,
+                    sizeof (NACK_CHANNEL));
+        EMIT (BPF_STMT (BPF_RET | BPF_K, 0));
+        *filtered = 1;
+    } else {
+        EMIT (BPF_STMT (BPF_RET | BPF_K, UDPM_FILTER_ACCEPT));
+    }
+#undef EMIT
 
-    dbg (DBG_LCM, "allocating resources for receiving messages\n");
+    assert (n <= max_len);
+    *result = code;
+    return n;
+}
+#endif
+
+/* Attach the socket filter for one receive thread's socket, or remove the
+ * socket's filter if it no longer needs one.  Returns -1 on failure. */
+static int
+_attach_recv_filter (lcm_udpm_t *lcm, SOCKET fd, int shard)
+{
+#ifdef __linux__
+    struct sock_filter *code;
+    int filtered;
+    int len = _build_recv_filter (lcm, shard, &code, &filtered);
+    g_atomic_int_set (&lcm->channel_filtered, filtered);
+    if (!len) {
+        int dummy = 0;
+        if (setsockopt (fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy,
+                    sizeof (dummy)) < 0 && errno != ENOENT)
+            return -1;
+        return 0;
+    }
 
-    // allocate the fragment buffer hashtable
-    lcm->frag_bufs = lcm_frag_buf_store_new(MAX_FRAG_BUF_TOTAL_SIZE,
-            MAX_NUM_FRAG_BUFS);
+    struct sock_fprog prog;
+    prog.len = len;
+    prog.filter = code;
+    int status = setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+            sizeof (prog));
+    free (code);
+    if (status < 0)
+        g_atomic_int_set (&lcm->channel_filtered, 0);
+    return status;
+#else
+    return 0;
+#endif
+}
+
+/* Rebuild the receive sockets' filters after the subscriptions change. */
+static void
+_update_recv_filters (lcm_udpm_t *lcm)
+{
+    for (int i = 0; i < lcm->num_recv_threads; i++) {
+        udpm_recv_thread_t *rt = &lcm->recv_threads[i];
+        if (rt->recvfd < 0)
+            continue;
+        if (_attach_recv_filter (lcm, rt->recvfd, i) < 0)
+            perror ("setsockopt (SOL_SOCKET, SO_ATTACH_FILTER)");
+    }
+}
 
-    // allocate multicast socket
-    lcm->recvfd = socket (AF_INET, SOCK_DGRAM, 0);
-    if (lcm->recvfd < 0) {
+/* Open a socket that receives the packets for one receive thread. */
+static SOCKET
+_open_recv_socket (lcm_udpm_t *lcm, int shard)
+{
+    SOCKET fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
         perror ("allocating LCM recv socket");
-        goto setup_recv_thread_fail;
+        return -1;
     }
 
     struct sockaddr_in addr;
@@ -937,10 +2531,10 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     // multicast address and port
     int opt=1;
     dbg (DBG_LCM, "LCM: setting SO_REUSEADDR\n");
-    if (setsockopt (lcm->recvfd, SOL_SOCKET, SO_REUSEADDR, 
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, 
             (char*)&opt, sizeof (opt)) < 0) {
         perror ("setsockopt (SOL_SOCKET, SO_REUSEADDR)");
-        goto setup_recv_thread_fail;
+        goto fail;
     }
 
 #ifdef USE_REUSEPORT
@@ -948,10 +2542,10 @@ _setup_recv_parts (lcm_udpm_t *lcm)
      * to REUSEADDR or it won't let multiple processes bind to the
      * same port, even if they are using multicast. */
     dbg (DBG_LCM, "LCM: setting SO_REUSEPORT\n");
-    if (setsockopt (lcm->recvfd, SOL_SOCKET, SO_REUSEPORT, 
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, 
             (char*)&opt, sizeof (opt)) < 0) {
         perror ("setsockopt (SOL_SOCKET, SO_REUSEPORT)");
-        goto setup_recv_thread_fail;
+        goto fail;
     }
 #endif
 
@@ -960,7 +2554,7 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     // are also delivered to it
     unsigned char lo_opt = 1;
     dbg (DBG_LCM, "LCM: setting multicast loopback option\n");
-    status = setsockopt (lcm->recvfd, IPPROTO_IP, IP_MULTICAST_LOOP, 
+    status = setsockopt (fd, IPPROTO_IP, IP_MULTICAST_LOOP, 
             &lo_opt, sizeof (lo_opt));
     if (status < 0) {
         perror ("setting multicast loopback");
@@ -972,23 +2566,23 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     // Windows has small (8k) buffer by default
     // Increase it to a default reasonable amount
     int recv_buf_size = 2048 * 1024;
-    setsockopt(lcm->recvfd, SOL_SOCKET, SO_RCVBUF, 
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, 
             (char*)&recv_buf_size, sizeof(recv_buf_size));
 #endif
 
     // debugging... how big is the receive buffer?
     unsigned int retsize = sizeof (int);
-    getsockopt (lcm->recvfd, SOL_SOCKET, SO_RCVBUF, 
+    getsockopt (fd, SOL_SOCKET, SO_RCVBUF, 
             (char*)&lcm->kernel_rbuf_sz, (socklen_t *) &retsize);
     dbg (DBG_LCM, "LCM: receive buffer is %d bytes\n", lcm->kernel_rbuf_sz);
     if (lcm->params.recv_buf_size) {
-        if (setsockopt (lcm->recvfd, SOL_SOCKET, SO_RCVBUF,
+        if (setsockopt (fd, SOL_SOCKET, SO_RCVBUF,
                 (char *) &lcm->params.recv_buf_size, 
                 sizeof (lcm->params.recv_buf_size)) < 0) {
             perror ("setsockopt(SOL_SOCKET, SO_RCVBUF)");
             fprintf (stderr, "Warning: Unable to set recv buffer size\n");
         }
-        getsockopt (lcm->recvfd, SOL_SOCKET, SO_RCVBUF, 
+        getsockopt (fd, SOL_SOCKET, SO_RCVBUF, 
                 (char*)&lcm->kernel_rbuf_sz, (socklen_t *) &retsize);
         dbg (DBG_LCM, "LCM: receive buffer is %d bytes\n", lcm->kernel_rbuf_sz);
 
@@ -1003,13 +2597,41 @@ _setup_recv_parts (lcm_udpm_t *lcm)
 
     /* Enable per-packet timestamping by the kernel, if available */
 #ifdef SO_TIMESTAMP
+    lcm_enable_recv_timestamps (fd);
+#endif
+
+    /* Have the kernel report how many packets it has dropped, if available */
+#ifdef SO_RXQ_OVFL
     opt = 1;
-    setsockopt (lcm->recvfd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof (opt));
+    setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof (opt));
+#endif
+
+#ifdef __linux__
+    /* Every socket bound to the multicast port receives a copy of each
+     * packet, so with several receive threads each socket only accepts the
+     * packets of its own share of the senders. */
+    if (lcm->num_recv_threads > 1) {
+        dbg (DBG_LCM, "LCM: setting SO_REUSEPORT\n");
+        if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+                (char*)&opt, sizeof (opt)) < 0) {
+            perror ("setsockopt (SOL_SOCKET, SO_REUSEPORT)");
+            goto fail;
+        }
+    }
 #endif
 
-    if (bind (lcm->recvfd, (struct sockaddr*)&addr, sizeof (addr)) < 0) {
+    if (lcm->params.busy_poll)
+        lcm_set_busy_poll (fd);
+
+    /* Drop the packets this socket has no use for as early as possible */
+    if (_attach_recv_filter (lcm, fd, shard) < 0) {
+        perror ("setsockopt (SOL_SOCKET, SO_ATTACH_FILTER)");
+        goto fail;
+    }
+
+    if (bind (fd, (struct sockaddr*)&addr, sizeof (addr)) < 0) {
         perror ("bind");
-        goto setup_recv_thread_fail;
+        goto fail;
     }
 
     struct ip_mreq mreq;
@@ -1017,22 +2639,110 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     mreq.imr_interface.s_addr = INADDR_ANY;
     // join the multicast group
     dbg (DBG_LCM, "LCM: joining multicast group\n");
-    if (setsockopt (lcm->recvfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+    if (setsockopt (fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
             (char*)&mreq, sizeof (mreq)) < 0) {
         perror ("setsockopt (IPPROTO_IP, IP_ADD_MEMBERSHIP)");
-        goto setup_recv_thread_fail;
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    lcm_close_socket (fd);
+    return -1;
+}
+
+static int
+_setup_recv_parts (lcm_udpm_t *lcm)
+{
+    g_static_rec_mutex_lock(&lcm->mutex);
+
+    // some thread synchronization code to ensure that only one thread sets up the
+    // receive thread, and that all threads entering this function after the thread
+    // setup begins wait for it to finish.
+    if(lcm->creating_read_thread) {
+        // check if this thread is the one creating the receive thread.
+        // If so, just return.
+        if(g_static_private_get(&CREATE_READ_THREAD_PKEY)) {
+            g_static_rec_mutex_unlock(&lcm->mutex);
+            return 0;
+        }
+
+        // ugly bit with two mutexes because we can't use a GStaticRecMutex with a GCond
+        g_mutex_lock(lcm->create_read_thread_mutex);
+        g_static_rec_mutex_unlock(&lcm->mutex);
+
+        // wait for the thread creating the read thread to finish
+        while(lcm->creating_read_thread) {
+            g_cond_wait(lcm->create_read_thread_cond, lcm->create_read_thread_mutex);
+        }
+        g_mutex_unlock(lcm->create_read_thread_mutex);
+        g_static_rec_mutex_lock(&lcm->mutex);
+
+        // if we've gotten here, then either the read thread is created, or it
+        // was not possible to do so.  Figure out which happened, and return.
+        int result = lcm->thread_created ? 0 : -1;
+        g_static_rec_mutex_unlock(&lcm->mutex);
+        return result;
+    } else if(lcm->thread_created) {
+        g_static_rec_mutex_unlock(&lcm->mutex);
+        return 0;
     }
 
-    lcm->inbufs_empty = lcm_buf_queue_new ();
-    lcm->inbufs_filled = lcm_buf_queue_new ();
-    lcm->ringbuf = lcm_ringbuf_new (LCM_RINGBUF_SIZE);
+    // no other thread is trying to create the read thread right now.  claim that task.
+    lcm->creating_read_thread = 1;
+    lcm->create_read_thread_mutex = g_mutex_new();
+    lcm->create_read_thread_cond = g_cond_new();
+    // mark this thread as the one creating the read thread
+    g_static_private_set(&CREATE_READ_THREAD_PKEY, GINT_TO_POINTER(1), NULL);
+
+    dbg (DBG_LCM, "allocating resources for receiving messages\n");
+
+    // a self-test that passed on this multicast group isn't repeated
+    int self_test = lcm->params.self_test;
+    int passed_before = self_test != UDPM_SELF_TEST_OFF &&
+        lcm_self_test_passed ("udpm", lcm->params.mc_addr,
+                lcm->params.mc_port, lcm->params.mc_ttl);
+    if (passed_before)
+        self_test = UDPM_SELF_TEST_OFF;
+    if (self_test == UDPM_SELF_TEST_ASYNC) {
+        // before the sockets are opened, so that their filters accept the
+        // self-test packets
+        lcm->self_test_nonce[0] = g_random_int ();
+        lcm->self_test_nonce[1] = g_random_int ();
+        lcm->self_test_received = 0;
+        lcm->self_test_quit = 0;
+        g_atomic_int_set (&lcm->self_test_pending, 1);
+    }
 
-    int i;
-    for (i = 0; i < LCM_DEFAULT_RECV_BUFS; i++) {
-        /* We don't set the receive buffer's data pointer yet because it
-         * will be taken from the ringbuffer at receive time. */
-        lcm_buf_t * lcmb = (lcm_buf_t *) calloc (1, sizeof (lcm_buf_t));
-        lcm_buf_enqueue (lcm->inbufs_empty, lcmb);
+    lcm->num_recv_threads = lcm->params.recv_threads;
+#ifndef __linux__
+    if (lcm->num_recv_threads > 1) {
+        fprintf (stderr, "Warning: recv_threads is only supported on Linux\n");
+        lcm->num_recv_threads = 1;
+    }
+#endif
+    lcm->recv_threads = (udpm_recv_thread_t *) calloc (lcm->num_recv_threads,
+            sizeof (udpm_recv_thread_t));
+    for (int i = 0; i < lcm->num_recv_threads; i++)
+        lcm->recv_threads[i].recvfd = -1;
+    for (int i = 0; i < lcm->num_recv_threads; i++) {
+        udpm_recv_thread_t *rt = &lcm->recv_threads[i];
+        rt->lcm = lcm;
+        rt->index = i;
+
+        // allocate the fragment buffer hashtable
+        rt->frag_bufs = lcm_frag_buf_store_new(
+                lcm->params.mem.max_frag_buf_total_size, MAX_NUM_FRAG_BUFS);
+
+        rt->handoff = lcm_buf_handoff_new (&lcm->params.mem);
+        rt->seqnos = lcm_seqno_tracker_new ();
+        rt->reliable_done = lcm_frag_done_set_new (UDPM_RELIABLE_DONE_USEC);
+
+        // allocate multicast socket
+        rt->recvfd = _open_recv_socket (lcm, i);
+        if (rt->recvfd < 0)
+            goto setup_recv_thread_fail;
     }
 
     // setup a pipe for notifying the reader thread when to quit
@@ -1042,22 +2752,31 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     }
     fcntl (lcm->thread_msg_pipe[1], F_SETFL, O_NONBLOCK);
 
-    /* Start the reader thread */
-    lcm->read_thread = g_thread_create (recv_thread, lcm, TRUE, NULL);
-    if (!lcm->read_thread) {
-        fprintf (stderr, "Error: LCM failed to start reader thread\n");
-        goto setup_recv_thread_fail;
+    /* Start the reader threads */
+    for (int i = 0; i < lcm->num_recv_threads; i++) {
+        udpm_recv_thread_t *rt = &lcm->recv_threads[i];
+        rt->thread = g_thread_create (recv_thread, rt, TRUE, NULL);
+        if (!rt->thread) {
+            fprintf (stderr, "Error: LCM failed to start reader thread\n");
+            goto setup_recv_thread_fail;
+        }
+        lcm->thread_created = 1;
     }
-    lcm->thread_created = 1;
+    if (self_test == UDPM_SELF_TEST_ASYNC && _start_self_test (lcm) < 0)
+        goto setup_recv_thread_fail;
     g_static_rec_mutex_unlock(&lcm->mutex);
 
     // conduct a self-test just to make sure everything is working.
-    dbg (DBG_LCM, "LCM: conducting self test\n");
-    int self_test_results = udpm_self_test(lcm);
+    int self_test_results = 0;
+    if (self_test == UDPM_SELF_TEST_SYNC) {
+        dbg (DBG_LCM, "LCM: conducting self test\n");
+        self_test_results = udpm_self_test(lcm);
+    }
     g_static_rec_mutex_lock(&lcm->mutex);
 
     if (0 == self_test_results) {
-        dbg (DBG_LCM, "LCM: self test successful\n");
+        if (self_test == UDPM_SELF_TEST_SYNC)
+            dbg (DBG_LCM, "LCM: self test successful\n");
     } else {
         // self test failed.  destroy the read thread
         fprintf (stderr, "LCM self test failed!!\n"
@@ -1072,6 +2791,8 @@ _setup_recv_parts (lcm_udpm_t *lcm)
     g_mutex_unlock(lcm->create_read_thread_mutex);
     g_static_rec_mutex_unlock(&lcm->mutex);
 
+    if (passed_before || self_test == UDPM_SELF_TEST_SYNC)
+        _self_test_done (lcm, self_test_results);
     return self_test_results;
 
 setup_recv_thread_fail:
@@ -1085,10 +2806,23 @@ lcm_udpm_create (lcm_t * parent, const char *network, const GHashTable *args)
 {
     udpm_params_t params;
     memset (&params, 0, sizeof (udpm_params_t));
+    params.recv_threads = 1;
+    params.coalesce_bytes = UDPM_DEFAULT_COALESCE_BYTES;
+    params.self_test = UDPM_SELF_TEST_SYNC;
+    params.reliable_mb = UDPM_DEFAULT_RELIABLE_MB;
+    lcm_recv_mem_params_init (&params.mem);
 
     g_hash_table_foreach ((GHashTable*) args, new_argument, &params);
+#ifndef MSG_DONTWAIT
+    // the receive threads can't read without blocking
+    if (params.busy_poll) {
+        fprintf (stderr, "Warning: busy_poll is not supported here\n");
+        params.busy_poll = 0;
+    }
+#endif
 
     if (parse_mc_addr_and_port (network, &params) < 0) {
+        free (params.reliable);
         return NULL;
     }
 
@@ -1096,28 +2830,25 @@ lcm_udpm_create (lcm_t * parent, const char *network, const GHashTable *args)
 
     lcm->lcm = parent;
     lcm->params = params;
-    lcm->recvfd = -1;
     lcm->sendfd = -1;
+    lcm->subscriptions = g_hash_table_new_full (g_str_hash, g_str_equal,
+            free, NULL);
     lcm->thread_msg_pipe[0] = lcm->thread_msg_pipe[1] = -1;
-    lcm->udp_low_watermark = 1.0;
 
     lcm->kernel_rbuf_sz = 0;
     lcm->warned_about_small_kernel_buf = 0;
 
-    lcm->frag_bufs = NULL;
-
     // synchronization variables used when allocating receive resources
     lcm->creating_read_thread = 0;
     lcm->create_read_thread_mutex = NULL;
     lcm->create_read_thread_cond = NULL;
 
-    // internal notification pipe
-    if(0 != lcm_internal_pipe_create(lcm->notify_pipe)) {
-        perror(__FILE__ " pipe(create)");
+    // internal notification
+    if(0 != lcm_notify_init(&lcm->notify)) {
+        perror(__FILE__ " notify(create)");
         lcm_udpm_destroy (lcm);
         return NULL;
     }
-    fcntl (lcm->notify_pipe[1], F_SETFL, O_NONBLOCK);
 
     g_static_rec_mutex_init (&lcm->mutex);
     g_static_mutex_init (&lcm->transmit_lock);
@@ -1211,9 +2942,69 @@ lcm_udpm_create (lcm_t * parent, const char *network, const GHashTable *args)
 #endif
     }
 
+    if (params.coalesce_us > 0) {
+        dbg (DBG_LCM, "LCM: coalescing short messages for %d us\n",
+                params.coalesce_us);
+        lcm->coalesce_buf = (char *) malloc (params.coalesce_bytes);
+    }
+    if (params.advertise) {
+        dbg (DBG_LCM, "LCM: advertising subscriptions\n");
+        lcm->local_patterns = g_ptr_array_new ();
+        lcm->remote_subs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                g_free, _advert_free);
+        lcm->wanted_channels = g_hash_table_new_full (g_str_hash,
+                g_str_equal, free, NULL);
+    }
+    if (params.reliable) {
+        dbg (DBG_LCM, "LCM: keeping %d MB of [%s] messages to send again\n",
+                params.reliable_mb, params.reliable);
+        lcm->reliable_patterns = g_ptr_array_new ();
+        g_ptr_array_add (lcm->reliable_patterns,
+                _pattern_new (params.reliable));
+        lcm->sent_msgs = g_queue_new ();
+        lcm->sent_by_seqno = g_hash_table_new (g_direct_hash, g_direct_equal);
+        lcm->publisher_id = g_random_int ();
+    }
+    if (params.coalesce_us > 0 || params.advertise || params.reliable) {
+        lcm->send_cond = g_cond_new ();
+        lcm->send_thread = g_thread_create (send_thread, lcm, TRUE, NULL);
+        if (!lcm->send_thread) {
+            fprintf (stderr, "Error: LCM failed to start send thread\n");
+            g_cond_free (lcm->send_cond);
+            lcm_udpm_destroy (lcm);
+            return NULL;
+        }
+    }
+
     return lcm;
 }
 
+static int
+lcm_udpm_get_transport_stats (lcm_udpm_t *lcm, lcm_transport_stats_t *stats)
+{
+    g_static_rec_mutex_lock (&lcm->mutex);
+    for (int i = 0; i < lcm->num_recv_threads; i++) {
+        udpm_recv_thread_t *rt = &lcm->recv_threads[i];
+        stats->packets_received += rt->udp_rx;
+        stats->packets_bad += rt->udp_discarded_bad;
+        stats->kernel_drops += rt->kernel_drops;
+        if (rt->seqnos) {
+            stats->messages_lost += rt->seqnos->num_lost;
+            stats->messages_reordered += rt->seqnos->num_reordered;
+        }
+        if (rt->handoff)
+            stats->ringbuf_exhausted += rt->handoff->num_ringbuf_exhausted;
+        if (rt->frag_bufs) {
+            stats->reassembly_incomplete += rt->frag_bufs->num_incomplete;
+            stats->reassembly_timeouts += rt->frag_bufs->num_timed_out;
+            stats->reassembly_evictions += rt->frag_bufs->num_evicted;
+            stats->duplicate_fragments += rt->frag_bufs->num_duplicates;
+        }
+    }
+    g_static_rec_mutex_unlock (&lcm->mutex);
+    return 0;
+}
+
 #ifdef WIN32
 static lcm_provider_vtable_t udpm_vtable;
 #else
@@ -1221,10 +3012,13 @@ static lcm_provider_vtable_t udpm_vtable = {
     .create      = lcm_udpm_create,
     .destroy     = lcm_udpm_destroy,
     .subscribe   = lcm_udpm_subscribe,
-    .unsubscribe = NULL,
+    .unsubscribe = lcm_udpm_unsubscribe,
     .publish     = lcm_udpm_publish,
     .handle      = lcm_udpm_handle,
     .get_fileno  = lcm_udpm_get_fileno,
+    .handle_batch = lcm_udpm_handle_batch,
+    .get_transport_stats = lcm_udpm_get_transport_stats,
+    .wait_ready  = lcm_udpm_wait_ready,
 };
 #endif
 
@@ -1239,10 +3033,13 @@ lcm_udpm_provider_init (GPtrArray * providers)
     udpm_vtable.create      = lcm_udpm_create;
     udpm_vtable.destroy     = lcm_udpm_destroy;
     udpm_vtable.subscribe   = lcm_udpm_subscribe;
-    udpm_vtable.unsubscribe = NULL;
+    udpm_vtable.unsubscribe = lcm_udpm_unsubscribe;
     udpm_vtable.publish     = lcm_udpm_publish;
     udpm_vtable.handle      = lcm_udpm_handle;
     udpm_vtable.get_fileno  = lcm_udpm_get_fileno;
+    udpm_vtable.handle_batch = lcm_udpm_handle_batch;
+    udpm_vtable.get_transport_stats = lcm_udpm_get_transport_stats;
+    udpm_vtable.wait_ready  = lcm_udpm_wait_ready;
 #endif
     udpm_info.name = "udpm";
     udpm_info.vtable = &udpm_vtable;
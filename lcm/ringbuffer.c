@@ -5,12 +5,20 @@
 #include <assert.h>
 #include <stdint.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "ringbuffer.h"
 
 // must be power of 2
 #define ALIGNMENT 32
 
 #define MAGIC 0x067f8687
+// marks a chunk that was released while other chunks were still allocated on
+// both sides of it.  It is reclaimed once it becomes the head or the tail.
+#define RELEASED_MAGIC 0x067f8688
 typedef struct _lcm_ringbuf_rec lcm_ringbuf_rec_t;
 
 #define EXTRA_RETENTIVE 0
@@ -26,7 +34,9 @@ struct _lcm_ringbuf_rec
 
 struct _lcm_ringbuf {
     char *data;
-    unsigned int   size;                 // allocated size of data
+    unsigned int   size;                 // usable size of data
+    size_t         mapped;               // size of the mmap()ed data, or 0
+                                         // if it was malloc()ed
     unsigned int   used;                 // total bytes currently allocated
 
     lcm_ringbuf_rec_t *head;
@@ -53,9 +63,10 @@ static inline void ringbuf_self_test(lcm_ringbuf_t *ring)
 
     while (1) {
         assert(rec->prev == prev);
-        assert(rec->magic == MAGIC);
+        assert(rec->magic == MAGIC || rec->magic == RELEASED_MAGIC);
 
-        total_length += rec->length;
+        if (rec->magic == MAGIC)
+            total_length += rec->length;
 
         if (!rec->next)
             break;
@@ -80,15 +91,72 @@ lcm_ringbuf_new (unsigned int ring_size)
     ring = (lcm_ringbuf_t *) malloc (sizeof (lcm_ringbuf_t));
     ring->data = (char*) malloc (ring_size);
     ring->size = ring_size;
+    ring->mapped = 0;
     ring->used = 0;
     ring->head = NULL;
     ring->tail = NULL;
     return ring;
 }
 
+#ifdef __linux__
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+lcm_ringbuf_t *
+lcm_ringbuf_new_huge (unsigned int ring_size)
+{
+#ifdef __linux__
+    // pages reserved for huge page mappings are only mapped whole
+    size_t map_size = ((size_t) ring_size + HUGE_PAGE_SIZE - 1) &
+        ~(size_t) (HUGE_PAGE_SIZE - 1);
+    char *data = (char *) MAP_FAILED;
+#ifdef MAP_HUGETLB
+    data = (char *) mmap (NULL, map_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (data == MAP_FAILED) {
+        // otherwise, ask for transparent huge pages.  They only back the
+        // parts of a mapping that are aligned to a huge page, so a smaller
+        // ring can't use them.
+        if (ring_size < HUGE_PAGE_SIZE)
+            return lcm_ringbuf_new (ring_size);
+        size_t page_size = sysconf (_SC_PAGESIZE);
+        map_size = ((size_t) ring_size + page_size - 1) & ~(page_size - 1);
+
+        // map an extra huge page, and trim the mapping to start on a huge
+        // page boundary
+        char *raw = (char *) mmap (NULL, map_size + HUGE_PAGE_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return lcm_ringbuf_new (ring_size);
+        data = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) &
+                ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+        if (data > raw)
+            munmap (raw, data - raw);
+        munmap (data + map_size, raw + HUGE_PAGE_SIZE - data);
+#ifdef MADV_HUGEPAGE
+        madvise (data, map_size, MADV_HUGEPAGE);
+#endif
+    }
+
+    lcm_ringbuf_t * ring = (lcm_ringbuf_t *) calloc (1, sizeof (lcm_ringbuf_t));
+    ring->data = data;
+    ring->size = ring_size;
+    ring->mapped = map_size;
+    return ring;
+#else
+    return lcm_ringbuf_new (ring_size);
+#endif
+}
+
 void
 lcm_ringbuf_free (lcm_ringbuf_t * ring)
 {
+#ifdef __linux__
+    if (ring->mapped)
+        munmap (ring->data, ring->mapped);
+    else
+#endif
     free (ring->data);
     free (ring);
 }
@@ -175,36 +243,10 @@ lcm_ringbuf_used(lcm_ringbuf_t *ring)
     return ring->used;
 }
 
-void 
-lcm_ringbuf_shrink_last(lcm_ringbuf_t *ring, const char *buf, 
-        unsigned int newlen)
-{
-    ringbuf_self_test(ring);
-
-    lcm_ringbuf_rec_t *rec = 
-        (lcm_ringbuf_rec_t*) (buf - offsetof(lcm_ringbuf_rec_t, buf));
-    // make sure this is the most recent alloc
-    assert (rec == ring->tail);
-    assert (rec->magic == MAGIC);
-
-    // compute the new size
-    newlen += sizeof(lcm_ringbuf_rec_t);
-    newlen = (newlen + ALIGNMENT - 1) & (~(ALIGNMENT - 1));
-
-    assert (rec->length >= newlen);
-
-    unsigned int shrink_amount = rec->length - newlen;
-
-    rec->length      = newlen;
-    ring->used      -= shrink_amount;
-
-    assert(ring->used >= 0);
-    ringbuf_self_test(ring);
-}
-
 /* 
- * Releases a previously-allocated chunk of the ring buffer.  Only the most
- * recently allocated, or the least recently allocated chunk can be released.
+ * Releases a previously-allocated chunk of the ring buffer.  Chunks may be
+ * released in any order, but the space of a chunk is only reusable once every
+ * chunk allocated before it, or every chunk allocated after it, is released.
  */
 void lcm_ringbuf_dealloc (lcm_ringbuf_t * ring, char * buf)
 {
@@ -213,20 +255,34 @@ void lcm_ringbuf_dealloc (lcm_ringbuf_t * ring, char * buf)
     lcm_ringbuf_rec_t *rec = 
         (lcm_ringbuf_rec_t*) (buf - offsetof(lcm_ringbuf_rec_t, buf));
 
-    assert (rec == ring->head || rec == ring->tail);
-
     assert (rec->magic == MAGIC);
 
     ring->used -= rec->length;
 
+    if (rec != ring->head && rec != ring->tail) {
+        rec->magic = RELEASED_MAGIC;
+        ringbuf_self_test(ring);
+        return;
+    }
+
+    rec->magic = 0;
     if (rec == ring->head) {
-        ring->head = rec->next;
+        // also reclaim chunks that were released out of order
+        do {
+            rec->magic = 0;
+            rec = rec->next;
+        } while (rec && rec->magic == RELEASED_MAGIC);
+        ring->head = rec;
         if (!ring->head) 
             ring->tail = NULL;
         else 
             ring->head->prev = NULL;
-    } else if (rec == ring->tail) {
-        ring->tail = rec->prev;
+    } else {
+        do {
+            rec->magic = 0;
+            rec = rec->prev;
+        } while (rec && rec->magic == RELEASED_MAGIC);
+        ring->tail = rec;
         if (!ring->tail) 
             ring->head = NULL;
         else 
@@ -237,6 +293,5 @@ void lcm_ringbuf_dealloc (lcm_ringbuf_t * ring, char * buf)
            (ring->head->prev == NULL && ring->tail->next == NULL));
     if (0 == ring->used) { assert (!ring->head && !ring->tail); }
 
-    rec->magic = 0;
     ringbuf_self_test(ring);
 }
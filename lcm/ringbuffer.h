@@ -10,28 +10,30 @@ extern "C" {
 typedef struct _lcm_ringbuf lcm_ringbuf_t;
 
 lcm_ringbuf_t * lcm_ringbuf_new (unsigned int ring_size);
+
+/*
+ * Like lcm_ringbuf_new(), but backs the ring with huge pages where the system
+ * provides them.  Reserved huge pages are mapped whole, so the memory used is
+ * rounded up to a whole number of them.
+ */
+lcm_ringbuf_t * lcm_ringbuf_new_huge (unsigned int ring_size);
 void lcm_ringbuf_free (lcm_ringbuf_t * ring);
 
 /* 
- * Allocates a variable-sized chunk of the ring buffer for use by the
- * application.  Returns the pointer to the available chunk. 
+ * Allocates a chunk of exactly len bytes (plus alignment) of the ring buffer
+ * for use by the application.  Returns the pointer to the available chunk, or
+ * NULL if the ring buffer is full.
  */
 char * lcm_ringbuf_alloc (lcm_ringbuf_t * ring, unsigned int len);
 
-/*
- * resizes the most recently allocated chunk of the ring buffer.  The newly
- * requested size must be smaller than the original chunk size.
- */
-void lcm_ringbuf_shrink_last(lcm_ringbuf_t *ring, const char *buf, 
-        unsigned int len);
-
 unsigned int lcm_ringbuf_capacity(lcm_ringbuf_t *ring);
 
 unsigned int lcm_ringbuf_used(lcm_ringbuf_t *ring);
 
 /* 
- * Releases a previously-allocated chunk of the ring buffer.  Only the most
- * recently allocated, or the least recently allocated chunk can be released.
+ * Releases a previously-allocated chunk of the ring buffer.  Chunks may be
+ * released in any order, but the space of a chunk is only reused once the
+ * chunks allocated before it, or the chunks allocated after it, are released.
  */
 void lcm_ringbuf_dealloc (lcm_ringbuf_t * ring, char * buf);
 
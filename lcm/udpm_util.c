@@ -1,36 +1,159 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // for sendmmsg
+#endif
+
 #include "udpm_util.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#ifndef WIN32
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#endif
 
 #include "dbg.h"
 
-#define LCM_MAX_UNFRAGMENTED_PACKET_SIZE 65536
+/******************** receive memory **********************/
+// the smallest ringbuffer accepted from ringbuf_mb
+#define LCM_MIN_RINGBUF_SIZE 4096
+// how often an adaptive ringbuffer checks whether it can shrink
+#define LCM_RINGBUF_SHRINK_INTERVAL_USEC 1000000
 
-/******************** fragment buffer **********************/
-lcm_frag_buf_t *
-lcm_frag_buf_new (struct sockaddr_in from, const char *channel, 
-        uint32_t msg_seqno, uint32_t data_size, uint16_t nfragments,
-        int64_t first_packet_utime)
+void
+lcm_recv_mem_params_init(lcm_recv_mem_params_t *params)
 {
-    lcm_frag_buf_t *fbuf = (lcm_frag_buf_t*) malloc (sizeof (lcm_frag_buf_t));
-    strncpy (fbuf->channel, channel, sizeof (fbuf->channel));
-    fbuf->from = from;
-    fbuf->msg_seqno = msg_seqno;
-    fbuf->data = (char*)malloc (data_size);
-    fbuf->data_size = data_size;
-    fbuf->fragments_remaining = nfragments;
-    fbuf->last_packet_utime = first_packet_utime;
-    return fbuf;
+    params->ringbuf_size = LCM_RINGBUF_SIZE;
+    params->num_recv_bufs = LCM_DEFAULT_RECV_BUFS;
+    params->max_frag_buf_total_size = MAX_FRAG_BUF_TOTAL_SIZE;
+    params->adaptive = 0;
+    params->hugepages = 0;
+}
+
+// parses a size in megabytes, which may be fractional.  Returns 0 if invalid.
+static uint32_t
+_parse_mb(const char *key, const char *value, uint32_t min_size)
+{
+    char *endptr = NULL;
+    double mb = strtod(value, &endptr);
+    if (endptr == value || mb * 1024 * 1024 < min_size || mb >= 4096) {
+        fprintf(stderr, "Warning: Invalid value for %s\n", key);
+        return 0;
+    }
+    return (uint32_t) (mb * 1024 * 1024);
+}
+
+int
+lcm_recv_mem_parse_arg(lcm_recv_mem_params_t *params, const char *key,
+        const char *value)
+{
+    if (!strcmp(key, "ringbuf_mb")) {
+        uint32_t size = _parse_mb(key, value, LCM_MIN_RINGBUF_SIZE);
+        if (size)
+            params->ringbuf_size = size;
+    } else if (!strcmp(key, "frag_mb")) {
+        uint32_t size = _parse_mb(key, value, 1);
+        if (size)
+            params->max_frag_buf_total_size = size;
+    } else if (!strcmp(key, "recv_bufs")) {
+        char *endptr = NULL;
+        int n = strtol(value, &endptr, 0);
+        if (endptr == value || n < 1)
+            fprintf(stderr, "Warning: Invalid value for recv_bufs\n");
+        else
+            params->num_recv_bufs = n;
+    } else if (!strcmp(key, "ringbuf_adaptive")) {
+        char *endptr = NULL;
+        int adaptive = strtol(value, &endptr, 0);
+        if (endptr == value || adaptive < 0 || adaptive > 1)
+            fprintf(stderr, "Warning: Invalid value for ringbuf_adaptive\n");
+        else
+            params->adaptive = adaptive;
+    } else if (!strcmp(key, "hugepages")) {
+        char *endptr = NULL;
+        int hugepages = strtol(value, &endptr, 0);
+        if (endptr == value || hugepages < 0 || hugepages > 1)
+            fprintf(stderr, "Warning: Invalid value for hugepages\n");
+        else
+            params->hugepages = hugepages;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/******************** fragment buffer pool **********************/
+// Reassembly buffers come in power of two sizes, from 4 KB up to the largest
+// message allowed.
+#define LCM_FRAG_POOL_MIN_SHIFT 12
+
+static int
+_frag_pool_class (uint32_t size)
+{
+    int c = 0;
+    while (((uint32_t) 1 << (c + LCM_FRAG_POOL_MIN_SHIFT)) < size)
+        c++;
+    assert (c < LCM_FRAG_POOL_NUM_CLASSES);
+    return c;
+}
+
+static uint32_t
+_frag_pool_class_size (int c)
+{
+    return (uint32_t) 1 << (c + LCM_FRAG_POOL_MIN_SHIFT);
+}
+
+lcm_frag_pool_t *
+lcm_frag_pool_new (uint32_t max_cached_size)
+{
+    lcm_frag_pool_t *pool = (lcm_frag_pool_t *) calloc (1,
+            sizeof (lcm_frag_pool_t));
+    pool->max_cached_size = max_cached_size;
+    return pool;
 }
 
 void
-lcm_frag_buf_destroy (lcm_frag_buf_t *fbuf)
+lcm_frag_pool_destroy (lcm_frag_pool_t *pool)
 {
-    free (fbuf->data);
-    free (fbuf);
+    int c;
+    for (c = 0; c < LCM_FRAG_POOL_NUM_CLASSES; c++) {
+        while (pool->free_bufs[c]) {
+            char *data = pool->free_bufs[c];
+            pool->free_bufs[c] = *(char **) data;
+            free (data);
+        }
+    }
+    free (pool);
+}
+
+char *
+lcm_frag_pool_alloc (lcm_frag_pool_t *pool, uint32_t size)
+{
+    int c = _frag_pool_class (size);
+    char *data = pool->free_bufs[c];
+    if (!data)
+        return (char *) malloc (_frag_pool_class_size (c));
+
+    // the free buffers are linked through their first bytes
+    pool->free_bufs[c] = *(char **) data;
+    pool->cached_size -= _frag_pool_class_size (c);
+    return data;
+}
+
+void
+lcm_frag_pool_free (lcm_frag_pool_t *pool, char *data, uint32_t size)
+{
+    int c = _frag_pool_class (size);
+    if (pool->cached_size + _frag_pool_class_size (c) > pool->max_cached_size) {
+        free (data);
+        return;
+    }
+    *(char **) data = pool->free_bufs[c];
+    pool->free_bufs[c] = data;
+    pool->cached_size += _frag_pool_class_size (c);
 }
 
 
@@ -38,33 +161,58 @@ lcm_frag_buf_destroy (lcm_frag_buf_t *fbuf)
 /******************** fragment buffer store **********************/
 
 static guint
-_sockaddr_in_hash (const void * key)
+_frag_key_hash (const void * key)
 {
-    struct sockaddr_in *addr = (struct sockaddr_in*) key;
-    int v = addr->sin_port * addr->sin_addr.s_addr;
-    return g_int_hash (&v);
+    const lcm_frag_key_t *k = (const lcm_frag_key_t *) key;
+    return k->from.sin_addr.s_addr ^ ((guint) k->from.sin_port << 16) ^
+        (k->msg_seqno * 2654435761U);
 }
 
 static gboolean
-_sockaddr_in_equal (const void * a, const void *b)
+_frag_key_equal (const void * a, const void *b)
 {
-    struct sockaddr_in *a_addr = (struct sockaddr_in*) a;
-    struct sockaddr_in *b_addr = (struct sockaddr_in*) b;
+    const lcm_frag_key_t *a_key = (const lcm_frag_key_t *) a;
+    const lcm_frag_key_t *b_key = (const lcm_frag_key_t *) b;
 
-    return a_addr->sin_addr.s_addr == b_addr->sin_addr.s_addr &&
-           a_addr->sin_port        == b_addr->sin_port &&
-           a_addr->sin_family      == b_addr->sin_family;
+    return a_key->msg_seqno            == b_key->msg_seqno &&
+           a_key->from.sin_addr.s_addr == b_key->from.sin_addr.s_addr &&
+           a_key->from.sin_port        == b_key->from.sin_port &&
+           a_key->from.sin_family      == b_key->from.sin_family;
 }
 
 static void
-_find_lru_frag_buf (gpointer key, gpointer value, void *user_data)
+_lru_unlink (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf)
 {
-    lcm_frag_buf_t **lru_fbuf = (lcm_frag_buf_t**) user_data;
-    lcm_frag_buf_t *c_fbuf = (lcm_frag_buf_t*) value;
-    if (! *lru_fbuf ||
-        (c_fbuf->last_packet_utime < (*lru_fbuf)->last_packet_utime)) {
-        *lru_fbuf = c_fbuf;
-    }
+    if (fbuf->lru_prev)
+        fbuf->lru_prev->lru_next = fbuf->lru_next;
+    else
+        store->lru_head = fbuf->lru_next;
+    if (fbuf->lru_next)
+        fbuf->lru_next->lru_prev = fbuf->lru_prev;
+    else
+        store->lru_tail = fbuf->lru_prev;
+    fbuf->lru_prev = NULL;
+    fbuf->lru_next = NULL;
+}
+
+static void
+_lru_append (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf)
+{
+    fbuf->lru_prev = store->lru_tail;
+    fbuf->lru_next = NULL;
+    if (store->lru_tail)
+        store->lru_tail->lru_next = fbuf;
+    else
+        store->lru_head = fbuf;
+    store->lru_tail = fbuf;
+}
+
+static void
+_frag_buf_destroy (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf)
+{
+    if (fbuf->data)
+        lcm_frag_pool_free (store->pool, fbuf->data, fbuf->data_size);
+    free (fbuf);
 }
 
 lcm_frag_buf_store * lcm_frag_buf_store_new(uint32_t max_total_size,
@@ -75,43 +223,126 @@ lcm_frag_buf_store * lcm_frag_buf_store_new(uint32_t max_total_size,
     store->max_total_size = max_total_size;
     store->max_n_frag_bufs = max_n_frag_bufs;
 
-    store->frag_bufs = g_hash_table_new_full(_sockaddr_in_hash,
-                                       _sockaddr_in_equal, NULL,
-                                       (GDestroyNotify) lcm_frag_buf_destroy);
+    store->frag_bufs = g_hash_table_new(_frag_key_hash, _frag_key_equal);
+    store->pool = lcm_frag_pool_new(max_total_size);
     return store;
 }
 
 void lcm_frag_buf_store_destroy(lcm_frag_buf_store * store){
     g_hash_table_destroy (store->frag_bufs);
+    while (store->lru_head) {
+        lcm_frag_buf_t *fbuf = store->lru_head;
+        store->lru_head = fbuf->lru_next;
+        _frag_buf_destroy (store, fbuf);
+    }
+    lcm_frag_pool_destroy (store->pool);
     free(store);
 }
 
 lcm_frag_buf_t * lcm_frag_buf_store_lookup(lcm_frag_buf_store * store,
-        struct sockaddr* key) {
-    return (lcm_frag_buf_t *) g_hash_table_lookup(store->frag_bufs, key);
+        struct sockaddr* from, uint32_t msg_seqno) {
+    lcm_frag_key_t key;
+    key.from = *(struct sockaddr_in *) from;
+    key.msg_seqno = msg_seqno;
+    return (lcm_frag_buf_t *) g_hash_table_lookup(store->frag_bufs, &key);
 }
 
-void
-lcm_frag_buf_store_add (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf)
-{
-    while (store->total_size > store->max_total_size ||
-            g_hash_table_size (store->frag_bufs) > store->max_n_frag_bufs) {
-        // find and remove the least recently updated fragment buffer
-        lcm_frag_buf_t *lru_fbuf = NULL;
-        g_hash_table_foreach (store->frag_bufs, _find_lru_frag_buf, &lru_fbuf);
-        if (lru_fbuf){
-            lcm_frag_buf_store_remove (store, lru_fbuf);
-        }
+lcm_frag_buf_t *
+lcm_frag_buf_store_add (lcm_frag_buf_store *store, struct sockaddr *from,
+        const char *channel, uint32_t msg_seqno, uint32_t data_size,
+        uint16_t nfragments, int64_t first_packet_ns)
+{
+    // drop the messages that have stopped receiving fragments
+    while (store->lru_head && first_packet_ns -
+            store->lru_head->last_packet_ns >
+            (int64_t) FRAG_BUF_TIMEOUT_USEC * 1000) {
+        store->num_timed_out++;
+        lcm_frag_buf_store_remove (store, store->lru_head);
+    }
+
+    // make room by evicting the least recently updated fragment buffers
+    while (store->lru_head &&
+            (store->total_size + data_size > store->max_total_size ||
+             g_hash_table_size (store->frag_bufs) >= store->max_n_frag_bufs)) {
+        store->num_evicted++;
+        lcm_frag_buf_store_remove (store, store->lru_head);
     }
-    g_hash_table_insert (store->frag_bufs, &fbuf->from, fbuf);
+
+    // the bitmap of received fragments is allocated along with the struct
+    size_t bitmap_size = (nfragments + 7) / 8;
+    lcm_frag_buf_t *fbuf = (lcm_frag_buf_t *) calloc (1,
+            sizeof (lcm_frag_buf_t) + bitmap_size);
+    fbuf->key.from = *(struct sockaddr_in *) from;
+    fbuf->key.msg_seqno = msg_seqno;
+    strncpy (fbuf->channel, channel, sizeof (fbuf->channel));
+    fbuf->data = lcm_frag_pool_alloc (store->pool, data_size);
+    fbuf->data_size = data_size;
+    fbuf->nfragments = nfragments;
+    fbuf->fragments_remaining = nfragments;
+    fbuf->last_packet_ns = first_packet_ns;
+    fbuf->received = (uint8_t *) (fbuf + 1);
+
+    g_hash_table_insert (store->frag_bufs, &fbuf->key, fbuf);
+    _lru_append (store, fbuf);
     store->total_size += fbuf->data_size;
+    return fbuf;
+}
+
+int
+lcm_frag_buf_store_add_fragment (lcm_frag_buf_store *store,
+        lcm_frag_buf_t *fbuf, uint16_t fragment_no, uint32_t fragment_offset,
+        const char *data, uint32_t size, int64_t recv_ns)
+{
+    if (fragment_no >= fbuf->nfragments ||
+            fragment_offset + size > fbuf->data_size) {
+        dbg (DBG_LCM, "dropping invalid fragment (off: %d, %d / %d)\n",
+                fragment_offset, size, fbuf->data_size);
+        lcm_frag_buf_store_remove (store, fbuf);
+        return -1;
+    }
+
+    uint8_t bit = 1 << (fragment_no % 8);
+    if (fbuf->received[fragment_no / 8] & bit) {
+        dbg (DBG_LCM, "dropping duplicate fragment %d\n", fragment_no);
+        store->num_duplicates++;
+        return 0;
+    }
+    fbuf->received[fragment_no / 8] |= bit;
+
+    memcpy (fbuf->data + fragment_offset, data, size);
+    fbuf->last_packet_ns = recv_ns;
+    fbuf->fragments_remaining--;
+
+    // move it to the most recently updated end of the list
+    _lru_unlink (store, fbuf);
+    _lru_append (store, fbuf);
+
+    return fbuf->fragments_remaining == 0 ? 1 : 0;
+}
+
+void
+lcm_frag_buf_store_take_data (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf,
+        lcm_buf_t *lcmb)
+{
+    lcmb->buf = fbuf->data;
+    lcmb->buf_size = fbuf->data_size;
+    lcmb->ringbuf = NULL;
+    lcmb->frag_pool = store->pool;
+    fbuf->data = NULL;
 }
 
 void
 lcm_frag_buf_store_remove (lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf)
 {
+    if (fbuf->fragments_remaining) {
+        dbg (DBG_LCM, "Dropping message (missing %d fragments)\n",
+                fbuf->fragments_remaining);
+        store->num_incomplete++;
+    }
     store->total_size -= fbuf->data_size;
-    g_hash_table_remove (store->frag_bufs, &fbuf->from);
+    g_hash_table_remove (store->frag_bufs, &fbuf->key);
+    _lru_unlink (store, fbuf);
+    _frag_buf_destroy (store, fbuf);
 }
 
 
@@ -169,56 +400,83 @@ lcm_buf_free_data(lcm_buf_t *lcmb, lcm_ringbuf_t *ringbuf)
             dbg(DBG_LCM, "Destroying unused orphan ringbuffer %p\n",
                     lcmb->ringbuf);
         }
+    } else if (lcmb->frag_pool) {
+        lcm_frag_pool_free (lcmb->frag_pool, lcmb->buf, lcmb->buf_size);
     } else {
         free (lcmb->buf);
     }
     lcmb->buf = NULL;
     lcmb->buf_size = 0;
     lcmb->ringbuf = NULL;
+    lcmb->frag_pool = NULL;
+}
+
+static lcm_ringbuf_t *
+handoff_ringbuf_new(lcm_buf_handoff_t *h, unsigned int capacity)
+{
+    if (h->mem.hugepages)
+        return lcm_ringbuf_new_huge(capacity);
+    return lcm_ringbuf_new(capacity);
+}
+
+// allocate len bytes from the ringbuf, replacing the ringbuf with a bigger one
+// if it is full.
+static char *
+ringbuf_alloc_growing(lcm_buf_handoff_t *h, unsigned int len)
+{
+    char *buf = lcm_ringbuf_alloc(h->ringbuf, len);
+    if (buf == NULL) {
+        // ringbuffer is full.  allocate a larger ringbuffer
+        h->num_ringbuf_exhausted++;
+
+        // Can't free the old ringbuffer yet because it's in use (i.e., full)
+        // Must wait until later to free it.
+        assert(lcm_ringbuf_used(h->ringbuf) > 0);
+        dbg(DBG_LCM, "Orphaning ringbuffer %p\n", h->ringbuf);
+
+        unsigned int old_capacity = lcm_ringbuf_capacity(h->ringbuf);
+        unsigned int new_capacity = (unsigned int) (old_capacity * 1.5);
+        // the message alone may not fit in a small ringbuffer
+        if (new_capacity < 2 * len)
+            new_capacity = 2 * len;
+        h->ringbuf = handoff_ringbuf_new(h, new_capacity);
+        buf = lcm_ringbuf_alloc(h->ringbuf, len);
+        assert(buf);
+        dbg(DBG_LCM, "Allocated new ringbuffer size %u\n", new_capacity);
+    }
+
+    unsigned int used = lcm_ringbuf_used(h->ringbuf);
+    if (used > h->ringbuf_peak)
+        h->ringbuf_peak = used;
+    return buf;
 }
 
 lcm_buf_t *
-lcm_buf_allocate_data(lcm_buf_queue_t * inbufs_empty, lcm_ringbuf_t **ringbuf) {
-     lcm_buf_t * lcmb = NULL;
-     // first allocate a buffer struct for the packet metadata
-     if (lcm_buf_queue_is_empty(inbufs_empty)) {
-         // allocate additional buffer structs if needed
-         int i;
-         for (i = 0; i < LCM_DEFAULT_RECV_BUFS; i++) {
-             lcm_buf_t * nbuf = (lcm_buf_t *) calloc(1, sizeof(lcm_buf_t));
-             lcm_buf_enqueue(inbufs_empty, nbuf);
-         }
-     }
-
-     lcmb = lcm_buf_dequeue(inbufs_empty);
-     assert(lcmb);
-
-    // allocate space on the ringbuffer for the packet data.
-    // give it the maximum possible size for an unfragmented packet
-    lcmb->buf = lcm_ringbuf_alloc(*ringbuf, LCM_MAX_UNFRAGMENTED_PACKET_SIZE);
-    if (lcmb->buf == NULL) {
-         // ringbuffer is full.  allocate a larger ringbuffer
-
-         // Can't free the old ringbuffer yet because it's in use (i.e., full)
-         // Must wait until later to free it.
-         assert(lcm_ringbuf_used(*ringbuf) > 0);
-         dbg(DBG_LCM, "Orphaning ringbuffer %p\n", *ringbuf);
-
-         unsigned int old_capacity = lcm_ringbuf_capacity(*ringbuf);
-         unsigned int new_capacity = (unsigned int) (old_capacity * 1.5);
-         // replace the passed in ringbuf with the new one
-         *ringbuf = lcm_ringbuf_new(new_capacity);
-         lcmb->buf = lcm_ringbuf_alloc(*ringbuf, 65536);
-         assert(lcmb->buf);
-         dbg(DBG_LCM, "Allocated new ringbuffer size %u\n", new_capacity);
-     }
-     // save a pointer to the ringbuf, in case it gets replaced by another call
-     lcmb->ringbuf = *ringbuf;
-
-     // zero the last byte so that strlen never segfaults
-     lcmb->buf[65535] = 0;
-     return lcmb;
- }
+lcm_buf_reserve(lcm_buf_handoff_t * h)
+{
+    if (lcm_buf_queue_is_empty(h->inbufs_empty)) {
+        // allocate additional buffer structs if needed
+        int i;
+        for (i = 0; i < h->mem.num_recv_bufs; i++) {
+            lcm_buf_t * nbuf = (lcm_buf_t *) calloc(1, sizeof(lcm_buf_t));
+            lcm_buf_enqueue(h->inbufs_empty, nbuf);
+        }
+    }
+
+    lcm_buf_t * lcmb = lcm_buf_dequeue(h->inbufs_empty);
+    assert(lcmb);
+    return lcmb;
+}
+
+void
+lcm_buf_copy_data(lcm_buf_handoff_t * h, lcm_buf_t *lcmb, int len)
+{
+    char *buf = ringbuf_alloc_growing(h, len);
+    memcpy(buf, lcmb->buf, len);
+    lcmb->buf = buf;
+    lcmb->buf_size = len;
+    lcmb->ringbuf = h->ringbuf;
+}
 
  void
 lcm_buf_queue_free (lcm_buf_queue_t * q, lcm_ringbuf_t *ringbuf)
@@ -237,7 +495,617 @@ lcm_buf_queue_is_empty (lcm_buf_queue_t * q)
     return q->head == NULL ? 1 : 0;
 }
 
+/*** Lock-free handoff of lcm buffers between two threads ***/
+lcm_buf_ring_t *
+lcm_buf_ring_new (unsigned int capacity)
+{
+    lcm_buf_ring_t * ring = (lcm_buf_ring_t *) calloc (1,
+            sizeof (lcm_buf_ring_t));
+    unsigned int size = 1;
+    while (size < capacity)
+        size <<= 1;
+    ring->bufs = (lcm_buf_t **) calloc (size, sizeof (lcm_buf_t *));
+    ring->mask = size - 1;
+    return ring;
+}
+
+void
+lcm_buf_ring_free (lcm_buf_ring_t * ring, lcm_ringbuf_t *ringbuf)
+{
+    lcm_buf_t * el;
+    while ( (el = lcm_buf_ring_pop (ring))) {
+        lcm_buf_free_data (el, ringbuf);
+        free (el);
+    }
+    free (ring->bufs);
+    free (ring);
+}
+
+unsigned int
+lcm_buf_ring_capacity (lcm_buf_ring_t * ring)
+{
+    return ring->mask + 1;
+}
+
+int
+lcm_buf_ring_push (lcm_buf_ring_t * ring, lcm_buf_t * el)
+{
+    // the indices are free-running, and only reduced modulo the capacity when
+    // indexing the slots
+    unsigned int tail = (unsigned int) ring->tail;
+    unsigned int head = (unsigned int) g_atomic_int_get (&ring->head);
+    if (tail - head > ring->mask)
+        return -1;
+    ring->bufs[tail & ring->mask] = el;
+    // publish the slot to the consumer
+    g_atomic_int_set (&ring->tail, (int) (tail + 1));
+    return 0;
+}
+
+lcm_buf_t *
+lcm_buf_ring_pop (lcm_buf_ring_t * ring)
+{
+    unsigned int head = (unsigned int) ring->head;
+    if (head == (unsigned int) g_atomic_int_get (&ring->tail))
+        return NULL;
+    lcm_buf_t * el = ring->bufs[head & ring->mask];
+    // hand the slot back to the producer
+    g_atomic_int_set (&ring->head, (int) (head + 1));
+    return el;
+}
+
+int
+lcm_buf_ring_is_empty (lcm_buf_ring_t * ring)
+{
+    return g_atomic_int_get (&ring->head) == g_atomic_int_get (&ring->tail);
+}
+
+
+
+/*** Message buffers received by one thread and handled by another ***/
+
+// the most messages that can be queued for the handling thread at a time
+#define LCM_HANDOFF_CAPACITY 16384
+
+lcm_buf_handoff_t *
+lcm_buf_handoff_new (const lcm_recv_mem_params_t * mem)
+{
+    lcm_buf_handoff_t * h = (lcm_buf_handoff_t *) calloc (1,
+            sizeof (lcm_buf_handoff_t));
+    h->mem = *mem;
+    h->filled = lcm_buf_ring_new (LCM_HANDOFF_CAPACITY);
+    h->recycled = lcm_buf_ring_new (LCM_HANDOFF_CAPACITY);
+    h->inbufs_empty = lcm_buf_queue_new ();
+    h->ringbuf = handoff_ringbuf_new (h, mem->ringbuf_size);
+    h->ringbuf_check_utime = lcm_timestamp_now ();
+    h->latest = g_hash_table_new (g_str_hash, g_str_equal);
+
+    int i;
+    for (i = 0; i < mem->num_recv_bufs; i++) {
+        /* We don't set the receive buffer's data pointer yet because it
+         * will be taken from the ringbuffer at receive time. */
+        lcm_buf_t * lcmb = (lcm_buf_t *) calloc (1, sizeof (lcm_buf_t));
+        lcm_buf_enqueue (h->inbufs_empty, lcmb);
+    }
+    return h;
+}
+
+void
+lcm_buf_handoff_free (lcm_buf_handoff_t * h)
+{
+    g_hash_table_destroy (h->latest);
+    lcm_buf_ring_free (h->filled, h->ringbuf);
+    lcm_buf_ring_free (h->recycled, h->ringbuf);
+    lcm_buf_queue_free (h->inbufs_empty, h->ringbuf);
+    lcm_ringbuf_free (h->ringbuf);
+    free (h);
+}
+
+// Replaces a ringbuffer that grew during a burst with one half its size, once
+// less than a quarter of it has been used for a while.
+static void
+handoff_shrink_ringbuf (lcm_buf_handoff_t * h)
+{
+    unsigned int capacity = lcm_ringbuf_capacity (h->ringbuf);
+    if (capacity <= h->mem.ringbuf_size)
+        return;
+    int64_t now = lcm_timestamp_now ();
+    if (now - h->ringbuf_check_utime < LCM_RINGBUF_SHRINK_INTERVAL_USEC)
+        return;
+    int idle = h->ringbuf_peak < capacity / 4;
+    unsigned int used = lcm_ringbuf_used (h->ringbuf);
+    h->ringbuf_peak = used;
+    h->ringbuf_check_utime = now;
+
+    // nothing may be left in the ringbuffer when it is replaced
+    if (!idle || used)
+        return;
+    unsigned int new_capacity = capacity / 2;
+    if (new_capacity < h->mem.ringbuf_size)
+        new_capacity = h->mem.ringbuf_size;
+    dbg (DBG_LCM, "Shrinking ringbuffer to %u\n", new_capacity);
+    lcm_ringbuf_free (h->ringbuf);
+    h->ringbuf = handoff_ringbuf_new (h, new_capacity);
+}
+
+void
+lcm_buf_handoff_recycle (lcm_buf_handoff_t * h)
+{
+    lcm_buf_t * lcmb;
+    while ((lcmb = lcm_buf_ring_pop (h->recycled))) {
+        if (lcmb->keep_latest &&
+                g_hash_table_lookup (h->latest, lcmb->channel_name) == lcmb)
+            g_hash_table_remove (h->latest, lcmb->channel_name);
+        lcm_buf_free_data (lcmb, h->ringbuf);
+        lcm_buf_enqueue (h->inbufs_empty, lcmb);
+        h->num_outstanding--;
+    }
 
+    if (h->mem.adaptive)
+        handoff_shrink_ringbuf (h);
+}
+
+int
+lcm_buf_handoff_push (lcm_buf_handoff_t * h, lcm_t * lcm, lcm_buf_t * lcmb)
+{
+    // Every lcm_buf on the recycled ring came off the filled ring, so as long
+    // as this holds, neither ring can overflow.
+    if (h->num_outstanding >= lcm_buf_ring_capacity (h->filled))
+        return -1;
+
+    if (lcmb->keep_latest) {
+        // The older message may be dispatched concurrently, in which case the
+        // handling thread claims it first and it isn't superseded.
+        lcm_buf_t * old = (lcm_buf_t *) g_hash_table_lookup (h->latest,
+                lcmb->channel_name);
+        if (old && g_atomic_int_compare_and_exchange (&old->claimed, 0, 1))
+            lcm_discard_message (lcm, old->channel_name, old->channel_id);
+        // the key points into the lcm_buf, so replace it as well
+        g_hash_table_replace (h->latest, lcmb->channel_name, lcmb);
+    }
+
+    lcmb->claimed = 0;
+    lcm_buf_ring_push (h->filled, lcmb);
+    h->num_outstanding++;
+    return 0;
+}
+
+lcm_buf_t *
+lcm_buf_handoff_pop (lcm_buf_handoff_t * h)
+{
+    lcm_buf_t * lcmb;
+    while ((lcmb = lcm_buf_ring_pop (h->filled))) {
+        if (g_atomic_int_compare_and_exchange (&lcmb->claimed, 0, 1))
+            return lcmb;
+        // superseded while it was queued
+        lcm_buf_handoff_release (h, lcmb);
+    }
+    return NULL;
+}
+
+int
+lcm_buf_handoff_is_empty (lcm_buf_handoff_t * h)
+{
+    return lcm_buf_ring_is_empty (h->filled);
+}
+
+void
+lcm_buf_handoff_release (lcm_buf_handoff_t * h, lcm_buf_t * lcmb)
+{
+    int status = lcm_buf_ring_push (h->recycled, lcmb);
+    assert (0 == status);
+    (void) status;
+}
+
+
+
+/******************** reassembled messages **********************/
+
+typedef struct _lcm_frag_done_msg {
+    lcm_frag_key_t key;
+    int64_t done_utime;
+} lcm_frag_done_msg_t;
+
+static void
+_frag_done_set_expire (lcm_frag_done_set_t *set, int64_t now_utime)
+{
+    while (!g_queue_is_empty (set->order)) {
+        lcm_frag_done_msg_t *msg =
+            (lcm_frag_done_msg_t *) g_queue_peek_head (set->order);
+        if (now_utime - msg->done_utime < set->keep_usec)
+            break;
+        g_queue_pop_head (set->order);
+        g_hash_table_remove (set->msgs, &msg->key);
+        free (msg);
+    }
+}
+
+lcm_frag_done_set_t *
+lcm_frag_done_set_new (int64_t keep_usec)
+{
+    lcm_frag_done_set_t *set = (lcm_frag_done_set_t *) calloc (1,
+            sizeof (lcm_frag_done_set_t));
+    set->msgs = g_hash_table_new (_frag_key_hash, _frag_key_equal);
+    set->order = g_queue_new ();
+    set->keep_usec = keep_usec;
+    return set;
+}
+
+void
+lcm_frag_done_set_destroy (lcm_frag_done_set_t *set)
+{
+    while (!g_queue_is_empty (set->order))
+        free (g_queue_pop_head (set->order));
+    g_queue_free (set->order);
+    g_hash_table_destroy (set->msgs);
+    free (set);
+}
+
+void
+lcm_frag_done_set_add (lcm_frag_done_set_t *set, struct sockaddr *from,
+        uint32_t msg_seqno, int64_t now_utime)
+{
+    _frag_done_set_expire (set, now_utime);
+
+    lcm_frag_key_t key;
+    key.from = *(struct sockaddr_in *) from;
+    key.msg_seqno = msg_seqno;
+    if (g_hash_table_lookup (set->msgs, &key))
+        return;
+
+    lcm_frag_done_msg_t *msg = (lcm_frag_done_msg_t *) malloc (
+            sizeof (lcm_frag_done_msg_t));
+    msg->key = key;
+    msg->done_utime = now_utime;
+    g_queue_push_tail (set->order, msg);
+    g_hash_table_insert (set->msgs, &msg->key, msg);
+}
+
+int
+lcm_frag_done_set_contains (lcm_frag_done_set_t *set, struct sockaddr *from,
+        uint32_t msg_seqno, int64_t now_utime)
+{
+    _frag_done_set_expire (set, now_utime);
+
+    lcm_frag_key_t key;
+    key.from = *(struct sockaddr_in *) from;
+    key.msg_seqno = msg_seqno;
+    return g_hash_table_lookup (set->msgs, &key) != NULL;
+}
+
+
+/******************** sender sequence numbers **********************/
+
+// the most senders that are followed at once
+#define LCM_MAX_TRACKED_SENDERS 1024
+
+// jumps in msg_seqno larger than this mean that the sender restarted
+#define LCM_SEQNO_WINDOW 65536
+
+typedef struct _lcm_seqno_sender {
+    struct sockaddr_in from;
+    uint32_t last_seqno;        // the latest message started
+} lcm_seqno_sender_t;
+
+static guint
+_sockaddr_in_hash (const void * key)
+{
+    struct sockaddr_in *addr = (struct sockaddr_in*) key;
+    int v = addr->sin_port * addr->sin_addr.s_addr;
+    return g_int_hash (&v);
+}
+
+static gboolean
+_sockaddr_in_equal (const void * a, const void *b)
+{
+    struct sockaddr_in *a_addr = (struct sockaddr_in*) a;
+    struct sockaddr_in *b_addr = (struct sockaddr_in*) b;
+
+    return a_addr->sin_addr.s_addr == b_addr->sin_addr.s_addr &&
+           a_addr->sin_port        == b_addr->sin_port &&
+           a_addr->sin_family      == b_addr->sin_family;
+}
+
+lcm_seqno_tracker_t *
+lcm_seqno_tracker_new (void)
+{
+    lcm_seqno_tracker_t *tracker = (lcm_seqno_tracker_t *) calloc (1,
+            sizeof (lcm_seqno_tracker_t));
+    tracker->senders = g_hash_table_new_full (_sockaddr_in_hash,
+            _sockaddr_in_equal, NULL, free);
+    return tracker;
+}
+
+void
+lcm_seqno_tracker_destroy (lcm_seqno_tracker_t *tracker)
+{
+    g_hash_table_destroy (tracker->senders);
+    free (tracker);
+}
+
+void
+lcm_seqno_tracker_update (lcm_seqno_tracker_t *tracker, struct sockaddr *from,
+        uint32_t msg_seqno, int starts_message)
+{
+    lcm_seqno_sender_t *sender = (lcm_seqno_sender_t *) g_hash_table_lookup (
+            tracker->senders, from);
+    if (!sender) {
+        if (g_hash_table_size (tracker->senders) >= LCM_MAX_TRACKED_SENDERS)
+            return;
+        sender = (lcm_seqno_sender_t *) malloc (sizeof (lcm_seqno_sender_t));
+        sender->from = *(struct sockaddr_in *) from;
+        sender->last_seqno = msg_seqno;
+        g_hash_table_insert (tracker->senders, &sender->from, sender);
+        return;
+    }
+
+    // the sequence numbers wrap around, so compare them by their difference
+    int32_t diff = (int32_t) (msg_seqno - sender->last_seqno);
+    if (diff > 0 && diff <= LCM_SEQNO_WINDOW) {
+        tracker->num_lost += diff - 1;
+        sender->last_seqno = msg_seqno;
+    } else if (diff < 0 && diff >= -LCM_SEQNO_WINDOW) {
+        // count each late message once, not once per fragment
+        if (starts_message)
+            tracker->num_reordered++;
+    } else if (diff) {
+        sender->last_seqno = msg_seqno;
+    }
+}
+
+
+
+/******************** fragmented transmit **********************/
+
+// number of fragments submitted to the kernel at a time.  On Linux, each group
+// is sent with one call to sendmmsg ().
+#define LCM_SEND_BATCH 64
+
+#ifdef __linux__
+typedef struct mmsghdr lcm_mmsghdr_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} lcm_mmsghdr_t;
+#endif
+
+// Sends the fragments numbered in @fragment_nos, or all of them if it is
+// NULL.
+static int
+_send_fragments(SOCKET fd, const struct sockaddr_in *dest,
+        uint32_t msg_seqno, const char *channel, const void *data,
+        unsigned int datalen, int nfragments, const lcm2_trace_ext_t *trace,
+        const uint16_t *fragment_nos, int num_fragment_nos)
+{
+    int channel_size = strlen(channel);
+    int fragment_size = lcm_fragment_max_payload(trace != NULL);
+    // the first fragment is special.  The channel is inserted before its data
+    int first_fraglen = fragment_size - (channel_size + 1);
+    assert(first_fraglen <= (int) datalen);
+
+    lcm2_header_long_t hdrs[LCM_SEND_BATCH];
+    struct iovec vecs[LCM_SEND_BATCH][4];
+    lcm_mmsghdr_t msgs[LCM_SEND_BATCH];
+
+    int total = fragment_nos ? num_fragment_nos : nfragments;
+    for (int first = 0; first < total; first += LCM_SEND_BATCH) {
+        int count = MIN(LCM_SEND_BATCH, total - first);
+
+        for (int i = 0; i < count; i++) {
+            int frag_no = fragment_nos ? fragment_nos[first + i] : first + i;
+            assert(frag_no < nfragments);
+            uint32_t fragment_offset = frag_no == 0 ? 0 :
+                first_fraglen + (uint32_t) (frag_no - 1) * fragment_size;
+            int fraglen;
+            if (frag_no == 0)
+                fraglen = first_fraglen;
+            else
+                fraglen = MIN(fragment_size, datalen - fragment_offset);
+
+            lcm2_header_long_t *hdr = &hdrs[i];
+            hdr->magic = htonl(trace ? LCM2_MAGIC_LONG_TRACED :
+                    LCM2_MAGIC_LONG);
+            hdr->msg_seqno = htonl(msg_seqno);
+            hdr->msg_size = htonl(datalen);
+            hdr->fragment_offset = htonl(fragment_offset);
+            hdr->fragment_no = htons(frag_no);
+            hdr->fragments_in_msg = htons(nfragments);
+
+            struct iovec *iov = vecs[i];
+            int niov = 0;
+            iov[niov].iov_base = (char *) hdr;
+            iov[niov++].iov_len = sizeof(lcm2_header_long_t);
+            if (trace) {
+                iov[niov].iov_base = (char *) trace;
+                iov[niov++].iov_len = sizeof(lcm2_trace_ext_t);
+            }
+            if (frag_no == 0) {
+                iov[niov].iov_base = (char *) channel;
+                iov[niov++].iov_len = channel_size + 1;
+            }
+            iov[niov].iov_base = (char *) data + fragment_offset;
+            iov[niov++].iov_len = fraglen;
+
+            struct msghdr *msg = &msgs[i].msg_hdr;
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_name = (struct sockaddr *) dest;
+            msg->msg_namelen = sizeof(struct sockaddr_in);
+            msg->msg_iov = iov;
+            msg->msg_iovlen = niov;
+        }
+
+#ifdef __linux__
+        int sent = 0;
+        while (sent < count) {
+            int status = sendmmsg(fd, msgs + sent, count - sent, 0);
+            if (status < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            sent += status;
+        }
+#else
+        for (int i = 0; i < count; i++) {
+            if (sendmsg(fd, &msgs[i].msg_hdr, 0) < 0)
+                return -1;
+        }
+#endif
+    }
+    return 0;
+}
+
+int
+lcm_udpm_send_fragments(SOCKET fd, const struct sockaddr_in *dest,
+        uint32_t msg_seqno, const char *channel, const void *data,
+        unsigned int datalen, int nfragments, const lcm2_trace_ext_t *trace)
+{
+    return _send_fragments(fd, dest, msg_seqno, channel, data, datalen,
+            nfragments, trace, NULL, 0);
+}
+
+int
+lcm_udpm_resend_fragments(SOCKET fd, const struct sockaddr_in *dest,
+        uint32_t msg_seqno, const char *channel, const void *data,
+        unsigned int datalen, int nfragments, const lcm2_trace_ext_t *trace,
+        const uint16_t *fragment_nos, int num_fragment_nos)
+{
+    return _send_fragments(fd, dest, msg_seqno, channel, data, datalen,
+            nfragments, trace, fragment_nos, num_fragment_nos);
+}
+
+uint32_t
+lcm_host_id(void)
+{
+    static int host_id;
+    if (!g_atomic_int_get(&host_id)) {
+        // 0 means that a message carries no trace
+        guint id = g_str_hash(g_get_host_name());
+        g_atomic_int_set(&host_id, id ? (int) id : 1);
+    }
+    return (uint32_t) g_atomic_int_get(&host_id);
+}
+
+/******************** self-test results **********************/
+static GStaticMutex self_tests_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *self_tests_passed;   // set of self_test_key ()s
+
+static char *
+self_test_key(const char *provider, struct in_addr mc_addr, uint16_t port,
+        int ttl)
+{
+    return g_strdup_printf("%s:%08x:%d:%d", provider,
+            (unsigned int) ntohl(mc_addr.s_addr), ntohs(port), ttl);
+}
+
+int
+lcm_self_test_passed(const char *provider, struct in_addr mc_addr,
+        uint16_t port, int ttl)
+{
+    char *key = self_test_key(provider, mc_addr, port, ttl);
+    g_static_mutex_lock(&self_tests_lock);
+    int passed = self_tests_passed &&
+        g_hash_table_lookup(self_tests_passed, key) != NULL;
+    g_static_mutex_unlock(&self_tests_lock);
+    g_free(key);
+    return passed;
+}
+
+void
+lcm_self_test_set_passed(const char *provider, struct in_addr mc_addr,
+        uint16_t port, int ttl)
+{
+    char *key = self_test_key(provider, mc_addr, port, ttl);
+    g_static_mutex_lock(&self_tests_lock);
+    if (!self_tests_passed)
+        self_tests_passed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, NULL);
+    g_hash_table_replace(self_tests_passed, key, key);
+    g_static_mutex_unlock(&self_tests_lock);
+}
+
+/******************** kernel receive timestamps **********************/
+#ifdef SO_TIMESTAMP
+void
+lcm_enable_recv_timestamps(SOCKET fd)
+{
+    int opt;
+#if defined(SO_TIMESTAMPING) && defined(SOF_TIMESTAMPING_RX_SOFTWARE)
+    opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &opt, sizeof(opt)) == 0)
+        return;
+#endif
+#ifdef SO_TIMESTAMPNS
+    opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) == 0)
+        return;
+#endif
+    opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt));
+}
+
+int
+lcm_parse_recv_timestamp(struct cmsghdr *cmsg, int64_t *recv_ns)
+{
+    if (cmsg->cmsg_level != SOL_SOCKET)
+        return 0;
+#if defined(SO_TIMESTAMPING) && defined(SOF_TIMESTAMPING_RX_SOFTWARE)
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        // the software timestamp comes first, and the hardware ones, which
+        // aren't requested, after it
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        if (!ts.tv_sec && !ts.tv_nsec)
+            return 0;
+        *recv_ns = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        return 1;
+    }
+#endif
+#ifdef SO_TIMESTAMPNS
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        *recv_ns = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        return 1;
+    }
+#endif
+    if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+        struct timeval tv;
+        memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+        *recv_ns = ((int64_t) tv.tv_sec * 1000000 + tv.tv_usec) * 1000;
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/******************** busy polling **********************/
+void
+lcm_set_busy_poll(SOCKET fd)
+{
+#ifdef SO_BUSY_POLL
+    int usec = LCM_BUSY_POLL_USEC;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (char *) &usec,
+                sizeof(usec)) < 0)
+        dbg(DBG_LCM, "LCM: unable to set SO_BUSY_POLL: %s\n",
+                strerror(errno));
+#else
+    (void) fd;
+#endif
+}
+
+void
+lcm_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#elif !defined(WIN32)
+    sched_yield();
+#endif
+}
 
 #ifdef __linux__
 static inline int _parse_inaddr(const char *addr_str, struct in_addr *addr)
@@ -7,6 +7,7 @@ extern "C" {
 
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -30,11 +31,15 @@ typedef int SOCKET;
 #include <glib.h>
 
 #include "lcm.h"
+#include "lcm_internal.h"
 #include "ringbuffer.h"
 
 /************************* Important Defines *******************/
 #define LCM2_MAGIC_SHORT 0x4c433032   // hex repr of ascii "LC02" 
 #define LCM2_MAGIC_LONG  0x4c433033   // hex repr of ascii "LC03" 
+#define LCM2_MAGIC_COALESCED 0x4c433034   // hex repr of ascii "LC04"
+#define LCM2_MAGIC_SHORT_TRACED 0x4c433035   // hex repr of ascii "LC05"
+#define LCM2_MAGIC_LONG_TRACED  0x4c433036   // hex repr of ascii "LC06"
 
 #ifdef __APPLE__
 #define LCM_SHORT_MESSAGE_MAX_SIZE 1435
@@ -44,12 +49,15 @@ typedef int SOCKET;
 #define LCM_FRAGMENT_MAX_PAYLOAD 65487
 #endif
 
+// defaults for the receive memory.  See lcm_recv_mem_params_t
 #define LCM_RINGBUF_SIZE (200*1024)
 
 #define LCM_DEFAULT_RECV_BUFS 2000
 
 #define MAX_FRAG_BUF_TOTAL_SIZE (1 << 24)// 16 megabytes
 #define MAX_NUM_FRAG_BUFS 1000
+#define FRAG_BUF_TIMEOUT_USEC 2000000 // drop messages after 2 s with no
+                                     // fragments
 
 // HUGE is not defined on cygwin as of 2008-03-05
 #ifndef HUGE
@@ -83,6 +91,65 @@ typedef struct _lcm2_header_long {
 // ASCII-encoded channel name, followed by the payload data
 // if fragment_no > 0, then header is immediately followed by the payload data
 
+// A traced packet is a short or long packet with the magic
+// LCM2_MAGIC_SHORT_TRACED or LCM2_MAGIC_LONG_TRACED, whose header is
+// immediately followed by this extension.  Every fragment of a traced message
+// carries it.
+typedef struct _lcm2_trace_ext {
+    uint32_t send_utime_hi;     // publisher's clock when the message was
+    uint32_t send_utime_lo;     // published, in microseconds since the epoch
+    uint32_t host_id;           // see lcm_host_id ()
+} lcm2_trace_ext_t;
+
+// A coalesced packet starts with the 32-bit magic LCM2_MAGIC_COALESCED.  It is
+// followed by one or more short messages, each a 16-bit size in network byte
+// order followed by a complete short message packet of that size.  The short
+// messages may be traced.
+
+// Size of the header of a short message packet, or 0 if @magic is not a short
+// message's.
+static inline int
+lcm2_short_header_size (uint32_t magic)
+{
+    if (magic == LCM2_MAGIC_SHORT)
+        return sizeof (lcm2_header_short_t);
+    if (magic == LCM2_MAGIC_SHORT_TRACED)
+        return sizeof (lcm2_header_short_t) + sizeof (lcm2_trace_ext_t);
+    return 0;
+}
+
+// Size of the header of a fragment, or 0 if @magic is not a fragment's.
+static inline int
+lcm2_long_header_size (uint32_t magic)
+{
+    if (magic == LCM2_MAGIC_LONG)
+        return sizeof (lcm2_header_long_t);
+    if (magic == LCM2_MAGIC_LONG_TRACED)
+        return sizeof (lcm2_header_long_t) + sizeof (lcm2_trace_ext_t);
+    return 0;
+}
+
+static inline void
+lcm2_trace_ext_init (lcm2_trace_ext_t *ext, int64_t send_utime,
+        uint32_t host_id)
+{
+    ext->send_utime_hi = htonl ((uint32_t) ((uint64_t) send_utime >> 32));
+    ext->send_utime_lo = htonl ((uint32_t) send_utime);
+    ext->host_id = htonl (host_id);
+}
+
+// @ext need not be aligned
+static inline void
+lcm2_trace_ext_parse (const void *ext, int64_t *send_utime,
+        uint32_t *host_id)
+{
+    lcm2_trace_ext_t e;
+    memcpy (&e, ext, sizeof (e));
+    *send_utime = (int64_t) (((uint64_t) ntohl (e.send_utime_hi) << 32) |
+            ntohl (e.send_utime_lo));
+    *host_id = ntohl (e.host_id);
+}
+
 
 /************************* Utility Functions *******************/
 static inline int
@@ -134,13 +201,36 @@ lcm_timestamp_now()
     return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// nanoseconds since the epoch
+static inline int64_t
+lcm_timestamp_now_ns()
+{
+#ifdef WIN32
+    return lcm_timestamp_now() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 
 /******************** message buffer **********************/
 typedef struct _lcm_buf {
     char  channel_name[LCM_MAX_CHANNEL_NAME_LENGTH+1];
     int   channel_size;      // length of channel name
+    lcm_channel_id_t channel_id;  // interned channel name, or 0
+    int   keep_latest;       // supersedes queued messages on the same channel
+    int   claimed;           // set atomically by whichever thread gets to a
+                             // queued message first: the handling thread to
+                             // dispatch it, or the receive thread to
+                             // supersede it
 
     int64_t recv_utime;      // timestamp of first datagram receipt
+    int64_t recv_utime_ns;   // the same, in nanoseconds.  Set together with
+                             // recv_utime by lcm_buf_set_recv_time ()
+    int64_t send_utime;      // from a traced packet's header, or 0
+    uint32_t send_host_id;   // from a traced packet's header, or 0
     char *buf;               // pointer to beginning of message.  This includes
                              // the header for unfragmented messages, and does
                              // not include the header for fragmented messages.
@@ -149,6 +239,8 @@ typedef struct _lcm_buf {
     int   data_size;         // size of payload
     lcm_ringbuf_t *ringbuf;  // the ringbuffer used to allocate buf.  NULL if
                              // not allocated from ringbuf
+    struct _lcm_frag_pool *frag_pool;  // the pool used to allocate buf, for
+                             // reassembled messages.  NULL otherwise
 
     int   packet_size;       // total bytes received
     int   buf_size;          // bytes allocated
@@ -160,6 +252,34 @@ typedef struct _lcm_buf {
 
 
 
+/******************** receive memory **********************/
+// How much memory a receiving thread sets aside for incoming messages.  Set
+// with the ringbuf_mb, recv_bufs, frag_mb, ringbuf_adaptive and hugepages
+// provider arguments.
+typedef struct _lcm_recv_mem_params {
+    unsigned int ringbuf_size;      // initial size of the ringbuffer.  It
+                                    // grows when a burst of messages fills it
+    int      num_recv_bufs;         // lcm_bufs allocated at a time
+    uint32_t max_frag_buf_total_size;   // memory for reassembling messages
+    int      adaptive;              // shrink the ringbuffer back to its
+                                    // initial size once it is idle
+    int      hugepages;             // back the ringbuffer with huge pages
+} lcm_recv_mem_params_t;
+
+void lcm_recv_mem_params_init(lcm_recv_mem_params_t *params);
+
+// parses one provider argument.  Returns 1 if it was a receive memory
+// argument, 0 otherwise.
+int lcm_recv_mem_parse_arg(lcm_recv_mem_params_t *params, const char *key,
+        const char *value);
+
+static inline void
+lcm_buf_set_recv_time(lcm_buf_t *lcmb, int64_t recv_ns)
+{
+    lcmb->recv_utime_ns = recv_ns;
+    lcmb->recv_utime = recv_ns / 1000;
+}
+
 /******* Functions for managing a queue of message buffers *******/
 typedef struct _lcm_buf_queue {
     lcm_buf_t * head;
@@ -174,47 +294,288 @@ void lcm_buf_enqueue(lcm_buf_queue_t * q, lcm_buf_t * el);
 void lcm_buf_queue_free(lcm_buf_queue_t * q, lcm_ringbuf_t *ringbuf);
 int lcm_buf_queue_is_empty(lcm_buf_queue_t * q);
 
-// allocate a lcm_buf from the ringbuf. If there is no more space in the ringbuf
-// it is replaced with a bigger one. In this case, the old ringbuffer will be
-// cleaned up when lcm_buf_free_data() is called;
-lcm_buf_t *
-lcm_buf_allocate_data(lcm_buf_queue_t * inbufs_empty, lcm_ringbuf_t **ringbuf);
-
 void lcm_buf_free_data(lcm_buf_t *lcmb, lcm_ringbuf_t *ringbuf);
 
+/******* Lock-free handoff of message buffers between two threads *******/
+// A fixed-capacity ring that one thread pushes to and another thread pops
+// from.  Neither side takes a lock, so there must be exactly one producer and
+// one consumer.
+typedef struct _lcm_buf_ring {
+    lcm_buf_t ** bufs;
+    unsigned int mask;      // capacity - 1.  The capacity is a power of two.
+    char pad0[64];          // keep head and tail on separate cache lines
+    int head;               // next slot to pop.  Only written by the consumer
+    char pad1[64];
+    int tail;               // next slot to push.  Only written by the producer
+    char pad2[64];
+} lcm_buf_ring_t;
+
+// capacity is rounded up to a power of two
+lcm_buf_ring_t * lcm_buf_ring_new(unsigned int capacity);
+// frees the ring, and any lcm_bufs still in it
+void lcm_buf_ring_free(lcm_buf_ring_t * ring, lcm_ringbuf_t *ringbuf);
+unsigned int lcm_buf_ring_capacity(lcm_buf_ring_t * ring);
+
+// producer side.  Returns 0 on success, or -1 if the ring is full.
+int lcm_buf_ring_push(lcm_buf_ring_t * ring, lcm_buf_t * el);
+
+// consumer side.  Returns NULL if the ring is empty.
+lcm_buf_t * lcm_buf_ring_pop(lcm_buf_ring_t * ring);
+int lcm_buf_ring_is_empty(lcm_buf_ring_t * ring);
+
+/******* Message buffers received by one thread and handled by another *******/
+// The receiving thread owns the empty lcm_bufs and the ringbuffer their data is
+// allocated from.  Received messages are passed to the handling thread on the
+// filled ring, and passed back for reuse on the recycled ring once they have
+// been handled, so that neither thread takes a lock.
+typedef struct _lcm_buf_handoff {
+    lcm_buf_ring_t * filled;
+    lcm_buf_ring_t * recycled;
+
+    // the rest is only used by the receiving thread
+    lcm_buf_queue_t * inbufs_empty;
+    lcm_ringbuf_t * ringbuf;
+    lcm_recv_mem_params_t mem;
+    unsigned int ringbuf_peak;      // most of the ringbuffer used recently
+    int64_t ringbuf_check_utime;    // when ringbuf_peak was last reset
+    unsigned int num_outstanding;   // on either ring, or being handled
+    uint64_t num_ringbuf_exhausted; // times the ringbuffer was replaced
+    GHashTable * latest;            // channel -> last keep_latest lcm_buf
+                                    // pushed, which may still be queued
+} lcm_buf_handoff_t;
+
+lcm_buf_handoff_t * lcm_buf_handoff_new(const lcm_recv_mem_params_t * mem);
+// frees the handoff and every lcm_buf in it.  Neither thread may be using it.
+void lcm_buf_handoff_free(lcm_buf_handoff_t * h);
+
+// receiving side.  Takes an lcm_buf from inbufs_empty without allocating space
+// for its data, allocating more lcm_bufs if inbufs_empty is empty.
+lcm_buf_t * lcm_buf_reserve(lcm_buf_handoff_t * h);
+
+// receiving side.  Copies the first len bytes of a packet that was received
+// outside of the ringbuffer into an exactly-sized chunk of the ringbuffer.  If
+// the ringbuffer is full, it is replaced with a bigger one, and the old one is
+// freed by lcm_buf_free_data() once it is empty.
+void lcm_buf_copy_data(lcm_buf_handoff_t * h, lcm_buf_t * lcmb, int len);
+
+// receiving side.  Takes back the lcm_bufs that have been handled, freeing
+// their data.
+void lcm_buf_handoff_recycle(lcm_buf_handoff_t * h);
+// receiving side.  Queues a complete message for the handling thread.  If the
+// message keeps only the latest on its channel, the older messages still
+// queued on that channel are superseded, and their placeholders released.
+// Returns 0 on success, or -1 if too many messages are queued already.
+int lcm_buf_handoff_push(lcm_buf_handoff_t * h, lcm_t * lcm,
+        lcm_buf_t * lcmb);
+
+// handling side.  Returns the next message that was not superseded, or NULL.
+lcm_buf_t * lcm_buf_handoff_pop(lcm_buf_handoff_t * h);
+int lcm_buf_handoff_is_empty(lcm_buf_handoff_t * h);
+// handling side.  Returns a message to the receiving thread once handled.
+void lcm_buf_handoff_release(lcm_buf_handoff_t * h, lcm_buf_t * lcmb);
+
+/******************** fragment buffer pool **********************/
+// Buffers for reassembling fragmented messages, pooled by size so that they
+// can be reused across messages instead of allocated for each one.
+#define LCM_FRAG_POOL_NUM_CLASSES 17
+
+typedef struct _lcm_frag_pool {
+    char     *free_bufs[LCM_FRAG_POOL_NUM_CLASSES];  // one free list per size
+    uint32_t cached_size;       // bytes on the free lists
+    uint32_t max_cached_size;   // buffers beyond this are freed instead
+} lcm_frag_pool_t;
+
+lcm_frag_pool_t * lcm_frag_pool_new(uint32_t max_cached_size);
+void lcm_frag_pool_destroy(lcm_frag_pool_t *pool);
+char * lcm_frag_pool_alloc(lcm_frag_pool_t *pool, uint32_t size);
+// size must be the one the buffer was allocated with
+void lcm_frag_pool_free(lcm_frag_pool_t *pool, char *data, uint32_t size);
+
+
 /******************** fragment buffer **********************/
+// A message is identified by its sender and sequence number, so several
+// messages from one sender can be reassembled at once.
+typedef struct _lcm_frag_key {
+    struct    sockaddr_in from;
+    uint32_t  msg_seqno;
+} lcm_frag_key_t;
+
 typedef struct _lcm_frag_buf {
+    lcm_frag_key_t key;
     char      channel[LCM_MAX_CHANNEL_NAME_LENGTH+1];
-    struct    sockaddr_in from;
     char      *data;
     uint32_t  data_size;
+    uint16_t  nfragments;
     uint16_t  fragments_remaining;
-    uint32_t  msg_seqno;
-    int64_t   last_packet_utime;
+    int64_t   last_packet_ns;   // receive time of the latest fragment
+    int64_t   send_utime;       // for traced messages, or 0
+    uint32_t  send_host_id;
+    uint8_t   *received;        // one bit per fragment, to reject duplicates
+
+    // the store's list, from the least to the most recently updated
+    struct _lcm_frag_buf *lru_prev;
+    struct _lcm_frag_buf *lru_next;
 } lcm_frag_buf_t;
 
-lcm_frag_buf_t * lcm_frag_buf_new(struct sockaddr_in from, const char *channel,
-        uint32_t msg_seqno, uint32_t data_size, uint16_t nfragments,
-        int64_t first_packet_utime);
-void lcm_frag_buf_destroy(lcm_frag_buf_t *fbuf);
-
 
 /******************** fragment buffer store **********************/
 typedef struct _lcm_frag_buf_store {
     uint32_t total_size;
     uint32_t max_total_size;
     uint32_t max_n_frag_bufs;
-    GHashTable *frag_bufs;
+    GHashTable *frag_bufs;      // lcm_frag_key_t -> lcm_frag_buf_t
+    lcm_frag_buf_t *lru_head;
+    lcm_frag_buf_t *lru_tail;
+    lcm_frag_pool_t *pool;
+
+    uint64_t num_evicted;       // dropped to make room for newer messages
+    uint64_t num_timed_out;     // dropped after FRAG_BUF_TIMEOUT_USEC with
+                                // no new fragments
+    uint64_t num_incomplete;    // dropped before all fragments arrived,
+                                // including the evicted and timed out ones
+    uint64_t num_duplicates;    // fragments received more than once
 } lcm_frag_buf_store;
 
 lcm_frag_buf_store * lcm_frag_buf_store_new(uint32_t max_total_size,
         uint32_t max_n_frag_bufs);
 void lcm_frag_buf_store_destroy(lcm_frag_buf_store * store);
 lcm_frag_buf_t * lcm_frag_buf_store_lookup(lcm_frag_buf_store * store,
-        struct sockaddr* key);
-
+        struct sockaddr* from, uint32_t msg_seqno);
+
+// start reassembling a message.  Fragment buffers that have timed out are
+// dropped, and the least recently updated ones are evicted if the store is
+// full.
+lcm_frag_buf_t * lcm_frag_buf_store_add(lcm_frag_buf_store *store,
+        struct sockaddr *from, const char *channel, uint32_t msg_seqno,
+        uint32_t data_size, uint16_t nfragments, int64_t first_packet_ns);
+// copy a fragment into its message.  Returns 1 if the message is now
+// complete, 0 if it is not or the fragment is a duplicate, and -1 if the
+// fragment is invalid, in which case the fragment buffer is removed.
+int lcm_frag_buf_store_add_fragment(lcm_frag_buf_store *store,
+        lcm_frag_buf_t *fbuf, uint16_t fragment_no, uint32_t fragment_offset,
+        const char *data, uint32_t size, int64_t recv_ns);
+// transfer ownership of a message's data to lcmb.  It goes back to the
+// store's pool when lcm_buf_free_data() is called.
+void lcm_frag_buf_store_take_data(lcm_frag_buf_store *store,
+        lcm_frag_buf_t *fbuf, lcm_buf_t *lcmb);
 void lcm_frag_buf_store_remove(lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf);
-void lcm_frag_buf_store_add(lcm_frag_buf_store *store, lcm_frag_buf_t *fbuf);
+
+
+/******************** reassembled messages **********************/
+// Remembers the messages reassembled in the last keep_usec microseconds, so
+// that fragments of a message sent again after it was delivered can be told
+// apart from the start of a new message.
+typedef struct _lcm_frag_done_set {
+    GHashTable *msgs;           // lcm_frag_key_t -> lcm_frag_done_msg_t
+    GQueue *order;              // lcm_frag_done_msg_t, oldest first
+    int64_t keep_usec;
+} lcm_frag_done_set_t;
+
+lcm_frag_done_set_t * lcm_frag_done_set_new(int64_t keep_usec);
+void lcm_frag_done_set_destroy(lcm_frag_done_set_t *set);
+// note that a message was reassembled at now_utime
+void lcm_frag_done_set_add(lcm_frag_done_set_t *set, struct sockaddr *from,
+        uint32_t msg_seqno, int64_t now_utime);
+int lcm_frag_done_set_contains(lcm_frag_done_set_t *set, struct sockaddr *from,
+        uint32_t msg_seqno, int64_t now_utime);
+
+
+/******************** sender sequence numbers **********************/
+// Follows the msg_seqno of each sender, to count the messages that never
+// arrived and the ones that arrived out of order.
+typedef struct _lcm_seqno_tracker {
+    GHashTable *senders;        // struct sockaddr_in -> last msg_seqno
+    uint64_t num_lost;
+    uint64_t num_reordered;
+} lcm_seqno_tracker_t;
+
+lcm_seqno_tracker_t * lcm_seqno_tracker_new(void);
+void lcm_seqno_tracker_destroy(lcm_seqno_tracker_t *tracker);
+// account for a received packet.  starts_message is nonzero for short
+// messages and the first fragment of fragmented messages.
+void lcm_seqno_tracker_update(lcm_seqno_tracker_t *tracker,
+        struct sockaddr *from, uint32_t msg_seqno, int starts_message);
+
+
+/******************** fragmented transmit **********************/
+
+// The most payload that fits in one fragment, with or without the trace
+// extension.
+static inline int
+lcm_fragment_max_payload (int traced)
+{
+    return LCM_FRAGMENT_MAX_PAYLOAD - (traced ? sizeof (lcm2_trace_ext_t) : 0);
+}
+
+// Transmit a message too large for a single packet as nfragments fragments,
+// submitting as many fragments to the kernel per system call as the platform
+// allows.  If @trace is not NULL, every fragment carries it.  The caller must
+// hold a lock so that fragments of different messages are not interleaved.
+// Returns 0 on success, -1 on failure.
+int lcm_udpm_send_fragments(SOCKET fd, const struct sockaddr_in *dest,
+        uint32_t msg_seqno, const char *channel, const void *data,
+        unsigned int datalen, int nfragments, const lcm2_trace_ext_t *trace);
+
+// Transmit again some of the fragments of a message sent with
+// lcm_udpm_send_fragments (), which must be passed the same arguments.
+int lcm_udpm_resend_fragments(SOCKET fd, const struct sockaddr_in *dest,
+        uint32_t msg_seqno, const char *channel, const void *data,
+        unsigned int datalen, int nfragments, const lcm2_trace_ext_t *trace,
+        const uint16_t *fragment_nos, int num_fragment_nos);
+
+// Identifies this host in traced packets.  Derived from the host name.
+uint32_t lcm_host_id(void);
+
+
+/******************** self-test results **********************/
+
+// Whether a self-test passed for a provider's multicast group earlier in the
+// life of the process.  @port is in network byte order.
+int lcm_self_test_passed(const char *provider, struct in_addr mc_addr,
+        uint16_t port, int ttl);
+
+// Remember that a self-test passed for a multicast group.
+void lcm_self_test_set_passed(const char *provider, struct in_addr mc_addr,
+        uint16_t port, int ttl);
+
+
+/******************** kernel receive timestamps **********************/
+
+// Room for the control messages received with a packet: its timestamps and
+// the kernel's count of dropped packets.
+#define LCM_RECV_CONTROL_SIZE 128
+
+#ifdef SO_TIMESTAMP
+// Have the kernel timestamp each packet received on a socket as soon as it
+// arrives, with the finest resolution available: a software timestamp from
+// SO_TIMESTAMPING, then SO_TIMESTAMPNS, then SO_TIMESTAMP.
+void lcm_enable_recv_timestamps(SOCKET fd);
+
+// If a control message received with a packet is its timestamp, stores it in
+// @recv_ns, in nanoseconds since the epoch, and returns 1.  Returns 0
+// otherwise.
+int lcm_parse_recv_timestamp(struct cmsghdr *cmsg, int64_t *recv_ns);
+#endif
+
+
+/******************** busy polling **********************/
+
+// How long each read on a busy polling socket polls the network device
+// for packets, in microseconds.
+#define LCM_BUSY_POLL_USEC 50
+
+// Have reads on a socket poll the network device for packets, instead of
+// waiting for its interrupt.  Does nothing where SO_BUSY_POLL is not
+// supported, or the process lacks permission for it.
+void lcm_set_busy_poll(SOCKET fd);
+
+// How long lcm_handle () spins waiting for a message when busy polling,
+// before it sleeps until one arrives, in microseconds.
+#define LCM_BUSY_POLL_SPIN_USEC 100000
+
+// Pause for a moment in a busy polling loop, to spare the core's other
+// hardware thread and the memory bus.
+void lcm_cpu_relax(void);
 
 
 /************************* Linux Specific Functions *******************/
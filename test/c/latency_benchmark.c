@@ -0,0 +1,128 @@
+// Measures the round trip latency of an LCM provider, with and without the
+// busy_poll option.
+//
+// An echo thread republishes each message it receives on PING as PONG, and
+// the main thread times how long each PING takes to come back.  Both run
+// lcm_handle_timeout(), so with busy_poll they spin instead of sleeping.
+//
+// Usage: test-c-latency_benchmark [num_round_trips] [url]
+//
+// The url defaults to udpm://239.255.76.67:7667?ttl=0.  The busy_poll option
+// is appended to it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <lcm/lcm.h>
+
+static volatile int stop_echo;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+echo_handler(const lcm_recv_buf_t* rbuf, const char* channel, void* user)
+{
+    lcm_publish((lcm_t*) user, "PONG", rbuf->data, rbuf->data_size);
+}
+
+static void*
+echo_thread(void* user)
+{
+    lcm_t* lcm = (lcm_t*) user;
+    while (!stop_echo)
+        lcm_handle_timeout(lcm, 100);
+    return NULL;
+}
+
+static void
+pong_handler(const lcm_recv_buf_t* rbuf, const char* channel, void* user)
+{
+    memcpy((int64_t*) user, rbuf->data, sizeof(int64_t));
+}
+
+static int
+compare_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Times num_round_trips round trips, and prints the percentiles in
+// microseconds.  Returns -1 if the LCM instances can't be created.
+static int
+run(const char* url, int num_round_trips)
+{
+    lcm_t* echo = lcm_create(url);
+    lcm_t* lcm = lcm_create(url);
+    if (!echo || !lcm) {
+        fprintf(stderr, "Failed to create LCM instance for %s\n", url);
+        return -1;
+    }
+    lcm_subscribe(echo, "PING", echo_handler, echo);
+    int64_t received = -1;
+    lcm_subscribe(lcm, "PONG", pong_handler, &received);
+
+    stop_echo = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo_thread, echo);
+
+    int64_t* rtt = (int64_t*) malloc(num_round_trips * sizeof(int64_t));
+    int num_done = 0;
+    int num_lost = 0;
+    // the first round trips warm up the caches, and aren't counted
+    for (int i = -100; i < num_round_trips; i++) {
+        int64_t sent = now_ns();
+        lcm_publish(lcm, "PING", &sent, sizeof(sent));
+        while (received != sent) {
+            if (lcm_handle_timeout(lcm, 100) <= 0)
+                break;
+        }
+        if (received != sent) {
+            num_lost++;
+            continue;
+        }
+        if (i >= 0)
+            rtt[num_done++] = now_ns() - sent;
+    }
+
+    stop_echo = 1;
+    pthread_join(thread, NULL);
+    lcm_destroy(lcm);
+    lcm_destroy(echo);
+
+    qsort(rtt, num_done, sizeof(int64_t), compare_int64);
+    if (num_done) {
+        printf("%-50s %10.1f %10.1f %10.1f %8d\n", url,
+                rtt[num_done / 2] * 1e-3, rtt[num_done * 99 / 100] * 1e-3,
+                rtt[num_done - 1] * 1e-3, num_lost);
+    }
+    free(rtt);
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    int num_round_trips = argc > 1 ? atoi(argv[1]) : 10000;
+    const char* url = argc > 2 ? argv[2] : "udpm://239.255.76.67:7667?ttl=0";
+
+    char busy_url[256];
+    snprintf(busy_url, sizeof(busy_url), "%s%sbusy_poll=1", url,
+            strchr(url, '?') ? "&" : "?");
+
+    printf("%-50s %10s %10s %10s %8s\n", "url", "p50 (us)", "p99 (us)",
+            "max (us)", "lost");
+    if (run(url, num_round_trips) < 0 || run(busy_url, num_round_trips) < 0)
+        return 1;
+    return 0;
+}
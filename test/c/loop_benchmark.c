@@ -0,0 +1,156 @@
+// Compares handling many LCM instances from one lcm_loop_t against one thread
+// per instance, each calling lcm_handle_timeout() with a 1 ms timeout.
+//
+// A publisher sends 1000 messages per second, round robin across the
+// instances, and the benchmark reports the CPU time used per second and the
+// delivery latency.
+//
+// Usage: test-c-loop_benchmark [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <lcm/lcm_loop.h>
+
+typedef struct {
+    int64_t num_received;
+    int64_t total_latency_us;
+    int64_t max_latency_us;
+} stats_t;
+
+static stats_t stats;
+static volatile int stop_threads;
+
+static int64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double
+cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+static void
+handler(const lcm_recv_buf_t* rbuf, const char* channel, void* user)
+{
+    int64_t sent;
+    memcpy(&sent, rbuf->data, sizeof(sent));
+    int64_t latency = now_us() - sent;
+    __sync_fetch_and_add(&stats.num_received, 1);
+    __sync_fetch_and_add(&stats.total_latency_us, latency);
+    int64_t max = stats.max_latency_us;
+    while (latency > max &&
+            !__sync_bool_compare_and_swap(&stats.max_latency_us, max, latency))
+        max = stats.max_latency_us;
+}
+
+static void*
+handle_timeout_thread(void* user)
+{
+    lcm_t* lcm = (lcm_t*) user;
+    while (!stop_threads)
+        lcm_handle_timeout(lcm, 1);
+    return NULL;
+}
+
+static void*
+loop_thread(void* user)
+{
+    lcm_loop_run((lcm_loop_t*) user);
+    return NULL;
+}
+
+// Publish one message per millisecond for the given time.
+static void
+publish(lcm_t** lcms, int num_lcms, double seconds)
+{
+    int64_t start = now_us();
+    int64_t next = start;
+    for (int i = 0; next - start < seconds * 1e6; i++) {
+        int64_t wait = next - now_us();
+        if (wait > 0)
+            usleep(wait);
+        int64_t sent = now_us();
+        lcm_publish(lcms[i % num_lcms], "BENCH", &sent, sizeof(sent));
+        next += 1000;
+    }
+    // let the last messages arrive
+    usleep(20000);
+}
+
+static void
+report(const char* mode, int num_lcms, double cpu, double seconds)
+{
+    printf("%10d %10s %14.3f %14.1f %14lld\n", num_lcms, mode, cpu / seconds,
+            stats.num_received ?
+                (double) stats.total_latency_us / stats.num_received : 0.0,
+            (long long) stats.max_latency_us);
+}
+
+int
+main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    const int num_lcms[] = { 1, 16, 128, 512 };
+
+    printf("%10s %10s %14s %14s %14s\n", "instances", "mode", "cpu (s/s)",
+            "latency (us)", "max (us)");
+    for (unsigned int i = 0; i < sizeof(num_lcms) / sizeof(int); i++) {
+        int n = num_lcms[i];
+        lcm_t** lcms = (lcm_t**) malloc(n * sizeof(lcm_t*));
+        for (int j = 0; j < n; j++) {
+            lcms[j] = lcm_create("memq://");
+            if (!lcms[j]) {
+                fprintf(stderr, "Failed to create LCM instance\n");
+                return 1;
+            }
+            lcm_subscribe(lcms[j], "BENCH", handler, NULL);
+        }
+
+        // one thread per instance
+        pthread_t* threads = (pthread_t*) malloc(n * sizeof(pthread_t));
+        memset(&stats, 0, sizeof(stats));
+        stop_threads = 0;
+        for (int j = 0; j < n; j++)
+            pthread_create(&threads[j], NULL, handle_timeout_thread, lcms[j]);
+        double cpu_start = cpu_seconds();
+        publish(lcms, n, seconds);
+        report("threads", n, cpu_seconds() - cpu_start, seconds);
+        stop_threads = 1;
+        for (int j = 0; j < n; j++)
+            pthread_join(threads[j], NULL);
+        free(threads);
+
+        // one event loop for all the instances
+        lcm_loop_t* loop = lcm_loop_create();
+        for (int j = 0; j < n; j++)
+            lcm_loop_add_lcm(loop, lcms[j]);
+        memset(&stats, 0, sizeof(stats));
+        pthread_t thread;
+        pthread_create(&thread, NULL, loop_thread, loop);
+        cpu_start = cpu_seconds();
+        publish(lcms, n, seconds);
+        report("loop", n, cpu_seconds() - cpu_start, seconds);
+        lcm_loop_quit(loop);
+        pthread_join(thread, NULL);
+        lcm_loop_destroy(loop);
+
+        for (int j = 0; j < n; j++)
+            lcm_destroy(lcms[j]);
+        free(lcms);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <gtest/gtest.h>
+
+#include <lcm/lcm_loop.h>
+
+static void CountingHandler(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    (*(int*)user_data)++;
+}
+
+static void PipeHandler(lcm_loop_t* loop, int fd, void* user_data) {
+    char buf[16];
+    int status = read(fd, buf, sizeof(buf));
+    if (status > 0) {
+        *(int*)user_data += status;
+    }
+}
+
+static void TimerHandler(lcm_loop_t* loop, int timer_id, void* user_data) {
+    (*(int*)user_data)++;
+}
+
+TEST(LCM_C, LoopConstructDestroy) {
+    lcm_loop_t* loop = lcm_loop_create();
+    ASSERT_TRUE(loop != NULL);
+    // Nothing is ready, so the call should timeout.
+    EXPECT_EQ(0, lcm_loop_run_once(loop, 0));
+    lcm_loop_destroy(loop);
+}
+
+TEST(LCM_C, LoopSources) {
+    // Messages from several LCM instances and data on a user file descriptor
+    // are all dispatched from one thread.
+    lcm_loop_t* loop = lcm_loop_create();
+    lcm_t* lcm_a = lcm_create("memq://");
+    lcm_t* lcm_b = lcm_create("memq://");
+    int num_a = 0;
+    int num_b = 0;
+    lcm_subscribe(lcm_a, "channel", CountingHandler, &num_a);
+    lcm_subscribe(lcm_b, "channel", CountingHandler, &num_b);
+    EXPECT_EQ(0, lcm_loop_add_lcm(loop, lcm_a));
+    EXPECT_EQ(0, lcm_loop_add_lcm(loop, lcm_b));
+    // Each instance can only be added once.
+    EXPECT_EQ(-1, lcm_loop_add_lcm(loop, lcm_a));
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    int num_bytes = 0;
+    EXPECT_EQ(0, lcm_loop_add_fd(loop, fds[0], PipeHandler, &num_bytes));
+
+    lcm_publish(lcm_a, "channel", "", 0);
+    lcm_publish(lcm_a, "channel", "", 0);
+    lcm_publish(lcm_b, "channel", "", 0);
+    EXPECT_EQ(3, write(fds[1], "abc", 3));
+
+    for (int i = 0; i < 10 && num_a + num_b + num_bytes < 6; ++i) {
+        EXPECT_LT(0, lcm_loop_run_once(loop, 1000));
+    }
+    EXPECT_EQ(2, num_a);
+    EXPECT_EQ(1, num_b);
+    EXPECT_EQ(3, num_bytes);
+    EXPECT_EQ(0, lcm_loop_run_once(loop, 0));
+
+    // Removed sources are no longer dispatched.
+    EXPECT_EQ(0, lcm_loop_remove_lcm(loop, lcm_b));
+    EXPECT_EQ(0, lcm_loop_remove_fd(loop, fds[0]));
+    EXPECT_EQ(-1, lcm_loop_remove_fd(loop, fds[0]));
+    lcm_publish(lcm_b, "channel", "", 0);
+    EXPECT_EQ(1, write(fds[1], "d", 1));
+    EXPECT_EQ(0, lcm_loop_run_once(loop, 10));
+    EXPECT_EQ(1, num_b);
+    EXPECT_EQ(3, num_bytes);
+
+    lcm_loop_destroy(loop);
+    lcm_destroy(lcm_a);
+    lcm_destroy(lcm_b);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(LCM_C, LoopTimers) {
+    lcm_loop_t* loop = lcm_loop_create();
+    int num_once = 0;
+    int num_repeat = 0;
+    int once_id = lcm_loop_add_timer(loop, 5, 0, TimerHandler, &num_once);
+    int repeat_id = lcm_loop_add_timer(loop, 5, 1, TimerHandler, &num_repeat);
+    EXPECT_LT(0, once_id);
+    EXPECT_LT(0, repeat_id);
+    EXPECT_NE(once_id, repeat_id);
+
+    // The loop wakes up for the timers even without a timeout.
+    while (num_repeat < 3) {
+        EXPECT_LT(0, lcm_loop_run_once(loop, -1));
+    }
+    EXPECT_EQ(1, num_once);
+    // The one-shot timer removed itself.
+    EXPECT_EQ(-1, lcm_loop_remove_timer(loop, once_id));
+    EXPECT_EQ(0, lcm_loop_remove_timer(loop, repeat_id));
+    EXPECT_EQ(0, lcm_loop_run_once(loop, 20));
+    EXPECT_EQ(3, num_repeat);
+
+    lcm_loop_destroy(loop);
+}
+
+static void* QuitThread(void* user_data) {
+    usleep(10000);
+    lcm_loop_quit((lcm_loop_t*)user_data);
+    return NULL;
+}
+
+TEST(LCM_C, LoopQuit) {
+    // lcm_loop_run() returns once another thread calls lcm_loop_quit().
+    lcm_loop_t* loop = lcm_loop_create();
+    pthread_t thread;
+    pthread_create(&thread, NULL, QuitThread, loop);
+    EXPECT_EQ(0, lcm_loop_run(loop));
+    pthread_join(thread, NULL);
+    lcm_loop_destroy(loop);
+}
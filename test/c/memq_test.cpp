@@ -1,5 +1,9 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef WIN32
+#include <time.h>
+#endif
 #include <gtest/gtest.h>
 
 #include <lcm/lcm.h>
@@ -113,3 +117,380 @@ TEST(LCM_C, MemqTimeout) {
 
   lcm_destroy(lcm);
 }
+
+struct MemqUnsubscribeState {
+    lcm_t* lcm;
+    lcm_subscription_t* subs[2];
+    int num_handled[2];
+};
+
+void MemqUnsubscribeHandler0(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    MemqUnsubscribeState* state = (MemqUnsubscribeState*)user_data;
+    state->num_handled[0]++;
+    // Unsubscribe both handlers from inside a callback.
+    lcm_unsubscribe(state->lcm, state->subs[0]);
+    lcm_unsubscribe(state->lcm, state->subs[1]);
+}
+
+void MemqUnsubscribeHandler1(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    MemqUnsubscribeState* state = (MemqUnsubscribeState*)user_data;
+    state->num_handled[1]++;
+}
+
+TEST(LCM_C, MemqUnsubscribeInHandler) {
+    lcm_t* lcm = lcm_create("memq://");
+    MemqUnsubscribeState state;
+    memset(&state, 0, sizeof(state));
+    state.lcm = lcm;
+    state.subs[0] = lcm_subscribe(lcm, "chan.*", MemqUnsubscribeHandler0,
+            &state);
+    state.subs[1] = lcm_subscribe(lcm, "channel", MemqUnsubscribeHandler1,
+            &state);
+
+    lcm_publish(lcm, "channel", "", 0);
+    lcm_publish(lcm, "channel", "", 0);
+    EXPECT_LT(0, lcm_handle_timeout(lcm, 1000));
+
+    // The second handler was unsubscribed before it could be called.
+    EXPECT_EQ(1, state.num_handled[0]);
+    EXPECT_EQ(0, state.num_handled[1]);
+
+    // Nothing is subscribed anymore, so the second message is not delivered.
+    lcm_handle_timeout(lcm, 0);
+    EXPECT_EQ(1, state.num_handled[0]);
+    EXPECT_EQ(0, state.num_handled[1]);
+
+    lcm_destroy(lcm);
+}
+
+TEST(LCM_C, MemqHandleBatch) {
+    // Publish several messages, then dispatch them in batches.
+    lcm_t* lcm = lcm_create("memq://");
+    std::vector<std::vector<uint8_t> > received_buffers;
+
+    lcm_subscribe(lcm, "channel", MemqBufferedHandler, &received_buffers);
+
+    // No messages available.  Call should timeout immediately.
+    EXPECT_EQ(0, lcm_handle_batch(lcm, 10, 0));
+
+    // Invalid batch size should result in an error.
+    EXPECT_GT(0, lcm_handle_batch(lcm, 0, 0));
+
+    uint8_t byte = 0;
+    for (int i = 0; i < 25; ++i) {
+        lcm_publish(lcm, "channel", &byte, 1);
+    }
+
+    EXPECT_EQ(10, lcm_handle_batch(lcm, 10, 1000));
+    EXPECT_EQ(10u, received_buffers.size());
+    EXPECT_EQ(10, lcm_handle_batch(lcm, 10, 0));
+    EXPECT_EQ(5, lcm_handle_batch(lcm, 10, -1));
+    EXPECT_EQ(25u, received_buffers.size());
+    EXPECT_EQ(0, lcm_handle_batch(lcm, 10, 0));
+
+    lcm_destroy(lcm);
+}
+
+#ifndef WIN32
+struct MemqThreadedState {
+    std::vector<int> received;
+    int sleep_usec;
+};
+
+void MemqThreadedHandler(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    MemqThreadedState* state = (MemqThreadedState*)user_data;
+    int value;
+    memcpy(&value, rbuf->data, sizeof(value));
+    state->received.push_back(value);
+    if (state->sleep_usec) {
+        struct timespec sleeptime;
+        sleeptime.tv_sec = 0;
+        sleeptime.tv_nsec = state->sleep_usec * 1000;
+        nanosleep(&sleeptime, NULL);
+    }
+}
+
+static void
+MemqWaitForQueueEmpty(lcm_subscription_t* subs) {
+    for (int i = 0; i < 1000 && lcm_subscription_get_queue_size(subs); i++) {
+        struct timespec sleeptime;
+        sleeptime.tv_sec = 0;
+        sleeptime.tv_nsec = 1000000;
+        nanosleep(&sleeptime, NULL);
+    }
+}
+
+TEST(LCM_C, MemqDispatchThreads) {
+    // Handlers run on worker threads, and each subscription sees its messages
+    // in order.
+    lcm_t* lcm = lcm_create("memq://");
+    EXPECT_EQ(0, lcm_set_dispatch_threads(lcm, 4));
+
+    MemqThreadedState slow;
+    slow.sleep_usec = 1000;
+    MemqThreadedState fast;
+    fast.sleep_usec = 0;
+    MemqThreadedState inline_state;
+    inline_state.sleep_usec = 0;
+    lcm_subscription_t* slow_subs =
+        lcm_subscribe(lcm, "slow", MemqThreadedHandler, &slow);
+    lcm_subscription_t* fast_subs =
+        lcm_subscribe(lcm, "fast", MemqThreadedHandler, &fast);
+    lcm_subscription_t* inline_subs =
+        lcm_subscribe(lcm, "fast", MemqThreadedHandler, &inline_state);
+    lcm_subscription_set_queue_capacity(slow_subs, 0);
+    lcm_subscription_set_queue_capacity(fast_subs, 0);
+    lcm_subscription_set_queue_capacity(inline_subs, 0);
+    EXPECT_EQ(0, lcm_subscription_set_dispatch_mode(inline_subs,
+                LCM_DISPATCH_INLINE));
+
+    const int num_msgs = 50;
+    for (int i = 0; i < num_msgs; ++i) {
+        lcm_publish(lcm, "slow", &i, sizeof(i));
+        lcm_publish(lcm, "fast", &i, sizeof(i));
+    }
+    EXPECT_EQ(2 * num_msgs, lcm_handle_batch(lcm, 2 * num_msgs, 1000));
+
+    // inline handlers are done when lcm_handle_batch returns
+    EXPECT_EQ(num_msgs, (int)inline_state.received.size());
+
+    MemqWaitForQueueEmpty(slow_subs);
+    MemqWaitForQueueEmpty(fast_subs);
+    ASSERT_EQ(num_msgs, (int)slow.received.size());
+    ASSERT_EQ(num_msgs, (int)fast.received.size());
+    for (int i = 0; i < num_msgs; ++i) {
+        EXPECT_EQ(i, slow.received[i]);
+        EXPECT_EQ(i, fast.received[i]);
+    }
+
+    lcm_destroy(lcm);
+}
+
+TEST(LCM_C, MemqDispatchThreadsUnsubscribe) {
+    // Unsubscribing while callbacks are still queued on the worker threads.
+    lcm_t* lcm = lcm_create("memq://");
+
+    MemqThreadedState state;
+    state.sleep_usec = 1000;
+    lcm_subscription_t* subs =
+        lcm_subscribe(lcm, "channel", MemqThreadedHandler, &state);
+    EXPECT_EQ(0, lcm_subscription_set_dispatch_mode(subs,
+                LCM_DISPATCH_THREADED));
+
+    const int num_msgs = 20;
+    for (int i = 0; i < num_msgs; ++i) {
+        lcm_publish(lcm, "channel", &i, sizeof(i));
+    }
+    EXPECT_EQ(num_msgs, lcm_handle_batch(lcm, num_msgs, 1000));
+    EXPECT_EQ(0, lcm_unsubscribe(lcm, subs));
+
+    // Queue more jobs that are still pending when the instance is destroyed.
+    subs = lcm_subscribe(lcm, "channel", MemqThreadedHandler, &state);
+    lcm_subscription_set_dispatch_mode(subs, LCM_DISPATCH_THREADED);
+    for (int i = 0; i < num_msgs; ++i) {
+        lcm_publish(lcm, "channel", &i, sizeof(i));
+    }
+    EXPECT_EQ(num_msgs, lcm_handle_batch(lcm, num_msgs, 1000));
+    lcm_destroy(lcm);
+}
+
+struct MemqPublishingState {
+    lcm_t* lcm;
+    volatile int started;
+    int num_handled;
+};
+
+void MemqPublishingHandler(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    MemqPublishingState* state = (MemqPublishingState*)user_data;
+    state->started = 1;
+    struct timespec sleeptime;
+    sleeptime.tv_sec = 0;
+    sleeptime.tv_nsec = 10000000;
+    nanosleep(&sleeptime, NULL);
+    lcm_publish(state->lcm, "echo", rbuf->data, rbuf->data_size);
+    state->num_handled++;
+}
+
+TEST(LCM_C, MemqDispatchThreadsDestroyWhilePublishing) {
+    // Destroying the instance waits for a handler that is still running on a
+    // worker thread, and that publishes after lcm_destroy() was called.
+    lcm_t* lcm = lcm_create("memq://");
+    MemqPublishingState state;
+    state.lcm = lcm;
+    state.started = 0;
+    state.num_handled = 0;
+    lcm_subscription_t* subs =
+        lcm_subscribe(lcm, "channel", MemqPublishingHandler, &state);
+    EXPECT_EQ(0, lcm_subscription_set_dispatch_mode(subs,
+                LCM_DISPATCH_THREADED));
+
+    int value = 1;
+    lcm_publish(lcm, "channel", &value, sizeof(value));
+    EXPECT_EQ(1, lcm_handle_batch(lcm, 1, 1000));
+    for (int i = 0; i < 1000 && !state.started; i++) {
+        struct timespec sleeptime;
+        sleeptime.tv_sec = 0;
+        sleeptime.tv_nsec = 100000;
+        nanosleep(&sleeptime, NULL);
+    }
+    ASSERT_TRUE(state.started);
+    lcm_destroy(lcm);
+    EXPECT_EQ(1, state.num_handled);
+}
+#endif
+
+struct MemqOrderState {
+    std::vector<int> order;
+};
+
+static MemqOrderState memq_order_state;
+
+template <int N>
+void MemqOrderHandler(const lcm_recv_buf_t* rbuf, const char* channel,
+        void* user_data) {
+    memq_order_state.order.push_back(N);
+}
+
+TEST(LCM_C, MemqSubscriptionKinds) {
+    // Literal, prefix and regex subscriptions all match as regular
+    // expressions, and handlers run in the order they were subscribed.
+    lcm_t* lcm = lcm_create("memq://");
+    lcm_subscribe(lcm, "CH[0-9]+", MemqOrderHandler<0>, NULL);
+    lcm_subscribe(lcm, "CH1", MemqOrderHandler<1>, NULL);
+    lcm_subscribe(lcm, "CH.*", MemqOrderHandler<2>, NULL);
+    lcm_subscribe(lcm, "CH1", MemqOrderHandler<3>, NULL);
+    lcm_subscribe(lcm, ".*", MemqOrderHandler<4>, NULL);
+    lcm_subscribe(lcm, "C.*", MemqOrderHandler<5>, NULL);
+    lcm_subscribe(lcm, "CH.1", MemqOrderHandler<6>, NULL);
+
+    memq_order_state.order.clear();
+    lcm_publish(lcm, "CH1", "", 0);
+    EXPECT_LT(0, lcm_handle_timeout(lcm, 1000));
+    int expected_ch1[] = { 0, 1, 2, 3, 4, 5 };
+    EXPECT_EQ(std::vector<int>(expected_ch1, expected_ch1 + 6),
+            memq_order_state.order);
+
+    memq_order_state.order.clear();
+    lcm_publish(lcm, "CHX1", "", 0);
+    EXPECT_LT(0, lcm_handle_timeout(lcm, 1000));
+    int expected_chx1[] = { 2, 4, 5, 6 };
+    EXPECT_EQ(std::vector<int>(expected_chx1, expected_chx1 + 4),
+            memq_order_state.order);
+
+    memq_order_state.order.clear();
+    lcm_publish(lcm, "OTHER", "", 0);
+    EXPECT_LT(0, lcm_handle_timeout(lcm, 1000));
+    EXPECT_EQ(std::vector<int>(1, 4), memq_order_state.order);
+
+    lcm_destroy(lcm);
+}
+
+TEST(LCM_C, MemqChannelCache) {
+    // Channels that nothing is subscribed to are forgotten once the cache is
+    // full, and subscriptions still match channels that were forgotten.
+    lcm_t* lcm = lcm_create("memq://");
+    EXPECT_EQ(0, lcm_set_channel_cache_capacity(lcm, 10));
+
+    char channel[32];
+    for (int i = 0; i < 100; ++i) {
+        snprintf(channel, sizeof(channel), "ID_%d", i);
+        lcm_publish(lcm, channel, "", 0);
+    }
+
+    lcm_channel_cache_stats_t stats;
+    lcm_get_channel_cache_stats(lcm, &stats);
+    EXPECT_EQ(10, stats.num_channels);
+    EXPECT_EQ(10, stats.num_idle);
+    EXPECT_EQ(10, stats.capacity);
+    EXPECT_EQ(100u, stats.misses);
+    EXPECT_EQ(90u, stats.evictions);
+
+    lcm_subscribe(lcm, "ID_5", MemqOrderHandler<0>, NULL);
+    lcm_subscribe(lcm, "ID_9.*", MemqOrderHandler<1>, NULL);
+
+    memq_order_state.order.clear();
+    lcm_publish(lcm, "ID_5", "", 0);
+    lcm_publish(lcm, "ID_95", "", 0);
+    lcm_publish(lcm, "ID_99", "", 0);
+    EXPECT_EQ(3, lcm_handle_batch(lcm, 10, 1000));
+    int expected[] = { 0, 1, 1 };
+    EXPECT_EQ(std::vector<int>(expected, expected + 3), memq_order_state.order);
+
+    // Channels with subscribers are kept even when they don't fit.
+    EXPECT_EQ(0, lcm_set_channel_cache_capacity(lcm, 1));
+    lcm_get_channel_cache_stats(lcm, &stats);
+    EXPECT_EQ(0, stats.num_idle);
+    EXPECT_LE(3, stats.num_channels);
+    EXPECT_LT(0u, stats.hits);
+
+    EXPECT_EQ(0, lcm_set_channel_cache_capacity(lcm, 0));
+    for (int i = 100; i < 200; ++i) {
+        snprintf(channel, sizeof(channel), "ID_%d", i);
+        lcm_publish(lcm, channel, "", 0);
+    }
+    lcm_get_channel_cache_stats(lcm, &stats);
+    EXPECT_EQ(100, stats.num_idle);
+
+    lcm_destroy(lcm);
+}
+
+TEST(LCM_C, MemqChannelCacheKeepsNewChannel) {
+    // A channel that was just looked up for the first time stays in the
+    // cache, even when the cache is already full of subscribed channels.
+    lcm_t* lcm = lcm_create("memq://");
+    EXPECT_EQ(0, lcm_set_channel_cache_capacity(lcm, 2));
+    lcm_subscribe(lcm, "A", MemqOrderHandler<0>, NULL);
+    lcm_subscribe(lcm, "B", MemqOrderHandler<1>, NULL);
+    lcm_subscribe(lcm, "C", MemqOrderHandler<2>, NULL);
+    lcm_publish(lcm, "A", "", 0);
+    lcm_publish(lcm, "B", "", 0);
+    lcm_publish(lcm, "C", "", 0);
+    EXPECT_EQ(3, lcm_handle_batch(lcm, 10, 1000));
+
+    lcm_channel_cache_stats_t before;
+    lcm_get_channel_cache_stats(lcm, &before);
+    EXPECT_EQ(3, before.num_channels);
+    EXPECT_EQ(0, before.num_idle);
+
+    for (int i = 0; i < 10; ++i) {
+        lcm_publish(lcm, "X", "", 0);
+    }
+    lcm_channel_cache_stats_t after;
+    lcm_get_channel_cache_stats(lcm, &after);
+    EXPECT_EQ(before.misses + 1, after.misses);
+    EXPECT_EQ(before.evictions, after.evictions);
+    EXPECT_EQ(1, after.num_idle);
+
+    // The next new channel takes its place.
+    lcm_publish(lcm, "Y", "", 0);
+    lcm_get_channel_cache_stats(lcm, &after);
+    EXPECT_EQ(before.misses + 2, after.misses);
+    EXPECT_EQ(before.evictions + 1, after.evictions);
+    EXPECT_EQ(1, after.num_idle);
+
+    lcm_destroy(lcm);
+}
+
+TEST(LCM_C, MemqKeepLatest) {
+    // Only the most recent message is handled when every subscription to the
+    // channel keeps the latest message.
+    lcm_t* lcm = lcm_create("memq://");
+    std::vector<std::vector<uint8_t> > received_buffers;
+    lcm_subscription_t* subs = lcm_subscribe(lcm, "channel",
+            MemqBufferedHandler, &received_buffers);
+    EXPECT_EQ(0, lcm_subscription_set_queue_policy(subs, LCM_QUEUE_KEEP_LATEST));
+
+    for (uint8_t i = 0; i < 10; ++i) {
+        lcm_publish(lcm, "channel", &i, 1);
+        lcm_publish(lcm, "other", &i, 1);
+    }
+    EXPECT_EQ(1, lcm_handle_batch(lcm, 100, 0));
+    ASSERT_EQ(1u, received_buffers.size());
+    EXPECT_EQ(9, received_buffers[0][0]);
+
+    lcm_destroy(lcm);
+}
@@ -0,0 +1,77 @@
+// Measures how the cost of lcm_subscribe() / lcm_unsubscribe() scales with
+// the number of channel names an LCM instance has seen.
+//
+// Usage: test-c-subscribe_benchmark [num_cycles]
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+#include <lcm/lcm.h>
+
+static void
+empty_handler(const lcm_recv_buf_t* rbuf, const char* channel, void* user)
+{
+}
+
+static double
+now_seconds(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Subscribe and unsubscribe num_cycles times with the given channel pattern.
+// Returns the average time per subscribe/unsubscribe pair, in microseconds.
+static double
+time_churn(lcm_t* lcm, const char* pattern, int num_cycles)
+{
+    double start = now_seconds();
+    for (int i = 0; i < num_cycles; i++) {
+        lcm_subscription_t* subs =
+            lcm_subscribe(lcm, pattern, empty_handler, NULL);
+        lcm_unsubscribe(lcm, subs);
+    }
+    return (now_seconds() - start) * 1e6 / num_cycles;
+}
+
+int
+main(int argc, char** argv)
+{
+    int num_cycles = argc > 1 ? atoi(argv[1]) : 10000;
+    const int num_channels[] = { 100, 1000, 10000, 100000 };
+
+    printf("%10s %14s %14s %14s\n", "channels", "literal (us)", "prefix (us)",
+            "regex (us)");
+    for (unsigned int i = 0; i < sizeof(num_channels) / sizeof(int); i++) {
+        lcm_t* lcm = lcm_create("memq://");
+        if (!lcm) {
+            fprintf(stderr, "Failed to create LCM instance\n");
+            return 1;
+        }
+
+        // Make the instance see a lot of distinct channel names.  Publishing
+        // with no subscribers looks up, and remembers, each channel name.
+        lcm_set_channel_cache_capacity(lcm, 0);
+        char channel[64];
+        for (int c = 0; c < num_channels[i]; c++) {
+            snprintf(channel, sizeof(channel), "VEHICLE_%d_POSE", c);
+            lcm_publish(lcm, channel, "", 0);
+        }
+
+        // Literal and prefix subscriptions should cost the same no matter
+        // how many channels have been seen.  A regex has to be tested against
+        // every channel, so it's run fewer times.
+        double literal_us = time_churn(lcm, "VEHICLE_7_POSE", num_cycles);
+        double prefix_us = time_churn(lcm, "VEHICLE_7_.*", num_cycles);
+        double regex_us = time_churn(lcm, "VEHICLE_[0-9]_POSE",
+                num_cycles / 100 + 1);
+        printf("%10d %14.3f %14.3f %14.3f\n", num_channels[i], literal_us,
+                prefix_us, regex_us);
+
+        lcm_destroy(lcm);
+    }
+    return 0;
+}
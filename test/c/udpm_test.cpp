@@ -1,7 +1,12 @@
 #ifndef WIN32
+#include <sys/time.h>
 #include <time.h>
 #endif
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include <lcm/lcm.h>
@@ -54,4 +59,617 @@ TEST(LCM_C, QueueSize) {
 
   lcm_destroy(lcm);
 }
+
+TEST(LCM_C, SubscriptionStats) {
+  lcm_t* lcm = lcm_create(NULL);
+  ASSERT_NE((void*)NULL, lcm);
+
+  lcm_subscription_t* subs = lcm_subscribe(lcm, "channel", empty_handler, NULL);
+  lcm_subscription_set_queue_capacity(subs, 5);
+
+  // Messages beyond the queue capacity are dropped.
+  for (int i = 0; i < 10; i++) {
+    lcm_publish(lcm, "channel", "abcd", 4);
+  }
+  struct timespec sleeptime;
+  sleeptime.tv_sec = 0;
+  sleeptime.tv_nsec = 100000000;
+  nanosleep(&sleeptime, NULL);
+
+  lcm_subscription_stats_t stats;
+  ASSERT_EQ(0, lcm_subscription_get_stats(subs, &stats));
+  EXPECT_EQ(0u, stats.num_delivered);
+  EXPECT_EQ(5u, stats.num_dropped);
+  EXPECT_EQ(5, stats.queue_depth);
+  EXPECT_EQ(5, stats.max_queue_depth);
+
+  for (int i = 0; i < 5; i++) {
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+  ASSERT_EQ(0, lcm_subscription_get_stats(subs, &stats));
+  EXPECT_EQ(5u, stats.num_delivered);
+  EXPECT_EQ(20u, stats.bytes_delivered);
+  EXPECT_EQ(0, stats.queue_depth);
+  EXPECT_EQ(5, stats.max_queue_depth);
+  EXPECT_LE(stats.max_handler_ns, stats.total_handler_ns);
+
+  lcm_destroy(lcm);
+}
+
+static void
+record_handler(const lcm_recv_buf_t* rbuf, const char* /* unused */, void* user_data)
+{
+  std::vector<int>* received = (std::vector<int>*) user_data;
+  received->push_back(((const uint8_t*) rbuf->data)[0]);
+}
+
+TEST(LCM_C, QueueKeepLatest) {
+  lcm_t* lcm = lcm_create(NULL);
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int> latest;
+  lcm_subscription_t* subs = lcm_subscribe(lcm, "channel", record_handler, &latest);
+  lcm_subscription_set_queue_capacity(subs, 5);
+  EXPECT_EQ(0, lcm_subscription_set_queue_policy(subs, LCM_QUEUE_KEEP_LATEST));
+
+  // Each message supersedes the one before it, regardless of the capacity.
+  for (uint8_t i = 0; i < 10; i++) {
+    lcm_publish(lcm, "channel", &i, 1);
+  }
+  struct timespec sleeptime;
+  sleeptime.tv_sec = 0;
+  sleeptime.tv_nsec = 100000000;
+  nanosleep(&sleeptime, NULL);
+
+  EXPECT_EQ(1, lcm_subscription_get_queue_size(subs));
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  EXPECT_EQ(0, lcm_subscription_get_queue_size(subs));
+  EXPECT_EQ(std::vector<int>(1, 9), latest);
+  EXPECT_EQ(0, lcm_handle_timeout(lcm, 0));
+
+  // A subscription that keeps every message still gets them all.
+  std::vector<int> all;
+  lcm_subscribe(lcm, "channel", record_handler, &all);
+  latest.clear();
+  for (uint8_t i = 0; i < 3; i++) {
+    lcm_publish(lcm, "channel", &i, 1);
+  }
+  nanosleep(&sleeptime, NULL);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+  EXPECT_EQ(3u, all.size());
+  EXPECT_EQ(std::vector<int>(1, 2), latest);
+
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, RecvThreads) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&recv_threads=3");
+  ASSERT_NE((void*)NULL, lcm);
+
+  // Each sender's messages are received exactly once, even when fragmented.
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+  lcm_t* senders[4];
+  std::vector<uint8_t> large(100000);
+  for (int i = 0; i < 4; i++) {
+    senders[i] = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+    ASSERT_NE((void*)NULL, senders[i]);
+    large[0] = i;
+    lcm_publish(senders[i], "channel", &large[0], large.size());
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+    uint8_t small = 4 + i;
+    lcm_publish(senders[i], "channel", &small, 1);
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+  EXPECT_EQ(0, lcm_handle_timeout(lcm, 50));
+
+  std::sort(received.begin(), received.end());
+  std::vector<int> expected;
+  for (int i = 0; i < 8; i++) {
+    expected.push_back(i);
+  }
+  EXPECT_EQ(expected, received);
+
+  for (int i = 0; i < 4; i++) {
+    lcm_destroy(senders[i]);
+  }
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, QueueKeepLatestInterleaved) {
+  lcm_t* lcm = lcm_create(NULL);
+  ASSERT_NE((void*)NULL, lcm);
+
+  // Superseded messages need not be the oldest ones queued.
+  std::vector<int> latest;
+  std::vector<int> other;
+  lcm_subscription_t* subs = lcm_subscribe(lcm, "channel", record_handler, &latest);
+  lcm_subscription_set_queue_policy(subs, LCM_QUEUE_KEEP_LATEST);
+  lcm_subscribe(lcm, "other", record_handler, &other);
+  for (uint8_t i = 0; i < 4; i++) {
+    lcm_publish(lcm, "channel", &i, 1);
+    lcm_publish(lcm, "other", &i, 1);
+  }
+  struct timespec sleeptime;
+  sleeptime.tv_sec = 0;
+  sleeptime.tv_nsec = 100000000;
+  nanosleep(&sleeptime, NULL);
+
+  while (lcm_handle_timeout(lcm, 0) > 0) {
+  }
+  EXPECT_EQ(std::vector<int>(1, 3), latest);
+  EXPECT_EQ(4u, other.size());
+
+  lcm_destroy(lcm);
+}
+
+static void
+copy_handler(const lcm_recv_buf_t* rbuf, const char* /* unused */, void* user_data)
+{
+  std::vector<std::vector<uint8_t> >* received =
+    (std::vector<std::vector<uint8_t> >*) user_data;
+  const uint8_t* data = (const uint8_t*) rbuf->data;
+  received->push_back(std::vector<uint8_t>(data, data + rbuf->data_size));
+}
+
+TEST(LCM_C, FragmentedMessages) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+
+  // Reassembly buffers are reused across messages of different sizes.
+  std::vector<std::vector<uint8_t> > received;
+  lcm_subscribe(lcm, "channel", copy_handler, &received);
+  const int sizes[] = { 100000, 300000, 70000, 100000 };
+  std::vector<std::vector<uint8_t> > sent;
+  for (int i = 0; i < 4; i++) {
+    std::vector<uint8_t> msg(sizes[i]);
+    for (int j = 0; j < sizes[i]; j++) {
+      msg[j] = (uint8_t) (i + j);
+    }
+    sent.push_back(msg);
+    lcm_publish(lcm, "channel", &msg[0], msg.size());
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+  EXPECT_EQ(sent, received);
+
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, ReceiveMemoryOptions) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&ringbuf_mb=0.01"
+      "&recv_bufs=4&frag_mb=1&ringbuf_adaptive=1");
+  ASSERT_NE((void*)NULL, lcm);
+
+  // A burst larger than the ringbuffer makes it grow.
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+  std::vector<uint8_t> msg(1000);
+  for (int i = 0; i < 50; i++) {
+    msg[0] = (uint8_t) i;
+    lcm_publish(lcm, "channel", &msg[0], msg.size());
+  }
+  while (received.size() < 50 && lcm_handle_timeout(lcm, 500) > 0) {
+  }
+  ASSERT_EQ(50u, received.size());
+  for (int i = 0; i < 50; i++) {
+    EXPECT_EQ(i, received[i]);
+  }
+  lcm_transport_stats_t stats;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &stats));
+  EXPECT_LT(0u, stats.ringbuf_exhausted);
+
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, CoalescedMessages) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&coalesce_us=20000");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+  lcm_transport_stats_t before;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &before));
+
+  // The short messages wait for the deadline, and are sent in one packet.
+  for (int i = 0; i < 10; i++) {
+    uint8_t value = (uint8_t) i;
+    lcm_publish(lcm, "channel", &value, 1);
+  }
+  while (received.size() < 10 && lcm_handle_timeout(lcm, 500) > 0) {
+  }
+  std::vector<int> expected;
+  for (int i = 0; i < 10; i++) {
+    expected.push_back(i);
+  }
+  EXPECT_EQ(expected, received);
+  lcm_transport_stats_t after;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &after));
+  EXPECT_EQ(before.packets_received + 1, after.packets_received);
+
+  // Messages too large to coalesce are sent after the ones waiting.
+  received.clear();
+  std::vector<uint8_t> large(10000);
+  uint8_t value = 1;
+  lcm_publish(lcm, "channel", &value, 1);
+  large[0] = 2;
+  lcm_publish(lcm, "channel", &large[0], large.size());
+  while (received.size() < 2 && lcm_handle_timeout(lcm, 500) > 0) {
+  }
+  ASSERT_EQ(2u, received.size());
+  EXPECT_EQ(1, received[0]);
+  EXPECT_EQ(2, received[1]);
+
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, ChannelFilter) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&channel_filter=1");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int> received;
+  lcm_subscription_t* sub =
+    lcm_subscribe(lcm, "wanted", record_handler, &received);
+  lcm_transport_stats_t before;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &before));
+  uint8_t value = 1;
+  lcm_publish(lcm, "unwanted", &value, 1);
+  lcm_publish(lcm, "wanted.not", &value, 1);
+  value = 2;
+  lcm_publish(lcm, "wanted", &value, 1);
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  EXPECT_EQ(std::vector<int>(1, 2), received);
+#ifdef __linux__
+  // Only the message on the subscribed channel leaves the kernel.
+  lcm_transport_stats_t after;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &after));
+  EXPECT_EQ(before.packets_received + 1, after.packets_received);
+#endif
+
+  // The filter follows the subscriptions as they change.
+  lcm_unsubscribe(lcm, sub);
+  received.clear();
+  lcm_subscribe(lcm, "prefix.*", record_handler, &received);
+  value = 3;
+  lcm_publish(lcm, "wanted", &value, 1);
+  value = 4;
+  lcm_publish(lcm, "prefix.a", &value, 1);
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  EXPECT_EQ(std::vector<int>(1, 4), received);
+
+  lcm_destroy(lcm);
+}
+
+TEST(LCM_C, AdvertisedSubscriptions) {
+  const char* url = "udpm://239.255.76.67:7667?ttl=0&advertise=1";
+  lcm_t* sub = lcm_create(url);
+  ASSERT_NE((void*)NULL, sub);
+  lcm_t* pub = lcm_create(url);
+  ASSERT_NE((void*)NULL, pub);
+  // doesn't advertise, so it sees what the publisher sends
+  lcm_t* monitor = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, monitor);
+
+  std::vector<int> received;
+  lcm_subscribe(sub, "wanted", record_handler, &received);
+  std::vector<int> seen;
+  lcm_subscribe(monitor, "wanted", record_handler, &seen);
+  lcm_subscribe(monitor, "unwanted", record_handler, &seen);
+
+  // Every channel is sent until the subscriptions have been advertised.
+  uint8_t value = 1;
+  lcm_publish(pub, "unwanted", &value, 1);
+  while (seen.size() < 1 && lcm_handle_timeout(monitor, 500) > 0) {
+  }
+  EXPECT_EQ(std::vector<int>(1, 1), seen);
+  struct timespec sleeptime;
+  sleeptime.tv_sec = 4;
+  sleeptime.tv_nsec = 0;
+  nanosleep(&sleeptime, NULL);
+
+  // Afterwards, only the channels that some process subscribes to are sent.
+  seen.clear();
+  value = 2;
+  lcm_publish(pub, "unwanted", &value, 1);
+  value = 3;
+  lcm_publish(pub, "wanted", &value, 1);
+  while (received.size() < 1 && lcm_handle_timeout(sub, 500) > 0) {
+  }
+  EXPECT_EQ(std::vector<int>(1, 3), received);
+  while (seen.size() < 1 && lcm_handle_timeout(monitor, 500) > 0) {
+  }
+  EXPECT_EQ(std::vector<int>(1, 3), seen);
+
+  lcm_destroy(monitor);
+  lcm_destroy(pub);
+  lcm_destroy(sub);
+}
+
+TEST(LCM_C, BusyPoll) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&busy_poll=1");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+
+  // Nothing is received before the timeout.
+  EXPECT_EQ(0, lcm_handle_timeout(lcm, 10));
+
+  for (uint8_t i = 0; i < 3; i++) {
+    lcm_publish(lcm, "channel", &i, 1);
+  }
+  ASSERT_EQ(0, lcm_handle(lcm));
+  while (received.size() < 3 && lcm_handle_timeout(lcm, 500) > 0) {
+  }
+  std::vector<int> expected;
+  expected.push_back(0);
+  expected.push_back(1);
+  expected.push_back(2);
+  EXPECT_EQ(expected, received);
+
+  lcm_destroy(lcm);
+}
+
+static void
+self_test_handler(lcm_t* /* unused */, int status, void* user)
+{
+  __sync_lock_test_and_set((int*) user, status);
+}
+
+TEST(LCM_C, SelfTest) {
+  // a port no other test uses, so that no self-test has passed on it yet
+  const char* url = "udpm://239.255.76.67:7671?ttl=0&self_test=async";
+  lcm_t* lcm = lcm_create(url);
+  ASSERT_NE((void*)NULL, lcm);
+  int status = 1;
+  lcm_set_self_test_handler(lcm, self_test_handler, &status);
+
+  // Messages are received while the self-test runs in the background.
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+  uint8_t value = 1;
+  lcm_publish(lcm, "channel", &value, 1);
+  while (received.size() < 1 && lcm_handle_timeout(lcm, 500) > 0) {
+  }
+  EXPECT_EQ(std::vector<int>(1, 1), received);
+  for (int i = 0; i < 100 && __sync_fetch_and_add(&status, 0) == 1; i++) {
+    struct timespec sleeptime;
+    sleeptime.tv_sec = 0;
+    sleeptime.tv_nsec = 10000000;
+    nanosleep(&sleeptime, NULL);
+  }
+  EXPECT_EQ(0, status);
+
+  // Once it has passed, it isn't run again.
+  lcm_t* other = lcm_create("udpm://239.255.76.67:7671?ttl=0");
+  ASSERT_NE((void*)NULL, other);
+  int other_status = 1;
+  lcm_set_self_test_handler(other, self_test_handler, &other_status);
+  lcm_subscribe(other, "channel", record_handler, &received);
+  EXPECT_EQ(0, other_status);
+
+  lcm_destroy(other);
+  lcm_destroy(lcm);
+}
+
+static void
+send_utime_handler(const lcm_recv_buf_t* rbuf, const char* /* unused */, void* user_data)
+{
+  ((std::vector<int64_t>*) user_data)->push_back(rbuf->send_utime);
+}
+
+TEST(LCM_C, TracedMessages) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+  lcm_t* traced = lcm_create("udpm://239.255.76.67:7667?ttl=0&trace=1");
+  ASSERT_NE((void*)NULL, traced);
+
+  std::vector<int64_t> send_utimes;
+  lcm_subscribe(lcm, "channel", send_utime_handler, &send_utimes);
+  lcm_subscribe(lcm, "plain", send_utime_handler, &send_utimes);
+
+  // Short and fragmented messages both carry the send timestamp.
+  struct timeval before;
+  gettimeofday(&before, NULL);
+  int64_t before_utime = (int64_t) before.tv_sec * 1000000 + before.tv_usec;
+  std::vector<uint8_t> large(100000);
+  lcm_publish(traced, "channel", &large[0], 1);
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  lcm_publish(traced, "channel", &large[0], large.size());
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  lcm_publish(lcm, "plain", &large[0], 1);
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+
+  ASSERT_EQ(3u, send_utimes.size());
+  EXPECT_LE(before_utime, send_utimes[0]);
+  EXPECT_LE(send_utimes[0], send_utimes[1]);
+  EXPECT_EQ(0, send_utimes[2]);
+
+  lcm_latency_histogram_t hist;
+  ASSERT_EQ(0, lcm_get_latency_histogram(lcm, "channel", &hist));
+  EXPECT_EQ(2u, hist.count);
+  EXPECT_LE(hist.min_usec, hist.max_usec);
+  uint64_t bucketed = 0;
+  for (int i = 0; i < LCM_LATENCY_HISTOGRAM_BUCKETS; i++) {
+    bucketed += hist.buckets[i];
+  }
+  EXPECT_EQ(2u, bucketed);
+  // Messages without a timestamp aren't measured.
+  EXPECT_EQ(-1, lcm_get_latency_histogram(lcm, "plain", &hist));
+
+  lcm_reset_latency_histograms(lcm);
+  EXPECT_EQ(-1, lcm_get_latency_histogram(lcm, "channel", &hist));
+
+  lcm_destroy(traced);
+  lcm_destroy(lcm);
+}
+
+static void
+recv_time_handler(const lcm_recv_buf_t* rbuf, const char* /* unused */, void* user_data)
+{
+  ((std::vector<int64_t>*) user_data)->push_back(rbuf->recv_utime);
+  ((std::vector<int64_t>*) user_data)->push_back(rbuf->recv_utime_ns);
+}
+
+TEST(LCM_C, RecvTimestampNs) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int64_t> times;
+  lcm_subscribe(lcm, "channel", recv_time_handler, &times);
+  struct timespec before;
+  clock_gettime(CLOCK_REALTIME, &before);
+  std::vector<uint8_t> large(100000);
+  lcm_publish(lcm, "channel", &large[0], 1);
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  lcm_publish(lcm, "channel", &large[0], large.size());
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  struct timespec after;
+  clock_gettime(CLOCK_REALTIME, &after);
+
+  // Short and reassembled messages both have the nanosecond receive time,
+  // which agrees with recv_utime.
+  ASSERT_EQ(4u, times.size());
+  int64_t before_ns = (int64_t) before.tv_sec * 1000000000 + before.tv_nsec;
+  int64_t after_ns = (int64_t) after.tv_sec * 1000000000 + after.tv_nsec;
+  for (int i = 0; i < 4; i += 2) {
+    EXPECT_EQ(times[i], times[i + 1] / 1000);
+    EXPECT_LE(before_ns / 1000, times[i]);
+    EXPECT_GE(after_ns, times[i + 1]);
+  }
+
+  lcm_destroy(lcm);
+}
+
+static void
+channel_handler(const lcm_recv_buf_t* /* unused */, const char* channel, void* user_data)
+{
+  ((std::vector<std::string>*) user_data)->push_back(channel);
+}
+
+TEST(LCM_C, ReliableMessages) {
+  lcm_t* reliable = lcm_create("udpm://239.255.76.67:7667?ttl=0&reliable=MAP.*&reliable_mb=1");
+  ASSERT_NE((void*)NULL, reliable);
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+  lcm_t* all = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, all);
+
+  std::vector<std::vector<uint8_t> > received;
+  lcm_subscribe(lcm, "MAP", copy_handler, &received);
+  std::vector<std::string> channels;
+  lcm_subscribe(all, ".*", channel_handler, &channels);
+
+  // Each message is received once, and the announcements and NACKs are
+  // never handled by subscribers.  More messages are sent than fit in the
+  // retransmit window.
+  std::vector<std::vector<uint8_t> > sent;
+  for (int i = 0; i < 16; i++) {
+    std::vector<uint8_t> msg(100000 + i);
+    for (size_t j = 0; j < msg.size(); j++) {
+      msg[j] = (uint8_t) (i * j);
+    }
+    sent.push_back(msg);
+    lcm_publish(reliable, "MAP", &msg[0], msg.size());
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+    ASSERT_GT(lcm_handle_timeout(all, 500), 0);
+  }
+  EXPECT_EQ(0, lcm_handle_timeout(lcm, 100));
+  EXPECT_EQ(0, lcm_handle_timeout(all, 100));
+  EXPECT_EQ(sent, received);
+  EXPECT_EQ(std::vector<std::string>(16, "MAP"), channels);
+
+  lcm_destroy(all);
+  lcm_destroy(lcm);
+  lcm_destroy(reliable);
+}
+
+TEST(LCM_C, ReliableMessageAnnouncedAgain) {
+  lcm_t* reliable = lcm_create("udpm://239.255.76.67:7667?ttl=0&reliable=MAP");
+  ASSERT_NE((void*)NULL, reliable);
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0&self_test=0");
+  ASSERT_NE((void*)NULL, lcm);
+
+  // The receiver only subscribes after the message and its first
+  // announcement have been sent, so it hears of the message from the
+  // announcements that follow, and asks for all of it.
+  std::vector<uint8_t> msg(100000);
+  for (size_t i = 0; i < msg.size(); i++) {
+    msg[i] = (uint8_t) i;
+  }
+  lcm_publish(reliable, "MAP", &msg[0], msg.size());
+  std::vector<std::vector<uint8_t> > received;
+  lcm_subscribe(lcm, "MAP", copy_handler, &received);
+  ASSERT_GT(lcm_handle_timeout(lcm, 1000), 0);
+  EXPECT_EQ(0, lcm_handle_timeout(lcm, 1000));
+  ASSERT_EQ(1u, received.size());
+  EXPECT_EQ(msg, received[0]);
+
+  lcm_destroy(lcm);
+  lcm_destroy(reliable);
+}
+
+TEST(LCM_C, ReliableMessageDeliveredOnce) {
+  lcm_t* reliable = lcm_create("udpm://239.255.76.67:7667?ttl=0&reliable=MAP");
+  ASSERT_NE((void*)NULL, reliable);
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<std::vector<uint8_t> > received;
+  lcm_subscribe(lcm, "MAP", copy_handler, &received);
+  std::vector<std::string> channels;
+  lcm_subscribe(lcm, "CAMERA", channel_handler, &channels);
+
+  // Many other fragmented messages are reassembled while the reliable
+  // message is still being announced, and the receiver doesn't ask for it
+  // again.
+  std::vector<uint8_t> msg(100000);
+  lcm_publish(reliable, "MAP", &msg[0], msg.size());
+  ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  const int num_frames = 100;
+  for (int i = 0; i < num_frames; i++) {
+    lcm_publish(reliable, "CAMERA", &msg[0], msg.size());
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+  // outlast the announcements
+  while (lcm_handle_timeout(lcm, 1000) > 0) {
+  }
+  EXPECT_EQ(1u, received.size());
+  EXPECT_EQ(std::vector<std::string>(num_frames, "CAMERA"), channels);
+
+  lcm_destroy(lcm);
+  lcm_destroy(reliable);
+}
+
+TEST(LCM_C, TransportStats) {
+  lcm_t* lcm = lcm_create("udpm://239.255.76.67:7667?ttl=0");
+  ASSERT_NE((void*)NULL, lcm);
+
+  std::vector<int> received;
+  lcm_subscribe(lcm, "channel", record_handler, &received);
+  std::vector<uint8_t> large(100000);
+  for (int i = 0; i < 4; i++) {
+    lcm_publish(lcm, "channel", &large[0], i % 2 ? large.size() : 1);
+    ASSERT_GT(lcm_handle_timeout(lcm, 500), 0);
+  }
+
+  lcm_transport_stats_t stats;
+  ASSERT_EQ(0, lcm_get_transport_stats(lcm, &stats));
+  EXPECT_LT(4u, stats.packets_received);
+  EXPECT_EQ(0u, stats.packets_bad);
+  EXPECT_EQ(0u, stats.messages_lost);
+  EXPECT_EQ(0u, stats.messages_reordered);
+  EXPECT_EQ(0u, stats.reassembly_incomplete);
+  EXPECT_EQ(0u, stats.duplicate_fragments);
+
+  lcm_destroy(lcm);
+
+  // Other providers don't keep transport statistics.
+  lcm = lcm_create("memq://");
+  ASSERT_NE((void*)NULL, lcm);
+  EXPECT_EQ(-1, lcm_get_transport_stats(lcm, &stats));
+  lcm_destroy(lcm);
+}
+
 #endif
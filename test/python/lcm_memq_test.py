@@ -34,6 +34,28 @@ class TestLcmMemq(unittest.TestCase):
         self.assertLess(0, lcm_obj.handle_timeout(10000))
         self.assertTrue(on_msg.msg_handled)
 
+    def test_subscription_stats(self):
+        lcm_obj = lcm.LCM("memq://")
+
+        def on_msg(channel, data):
+            pass
+        subs = lcm_obj.subscribe("channel", on_msg)
+        stats = subs.get_stats()
+        self.assertEqual(0, stats["num_delivered"])
+        self.assertEqual(0, stats["bytes_delivered"])
+
+        lcm_obj.publish("channel", "abc")
+        lcm_obj.publish("channel", "de")
+        self.assertLess(0, lcm_obj.handle_timeout(10000))
+        self.assertLess(0, lcm_obj.handle_timeout(10000))
+
+        stats = subs.get_stats()
+        self.assertEqual(2, stats["num_delivered"])
+        self.assertEqual(5, stats["bytes_delivered"])
+        self.assertEqual(0, stats["num_dropped"])
+        self.assertEqual(0, stats["queue_depth"])
+        self.assertLessEqual(stats["max_handler_ns"], stats["total_handler_ns"])
+
 def main():
     unittest.main()
 